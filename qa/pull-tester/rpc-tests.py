@@ -128,10 +128,16 @@ testScripts = [
     'reindex.py',
     # vv Tests less than 30s vv
     'mempool_resurrect_test.py',
+    'mempool_persist.py',
     'txn_doublespend.py --mineblock',
     'txn_clone.py',
     'getchaintips.py',
     'rest.py',
+    'addressindex.py',
+    'txindex.py',
+    'blockfilterindex.py',
+    'spentoutputs.py',
+    'netmsgprofile.py',
     'mempool_spendcoinbase.py',
     'mempool_reorg.py',
     'httpbasics.py',
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017 The Bitcoin developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the address index: getaddresshistory, getaddressutxos, their REST
+# equivalents and rewinding on reorganizations.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+from decimal import Decimal
+
+import http.client
+import json
+import urllib.parse
+
+
+class AddressIndexTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+        self.extra_args = [['-addressindex', '-rest'], []]
+
+    def setup_network(self):
+        self.setup_nodes()
+        connect_nodes_bi(self.nodes, 0, 1)
+
+    def run_test(self):
+        node = self.nodes[0]
+        address = node.getnewaddress()
+        node.generatetoaddress(101, address)
+        sync_index(node, "addressindex")
+
+        self.log.info("Check the history and unspent outputs of an address")
+        result = node.getaddresshistory(address)
+        assert_equal(result['height'], 101)
+        assert_equal(result['cursor'], None)
+        history = result['history']
+        assert_equal(len(history), 101)
+        for i, entry in enumerate(history):
+            assert_equal(entry['height'], i + 1)
+            assert_equal(entry['type'], 'output')
+            assert_equal(entry['txpos'], 0)
+            block = node.getblock(node.getblockhash(i + 1))
+            assert_equal(entry['txid'], block['tx'][0])
+            assert_equal(entry['outpoint'], {'txid': block['tx'][0], 'vout': 0})
+        utxos = node.getaddressutxos(address)['utxos']
+        assert_equal(len(utxos), 101)
+        assert_equal(sorted(u['height'] for u in utxos), list(range(1, 102)))
+
+        # The output script can be given instead of the address.
+        script = node.validateaddress(address)['scriptPubKey']
+        assert_equal(node.getaddresshistory(script)['history'], history)
+
+        self.log.info("Page through the history and unspent outputs")
+        paged = []
+        result = node.getaddresshistory(address, 0, 40)
+        while True:
+            assert(len(result['history']) <= 40)
+            paged += result['history']
+            if result['cursor'] is None:
+                break
+            result = node.getaddresshistory(
+                address, 0, 40, result['cursor'])
+        assert_equal(paged, history)
+        assert_equal(node.getaddresshistory(address, 51)['history'],
+                     history[50:])
+
+        paged = []
+        result = node.getaddressutxos(address, 30)
+        while result['cursor'] is not None:
+            paged += result['utxos']
+            result = node.getaddressutxos(address, 30, result['cursor'])
+        paged += result['utxos']
+        assert_equal(paged, utxos)
+
+        self.log.info("Check spends")
+        other = self.nodes[1].getnewaddress()
+        txid = node.sendtoaddress(other, 10)
+        node.generate(1)
+        sync_index(node, "addressindex")
+
+        result = node.getaddresshistory(other)
+        assert_equal(len(result['history']), 1)
+        entry = result['history'][0]
+        assert_equal(entry['txid'], txid)
+        assert_equal(entry['height'], 102)
+        assert_equal(entry['value'], 10)
+        assert_equal(node.getaddressutxos(other)['utxos'],
+                     [{'txid': txid, 'vout': entry['index'],
+                       'value': 10, 'height': 102}])
+
+        spends = [e for e in node.getaddresshistory(address, 102)['history']
+                  if e['type'] == 'spend']
+        assert(len(spends) > 0)
+        spent = set()
+        for e in spends:
+            assert_equal(e['txid'], txid)
+            spent.add((e['outpoint']['txid'], e['outpoint']['vout']))
+        remaining = node.getaddressutxos(address)['utxos']
+        assert_equal(len(remaining), 101 - len(spends))
+        for u in remaining:
+            assert((u['txid'], u['vout']) not in spent)
+
+        self.log.info("Check REST queries")
+        url = urllib.parse.urlparse(node.url)
+        conn = http.client.HTTPConnection(url.hostname, url.port)
+        conn.request('GET', '/rest/addresshistory/%s/0/1000.json' % other)
+        response = conn.getresponse()
+        assert_equal(response.status, 200)
+        assert_equal(json.loads(response.read().decode('utf-8'),
+                                parse_float=Decimal), result)
+        conn.request('GET', '/rest/addressutxos/%s/10.json' % other)
+        response = conn.getresponse()
+        assert_equal(response.status, 200)
+        assert_equal(len(json.loads(response.read().decode('utf-8'))['utxos']),
+                     1)
+        conn.request('GET', '/rest/addressutxos/%s/0.json' % other)
+        response = conn.getresponse()
+        assert_equal(response.status, 400)
+        response.read()
+
+        self.log.info("Check that disconnected blocks are rewound")
+        node.invalidateblock(node.getbestblockhash())
+        sync_index(node, "addressindex")
+        assert_equal(node.getaddresshistory(other)['history'], [])
+        assert_equal(node.getaddressutxos(other)['utxos'], [])
+        assert_equal(node.getaddresshistory(address)['history'], history)
+        assert_equal(node.getaddressutxos(address)['utxos'], utxos)
+
+        self.log.info("Check errors")
+        assert_raises_jsonrpc(-5, "Invalid address or output script",
+                              node.getaddresshistory, "notanaddress")
+        assert_raises_jsonrpc(-8, "Count out of range",
+                              node.getaddressutxos, address, 0)
+        assert_raises_jsonrpc(-8, "Invalid cursor",
+                              node.getaddresshistory, address, 0, 10, "00")
+        assert_raises_jsonrpc(-1, "The address index is disabled",
+                              self.nodes[1].getaddresshistory, address)
+
+
+if __name__ == '__main__':
+    AddressIndexTest().main()
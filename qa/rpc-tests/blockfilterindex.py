@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017 The Bitcoin developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the block filter index (-blockfilterindex) and the ways its filters
+# are served: the getblockfilter RPC, the REST interface and the BIP 157 P2P
+# messages (-peerblockfilters).
+#
+
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.script import CScript, OP_TRUE
+
+import http.client
+import os
+import json
+import urllib.parse
+
+
+class FiltersNode(SingleNodeConnCB):
+
+    def __init__(self):
+        SingleNodeConnCB.__init__(self)
+        self.cfilters = []
+        self.last_cfheaders = None
+        self.last_cfcheckpt = None
+        self.disconnected = False
+
+    def on_cfilter(self, conn, message):
+        self.cfilters.append(message)
+
+    def on_cfheaders(self, conn, message):
+        self.last_cfheaders = message
+
+    def on_cfcheckpt(self, conn, message):
+        self.last_cfcheckpt = message
+
+    def on_close(self, conn):
+        self.disconnected = True
+
+
+def filter_header(filter_hex, prev_header_hex):
+    """The header of a filter, from the header of the previous block's."""
+    filter_hash = hash256(hex_str_to_bytes(filter_hex))
+    prev_header = hex_str_to_bytes(prev_header_hex)[::-1]
+    return bytes_to_hex_str(hash256(filter_hash + prev_header)[::-1])
+
+
+class BlockFilterIndexTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+        self.extra_args = [['-blockfilterindex', '-peerblockfilters', '-rest'],
+                           ['-blockfilterindex']]
+
+    def run_test(self):
+        node = self.nodes[0]
+        address = node.decodescript(
+            bytes_to_hex_str(CScript([OP_TRUE])))['p2sh']
+        node.generatetoaddress(110, address)
+        self.sync_all()
+        sync_index(node, "blockfilterindex")
+        sync_index(self.nodes[1], "blockfilterindex")
+        assert_equal(node.getindexinfo("blockfilterindex")
+                     ["blockfilterindex"]["best_block_height"], 110)
+        # The filters are stored next to the database, not inside it.
+        filters_dir = os.path.join(self.options.tmpdir, "node0", "regtest",
+                                   "indexes", "blockfilters")
+        assert(os.path.isfile(os.path.join(filters_dir, "fltr00000.dat")))
+
+        self.log.info("Check the filters and headers over RPC")
+        headers = []
+        prev_header = "00" * 32
+        for height in range(111):
+            result = node.getblockfilter(node.getblockhash(height))
+            assert_equal(result["header"],
+                         filter_header(result["filter"], prev_header))
+            headers.append(result["header"])
+            prev_header = result["header"]
+        tip = node.getbestblockhash()
+        tip_filter = node.getblockfilter(tip, "basic")
+        assert_equal(self.nodes[1].getblockfilter(tip), tip_filter)
+        assert_raises_jsonrpc(-5, "Unknown filtertype",
+                              node.getblockfilter, tip, "unknown")
+        assert_raises_jsonrpc(-5, "Block not found",
+                              node.getblockfilter, "00" * 32)
+
+        self.log.info("Check REST queries")
+        url = urllib.parse.urlparse(node.url)
+        conn = http.client.HTTPConnection(url.hostname, url.port)
+        conn.request('GET', '/rest/blockfilter/basic/%s.json' % tip)
+        response = conn.getresponse()
+        assert_equal(response.status, 200)
+        assert_equal(json.loads(response.read().decode('utf-8')),
+                     {"filter": tip_filter["filter"]})
+        conn.request('GET', '/rest/blockfilter/basic/%s.bin' % tip)
+        response = conn.getresponse()
+        assert_equal(response.status, 200)
+        cfilter = msg_cfilter()
+        cfilter.deserialize(BytesIO(response.read()))
+        assert_equal(cfilter.block_hash, int(tip, 16))
+        assert_equal(bytes_to_hex_str(cfilter.filter_data),
+                     tip_filter["filter"])
+        conn.request('GET', '/rest/blockfilterheaders/basic/20/%s.json' %
+                     node.getblockhash(100))
+        response = conn.getresponse()
+        assert_equal(response.status, 200)
+        assert_equal(json.loads(response.read().decode('utf-8')),
+                     headers[100:])
+        conn.request('GET', '/rest/blockfilter/unknown/%s.json' % tip)
+        response = conn.getresponse()
+        assert_equal(response.status, 400)
+        response.read()
+
+        self.log.info("Check the P2P messages")
+        # NODE_COMPACT_FILTERS is only advertised once the index is synced.
+        assert(wait_until(lambda: int(node.getnetworkinfo()["localservices"],
+                                      16) & NODE_COMPACT_FILTERS,
+                          timeout=10))
+        peer = FiltersNode()
+        peer.add_connection(NodeConn('127.0.0.1', p2p_port(0), node, peer))
+        other = FiltersNode()
+        other.add_connection(NodeConn('127.0.0.1', p2p_port(1),
+                                      self.nodes[1], other))
+        NetworkThread().start()
+        peer.wait_for_verack()
+        other.wait_for_verack()
+        assert(peer.connection.nServices & NODE_COMPACT_FILTERS)
+        assert(not other.connection.nServices & NODE_COMPACT_FILTERS)
+
+        tip_hash = int(tip, 16)
+        peer.send_and_ping(msg_getcfilters(0, 101, tip_hash))
+        assert_equal(len(peer.cfilters), 10)
+        for height, cfilter in enumerate(peer.cfilters, 101):
+            assert_equal(cfilter.block_hash, int(node.getblockhash(height), 16))
+        assert_equal(bytes_to_hex_str(peer.cfilters[-1].filter_data),
+                     tip_filter["filter"])
+
+        peer.send_and_ping(msg_getcfheaders(0, 1, tip_hash))
+        cfheaders = peer.last_cfheaders
+        assert_equal(cfheaders.stop_hash, tip_hash)
+        assert_equal(cfheaders.prev_header, int(headers[0], 16))
+        assert_equal(len(cfheaders.hashes), 110)
+        assert_equal(cfheaders.hashes[-1],
+                     uint256_from_str(hash256(
+                         hex_str_to_bytes(tip_filter["filter"]))))
+
+        peer.send_and_ping(msg_getcfcheckpt(0, tip_hash))
+        assert_equal(peer.last_cfcheckpt.stop_hash, tip_hash)
+        assert_equal(peer.last_cfcheckpt.headers, [])
+
+        # Requests to a node without -peerblockfilters, and invalid
+        # requests, get the peer disconnected.
+        other.send_message(msg_getcfilters(0, 101, tip_hash))
+        assert(wait_until(lambda: other.disconnected, timeout=10))
+        peer.send_message(msg_getcfilters(0, 5, int(node.getblockhash(4), 16)))
+        assert(wait_until(lambda: peer.disconnected, timeout=10))
+
+        self.log.info("Follow reorganizations")
+        node.invalidateblock(tip)
+        other_address = node.decodescript(
+            bytes_to_hex_str(CScript([OP_TRUE, OP_TRUE])))['p2sh']
+        new_tip = node.generatetoaddress(1, other_address)[0]
+        sync_index(node, "blockfilterindex")
+        result = node.getblockfilter(new_tip)
+        assert_equal(result["header"],
+                     filter_header(result["filter"], headers[109]))
+        # The filter of the disconnected block is kept.
+        assert_equal(node.getblockfilter(tip), tip_filter)
+
+
+if __name__ == '__main__':
+    BlockFilterIndexTest().main()
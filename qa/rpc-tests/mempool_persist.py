@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017 The Bitcoin developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test mempool persistence across restarts.
+#
+# Creates a chain of transactions, prioritises one of them, restarts the node
+# and checks that the mempool and the fee delta are reloaded from
+# mempool.dat. The reload is done once with parallel script pre-checks
+# (-par=2) and once without (-par=1), and the periodic dump is exercised with
+# -mempooldumpinterval.
+#
+
+import os
+import time
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.num_nodes = 1
+        self.setup_clean_chain = False
+
+    def setup_network(self):
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir)
+        self.is_network_split = False
+
+    def restart_node(self, extra_args):
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, extra_args)
+
+    def wait_for_mempool(self, expected):
+        # mempool.dat is loaded in the background after startup
+        timeout = 30
+        while timeout > 0:
+            if set(self.nodes[0].getrawmempool()) == expected:
+                return
+            time.sleep(0.5)
+            timeout -= 0.5
+        assert_equal(set(self.nodes[0].getrawmempool()), expected)
+
+    def run_test(self):
+        node = self.nodes[0]
+        address = node.getnewaddress()
+
+        # A chain of transactions, so that children are reloaded after
+        # their parents.
+        txids = []
+        amount = Decimal("10")
+        for i in range(5):
+            txids.append(node.sendtoaddress(address, amount))
+            amount -= Decimal("1")
+        node.prioritisetransaction(txids[0], 0, 1000)
+        fee = node.getmempoolentry(txids[0])['fee']
+        expected = set(txids)
+        assert_equal(set(node.getrawmempool()), expected)
+
+        for extra_args in [["-par=2"], ["-par=1"]]:
+            self.restart_node(extra_args)
+            self.wait_for_mempool(expected)
+            assert_equal(
+                self.nodes[0].getmempoolentry(txids[0])['modifiedfee'],
+                fee + Decimal("0.00001000"))
+
+        # Periodic dumps rewrite mempool.dat while the node is running.
+        mempooldat = os.path.join(self.options.tmpdir, "node0", "regtest",
+                                  "mempool.dat")
+        self.restart_node(["-mempooldumpinterval=1"])
+        self.wait_for_mempool(expected)
+        os.remove(mempooldat)
+        timeout = 90
+        while timeout > 0 and not os.path.isfile(mempooldat):
+            time.sleep(1)
+            timeout -= 1
+        assert(os.path.isfile(mempooldat))
+
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
@@ -92,6 +92,7 @@ class MerkleBlockTest(BitcoinTestFramework):
             assert_equal(self.nodes[2].verifytxoutproof(
                 self.nodes[2].gettxoutproof([txid2, txid1])), txlist)
         # ...or if we have a -txindex
+        sync_index(self.nodes[3], "txindex")
         assert_equal(self.nodes[2].verifytxoutproof(
             self.nodes[3].gettxoutproof([txid_spent])), [txid_spent])
 
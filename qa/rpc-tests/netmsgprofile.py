@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017 The Bitcoin developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the P2P message time profile reported by getnetmsgprofile, for all
+# peers and for a single one, and that the totals keep the messages of
+# disconnected peers.
+#
+
+from test_framework.mininode import wait_until
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+MSG_PROFILE_BUCKETS = 16
+
+
+def check_profile(profile, queue_wait):
+    for command, entry in profile.items():
+        assert(entry["count"] > 0)
+        assert(entry["maxtime"] <= entry["time"])
+        assert_equal(len(entry["histogram"]), MSG_PROFILE_BUCKETS)
+        assert_equal(sum(entry["histogram"]), entry["count"])
+        assert_equal("queuewait" in entry, queue_wait)
+
+
+def total_count(profile, command):
+    return profile[command]["count"] if command in profile else 0
+
+
+class NetMsgProfileTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def run_test(self):
+        node = self.nodes[1]
+        self.nodes[0].generatetoaddress(
+            1, self.nodes[0].decodescript("51")["p2sh"])
+        self.sync_all()
+
+        self.log.info("Check the totals of all peers")
+        profile = node.getnetmsgprofile()
+        check_profile(profile["recv"], True)
+        check_profile(profile["send"], False)
+        peers = node.getpeerinfo()
+        assert_equal(len(peers), 2)
+        # Each connection starts with one version message in each direction.
+        assert_equal(total_count(profile["recv"], "version"), len(peers))
+        assert_equal(total_count(profile["send"], "version"), len(peers))
+        assert(total_count(profile["recv"], "headers") +
+               total_count(profile["recv"], "cmpctblock") +
+               total_count(profile["recv"], "inv") > 0)
+        totals = node.getnettotals()
+        assert(totals["totalprocesstime"] >= 0)
+        assert(totals["totalserializetime"] >= 0)
+
+        self.log.info("Check the profile of a single peer")
+        peer_profile = node.getnetmsgprofile(peers[0]["id"])
+        check_profile(peer_profile["recv"], True)
+        check_profile(peer_profile["send"], False)
+        assert_equal(total_count(peer_profile["recv"], "version"), 1)
+        assert_equal(total_count(peer_profile["send"], "version"), 1)
+        assert_raises_jsonrpc(-29, "Node not found in connected nodes",
+                              node.getnetmsgprofile, 1000)
+
+        self.log.info("Check that disconnected peers stay in the totals")
+        disconnect_nodes(node, 0)
+        wait_until(lambda: node.getpeerinfo() == [], timeout=10)
+        assert(wait_until(
+            lambda: total_count(node.getnetmsgprofile()["recv"],
+                                "version") == len(peers), timeout=10))
+        profile = node.getnetmsgprofile()
+        check_profile(profile["recv"], True)
+        check_profile(profile["send"], False)
+        assert_equal(total_count(profile["send"], "version"), len(peers))
+
+
+if __name__ == '__main__':
+    NetMsgProfileTest().main()
@@ -321,6 +321,33 @@ class RESTTest (BitcoinTestFramework):
         json_obj = json.loads(response_header_json_str)
         assert_equal(len(json_obj), 5)  # now we should have 5 header objects
 
+        # stream a range of raw blocks with their undo data
+        height = self.nodes[0].getblockcount()
+        response = http_get_call(
+            url.hostname, url.port, '/rest/blockrange/' + str(height - 4) + '/10' + self.FORMAT_SEPARATOR + "bin", True)
+        assert_equal(response.status, 200)
+        assert_equal(response.getheader('transfer-encoding'), 'chunked')
+        f = BytesIO(response.read())
+        rpc_blocks = self.nodes[0].getblockrange(height - 4, 10)
+        assert_equal(len(rpc_blocks), 5)  # the range stops at the tip
+        for rpc_block in rpc_blocks:
+            block_bytes = f.read(unpack(b"<I", f.read(4))[0])
+            assert_equal(encode(block_bytes, "hex_codec").decode('ascii'),
+                         self.nodes[0].getblock(rpc_block['hash'], False))
+            assert_equal(encode(block_bytes, "hex_codec").decode('ascii'),
+                         rpc_block['block'])
+            undo_bytes = f.read(unpack(b"<I", f.read(4))[0])
+            assert_equal(encode(undo_bytes, "hex_codec").decode('ascii'),
+                         rpc_block['undo'])
+        assert_equal(f.read(), b'')
+
+        response = http_get_call(
+            url.hostname, url.port, '/rest/blockrange/' + str(height + 1) + '/1' + self.FORMAT_SEPARATOR + "bin", True)
+        assert_equal(response.status, 404)
+        response = http_get_call(
+            url.hostname, url.port, '/rest/blockrange/0/1001' + self.FORMAT_SEPARATOR + "bin", True)
+        assert_equal(response.status, 400)
+
         # do tx test
         tx_hash = block_json_obj['tx'][0]['txid']
         json_string = http_get_call(
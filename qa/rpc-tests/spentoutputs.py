@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017 The Bitcoin developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that getblock (verbose=3) and getrawtransaction (verbose=2) describe
+# the outputs spent by the inputs, for confirmed and mempool transactions.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.blocktools import create_transaction
+from test_framework.mininode import CTransaction, FromHex, ToHex
+from test_framework.script import CScript, OP_TRUE, OP_HASH160, OP_EQUAL, hash160
+
+
+class SpentOutputsTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 1
+        self.extra_args = [['-txindex']]
+
+    def run_test(self):
+        node = self.nodes[0]
+        # Mine to a P2SH of OP_TRUE, so the outputs can be spent without a
+        # wallet.
+        redeem_script = CScript([OP_TRUE])
+        p2sh_script = CScript([OP_HASH160, hash160(redeem_script), OP_EQUAL])
+        address = node.decodescript(bytes_to_hex_str(redeem_script))['p2sh']
+        node.generatetoaddress(101, address)
+        sync_index(node, "txindex")
+
+        coinbase_txid = node.getblock(node.getblockhash(1))['tx'][0]
+        coinbase = FromHex(CTransaction(), node.getrawtransaction(coinbase_txid))
+        coinbase.calc_sha256()
+        spend = create_transaction(coinbase, 0, CScript([redeem_script]),
+                                   coinbase.vout[0].nValue - 10000, p2sh_script)
+        spend.calc_sha256()
+        spend_txid = node.sendrawtransaction(ToHex(spend))
+        block_hash = node.generatetoaddress(1, address)[0]
+        sync_index(node, "txindex")
+
+        coinbase_value = satoshi_round(coinbase.vout[0].nValue / 100000000)
+        prevout_script = bytes_to_hex_str(p2sh_script)
+
+        self.log.info("Check getblock verbosity levels")
+        assert_equal(node.getblock(block_hash, 0),
+                     node.getblock(block_hash, False))
+        assert_equal(node.getblock(block_hash, 1),
+                     node.getblock(block_hash, True))
+        assert_equal(node.getblock(block_hash, 1)['tx'],
+                     [node.getblock(block_hash)['tx'][0], spend_txid])
+        block = node.getblock(block_hash, 2)
+        assert_equal(block['tx'][1]['txid'], spend_txid)
+        assert('prevout' not in block['tx'][1]['vin'][0])
+        assert('fee' not in block['tx'][1])
+
+        block = node.getblock(block_hash, 3)
+        assert('prevout' not in block['tx'][0]['vin'][0])
+        assert('fee' not in block['tx'][0])
+        vin = block['tx'][1]['vin'][0]
+        assert_equal(vin['prevout']['generated'], True)
+        assert_equal(vin['prevout']['height'], 1)
+        assert_equal(vin['prevout']['value'], coinbase_value)
+        assert_equal(vin['prevout']['scriptPubKey']['hex'], prevout_script)
+        assert_equal(block['tx'][1]['fee'], Decimal('0.0001'))
+        # The genesis block has no undo data, but spends nothing either.
+        assert_equal(node.getblock(node.getblockhash(0), 3)['tx'][0]['txid'],
+                     node.getblock(node.getblockhash(0))['tx'][0])
+
+        self.log.info("Check getrawtransaction verbosity levels")
+        tx = node.getrawtransaction(spend_txid, 1)
+        assert('prevout' not in tx['vin'][0])
+        tx = node.getrawtransaction(spend_txid, 2)
+        assert_equal(tx['vin'][0], vin)
+        assert_equal(tx['fee'], Decimal('0.0001'))
+        assert_equal(tx['blockhash'], block_hash)
+        tx = node.getrawtransaction(coinbase_txid, 2)
+        assert('prevout' not in tx['vin'][0])
+
+        # A mempool transaction spending the output of the confirmed one
+        mempool_spend = create_transaction(spend, 0, CScript([redeem_script]),
+                                           spend.vout[0].nValue - 20000,
+                                           p2sh_script)
+        mempool_txid = node.sendrawtransaction(ToHex(mempool_spend))
+        tx = node.getrawtransaction(mempool_txid, 2)
+        prevout = tx['vin'][0]['prevout']
+        assert_equal(prevout['generated'], False)
+        assert_equal(prevout['height'], 102)
+        assert_equal(prevout['scriptPubKey']['hex'], prevout_script)
+        assert_equal(tx['fee'], Decimal('0.0002'))
+        # And one spending an output that is still in the mempool, which has
+        # no height.
+        mempool_spend.calc_sha256()
+        chained = create_transaction(mempool_spend, 0,
+                                     CScript([redeem_script]),
+                                     mempool_spend.vout[0].nValue - 10000,
+                                     p2sh_script)
+        chained_txid = node.sendrawtransaction(ToHex(chained))
+        prevout = node.getrawtransaction(chained_txid, 2)['vin'][0]['prevout']
+        assert('height' not in prevout)
+        assert_equal(prevout['generated'], False)
+
+
+if __name__ == '__main__':
+    SpentOutputsTest().main()
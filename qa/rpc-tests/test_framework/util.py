@@ -196,6 +196,22 @@ def sync_mempools(rpc_connections, *, wait=1, timeout=60):
     raise AssertionError("Mempool sync failed")
 
 
+def sync_index(node, name, *, wait=0.1, timeout=60):
+    """
+    Wait until an optional index of a node, which is built in the background,
+    has caught up with its best block
+    """
+    while timeout > 0:
+        best_hash = node.getbestblockhash()
+        info = node.getindexinfo(name)
+        if info[name]["best_block_hash"] == best_hash:
+            return
+        time.sleep(wait)
+        timeout -= wait
+    raise AssertionError("Index sync failed: {} is at {!r}".format(
+                         name, info[name]))
+
+
 bitcoind_processes = {}
 
 
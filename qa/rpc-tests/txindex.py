@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017 The Bitcoin developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that -txindex can be enabled on an existing chain without -reindex,
+# that it follows new blocks and reorganizations, and getindexinfo.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.blocktools import create_transaction
+from test_framework.mininode import CTransaction, FromHex, ToHex
+from test_framework.script import CScript, OP_TRUE, OP_HASH160, OP_EQUAL, hash160
+
+
+class TxIndexTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 1
+        self.extra_args = [[]]
+
+    def restart_node(self, extra_args):
+        stop_nodes(self.nodes)
+        self.nodes = start_nodes(
+            self.num_nodes, self.options.tmpdir, [extra_args])
+
+    def run_test(self):
+        node = self.nodes[0]
+        # Mine to a P2SH of OP_TRUE, so the outputs can be spent without a
+        # wallet.
+        redeem_script = CScript([OP_TRUE])
+        p2sh_script = CScript([OP_HASH160, hash160(redeem_script), OP_EQUAL])
+        address = node.decodescript(bytes_to_hex_str(redeem_script))['p2sh']
+        node.generatetoaddress(101, address)
+
+        # Fully spend the coinbase of block 1.
+        coinbase_txid = node.getblock(node.getblockhash(1))['tx'][0]
+        coinbase = FromHex(CTransaction(), node.getrawtransaction(coinbase_txid))
+        coinbase.calc_sha256()
+        spend = create_transaction(coinbase, 0, CScript([redeem_script]),
+                                   coinbase.vout[0].nValue - 10000, p2sh_script)
+        spend_txid = node.sendrawtransaction(ToHex(spend))
+        node.generatetoaddress(1, address)
+        assert_raises_jsonrpc(-5, "Use -txindex",
+                              node.getrawtransaction, coinbase_txid)
+        assert_equal(node.getindexinfo(), {})
+
+        self.log.info("Enable the index on the existing chain")
+        self.restart_node(['-txindex'])
+        node = self.nodes[0]
+        sync_index(node, "txindex")
+        info = node.getindexinfo()
+        assert_equal(list(info.keys()), ['txindex'])
+        assert_equal(info['txindex']['synced'], True)
+        assert_equal(info['txindex']['best_block_height'], 102)
+        assert_equal(info['txindex']['best_block_hash'],
+                     node.getbestblockhash())
+        assert_equal(node.getindexinfo('addressindex'), {})
+        assert_equal(node.getrawtransaction(coinbase_txid, True)['blockhash'],
+                     node.getblockhash(1))
+        assert_equal(node.getrawtransaction(spend_txid, True)['blockhash'],
+                     node.getblockhash(102))
+
+        self.log.info("Follow new blocks and reorganizations")
+        tip = node.generatetoaddress(1, address)[0]
+        tip_coinbase_txid = node.getblock(tip)['tx'][0]
+        sync_index(node, "txindex")
+        assert_equal(node.getrawtransaction(tip_coinbase_txid, True)['blockhash'],
+                     tip)
+        node.invalidateblock(tip)
+        sync_index(node, "txindex")
+        assert_equal(node.getindexinfo()['txindex']['best_block_height'], 102)
+        assert_raises_jsonrpc(-5, "No such mempool or blockchain transaction",
+                              node.getrawtransaction, tip_coinbase_txid)
+        node.reconsiderblock(tip)
+        sync_index(node, "txindex")
+        assert_equal(node.getrawtransaction(tip_coinbase_txid, True)['blockhash'],
+                     tip)
+
+        self.log.info("Keep the index across restarts")
+        self.restart_node(['-txindex'])
+        node = self.nodes[0]
+        sync_index(node, "txindex")
+        assert_equal(node.getrawtransaction(coinbase_txid, True)['blockhash'],
+                     node.getblockhash(1))
+
+
+if __name__ == '__main__':
+    TxIndexTest().main()
@@ -64,6 +64,19 @@ static void SipHash_32b(benchmark::State &state) {
     }
 }
 
+static void SipHash_32b_Batch(benchmark::State &state) {
+    std::vector<uint256> vals(1000000);
+    std::vector<const uint256 *> ptrs(vals.size());
+    for (size_t i = 0; i < vals.size(); i++) {
+        *((uint64_t *)vals[i].begin()) = i;
+        ptrs[i] = &vals[i];
+    }
+    std::vector<uint64_t> out(vals.size());
+    while (state.KeepRunning()) {
+        SipHashUint256Batch(0, out[0], ptrs.data(), out.data(), ptrs.size());
+    }
+}
+
 static void FastRandom_32bit(benchmark::State &state) {
     FastRandomContext rng(true);
     uint32_t x;
@@ -91,5 +104,6 @@ BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
 BENCHMARK(SipHash_32b);
+BENCHMARK(SipHash_32b_Batch);
 BENCHMARK(FastRandom_32bit);
 BENCHMARK(FastRandom_1bit);
@@ -112,4 +112,47 @@ static void MempoolEviction(benchmark::State &state) {
     }
 }
 
+// Evicts half of a mempool made of many small packages in a single
+// TrimToSize call, as happens when -maxmempool is reached during a fee spike.
+static const int EVICTION_PACKAGES = 500;
+static const int EVICTION_CHILDREN_PER_PACKAGE = 4;
+
+static void MempoolEvictionLarge(benchmark::State &state) {
+    std::vector<std::pair<CMutableTransaction, CAmount>> txs;
+    for (int i = 0; i < EVICTION_PACKAGES; i++) {
+        CMutableTransaction parent;
+        parent.vin.resize(1);
+        parent.vin[0].scriptSig = CScript() << i << OP_1;
+        parent.vout.resize(EVICTION_CHILDREN_PER_PACKAGE);
+        for (CTxOut &out : parent.vout) {
+            out.scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+            out.nValue = 10 * COIN;
+        }
+        // Spread the package feerates so eviction order is not trivial.
+        txs.emplace_back(parent, 1000 + (i * 7919) % 10000);
+
+        for (int j = 0; j < EVICTION_CHILDREN_PER_PACKAGE; j++) {
+            CMutableTransaction child;
+            child.vin.resize(1);
+            child.vin[0].prevout = COutPoint(parent.GetId(), j);
+            child.vin[0].scriptSig = CScript() << OP_2;
+            child.vout.resize(1);
+            child.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+            child.vout[0].nValue = 10 * COIN;
+            txs.emplace_back(child, 1000 + (i * 104729 + j * 31) % 10000);
+        }
+    }
+
+    CTxMemPool pool(CFeeRate(1000));
+
+    while (state.KeepRunning()) {
+        for (const auto &tx : txs) {
+            AddTx(tx.first, tx.second, pool);
+        }
+        pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+        pool.TrimToSize(0);
+    }
+}
+
 BENCHMARK(MempoolEviction);
+BENCHMARK(MempoolEvictionLarge);
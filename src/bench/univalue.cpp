@@ -0,0 +1,87 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "core_io.h"
+#include "primitives/block.h"
+#include "rpc/jsonwriter.h"
+#include "streams.h"
+#include "version.h"
+
+#include <univalue.h>
+
+namespace univalue_bench {
+#include "bench/data/block413567.raw.h"
+}
+
+// A verbose getblock-like document, so that the benchmarks exercise the mix of
+// objects, short keys, numbers and long hex strings RPC replies are made of.
+static UniValue BlockDocument() {
+    // Output scripts are decoded to addresses, which needs chain parameters.
+    SelectParams(CBaseChainParams::MAIN);
+
+    CDataStream stream((const char *)univalue_bench::block413567,
+                       (const char *)&univalue_bench::block413567[sizeof(
+                           univalue_bench::block413567)],
+                       SER_NETWORK, PROTOCOL_VERSION);
+    CBlock block;
+    stream >> block;
+
+    UniValue txs(UniValue::VARR);
+    for (const auto &tx : block.vtx) {
+        UniValue objTx(UniValue::VOBJ);
+        TxToUniv(*tx, uint256(), objTx);
+        txs.push_back(objTx);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("hash", block.GetHash().GetHex()));
+    result.push_back(Pair("version", block.nVersion));
+    result.push_back(Pair("time", int64_t(block.nTime)));
+    result.push_back(Pair("tx", txs));
+    return result;
+}
+
+static void UniValueWrite(benchmark::State &state) {
+    const UniValue doc = BlockDocument();
+    while (state.KeepRunning()) {
+        std::string str = doc.write();
+        assert(!str.empty());
+    }
+}
+
+static void UniValueWritePretty(benchmark::State &state) {
+    const UniValue doc = BlockDocument();
+    while (state.KeepRunning()) {
+        std::string str = doc.write(4);
+        assert(!str.empty());
+    }
+}
+
+static void JSONTextWriterWrite(benchmark::State &state) {
+    const UniValue doc = BlockDocument();
+    while (state.KeepRunning()) {
+        size_t nSize = 0;
+        JSONTextWriter writer(
+            [&](const char *data, size_t size) { nSize += size; });
+        writer.Value(doc);
+        writer.Flush();
+        assert(nSize > 0);
+    }
+}
+
+static void UniValueRead(benchmark::State &state) {
+    const std::string str = BlockDocument().write();
+    while (state.KeepRunning()) {
+        UniValue doc;
+        assert(doc.read(str));
+    }
+}
+
+BENCHMARK(UniValueWrite);
+BENCHMARK(UniValueWritePretty);
+BENCHMARK(JSONTextWriterWrite);
+BENCHMARK(UniValueRead);
@@ -23,9 +23,14 @@ CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock &block)
     // TODO: Use our mempool prior to block acceptance to predictively fill more
     // than just the coinbase.
     prefilledtxn[0] = {0, block.vtx[0]};
+    std::vector<const uint256 *> txhashes(shorttxids.size());
     for (size_t i = 1; i < block.vtx.size(); i++) {
-        const CTransaction &tx = *block.vtx[i];
-        shorttxids[i - 1] = GetShortID(tx.GetHash());
+        txhashes[i - 1] = &block.vtx[i]->GetId();
+    }
+    SipHashUint256Batch(shorttxidk0, shorttxidk1, txhashes.data(),
+                        shorttxids.data(), txhashes.size());
+    for (uint64_t &shorttxid : shorttxids) {
+        shorttxid = ShortIDFromSipHash(shorttxid);
     }
 }
 
@@ -41,9 +46,8 @@ void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const {
 }
 
 uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256 &txhash) const {
-    static_assert(SHORTTXIDS_LENGTH == 6,
-                  "shorttxids calculation assumes 6-byte shorttxids");
-    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
+    return ShortIDFromSipHash(
+        SipHashUint256(shorttxidk0, shorttxidk1, txhash));
 }
 
 ReadStatus PartiallyDownloadedBlock::InitData(
@@ -118,8 +122,12 @@ ReadStatus PartiallyDownloadedBlock::InitData(
         LOCK(pool->cs);
         const std::vector<std::pair<uint256, CTxMemPool::txiter>> &vTxHashes =
             pool->vTxHashes;
+        std::vector<uint64_t> vSipHashes;
+        pool->GetTxHashSipHashes(cmpctblock.shorttxidk0,
+                                 cmpctblock.shorttxidk1, vSipHashes);
         for (size_t i = 0; i < vTxHashes.size(); i++) {
-            uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
+            uint64_t shortid =
+                CBlockHeaderAndShortTxIDs::ShortIDFromSipHash(vSipHashes[i]);
             std::unordered_map<uint64_t, uint16_t>::iterator idit =
                 shorttxids.find(shortid);
             if (idit != shorttxids.end()) {
@@ -146,8 +154,17 @@ ReadStatus PartiallyDownloadedBlock::InitData(
         }
     }
 
+    std::vector<const uint256 *> extra_hashes(extra_txn.size());
+    for (size_t i = 0; i < extra_txn.size(); i++) {
+        extra_hashes[i] = &extra_txn[i].first;
+    }
+    std::vector<uint64_t> extra_siphashes(extra_txn.size());
+    SipHashUint256Batch(cmpctblock.shorttxidk0, cmpctblock.shorttxidk1,
+                        extra_hashes.data(), extra_siphashes.data(),
+                        extra_hashes.size());
     for (size_t i = 0; i < extra_txn.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(extra_txn[i].first);
+        uint64_t shortid =
+            CBlockHeaderAndShortTxIDs::ShortIDFromSipHash(extra_siphashes[i]);
         std::unordered_map<uint64_t, uint16_t>::iterator idit =
             shorttxids.find(shortid);
         if (idit != shorttxids.end()) {
@@ -163,6 +163,13 @@ public:
 
     uint64_t GetShortID(const uint256 &txhash) const;
 
+    /** Truncate a txid's SipHash under this block's key to a short ID. */
+    static uint64_t ShortIDFromSipHash(uint64_t siphash) {
+        static_assert(SHORTTXIDS_LENGTH == 6,
+                      "shorttxids calculation assumes 6-byte shorttxids");
+        return siphash & 0xffffffffffffL;
+    }
+
     size_t BlockTxCount() const {
         return shorttxids.size() + prefilledtxn.size();
     }
@@ -0,0 +1,345 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "undo.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+/** Reads bytes from a buffer, for the deserialization helpers. */
+class SpanReader {
+public:
+    SpanReader(const uint8_t *pbeginIn, const uint8_t *pendIn)
+        : pcur(pbeginIn), pend(pendIn) {}
+
+    void read(char *dst, size_t size) {
+        if (size > size_t(pend - pcur)) {
+            throw std::ios_base::failure("SpanReader::read(): end of data");
+        }
+        memcpy(dst, pcur, size);
+        pcur += size;
+    }
+
+    bool empty() const { return pcur == pend; }
+
+private:
+    const uint8_t *pcur;
+    const uint8_t *pend;
+};
+
+/** Appends bits, most significant first, to a byte vector. */
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t> &outIn)
+        : out(outIn), buffer(0), nBits(0) {}
+
+    /** Write the nbits least significant bits of data (nbits <= 64). */
+    void Write(uint64_t data, int nbits) {
+        while (nbits > 0) {
+            const int n = std::min(8 - nBits, nbits);
+            const uint8_t bits = (data >> (nbits - n)) & ((1 << n) - 1);
+            buffer |= bits << (8 - nBits - n);
+            nBits += n;
+            nbits -= n;
+            if (nBits == 8) {
+                Flush();
+            }
+        }
+    }
+
+    /** Write out a partial byte, padded with zero bits. */
+    void Flush() {
+        if (nBits > 0) {
+            out.push_back(buffer);
+            buffer = 0;
+            nBits = 0;
+        }
+    }
+
+private:
+    std::vector<uint8_t> &out;
+    uint8_t buffer;
+    //! Number of bits of buffer in use
+    int nBits;
+};
+
+/** Reads bits, most significant first, from a SpanReader. */
+class BitReader {
+public:
+    explicit BitReader(SpanReader &inIn) : in(inIn), buffer(0), nBits(0) {}
+
+    /** Read nbits bits (nbits <= 64). */
+    uint64_t Read(int nbits) {
+        uint64_t data = 0;
+        while (nbits > 0) {
+            if (nBits == 0) {
+                in.read((char *)&buffer, 1);
+                nBits = 8;
+            }
+            const int n = std::min(nBits, nbits);
+            data = (data << n) | ((buffer >> (nBits - n)) & ((1 << n) - 1));
+            nBits -= n;
+            nbits -= n;
+        }
+        return data;
+    }
+
+private:
+    SpanReader &in;
+    uint8_t buffer;
+    //! Number of bits of buffer not read yet
+    int nBits;
+};
+
+void GolombRiceEncode(BitWriter &writer, uint8_t P, uint64_t x) {
+    // The quotient in unary, then the remainder in P bits.
+    uint64_t q = x >> P;
+    while (q > 0) {
+        const int nbits = q <= 64 ? int(q) : 64;
+        writer.Write(~uint64_t(0), nbits);
+        q -= nbits;
+    }
+    writer.Write(0, 1);
+    writer.Write(x, P);
+}
+
+uint64_t GolombRiceDecode(BitReader &reader, uint8_t P) {
+    uint64_t q = 0;
+    while (reader.Read(1) == 1) {
+        q++;
+    }
+    const uint64_t r = reader.Read(P);
+    return (q << P) + r;
+}
+
+/**
+ * Map a uniformly distributed 64-bit value into [0, n) without a division:
+ * the high 64 bits of x * n.
+ */
+uint64_t MapIntoRange(uint64_t x, uint64_t n) {
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((unsigned __int128)x * (unsigned __int128)n) >> 64);
+#else
+    const uint64_t x_hi = x >> 32;
+    const uint64_t x_lo = x & 0xFFFFFFFF;
+    const uint64_t n_hi = n >> 32;
+    const uint64_t n_lo = n & 0xFFFFFFFF;
+
+    const uint64_t ac = x_hi * n_hi;
+    const uint64_t ad = x_hi * n_lo;
+    const uint64_t bc = x_lo * n_hi;
+    const uint64_t bd = x_lo * n_lo;
+
+    const uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+#endif
+}
+}
+
+GCSFilter::GCSFilter(const Params &paramsIn)
+    : params(paramsIn), N(0), F(0), encoded(1, 0) {}
+
+GCSFilter::GCSFilter(const Params &paramsIn, std::vector<uint8_t> encodedIn)
+    : params(paramsIn), encoded(std::move(encodedIn)) {
+    SpanReader reader(encoded.data(), encoded.data() + encoded.size());
+    const uint64_t n = ReadCompactSize(reader);
+    N = uint32_t(n);
+    if (N != n) {
+        throw std::ios_base::failure("N must be less than 2^32");
+    }
+    F = uint64_t(N) * uint64_t(params.M);
+
+    // Decode the whole filter once, so that an invalid encoding is caught
+    // here rather than by every Match.
+    BitReader bits(reader);
+    for (uint32_t i = 0; i < N; i++) {
+        GolombRiceDecode(bits, params.P);
+    }
+    if (!reader.empty()) {
+        throw std::ios_base::failure("encoded filter contains excess data");
+    }
+}
+
+GCSFilter::GCSFilter(const Params &paramsIn, const ElementSet &elements)
+    : params(paramsIn) {
+    const size_t n = elements.size();
+    N = uint32_t(n);
+    if (N != n) {
+        throw std::invalid_argument("N must be less than 2^32");
+    }
+    F = uint64_t(N) * uint64_t(params.M);
+
+    CVectorWriter writer(SER_NETWORK, 0, encoded, 0);
+    WriteCompactSize(writer, N);
+    if (elements.empty()) {
+        return;
+    }
+
+    BitWriter bits(encoded);
+    uint64_t last = 0;
+    for (uint64_t value : BuildHashedSet(elements)) {
+        GolombRiceEncode(bits, params.P, value - last);
+        last = value;
+    }
+    bits.Flush();
+}
+
+uint64_t GCSFilter::HashToRange(const Element &element) const {
+    const uint64_t hash = CSipHasher(params.k0, params.k1)
+                              .Write(element.data(), element.size())
+                              .Finalize();
+    return MapIntoRange(hash, F);
+}
+
+std::vector<uint64_t>
+GCSFilter::BuildHashedSet(const ElementSet &elements) const {
+    std::vector<uint64_t> hashes;
+    hashes.reserve(elements.size());
+    for (const Element &element : elements) {
+        hashes.push_back(HashToRange(element));
+    }
+    std::sort(hashes.begin(), hashes.end());
+    return hashes;
+}
+
+bool GCSFilter::MatchInternal(const std::vector<uint64_t> &hashes) const {
+    SpanReader reader(encoded.data(), encoded.data() + encoded.size());
+    // Skip N, which was validated when the filter was built.
+    ReadCompactSize(reader);
+    BitReader bits(reader);
+
+    // Walk the set and the sorted queries together.
+    uint64_t value = 0;
+    size_t i = 0;
+    for (uint32_t n = 0; n < N && i < hashes.size(); n++) {
+        value += GolombRiceDecode(bits, params.P);
+        while (i < hashes.size() && hashes[i] < value) {
+            i++;
+        }
+        if (i < hashes.size() && hashes[i] == value) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool GCSFilter::Match(const Element &element) const {
+    if (N == 0) {
+        return false;
+    }
+    return MatchInternal(std::vector<uint64_t>(1, HashToRange(element)));
+}
+
+bool GCSFilter::MatchAny(const ElementSet &elements) const {
+    if (N == 0 || elements.empty()) {
+        return false;
+    }
+    return MatchInternal(BuildHashedSet(elements));
+}
+
+static const std::string BASIC_FILTER_NAME = "basic";
+static const std::string INVALID_FILTER_NAME = "";
+
+const std::string &BlockFilterTypeName(BlockFilterType filterType) {
+    switch (filterType) {
+        case BlockFilterType::BASIC:
+            return BASIC_FILTER_NAME;
+        default:
+            return INVALID_FILTER_NAME;
+    }
+}
+
+bool BlockFilterTypeByName(const std::string &name,
+                           BlockFilterType &filterType) {
+    if (name == BASIC_FILTER_NAME) {
+        filterType = BlockFilterType::BASIC;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * The elements of the basic filter of a block: the output scripts it creates
+ * and the scripts of the outputs it spends. Empty and OP_RETURN scripts are
+ * left out, since nobody can watch for them.
+ */
+static GCSFilter::ElementSet BasicFilterElements(const CBlock &block,
+                                                 const CBlockUndo &blockundo) {
+    GCSFilter::ElementSet elements;
+    for (const CTransactionRef &tx : block.vtx) {
+        for (const CTxOut &out : tx->vout) {
+            const CScript &script = out.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN) {
+                continue;
+            }
+            elements.emplace(script.begin(), script.end());
+        }
+    }
+    for (const CTxUndo &txundo : blockundo.vtxundo) {
+        for (const Coin &prevout : txundo.vprevout) {
+            const CScript &script = prevout.GetTxOut().scriptPubKey;
+            if (script.empty()) {
+                continue;
+            }
+            elements.emplace(script.begin(), script.end());
+        }
+    }
+    return elements;
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const CBlock &block,
+                         const CBlockUndo &blockundo)
+    : filterType(filterTypeIn), blockHash(block.GetHash()) {
+    GCSFilter::Params params;
+    if (!BuildParams(params)) {
+        throw std::invalid_argument("unknown filter type");
+    }
+    filter = GCSFilter(params, BasicFilterElements(block, blockundo));
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn,
+                         const uint256 &blockHashIn,
+                         std::vector<uint8_t> encodedIn)
+    : filterType(filterTypeIn), blockHash(blockHashIn) {
+    GCSFilter::Params params;
+    if (!BuildParams(params)) {
+        throw std::invalid_argument("unknown filter type");
+    }
+    filter = GCSFilter(params, std::move(encodedIn));
+}
+
+bool BlockFilter::BuildParams(GCSFilter::Params &params) const {
+    switch (filterType) {
+        case BlockFilterType::BASIC:
+            // The SipHash key is the first 16 bytes of the block hash.
+            params.k0 = ReadLE64(blockHash.begin());
+            params.k1 = ReadLE64(blockHash.begin() + 8);
+            params.P = BASIC_FILTER_P;
+            params.M = BASIC_FILTER_M;
+            return true;
+        default:
+            return false;
+    }
+}
+
+uint256 BlockFilter::GetHash() const {
+    const std::vector<uint8_t> &data = GetEncodedFilter();
+    return Hash(data.begin(), data.end());
+}
+
+uint256 BlockFilter::ComputeHeader(const uint256 &prevHeader) const {
+    const uint256 filterHash = GetHash();
+    return Hash(filterHash.begin(), filterHash.end(), prevHeader.begin(),
+                prevHeader.end());
+}
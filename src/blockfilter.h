@@ -0,0 +1,147 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <cstdint>
+#include <ios>
+#include <set>
+#include <string>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/**
+ * A compact, probabilistic representation of a set of byte strings, encoded
+ * as a Golomb-Rice coded set (GCS) as described in BIP 158.
+ *
+ * Every element is hashed with SipHash into the range [0, N * M), and the
+ * sorted differences between consecutive hashes are Golomb-Rice coded with
+ * parameter P. Lookups never give false negatives, and give false positives
+ * with a probability of about 1 / M.
+ */
+class GCSFilter {
+public:
+    typedef std::vector<uint8_t> Element;
+    typedef std::set<Element> ElementSet;
+
+    struct Params {
+        uint64_t k0;
+        uint64_t k1;
+        //! Golomb-Rice coding parameter
+        uint8_t P;
+        //! Inverse false positive rate
+        uint32_t M;
+
+        Params(uint64_t k0In = 0, uint64_t k1In = 0, uint8_t PIn = 0,
+               uint32_t MIn = 1)
+            : k0(k0In), k1(k1In), P(PIn), M(MIn) {}
+    };
+
+    /** An empty filter. */
+    explicit GCSFilter(const Params &paramsIn = Params());
+    /**
+     * A filter from its encoding. Throws std::ios_base::failure if the
+     * encoding is invalid.
+     */
+    GCSFilter(const Params &paramsIn, std::vector<uint8_t> encodedIn);
+    /** A filter of a set of elements. */
+    GCSFilter(const Params &paramsIn, const ElementSet &elements);
+
+    uint32_t GetN() const { return N; }
+    const Params &GetParams() const { return params; }
+    const std::vector<uint8_t> &GetEncoded() const { return encoded; }
+
+    /** Whether the element may be in the set. */
+    bool Match(const Element &element) const;
+    /** Whether any of the elements may be in the set. */
+    bool MatchAny(const ElementSet &elements) const;
+
+private:
+    Params params;
+    uint32_t N;
+    //! N * M, the range elements are hashed into
+    uint64_t F;
+    std::vector<uint8_t> encoded;
+
+    uint64_t HashToRange(const Element &element) const;
+    std::vector<uint64_t> BuildHashedSet(const ElementSet &elements) const;
+    /** Whether any of the sorted hashes is in the set. */
+    bool MatchInternal(const std::vector<uint64_t> &hashes) const;
+};
+
+static const uint8_t BASIC_FILTER_P = 19;
+static const uint32_t BASIC_FILTER_M = 784931;
+
+enum class BlockFilterType : uint8_t {
+    //! The output scripts of a block and the scripts of the outputs it spends
+    BASIC = 0,
+    INVALID = 255,
+};
+
+/** The name of a filter type, or an empty string for an invalid type. */
+const std::string &BlockFilterTypeName(BlockFilterType filterType);
+/** Look a filter type up by name. */
+bool BlockFilterTypeByName(const std::string &name,
+                           BlockFilterType &filterType);
+
+/** A filter of the scripts of a block, as served to light clients. */
+class BlockFilter {
+public:
+    BlockFilter() : filterType(BlockFilterType::INVALID) {}
+    /** Compute the filter of a block from the block and its undo data. */
+    BlockFilter(BlockFilterType filterTypeIn, const CBlock &block,
+                const CBlockUndo &blockundo);
+    /**
+     * A filter from its encoding. Throws std::ios_base::failure if the
+     * encoding is invalid.
+     */
+    BlockFilter(BlockFilterType filterTypeIn, const uint256 &blockHashIn,
+                std::vector<uint8_t> encodedIn);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    const uint256 &GetBlockHash() const { return blockHash; }
+    const GCSFilter &GetFilter() const { return filter; }
+    const std::vector<uint8_t> &GetEncodedFilter() const {
+        return filter.GetEncoded();
+    }
+
+    /** The double SHA256 of the encoded filter. */
+    uint256 GetHash() const;
+    /**
+     * The header of the filter, which commits to the filters of all previous
+     * blocks through the header of the filter of the previous block.
+     */
+    uint256 ComputeHeader(const uint256 &prevHeader) const;
+
+    template <typename Stream> void Serialize(Stream &s) const {
+        s << uint8_t(filterType) << blockHash << filter.GetEncoded();
+    }
+
+    template <typename Stream> void Unserialize(Stream &s) {
+        uint8_t type;
+        std::vector<uint8_t> encodedFilter;
+        s >> type >> blockHash >> encodedFilter;
+        filterType = BlockFilterType(type);
+        GCSFilter::Params params;
+        if (!BuildParams(params)) {
+            throw std::ios_base::failure("unknown filter type");
+        }
+        filter = GCSFilter(params, std::move(encodedFilter));
+    }
+
+private:
+    BlockFilterType filterType;
+    uint256 blockHash;
+    GCSFilter filter;
+
+    bool BuildParams(GCSFilter::Params &params) const;
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
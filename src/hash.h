@@ -251,4 +251,13 @@ uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256 &val);
 uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256 &val,
                              uint32_t extra);
 
+/** Compute out[i] = SipHashUint256(k0, k1, *vals[i]) for i < count.
+ *
+ *  On x86-64 CPUs with AVX2, four inputs are hashed at once in the lanes of
+ *  the vector registers; elsewhere, and for any remainder, this falls back to
+ *  SipHashUint256.
+ */
+void SipHashUint256Batch(uint64_t k0, uint64_t k1, const uint256 *const *vals,
+                         uint64_t *out, size_t count);
+
 #endif // BITCOIN_HASH_H
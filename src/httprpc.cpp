@@ -10,6 +10,7 @@
 #include "crypto/hmac_sha256.h"
 #include "httpserver.h"
 #include "random.h"
+#include "rpc/jsonwriter.h"
 #include "rpc/protocol.h"
 #include "rpc/server.h"
 #include "sync.h"
@@ -194,10 +195,20 @@ static bool HTTPReq_JSONRPC(Config &config, HTTPRequest *req,
         if (valRequest.isObject()) {
             jreq.parse(valRequest);
 
-            UniValue result = tableRPC.execute(config, jreq);
-
-            // Send reply
-            strReply = JSONRPCReply(result, NullUniValue, jreq.id);
+            // Write the reply straight into the HTTP reply buffer, without
+            // building it as a string first. Nothing reaches the buffer if
+            // the call fails.
+            JSONTextWriter writer([req](const char *data, size_t size) {
+                req->WriteReplyBody(data, size);
+            });
+            writer.BeginObject();
+            writer.Key("result");
+            tableRPC.execute(config, jreq, writer);
+            writer.KeyValue("error", NullUniValue);
+            writer.KeyValue("id", jreq.id);
+            writer.EndObject();
+            writer.Flush();
+            strReply = "\n";
 
             // array of requests
         } else if (valRequest.isArray()) {
@@ -6,6 +6,7 @@
 
 #include "chainparamsbase.h"
 #include "compat.h"
+#include "httpworkqueue.h"
 #include "netbase.h"
 #include "rpc/protocol.h" // For HTTP status codes
 #include "sync.h"
@@ -16,6 +17,7 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <atomic>
 #include <future>
 #include <signal.h>
 #include <sys/stat.h>
@@ -25,6 +27,7 @@
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/keyvalq_struct.h>
+#include <event2/listener.h>
 #include <event2/thread.h>
 #include <event2/util.h>
 
@@ -38,6 +41,17 @@
 /** Maximum size of http request (request line + headers) */
 static const size_t MAX_HEADERS_SIZE = 8192;
 
+/** While new connections are paused because the work queue is full, requests
+ * on already open connections are still queued up to this multiple of the
+ * -rpcworkqueue depth before being rejected. */
+static const size_t HTTP_WORKQUEUE_OVERFLOW_FACTOR = 4;
+
+static void ResumeAcceptingIfDrained();
+
+/** Data of a chunked reply that may wait in the event loop for a slow client
+ * before WriteReplyChunk blocks. */
+static const size_t HTTP_CHUNKED_REPLY_MAX_PENDING = 4 * 1024 * 1024;
+
 /** HTTP request work item */
 class HTTPWorkItem : public HTTPClosure {
 public:
@@ -45,7 +59,10 @@ public:
                  const std::string &_path, const HTTPRequestHandler &_func)
         : req(std::move(_req)), path(_path), func(_func), config(&_config) {}
 
-    void operator()() { func(*config, req.get(), path); }
+    void operator()() {
+        ResumeAcceptingIfDrained();
+        func(*config, req.get(), path);
+    }
 
     std::unique_ptr<HTTPRequest> req;
 
@@ -55,87 +72,6 @@ private:
     Config *config;
 };
 
-/** Simple work queue for distributing work over multiple threads.
- * Work items are simply callable objects.
- */
-template <typename WorkItem> class WorkQueue {
-private:
-    /** Mutex protects entire object */
-    std::mutex cs;
-    std::condition_variable cond;
-    std::deque<std::unique_ptr<WorkItem>> queue;
-    bool running;
-    size_t maxDepth;
-    int numThreads;
-
-    /** RAII object to keep track of number of running worker threads */
-    class ThreadCounter {
-    public:
-        WorkQueue &wq;
-        ThreadCounter(WorkQueue &w) : wq(w) {
-            std::lock_guard<std::mutex> lock(wq.cs);
-            wq.numThreads += 1;
-        }
-        ~ThreadCounter() {
-            std::lock_guard<std::mutex> lock(wq.cs);
-            wq.numThreads -= 1;
-            wq.cond.notify_all();
-        }
-    };
-
-public:
-    WorkQueue(size_t _maxDepth)
-        : running(true), maxDepth(_maxDepth), numThreads(0) {}
-    /** Precondition: worker threads have all stopped
-     * (call WaitExit)
-     */
-    ~WorkQueue() {}
-    /** Enqueue a work item */
-    bool Enqueue(WorkItem *item) {
-        std::unique_lock<std::mutex> lock(cs);
-        if (queue.size() >= maxDepth) {
-            return false;
-        }
-        queue.emplace_back(std::unique_ptr<WorkItem>(item));
-        cond.notify_one();
-        return true;
-    }
-    /** Thread function */
-    void Run() {
-        ThreadCounter count(*this);
-        while (true) {
-            std::unique_ptr<WorkItem> i;
-            {
-                std::unique_lock<std::mutex> lock(cs);
-                while (running && queue.empty())
-                    cond.wait(lock);
-                if (!running) break;
-                i = std::move(queue.front());
-                queue.pop_front();
-            }
-            (*i)();
-        }
-    }
-    /** Interrupt and exit loops */
-    void Interrupt() {
-        std::unique_lock<std::mutex> lock(cs);
-        running = false;
-        cond.notify_all();
-    }
-    /** Wait for worker threads to exit */
-    void WaitExit() {
-        std::unique_lock<std::mutex> lock(cs);
-        while (numThreads > 0)
-            cond.wait(lock);
-    }
-
-    /** Return current depth of queue */
-    size_t Depth() {
-        std::unique_lock<std::mutex> lock(cs);
-        return queue.size();
-    }
-};
-
 struct HTTPPathHandler {
     HTTPPathHandler() {}
     HTTPPathHandler(std::string _prefix, bool _exactMatch,
@@ -146,20 +82,36 @@ struct HTTPPathHandler {
     HTTPRequestHandler handler;
 };
 
+/** libevent event loop with its own HTTP server. All event loops accept
+ * connections on the same listening sockets. */
+struct HTTPEventLoop {
+    struct event_base *base = nullptr;
+    struct evhttp *http = nullptr;
+    //! Listening sockets of this loop's HTTP server
+    std::vector<evhttp_bound_socket *> boundSockets;
+    //! Pending while accepting is paused, so that the loop does not exit for
+    //! lack of events
+    struct event *keepAlive = nullptr;
+    std::thread thread;
+    std::future<bool> result;
+};
+
 /** HTTP module state */
 
-//! libevent event loop
-static struct event_base *eventBase = 0;
-//! HTTP server
-struct evhttp *eventHTTP = 0;
+//! Event loops, the first one is also returned by EventBase()
+static std::vector<std::unique_ptr<HTTPEventLoop>> eventLoops;
 //! List of subnets to allow RPC connections from
 static std::vector<CSubNet> rpc_allow_subnets;
 //! Work queue for handling longer requests off the event loop thread
 static WorkQueue<HTTPClosure> *workQueue = 0;
+//! Work queue depth at which new connections stop being accepted
+static size_t workQueueDepth = DEFAULT_HTTP_WORKQUEUE;
+//! Whether accepting new connections is paused because the queue is full
+static std::atomic<bool> fAcceptPaused(false);
+//! Set once the server is being shut down
+static std::atomic<bool> fHTTPInterrupted(false);
 //! Handlers for (sub)paths
 std::vector<HTTPPathHandler> pathHandlers;
-//! Bound listening sockets
-std::vector<evhttp_bound_socket *> boundSockets;
 
 /** Check if a network address is allowed to access the HTTP server */
 static bool ClientAllowed(const CNetAddr &netaddr) {
@@ -225,6 +177,48 @@ static std::string RequestMethodString(HTTPRequest::RequestMethod m) {
     }
 }
 
+/**
+ * Make every event loop stop or resume accepting new connections according to
+ * fAcceptPaused. Listeners are not thread safe, so each loop updates its own
+ * from its event thread. Pending connections wait in the kernel backlog.
+ */
+static void UpdateAccepting() {
+    for (const std::unique_ptr<HTTPEventLoop> &loop : eventLoops) {
+        HTTPEventLoop *pLoop = loop.get();
+        HTTPEvent *ev = new HTTPEvent(pLoop->base, true, [pLoop]() {
+            if (fHTTPInterrupted) return;
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+            for (evhttp_bound_socket *socket : pLoop->boundSockets) {
+                evconnlistener *listener =
+                    evhttp_bound_socket_get_listener(socket);
+                if (fAcceptPaused) {
+                    evconnlistener_disable(listener);
+                } else {
+                    evconnlistener_enable(listener);
+                }
+            }
+            if (fAcceptPaused) {
+                struct timeval tv = {3600, 0};
+                event_add(pLoop->keepAlive, &tv);
+            } else {
+                event_del(pLoop->keepAlive);
+            }
+#endif
+        });
+        ev->trigger(nullptr);
+    }
+}
+
+/** Resume accepting connections once workers have drained the queue to half
+ * its depth. Called by workers when they start on a request. */
+static void ResumeAcceptingIfDrained() {
+    if (fAcceptPaused && workQueue->Depth() <= workQueueDepth / 2 &&
+        fAcceptPaused.exchange(false)) {
+        LogPrint("http", "HTTP work queue drained, accepting connections\n");
+        UpdateAccepting();
+    }
+}
+
 /** HTTP request callback */
 static void http_request_cb(struct evhttp_request *req, void *arg) {
     Config &config = *reinterpret_cast<Config *>(arg);
@@ -273,6 +267,14 @@ static void http_request_cb(struct evhttp_request *req, void *arg) {
         if (workQueue->Enqueue(item.get())) {
             /* if true, queue took ownership */
             item.release();
+            // Apply backpressure: leave new clients in the listen backlog
+            // until the workers catch up, instead of rejecting them.
+            if (workQueue->Depth() >= workQueueDepth &&
+                !fAcceptPaused.exchange(true)) {
+                LogPrint("http", "HTTP work queue full, pausing new "
+                                 "connections\n");
+                UpdateAccepting();
+            }
         } else {
             LogPrintf("WARNING: request rejected because http work queue depth "
                       "exceeded, it can be increased with the -rpcworkqueue= "
@@ -301,7 +303,8 @@ static bool ThreadHTTP(struct event_base *base, struct evhttp *http) {
 }
 
 /** Bind HTTP server to specified addresses */
-static bool HTTPBindAddresses(struct evhttp *http) {
+static bool HTTPBindAddresses(struct evhttp *http,
+                              std::vector<evhttp_bound_socket *> &boundSockets) {
     int defaultPort = GetArg("-rpcport", BaseParams().RPCPort());
     std::vector<std::pair<std::string, uint16_t>> endpoints;
 
@@ -350,9 +353,9 @@ static bool HTTPBindAddresses(struct evhttp *http) {
 }
 
 /** Simple wrapper to set thread name and run work queue */
-static void HTTPWorkQueueRun(WorkQueue<HTTPClosure> *queue) {
+static void HTTPWorkQueueRun(WorkQueue<HTTPClosure> *queue, size_t nShard) {
     RenameThread("bitcoin-httpworker");
-    queue->Run();
+    queue->Run(nShard);
 }
 
 /** libevent event log callback */
@@ -369,10 +372,72 @@ static void libevent_log_cb(int severity, const char *msg) {
     }
 }
 
-bool InitHTTPServer(Config &config) {
-    struct evhttp *http = 0;
-    struct event_base *base = 0;
+/** Create an event loop with an HTTP server that has no sockets yet */
+static HTTPEventLoop *NewHTTPEventLoop(Config &config) {
+    // XXX RAII
+    struct event_base *base = event_base_new();
+    if (!base) {
+        LogPrintf("Couldn't create an event_base: exiting\n");
+        return nullptr;
+    }
+
+    /* Create a new evhttp object to handle requests. */
+    // XXX RAII
+    struct evhttp *http = evhttp_new(base);
+    if (!http) {
+        LogPrintf("couldn't create evhttp. Exiting.\n");
+        event_base_free(base);
+        return nullptr;
+    }
+
+    evhttp_set_timeout(
+        http, GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT));
+    evhttp_set_max_headers_size(http, MAX_HEADERS_SIZE);
+    evhttp_set_max_body_size(http, MAX_SIZE);
+    evhttp_set_gencb(http, http_request_cb, &config);
+
+    HTTPEventLoop *loop = new HTTPEventLoop();
+    loop->base = base;
+    loop->http = http;
+    loop->keepAlive = event_new(base, -1, EV_PERSIST,
+                                [](evutil_socket_t, short, void *) {}, nullptr);
+    assert(loop->keepAlive);
+    return loop;
+}
+
+static void FreeHTTPEventLoop(HTTPEventLoop *loop) {
+    event_free(loop->keepAlive);
+    evhttp_free(loop->http);
+    event_base_free(loop->base);
+    delete loop;
+}
 
+/** Let another event loop accept connections on the sockets of the first */
+static bool ShareBoundSockets(const HTTPEventLoop &from, HTTPEventLoop &to) {
+#ifdef WIN32
+    return false;
+#else
+    for (evhttp_bound_socket *socket : from.boundSockets) {
+        // Every listener closes its socket when freed, so give each loop its
+        // own descriptor for the shared socket.
+        evutil_socket_t fd = dup(evhttp_bound_socket_get_fd(socket));
+        if (fd < 0 || evutil_make_socket_nonblocking(fd) < 0) {
+            if (fd >= 0) close(fd);
+            return false;
+        }
+        evhttp_bound_socket *handle =
+            evhttp_accept_socket_with_handle(to.http, fd);
+        if (!handle) {
+            close(fd);
+            return false;
+        }
+        to.boundSockets.push_back(handle);
+    }
+    return true;
+#endif
+}
+
+bool InitHTTPServer(Config &config) {
     if (!InitHTTPAllowList()) return false;
 
     if (GetBoolArg("-rpcssl", false)) {
@@ -398,60 +463,57 @@ bool InitHTTPServer(Config &config) {
     evthread_use_pthreads();
 #endif
 
-    // XXX RAII
-    base = event_base_new();
-    if (!base) {
-        LogPrintf("Couldn't create an event_base: exiting\n");
-        return false;
-    }
-
-    /* Create a new evhttp object to handle requests. */
-    // XXX RAII
-    http = evhttp_new(base);
-    if (!http) {
-        LogPrintf("couldn't create evhttp. Exiting.\n");
-        event_base_free(base);
-        return false;
-    }
+    std::unique_ptr<HTTPEventLoop> loop(NewHTTPEventLoop(config));
+    if (!loop) return false;
 
-    evhttp_set_timeout(
-        http, GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT));
-    evhttp_set_max_headers_size(http, MAX_HEADERS_SIZE);
-    evhttp_set_max_body_size(http, MAX_SIZE);
-    evhttp_set_gencb(http, http_request_cb, &config);
-
-    if (!HTTPBindAddresses(http)) {
+    if (!HTTPBindAddresses(loop->http, loop->boundSockets)) {
         LogPrintf("Unable to bind any endpoint for RPC server\n");
-        evhttp_free(http);
-        event_base_free(base);
+        FreeHTTPEventLoop(loop.release());
         return false;
     }
+    eventLoops.push_back(std::move(loop));
+
+    int eventThreads = std::max(
+        (long)GetArg("-rpceventthreads", DEFAULT_HTTP_EVENT_THREADS), 1L);
+    while ((int)eventLoops.size() < eventThreads) {
+        loop.reset(NewHTTPEventLoop(config));
+        if (!loop || !ShareBoundSockets(*eventLoops[0], *loop)) {
+            LogPrintf("HTTP: could not create more than %d event loops\n",
+                      eventLoops.size());
+            if (loop) FreeHTTPEventLoop(loop.release());
+            break;
+        }
+        eventLoops.push_back(std::move(loop));
+    }
 
     LogPrint("http", "Initialized HTTP server\n");
-    int workQueueDepth =
+    workQueueDepth =
         std::max((long)GetArg("-rpcworkqueue", DEFAULT_HTTP_WORKQUEUE), 1L);
+    int rpcThreads =
+        std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
     LogPrintf("HTTP: creating work queue of depth %d\n", workQueueDepth);
 
-    workQueue = new WorkQueue<HTTPClosure>(workQueueDepth);
-    eventBase = base;
-    eventHTTP = http;
+    workQueue = new WorkQueue<HTTPClosure>(
+        workQueueDepth * HTTP_WORKQUEUE_OVERFLOW_FACTOR, rpcThreads);
+    fAcceptPaused = false;
+    fHTTPInterrupted = false;
     return true;
 }
 
-std::thread threadHTTP;
-std::future<bool> threadResult;
-
 bool StartHTTPServer() {
     LogPrint("http", "Starting HTTP server\n");
     int rpcThreads =
         std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
-    LogPrintf("HTTP: starting %d worker threads\n", rpcThreads);
-    std::packaged_task<bool(event_base *, evhttp *)> task(ThreadHTTP);
-    threadResult = task.get_future();
-    threadHTTP = std::thread(std::move(task), eventBase, eventHTTP);
+    LogPrintf("HTTP: starting %d event loops and %d worker threads\n",
+              eventLoops.size(), rpcThreads);
+    for (const std::unique_ptr<HTTPEventLoop> &loop : eventLoops) {
+        std::packaged_task<bool(event_base *, evhttp *)> task(ThreadHTTP);
+        loop->result = task.get_future();
+        loop->thread = std::thread(std::move(task), loop->base, loop->http);
+    }
 
     for (int i = 0; i < rpcThreads; i++) {
-        std::thread rpc_worker(HTTPWorkQueueRun, workQueue);
+        std::thread rpc_worker(HTTPWorkQueueRun, workQueue, i);
         rpc_worker.detach();
     }
     return true;
@@ -459,13 +521,16 @@ bool StartHTTPServer() {
 
 void InterruptHTTPServer() {
     LogPrint("http", "Interrupting HTTP server\n");
-    if (eventHTTP) {
+    fHTTPInterrupted = true;
+    for (const std::unique_ptr<HTTPEventLoop> &loop : eventLoops) {
         // Unlisten sockets
-        for (evhttp_bound_socket *socket : boundSockets) {
-            evhttp_del_accept_socket(eventHTTP, socket);
+        for (evhttp_bound_socket *socket : loop->boundSockets) {
+            evhttp_del_accept_socket(loop->http, socket);
         }
         // Reject requests on current connections
-        evhttp_set_gencb(eventHTTP, http_reject_request_cb, nullptr);
+        evhttp_set_gencb(loop->http, http_reject_request_cb, nullptr);
+        // Let the loop exit once its connections are done
+        event_del(loop->keepAlive);
     }
     if (workQueue) workQueue->Interrupt();
 }
@@ -476,38 +541,39 @@ void StopHTTPServer() {
         LogPrint("http", "Waiting for HTTP worker threads to exit\n");
         workQueue->WaitExit();
         delete workQueue;
+        workQueue = 0;
     }
-    if (eventBase) {
-        LogPrint("http", "Waiting for HTTP event thread to exit\n");
-        // Give event loop a few seconds to exit (to send back last RPC
-        // responses), then break it. Before this was solved with
+    if (!eventLoops.empty()) {
+        LogPrint("http", "Waiting for HTTP event threads to exit\n");
+        // Give event loops a few seconds to exit (to send back last RPC
+        // responses), then break them. Before this was solved with
         // event_base_loopexit, but that didn't work as expected in at least
         // libevent 2.0.21 and always introduced a delay. In libevent master
         // that appears to be solved, so in the future that solution could be
         // used again (if desirable).
         // (see discussion in https://github.com/bitcoin/bitcoin/pull/6990)
-        if (threadResult.valid() &&
-            threadResult.wait_for(std::chrono::milliseconds(2000)) ==
-                std::future_status::timeout) {
-            LogPrintf("HTTP event loop did not exit within allotted time, "
-                      "sending loopbreak\n");
-            event_base_loopbreak(eventBase);
+        auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(2000);
+        for (const std::unique_ptr<HTTPEventLoop> &loop : eventLoops) {
+            if (loop->result.valid() &&
+                loop->result.wait_until(deadline) ==
+                    std::future_status::timeout) {
+                LogPrintf("HTTP event loop did not exit within allotted time, "
+                          "sending loopbreak\n");
+                event_base_loopbreak(loop->base);
+            }
+            if (loop->thread.joinable()) loop->thread.join();
         }
-        threadHTTP.join();
-    }
-    if (eventHTTP) {
-        evhttp_free(eventHTTP);
-        eventHTTP = 0;
     }
-    if (eventBase) {
-        event_base_free(eventBase);
-        eventBase = 0;
+    for (std::unique_ptr<HTTPEventLoop> &loop : eventLoops) {
+        FreeHTTPEventLoop(loop.release());
     }
+    eventLoops.clear();
     LogPrint("http", "Stopped HTTP server\n");
 }
 
 struct event_base *EventBase() {
-    return eventBase;
+    return eventLoops.empty() ? nullptr : eventLoops[0]->base;
 }
 
 static void httpevent_callback_fn(evutil_socket_t, short, void *data) {
@@ -536,9 +602,14 @@ void HTTPEvent::trigger(struct timeval *tv) {
     }
 }
 HTTPRequest::HTTPRequest(struct evhttp_request *_req)
-    : req(_req), replySent(false) {}
+    : req(_req),
+      base(evhttp_connection_get_base(evhttp_request_get_connection(_req))),
+      replySent(false) {}
 HTTPRequest::~HTTPRequest() {
-    if (!replySent) {
+    if (chunked && !replySent) {
+        // A chunked reply was abandoned half way, do not pass it off as done
+        EndReply(false);
+    } else if (!replySent) {
         // Keep track of whether reply was sent to avoid request leaks
         LogPrintf("%s: Unhandled request\n", __func__);
         WriteReply(HTTP_INTERNAL, "Unhandled request");
@@ -560,19 +631,11 @@ std::string HTTPRequest::ReadBody() {
     struct evbuffer *buf = evhttp_request_get_input_buffer(req);
     if (!buf) return "";
     size_t size = evbuffer_get_length(buf);
-    /** Trivial implementation: if this is ever a performance bottleneck,
-     * internal copying can be avoided in multi-segment buffers by using
-     * evbuffer_peek and an awkward loop. Though in that case, it'd be even
-     * better to not copy into an intermediate string but use a stream
-     * abstraction to consume the evbuffer on the fly in the parsing algorithm.
-     */
-    const char *data = (const char *)evbuffer_pullup(buf, size);
-    // returns nullptr in case of empty buffer.
-    if (!data) {
-        return "";
-    }
-    std::string rv(data, size);
-    evbuffer_drain(buf, size);
+    if (size == 0) return "";
+    // Copy the segments of the buffer straight into the string, rather than
+    // first making them contiguous inside the evbuffer and copying again.
+    std::string rv(size, '\0');
+    evbuffer_remove(buf, &rv[0], size);
     return rv;
 }
 
@@ -583,9 +646,16 @@ void HTTPRequest::WriteHeader(const std::string &hdr,
     evhttp_add_header(headers, hdr.c_str(), value.c_str());
 }
 
-/** Closure sent to main thread to request a reply to be sent to a HTTP request.
- * Replies must be sent in the main loop in the main http thread, this cannot be
- * done from worker threads.
+void HTTPRequest::WriteReplyBody(const char *data, size_t size) {
+    assert(!replySent && req);
+    struct evbuffer *evb = evhttp_request_get_output_buffer(req);
+    assert(evb);
+    evbuffer_add(evb, data, size);
+}
+
+/** Closure sent to the event loop of the request's connection to request a
+ * reply to be sent. Replies must be sent from that loop's thread, this cannot
+ * be done from worker threads.
  */
 void HTTPRequest::WriteReply(int nStatus, const std::string &strReply) {
     assert(!replySent && req);
@@ -594,7 +664,7 @@ void HTTPRequest::WriteReply(int nStatus, const std::string &strReply) {
     assert(evb);
     evbuffer_add(evb, strReply.data(), strReply.size());
     HTTPEvent *ev =
-        new HTTPEvent(eventBase, true, std::bind(evhttp_send_reply, req,
+        new HTTPEvent(base, true, std::bind(evhttp_send_reply, req,
                                                  nStatus, (const char *)nullptr,
                                                  (struct evbuffer *)nullptr));
     ev->trigger(0);
@@ -603,6 +673,153 @@ void HTTPRequest::WriteReply(int nStatus, const std::string &strReply) {
     req = 0;
 }
 
+/** Flow control between the worker producing a chunked reply and the event
+ * loop sending it. */
+struct HTTPChunkedReply {
+    std::mutex cs;
+    std::condition_variable cond;
+    //! Bytes handed to the event loop and not yet written to the socket
+    size_t nPending;
+    //! Whether the connection is gone or the body cannot be sent
+    bool fClosed;
+    //! Bytes given to the connection since its last write callback (event
+    //! loop thread only)
+    size_t nQueued;
+    //! Status of the reply, for the buffered fallback to send with the body
+    int nStatus;
+
+    HTTPChunkedReply(int nStatusIn)
+        : nPending(0), fClosed(false), nQueued(0), nStatus(nStatusIn) {}
+
+    void Release(size_t size) {
+        std::lock_guard<std::mutex> lock(cs);
+        nPending -= size;
+        cond.notify_all();
+    }
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(cs);
+        fClosed = true;
+        cond.notify_all();
+    }
+};
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+/** Called once the connection has written out everything given to it. */
+static void http_chunk_written_cb(struct evhttp_connection *, void *arg) {
+    HTTPChunkedReply *state = static_cast<HTTPChunkedReply *>(arg);
+    state->Release(state->nQueued);
+    state->nQueued = 0;
+}
+
+static void http_chunked_close_cb(struct evhttp_connection *, void *arg) {
+    static_cast<HTTPChunkedReply *>(arg)->Close();
+}
+#endif
+
+void HTTPRequest::StartReply(int nStatus) {
+    assert(!replySent && !chunked && req);
+    chunked = std::make_shared<HTTPChunkedReply>(nStatus);
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+    std::shared_ptr<HTTPChunkedReply> state = chunked;
+    struct evhttp_request *r = req;
+    HTTPEvent *ev = new HTTPEvent(base, true, [state, r, nStatus]() {
+        // The connection may already be gone, and HEAD requests take no body.
+        struct evhttp_connection *evcon = evhttp_request_get_connection(r);
+        if (!evcon || evhttp_request_get_command(r) == EVHTTP_REQ_HEAD) {
+            if (evcon) evhttp_send_reply_start(r, nStatus, nullptr);
+            state->Close();
+            return;
+        }
+        evhttp_connection_set_closecb(evcon, http_chunked_close_cb,
+                                      state.get());
+        evhttp_send_reply_start(r, nStatus, nullptr);
+    });
+    ev->trigger(0);
+#endif
+}
+
+bool HTTPRequest::WriteReplyChunk(const char *data, size_t size) {
+    assert(!replySent && chunked && req);
+    if (size == 0) return true;
+#if LIBEVENT_VERSION_NUMBER < 0x02010100
+    // Older libevent cannot tell when a chunk has been written, so there is
+    // no flow control to base streaming on: the body is buffered instead and
+    // sent whole by EndReply.
+    WriteReplyBody(data, size);
+    return !fHTTPInterrupted;
+#else
+    {
+        std::unique_lock<std::mutex> lock(chunked->cs);
+        while (!chunked->fClosed &&
+               chunked->nPending >= HTTP_CHUNKED_REPLY_MAX_PENDING) {
+            if (fHTTPInterrupted) return false;
+            chunked->cond.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        if (chunked->fClosed || fHTTPInterrupted) return false;
+        chunked->nPending += size;
+    }
+
+    struct evbuffer *buf = evbuffer_new();
+    evbuffer_add(buf, data, size);
+    std::shared_ptr<HTTPChunkedReply> state = chunked;
+    struct evhttp_request *r = req;
+    HTTPEvent *ev = new HTTPEvent(base, true, [state, r, buf, size]() {
+        bool fClosed;
+        {
+            std::lock_guard<std::mutex> lock(state->cs);
+            fClosed = state->fClosed;
+        }
+        if (fClosed) {
+            state->Release(size);
+        } else {
+            state->nQueued += size;
+            evhttp_send_reply_chunk_with_cb(r, buf, http_chunk_written_cb,
+                                            state.get());
+        }
+        evbuffer_free(buf);
+    });
+    ev->trigger(0);
+    return true;
+#endif
+}
+
+void HTTPRequest::EndReply(bool fComplete) {
+    assert(!replySent && chunked && req);
+#if LIBEVENT_VERSION_NUMBER < 0x02010100
+    if (!fComplete) {
+        // Nothing was sent yet, so an incomplete body can be replaced by an
+        // error.
+        struct evbuffer *evb = evhttp_request_get_output_buffer(req);
+        evbuffer_drain(evb, evbuffer_get_length(evb));
+        WriteReply(HTTP_INTERNAL, "Incomplete reply");
+        return;
+    }
+    WriteReply(chunked->nStatus);
+#else
+    std::shared_ptr<HTTPChunkedReply> state = chunked;
+    struct evhttp_request *r = req;
+    HTTPEvent *ev = new HTTPEvent(base, true, [state, r, fComplete]() {
+        struct evhttp_connection *evcon = evhttp_request_get_connection(r);
+        if (evcon) {
+            // Stop reporting to the worker, which is done with the request.
+            evhttp_connection_set_closecb(evcon, nullptr, nullptr);
+            if (!fComplete &&
+                evhttp_request_get_command(r) != EVHTTP_REQ_HEAD) {
+                // Frees the request along with the connection
+                evhttp_connection_free(evcon);
+                return;
+            }
+        }
+        // Frees the request if its connection is already gone
+        evhttp_send_reply_end(r);
+    });
+    ev->trigger(0);
+    replySent = true;
+    req = 0;
+#endif
+}
+
 CService HTTPRequest::GetPeer() {
     evhttp_connection *con = evhttp_request_get_connection(req);
     CService peer;
@@ -7,9 +7,11 @@
 
 #include <cstdint>
 #include <functional>
+#include <memory>
 #include <string>
 
 static const int DEFAULT_HTTP_THREADS = 4;
+static const int DEFAULT_HTTP_EVENT_THREADS = 1;
 static const int DEFAULT_HTTP_WORKQUEUE = 16;
 static const int DEFAULT_HTTP_SERVER_TIMEOUT = 30;
 
@@ -19,6 +21,7 @@ struct event_base;
 class Config;
 class CService;
 class HTTPRequest;
+struct HTTPChunkedReply;
 
 /** Initialize HTTP server.
  * Call this before RegisterHTTPHandler or EventBase().
@@ -58,7 +61,11 @@ struct event_base *EventBase();
 class HTTPRequest {
 private:
     struct evhttp_request *req;
+    //! Event loop of the connection, which must send the reply
+    struct event_base *base;
     bool replySent;
+    //! Flow control of a reply started with StartReply, or null
+    std::shared_ptr<HTTPChunkedReply> chunked;
 
 public:
     HTTPRequest(struct evhttp_request *req);
@@ -99,6 +106,13 @@ public:
      */
     void WriteHeader(const std::string &hdr, const std::string &value);
 
+    /**
+     * Append to the body of the reply, for replies that are produced in
+     * pieces. The data goes straight into the reply buffer; the reply is sent
+     * by a following WriteReply, whose strReply is appended last.
+     */
+    void WriteReplyBody(const char *data, size_t size);
+
     /**
      * Write HTTP reply.
      * nStatus is the HTTP status code to send.
@@ -110,6 +124,33 @@ public:
      * this.
      */
     void WriteReply(int nStatus, const std::string &strReply = "");
+
+    /**
+     * Start a reply whose body is sent while it is being produced, with
+     * chunked transfer encoding. Write the headers before, then send the body
+     * with WriteReplyChunk and finish with EndReply instead of WriteReply.
+     * With libevent older than 2.1.1 the body is buffered and sent by
+     * EndReply instead.
+     */
+    void StartReply(int nStatus);
+
+    /**
+     * Send the next piece of a reply started with StartReply. Waits while the
+     * client is slow to take what was sent before. Returns false when the
+     * connection was closed or the server is shutting down; the caller should
+     * stop producing output then, and still call EndReply.
+     */
+    bool WriteReplyChunk(const char *data, size_t size);
+
+    /**
+     * Finish a reply started with StartReply. With fComplete false, the
+     * connection is dropped instead of terminating the body, so that the
+     * client can tell the reply is incomplete.
+     *
+     * @note Like WriteReply, do not call any other HTTPRequest methods after
+     * calling this.
+     */
+    void EndReply(bool fComplete = true);
 };
 
 /** Event handler closure.
@@ -0,0 +1,181 @@
+// Copyright (c) 2015-2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HTTPWORKQUEUE_H
+#define BITCOIN_HTTPWORKQUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/** Work queue for distributing work over multiple threads.
+ * Work items are simply callable objects.
+ *
+ * The queue is split into one shard per worker thread, each with its own lock,
+ * so that the event loops and the workers rarely contend on the same mutex.
+ * Items go to the shard with the least pending work. A worker serves its own
+ * shard first and takes work from the other shards before going to sleep.
+ *
+ * Idle workers all sleep on one condition variable, and every enqueue wakes
+ * one of them if there is any. So an item never waits while some worker is
+ * idle, even when the shard it was put in belongs to a worker that is busy
+ * with a long request.
+ */
+template <typename WorkItem> class WorkQueue {
+private:
+    struct Shard {
+        /** Mutex protects queue */
+        std::mutex cs;
+        std::deque<std::unique_ptr<WorkItem>> queue;
+        //! Items queued in this shard
+        std::atomic<size_t> nQueued{0};
+        //! Whether the worker owning this shard is running an item
+        std::atomic<bool> fBusy{false};
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<bool> running;
+    //! Items queued in all shards, only changed with a shard lock held
+    std::atomic<size_t> depth;
+    std::atomic<size_t> nextShard;
+    size_t maxDepth;
+
+    /** Mutex protects sleeping on condIdle */
+    std::mutex csIdle;
+    std::condition_variable condIdle;
+    //! Workers that are about to sleep or sleeping on condIdle
+    std::atomic<int> nIdle;
+
+    /** Mutex protects numThreads */
+    std::mutex csThreads;
+    std::condition_variable condThreads;
+    int numThreads;
+
+    /** RAII object to keep track of number of running worker threads */
+    class ThreadCounter {
+    public:
+        WorkQueue &wq;
+        ThreadCounter(WorkQueue &w) : wq(w) {
+            std::lock_guard<std::mutex> lock(wq.csThreads);
+            wq.numThreads += 1;
+        }
+        ~ThreadCounter() {
+            std::lock_guard<std::mutex> lock(wq.csThreads);
+            wq.numThreads -= 1;
+            wq.condThreads.notify_all();
+        }
+    };
+
+    /** Take the oldest item of a shard, if any */
+    std::unique_ptr<WorkItem> Pop(Shard &shard) {
+        if (shard.nQueued == 0) return nullptr;
+        std::lock_guard<std::mutex> lock(shard.cs);
+        if (shard.queue.empty()) return nullptr;
+        std::unique_ptr<WorkItem> i = std::move(shard.queue.front());
+        shard.queue.pop_front();
+        shard.nQueued--;
+        depth--;
+        return i;
+    }
+
+    /** Take an item from the given shard, or else from any other one. Only
+     * one shard lock is held at a time, so this waits for busy locks rather
+     * than skipping their shards. */
+    std::unique_ptr<WorkItem> Take(size_t nShard) {
+        for (size_t n = 0; n < shards.size(); n++) {
+            std::unique_ptr<WorkItem> i =
+                Pop(*shards[(nShard + n) % shards.size()]);
+            if (i) return i;
+        }
+        return nullptr;
+    }
+
+public:
+    WorkQueue(size_t _maxDepth, int nShards)
+        : running(true), depth(0), nextShard(0), maxDepth(_maxDepth),
+          nIdle(0), numThreads(0) {
+        for (int n = 0; n < std::max(nShards, 1); n++) {
+            shards.emplace_back(new Shard());
+        }
+    }
+    /** Precondition: worker threads have all stopped
+     * (call WaitExit)
+     */
+    ~WorkQueue() {}
+    /** Enqueue a work item */
+    bool Enqueue(WorkItem *item) {
+        if (depth >= maxDepth) {
+            return false;
+        }
+        // Prefer an idle worker, starting the scan at a rotating offset so
+        // that ties are spread over the shards. The loads may be stale, which
+        // only costs locality: any idle worker picks the item up below.
+        size_t nStart = nextShard++;
+        Shard *best = nullptr;
+        size_t nBestLoad = std::numeric_limits<size_t>::max();
+        for (size_t n = 0; n < shards.size() && nBestLoad > 0; n++) {
+            Shard &shard = *shards[(nStart + n) % shards.size()];
+            size_t nLoad = shard.nQueued + shard.fBusy;
+            if (nLoad < nBestLoad) {
+                best = &shard;
+                nBestLoad = nLoad;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(best->cs);
+            best->queue.emplace_back(std::unique_ptr<WorkItem>(item));
+            best->nQueued++;
+            depth++;
+        }
+        // A worker going to sleep raises nIdle before checking depth, and
+        // depth was raised above before checking nIdle, so either it sees the
+        // item or it is woken here.
+        if (nIdle > 0) {
+            std::lock_guard<std::mutex> lock(csIdle);
+            condIdle.notify_one();
+        }
+        return true;
+    }
+    /** Thread function, serving the given shard first */
+    void Run(size_t nShard) {
+        ThreadCounter count(*this);
+        nShard %= shards.size();
+        Shard &own = *shards[nShard];
+        while (running) {
+            std::unique_ptr<WorkItem> i = Take(nShard);
+            if (!i) {
+                std::unique_lock<std::mutex> lock(csIdle);
+                nIdle++;
+                if (running && depth == 0) condIdle.wait(lock);
+                nIdle--;
+                continue;
+            }
+            own.fBusy = true;
+            (*i)();
+            own.fBusy = false;
+        }
+    }
+    /** Interrupt and exit loops */
+    void Interrupt() {
+        running = false;
+        std::lock_guard<std::mutex> lock(csIdle);
+        condIdle.notify_all();
+    }
+    /** Wait for worker threads to exit */
+    void WaitExit() {
+        std::unique_lock<std::mutex> lock(csThreads);
+        while (numThreads > 0)
+            condThreads.wait(lock);
+    }
+
+    /** Return current depth of queue */
+    size_t Depth() { return depth; }
+};
+
+#endif // BITCOIN_HTTPWORKQUEUE_H
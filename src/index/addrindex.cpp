@@ -0,0 +1,257 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/addrindex.h"
+
+#include "chain.h"
+#include "crypto/sha256.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "undo.h"
+#include "util.h"
+
+#include <ios>
+
+static const char DB_HISTORY = 'h';
+static const char DB_UNSPENT = 'u';
+
+std::unique_ptr<AddressIndex> g_addressindex;
+
+namespace {
+
+struct HistoryKey {
+    uint256 scripthash;
+    AddressHistoryPos pos;
+
+    HistoryKey() {}
+    HistoryKey(const uint256 &scripthashIn, const AddressHistoryPos &posIn)
+        : scripthash(scripthashIn), pos(posIn) {}
+
+    template <typename Stream> void Serialize(Stream &s) const {
+        s << DB_HISTORY << scripthash << pos;
+    }
+
+    template <typename Stream> void Unserialize(Stream &s) {
+        char prefix;
+        s >> prefix;
+        if (prefix != DB_HISTORY) {
+            throw std::ios_base::failure("not a history key");
+        }
+        s >> scripthash >> pos;
+    }
+};
+
+/** Outputs only store the transaction and value; spends also the outpoint. */
+struct HistoryValue {
+    bool fOutput;
+    uint256 txid;
+    CAmount nValue;
+    COutPoint prevout;
+
+    explicit HistoryValue(bool fOutputIn) : fOutput(fOutputIn), nValue(0) {}
+    HistoryValue(const uint256 &txidIn, CAmount nValueIn)
+        : fOutput(true), txid(txidIn), nValue(nValueIn) {}
+    HistoryValue(const uint256 &txidIn, CAmount nValueIn,
+                 const COutPoint &prevoutIn)
+        : fOutput(false), txid(txidIn), nValue(nValueIn), prevout(prevoutIn) {}
+
+    template <typename Stream> void Serialize(Stream &s) const {
+        s << txid << nValue;
+        if (!fOutput) {
+            s << prevout;
+        }
+    }
+
+    template <typename Stream> void Unserialize(Stream &s) {
+        s >> txid >> nValue;
+        if (!fOutput) {
+            s >> prevout;
+        }
+    }
+};
+
+struct UnspentKey {
+    uint256 scripthash;
+    COutPoint outpoint;
+
+    UnspentKey() {}
+    UnspentKey(const uint256 &scripthashIn, const COutPoint &outpointIn)
+        : scripthash(scripthashIn), outpoint(outpointIn) {}
+
+    template <typename Stream> void Serialize(Stream &s) const {
+        s << DB_UNSPENT << scripthash << outpoint;
+    }
+
+    template <typename Stream> void Unserialize(Stream &s) {
+        char prefix;
+        s >> prefix;
+        if (prefix != DB_UNSPENT) {
+            throw std::ios_base::failure("not an unspent key");
+        }
+        s >> scripthash >> outpoint;
+    }
+};
+
+typedef std::pair<CAmount, uint32_t> UnspentValue;
+}
+
+uint256 GetScriptHash(const CScript &script) {
+    uint256 hash;
+    CSHA256().Write(script.data(), script.size()).Finalize(hash.begin());
+    return hash;
+}
+
+AddressIndex::AddressIndex(size_t nCacheSize, bool fMemory, bool fWipe)
+    : BaseIndex("addressindex", nCacheSize, fMemory, fWipe) {}
+
+AddressIndex::~AddressIndex() {
+    Interrupt();
+    Stop();
+}
+
+bool AddressIndex::WriteBlock(CDBBatch &batch, const CBlock &block,
+                              const CBlockUndo &blockundo,
+                              const CBlockIndex *pindex) {
+    const uint32_t nHeight = pindex->nHeight;
+
+    // Outputs first, so that outputs spent in the same block are removed from
+    // the unspent set again below.
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = *block.vtx[i];
+        for (size_t j = 0; j < tx.vout.size(); j++) {
+            const CTxOut &out = tx.vout[j];
+            if (out.scriptPubKey.IsUnspendable()) {
+                continue;
+            }
+            const uint256 scripthash = GetScriptHash(out.scriptPubKey);
+            batch.Write(
+                HistoryKey(scripthash, AddressHistoryPos(nHeight, i, true, j)),
+                HistoryValue(tx.GetId(), out.nValue));
+            batch.Write(UnspentKey(scripthash, COutPoint(tx.GetId(), j)),
+                        UnspentValue(out.nValue, nHeight));
+        }
+    }
+
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        const CTransaction &tx = *block.vtx[i];
+        const CTxUndo &txundo = blockundo.vtxundo[i - 1];
+        if (txundo.vprevout.size() != tx.vin.size()) {
+            return error("%s: undo data doesn't match transaction %s",
+                         __func__, tx.GetId().ToString());
+        }
+        for (size_t j = 0; j < tx.vin.size(); j++) {
+            const CTxOut &prev = txundo.vprevout[j].GetTxOut();
+            const uint256 scripthash = GetScriptHash(prev.scriptPubKey);
+            batch.Write(
+                HistoryKey(scripthash, AddressHistoryPos(nHeight, i, false, j)),
+                HistoryValue(tx.GetId(), prev.nValue, tx.vin[j].prevout));
+            batch.Erase(UnspentKey(scripthash, tx.vin[j].prevout));
+        }
+    }
+    return true;
+}
+
+bool AddressIndex::RewindBlock(CDBBatch &batch, const CBlock &block,
+                               const CBlockUndo &blockundo,
+                               const CBlockIndex *pindex) {
+    const uint32_t nHeight = pindex->nHeight;
+
+    // The reverse of WriteBlock: spent outputs are restored before the outputs
+    // of the block are removed.
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        const CTransaction &tx = *block.vtx[i];
+        const CTxUndo &txundo = blockundo.vtxundo[i - 1];
+        if (txundo.vprevout.size() != tx.vin.size()) {
+            return error("%s: undo data doesn't match transaction %s",
+                         __func__, tx.GetId().ToString());
+        }
+        for (size_t j = 0; j < tx.vin.size(); j++) {
+            const Coin &coin = txundo.vprevout[j];
+            const uint256 scripthash =
+                GetScriptHash(coin.GetTxOut().scriptPubKey);
+            batch.Erase(HistoryKey(scripthash,
+                                   AddressHistoryPos(nHeight, i, false, j)));
+            batch.Write(UnspentKey(scripthash, tx.vin[j].prevout),
+                        UnspentValue(coin.GetTxOut().nValue, coin.GetHeight()));
+        }
+    }
+
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = *block.vtx[i];
+        for (size_t j = 0; j < tx.vout.size(); j++) {
+            const CTxOut &out = tx.vout[j];
+            if (out.scriptPubKey.IsUnspendable()) {
+                continue;
+            }
+            const uint256 scripthash = GetScriptHash(out.scriptPubKey);
+            batch.Erase(
+                HistoryKey(scripthash, AddressHistoryPos(nHeight, i, true, j)));
+            batch.Erase(UnspentKey(scripthash, COutPoint(tx.GetId(), j)));
+        }
+    }
+    return true;
+}
+
+bool AddressIndex::FindHistory(
+    const uint256 &scripthash, const AddressHistoryPos &posStart, size_t nLimit,
+    std::vector<AddressHistoryEntry> &entries) const {
+    if (!db) {
+        return false;
+    }
+
+    // The iterator reads from a snapshot of the database, so the entries are
+    // consistent even if blocks are indexed meanwhile.
+    std::unique_ptr<CDBIterator> it(db->NewIterator());
+    it->Seek(HistoryKey(scripthash, posStart));
+    for (size_t n = 0; n < nLimit && it->Valid(); n++, it->Next()) {
+        HistoryKey key;
+        if (!it->GetKey(key) || key.scripthash != scripthash) {
+            break;
+        }
+        HistoryValue value(key.pos.fOutput);
+        if (!it->GetValue(value)) {
+            return error("%s: failed to read history entry", __func__);
+        }
+
+        AddressHistoryEntry entry;
+        entry.pos = key.pos;
+        entry.txid = value.txid;
+        entry.outpoint = key.pos.fOutput
+                             ? COutPoint(value.txid, key.pos.nIndex)
+                             : value.prevout;
+        entry.nValue = value.nValue;
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+bool AddressIndex::FindUnspent(
+    const uint256 &scripthash, const COutPoint &outpointStart, size_t nLimit,
+    std::vector<AddressUnspentEntry> &entries) const {
+    if (!db) {
+        return false;
+    }
+
+    std::unique_ptr<CDBIterator> it(db->NewIterator());
+    const COutPoint outpointSeek =
+        outpointStart.IsNull() ? COutPoint(uint256(), 0) : outpointStart;
+    it->Seek(UnspentKey(scripthash, outpointSeek));
+    for (size_t n = 0; n < nLimit && it->Valid(); n++, it->Next()) {
+        UnspentKey key;
+        if (!it->GetKey(key) || key.scripthash != scripthash) {
+            break;
+        }
+        UnspentValue value;
+        if (!it->GetValue(value)) {
+            return error("%s: failed to read unspent entry", __func__);
+        }
+
+        AddressUnspentEntry entry;
+        entry.outpoint = key.outpoint;
+        entry.nValue = value.first;
+        entry.nHeight = value.second;
+        entries.push_back(entry);
+    }
+    return true;
+}
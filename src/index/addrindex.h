@@ -0,0 +1,119 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_ADDRINDEX_H
+#define BITCOIN_INDEX_ADDRINDEX_H
+
+#include "amount.h"
+#include "crypto/common.h"
+#include "index/base.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+
+#include <memory>
+#include <vector>
+
+class CScript;
+
+//! -addressindex default
+static const bool DEFAULT_ADDRESSINDEX = false;
+//! Max memory allocated to the address index database cache (MiB)
+static const int64_t nMaxAddressIndexCache = 1024;
+
+/** The key output scripts are indexed by: their single SHA256 hash. */
+uint256 GetScriptHash(const CScript &script);
+
+/**
+ * Position of an entry in the history of a script: entries are ordered by
+ * block height, position of the transaction in the block, spends before
+ * outputs, and input or output index.
+ */
+struct AddressHistoryPos {
+    uint32_t nHeight;
+    uint32_t nTxPos;
+    bool fOutput;
+    uint32_t nIndex;
+
+    AddressHistoryPos()
+        : nHeight(0), nTxPos(0), fOutput(false), nIndex(0) {}
+    AddressHistoryPos(uint32_t nHeightIn, uint32_t nTxPosIn, bool fOutputIn,
+                      uint32_t nIndexIn)
+        : nHeight(nHeightIn), nTxPos(nTxPosIn), fOutput(fOutputIn),
+          nIndex(nIndexIn) {}
+
+    // Big endian, so that the database orders entries by position.
+    template <typename Stream> void Serialize(Stream &s) const {
+        uint8_t buf[13];
+        WriteBE32(buf, nHeight);
+        WriteBE32(buf + 4, nTxPos);
+        buf[8] = fOutput;
+        WriteBE32(buf + 9, nIndex);
+        s.write((const char *)buf, sizeof(buf));
+    }
+
+    template <typename Stream> void Unserialize(Stream &s) {
+        uint8_t buf[13];
+        s.read((char *)buf, sizeof(buf));
+        nHeight = ReadBE32(buf);
+        nTxPos = ReadBE32(buf + 4);
+        fOutput = buf[8];
+        nIndex = ReadBE32(buf + 9);
+    }
+};
+
+/** An output paying to a script, or the spend of such an output. */
+struct AddressHistoryEntry {
+    AddressHistoryPos pos;
+    //! The transaction at pos
+    uint256 txid;
+    //! The output created, or the output spent
+    COutPoint outpoint;
+    CAmount nValue;
+};
+
+/** An unspent output paying to a script. */
+struct AddressUnspentEntry {
+    COutPoint outpoint;
+    CAmount nValue;
+    uint32_t nHeight;
+};
+
+/**
+ * Index of the outputs paying to each output script and of their spends, in
+ * chain order, and of the outputs that are still unspent. Transactions in the
+ * mempool are not included.
+ */
+class AddressIndex : public BaseIndex {
+public:
+    AddressIndex(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~AddressIndex();
+
+    /**
+     * Append up to nLimit entries of the history of a script, starting at
+     * posStart, to entries.
+     */
+    bool FindHistory(const uint256 &scripthash,
+                     const AddressHistoryPos &posStart, size_t nLimit,
+                     std::vector<AddressHistoryEntry> &entries) const;
+    /**
+     * Append up to nLimit unspent outputs paying to a script, in outpoint
+     * order, starting at outpointStart (if not null), to entries.
+     */
+    bool FindUnspent(const uint256 &scripthash, const COutPoint &outpointStart,
+                     size_t nLimit,
+                     std::vector<AddressUnspentEntry> &entries) const;
+
+protected:
+    bool WriteBlock(CDBBatch &batch, const CBlock &block,
+                    const CBlockUndo &blockundo,
+                    const CBlockIndex *pindex) override;
+    bool RewindBlock(CDBBatch &batch, const CBlock &block,
+                     const CBlockUndo &blockundo,
+                     const CBlockIndex *pindex) override;
+};
+
+/** The address index, if -addressindex is enabled. */
+extern std::unique_ptr<AddressIndex> g_addressindex;
+
+#endif // BITCOIN_INDEX_ADDRINDEX_H
@@ -0,0 +1,297 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/base.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "primitives/block.h"
+#include "sync.h"
+#include "undo.h"
+#include "util.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <functional>
+
+static const char DB_BEST_BLOCK = 'B';
+
+//! How often progress is logged while an index catches up, in seconds
+static const int64_t SYNC_LOG_INTERVAL = 30;
+//! Size at which the blocks indexed so far are written while catching up
+static const size_t SYNC_BATCH_SIZE = 1 << 24;
+//! How often the blocks indexed so far are written while catching up, in
+//! seconds, so that little work is lost if the node stops
+static const int64_t SYNC_COMMIT_INTERVAL = 30;
+//! How long the sync thread sleeps when no tip change was announced. Not all
+//! tip changes are (invalidateblock isn't), so it checks anyway after this.
+static const std::chrono::seconds SYNC_POLL_INTERVAL(1);
+
+BaseIndex::BaseIndex(const std::string &nameIn, size_t nCacheSizeIn,
+                     bool fMemoryIn, bool fWipeIn)
+    : name(nameIn), nCacheSize(nCacheSizeIn), fMemory(fMemoryIn),
+      fWipe(fWipeIn), pbest(nullptr), fSynced(false), fNotified(false),
+      fInterrupted(false), fRegistered(false) {}
+
+BaseIndex::~BaseIndex() {
+    Interrupt();
+    Stop();
+}
+
+bool BaseIndex::Start() {
+    const boost::filesystem::path path = GetDataDir() / "indexes" / name;
+    try {
+        TryCreateDirectory(path.parent_path());
+        db.reset(new CDBWrapper(path, nCacheSize, fMemory, fWipe));
+
+        uint256 hashBest;
+        if (db->Read(DB_BEST_BLOCK, hashBest)) {
+            LOCK(cs_main);
+            BlockMap::const_iterator it = mapBlockIndex.find(hashBest);
+            if (it == mapBlockIndex.end()) {
+                // The block index was rebuilt without the block the index is
+                // at, so there is no undo data to rewind it with.
+                LogPrintf("%s: best block %s of the %s is unknown, "
+                          "rebuilding it\n",
+                          __func__, hashBest.ToString(), name);
+                db.reset();
+                db.reset(new CDBWrapper(path, nCacheSize, fMemory, true));
+            } else {
+                pbest = it->second;
+            }
+        }
+        if (!Init()) {
+            db.reset();
+            return error("%s: failed to initialize the %s", __func__, name);
+        }
+    } catch (const std::exception &e) {
+        db.reset();
+        return error("%s: failed to open the %s database: %s", __func__, name,
+                     e.what());
+    }
+
+    RegisterValidationInterface(this);
+    fRegistered = true;
+    threadSync = std::thread(
+        &TraceThread<std::function<void()>>, name.c_str(),
+        std::function<void()>(std::bind(&BaseIndex::ThreadSync, this)));
+    return true;
+}
+
+void BaseIndex::Interrupt() {
+    std::lock_guard<std::mutex> lock(cs);
+    fInterrupted = true;
+    cond.notify_all();
+}
+
+void BaseIndex::Stop() {
+    if (fRegistered) {
+        UnregisterValidationInterface(this);
+        fRegistered = false;
+    }
+    if (threadSync.joinable()) {
+        threadSync.join();
+    }
+}
+
+void BaseIndex::UpdatedBlockTip(const CBlockIndex *pindexNew,
+                                const CBlockIndex *pindexFork,
+                                bool fInitialDownload) {
+    std::lock_guard<std::mutex> lock(cs);
+    fNotified = true;
+    cond.notify_all();
+}
+
+void BaseIndex::WaitForTipChange() {
+    std::unique_lock<std::mutex> lock(cs);
+    cond.wait_for(lock, SYNC_POLL_INTERVAL,
+                  [this] { return fInterrupted || fNotified; });
+    fNotified = false;
+}
+
+bool BaseIndex::IsBlockFailed(const CBlockIndex *pindex) {
+    LOCK(cs_main);
+    return (pindex->nStatus & BLOCK_FAILED_MASK) != 0;
+}
+
+bool BaseIndex::ReadBlockAndUndo(const CBlockIndex *pindex, CBlock &block,
+                                 CBlockUndo &blockundo) {
+    CDiskBlockPos posBlock;
+    CDiskBlockPos posUndo;
+    {
+        LOCK(cs_main);
+        posBlock = pindex->GetBlockPos();
+        posUndo = pindex->GetUndoPos();
+    }
+
+    if (!ReadBlockFromDisk(block, posBlock, Params().GetConsensus())) {
+        return error("%s: failed to read block %s", __func__,
+                     pindex->GetBlockHash().ToString());
+    }
+    // The genesis block has no undo data.
+    blockundo.vtxundo.clear();
+    if (pindex->pprev == nullptr || !NeedsUndoData()) {
+        return true;
+    }
+    if (!UndoReadFromDisk(blockundo, posUndo, pindex->pprev->GetBlockHash())) {
+        return error("%s: failed to read undo data of block %s", __func__,
+                     pindex->GetBlockHash().ToString());
+    }
+    // There is undo data for every transaction but the coinbase.
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size()) {
+        return error("%s: undo data of block %s doesn't match the block",
+                     __func__, pindex->GetBlockHash().ToString());
+    }
+    return true;
+}
+
+bool BaseIndex::Append(CDBBatch &batch, const CBlockIndex *pindex) {
+    CBlock block;
+    CBlockUndo blockundo;
+    if (!ReadBlockAndUndo(pindex, block, blockundo)) {
+        return false;
+    }
+    try {
+        if (!WriteBlock(batch, block, blockundo, pindex)) {
+            return error("%s: failed to index block %s", __func__,
+                         pindex->GetBlockHash().ToString());
+        }
+    } catch (const dbwrapper_error &e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool BaseIndex::WriteBestBlock(CDBBatch &batch,
+                               const CBlockIndex *pindexBest) {
+    try {
+        if (!Commit(batch)) {
+            return error("%s: failed to commit the %s", __func__, name);
+        }
+        if (pindexBest != nullptr) {
+            batch.Write(DB_BEST_BLOCK, pindexBest->GetBlockHash());
+        } else {
+            batch.Erase(DB_BEST_BLOCK);
+        }
+        db->WriteBatch(batch);
+    } catch (const dbwrapper_error &e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    batch.Clear();
+    pbest = pindexBest;
+    return true;
+}
+
+bool BaseIndex::Rewind(const CBlockIndex *pindex) {
+    CBlock block;
+    CBlockUndo blockundo;
+    if (!ReadBlockAndUndo(pindex, block, blockundo)) {
+        return false;
+    }
+
+    CDBBatch batch(*db);
+    try {
+        if (!RewindBlock(batch, block, blockundo, pindex)) {
+            return error("%s: failed to rewind block %s", __func__,
+                         pindex->GetBlockHash().ToString());
+        }
+    } catch (const dbwrapper_error &e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    return WriteBestBlock(batch, pindex->pprev);
+}
+
+void BaseIndex::ThreadSync() {
+    int64_t nLastLog = GetTime();
+    int64_t nLastCommit = GetTime();
+    // Blocks indexed but not written yet, up to and including pindexBatch.
+    // They are written before the sync thread waits or rewinds, so that
+    // rewinds and queries only ever see the database.
+    CDBBatch batch(*db);
+    const CBlockIndex *pindexBatch = nullptr;
+    bool fError = false;
+    while (!fInterrupted) {
+        std::shared_ptr<const ChainTipSnapshot> tip = GetChainTipSnapshot();
+        const CBlockIndex *pindex =
+            pindexBatch != nullptr ? pindexBatch : pbest.load();
+
+        if (pindex != nullptr && !tip->Contains(pindex)) {
+            if (pindexBatch != nullptr) {
+                if (!WriteBestBlock(batch, pindexBatch)) {
+                    fError = true;
+                    break;
+                }
+                pindexBatch = nullptr;
+                nLastCommit = GetTime();
+                continue;
+            }
+            if ((tip->pindex == nullptr ||
+                 pindex->GetAncestor(tip->nHeight) == tip->pindex) &&
+                !IsBlockFailed(pindex)) {
+                // The chain is being reconnected below the index, e.g. with
+                // -reindex-chainstate: wait for it instead of rewinding.
+                WaitForTipChange();
+                continue;
+            }
+            if (!Rewind(pindex)) {
+                fError = true;
+                break;
+            }
+            LogPrint("index", "%s: rewound %s to height %d\n", __func__, name,
+                     pindex->nHeight - 1);
+            continue;
+        }
+
+        const CBlockIndex *pnext =
+            pindex != nullptr ? tip->Next(pindex) : (*tip)[0];
+        if (pnext == nullptr) {
+            if (pindexBatch != nullptr) {
+                if (!WriteBestBlock(batch, pindexBatch)) {
+                    fError = true;
+                    break;
+                }
+                pindexBatch = nullptr;
+                nLastCommit = GetTime();
+            }
+            if (!fSynced && tip->pindex != nullptr) {
+                fSynced = true;
+                LogPrintf("%s is synced to height %d\n", name, tip->nHeight);
+            }
+            WaitForTipChange();
+            continue;
+        }
+
+        if (!Append(batch, pnext)) {
+            fError = true;
+            break;
+        }
+        pindexBatch = pnext;
+        if (batch.SizeEstimate() >= SYNC_BATCH_SIZE ||
+            GetTime() - nLastCommit >= SYNC_COMMIT_INTERVAL) {
+            if (!WriteBestBlock(batch, pindexBatch)) {
+                fError = true;
+                break;
+            }
+            pindexBatch = nullptr;
+            nLastCommit = GetTime();
+        }
+        if (GetTime() - nLastLog >= SYNC_LOG_INTERVAL) {
+            nLastLog = GetTime();
+            LogPrintf("Syncing %s with block chain at height %d of %d\n", name,
+                      pnext->nHeight, tip->nHeight);
+        }
+    }
+
+    // Keep what was indexed before an interruption. After an error the batch
+    // may hold part of a block, so it is dropped.
+    if (!fError && pindexBatch != nullptr &&
+        !WriteBestBlock(batch, pindexBatch)) {
+        fError = true;
+    }
+    if (fError) {
+        LogPrintf("%s: %s stopped at height %d after an error, restart the "
+                  "node to resume it\n",
+                  __func__, name, pbest.load() ? pbest.load()->nHeight : -1);
+    }
+}
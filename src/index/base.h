@@ -0,0 +1,118 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_BASE_H
+#define BITCOIN_INDEX_BASE_H
+
+#include "dbwrapper.h"
+#include "validationinterface.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class CBlock;
+class CBlockIndex;
+class CBlockUndo;
+
+/**
+ * Base class for optional indexes of the active chain that are kept in their
+ * own database under <datadir>/indexes/<name>.
+ *
+ * A background thread reads blocks and their undo data from disk and brings
+ * the index up to the published chain tip, block by block, without holding
+ * cs_main while it does so. Blocks that leave the active chain are rewound
+ * with their undo data. While catching up, the entries of many blocks are
+ * committed in one batch together with the hash of the block the index is
+ * synced to, so the index stays consistent across crashes. Queries may
+ * therefore lag behind the tip.
+ */
+class BaseIndex : public CValidationInterface {
+public:
+    virtual ~BaseIndex();
+
+    /**
+     * Open the database, register for chain notifications and start syncing
+     * in the background.
+     */
+    bool Start();
+    /** Ask the sync thread to stop. */
+    void Interrupt();
+    /**
+     * Stop the sync thread and unregister. Must be called after Interrupt()
+     * and before an index that was started is destroyed.
+     */
+    void Stop();
+
+    const std::string &GetName() const { return name; }
+    /** The last block the index covers, or nullptr if it covers none. */
+    const CBlockIndex *GetBestBlock() const { return pbest; }
+    /** Whether the index has caught up with the chain tip since it started. */
+    bool IsSynced() const { return fSynced; }
+
+protected:
+    BaseIndex(const std::string &nameIn, size_t nCacheSizeIn, bool fMemoryIn,
+              bool fWipeIn);
+
+    /** Called by Start() once the database is open, before syncing. */
+    virtual bool Init() { return true; }
+    /** Add the entries of a block that extends the index to the batch. */
+    virtual bool WriteBlock(CDBBatch &batch, const CBlock &block,
+                            const CBlockUndo &blockundo,
+                            const CBlockIndex *pindex) = 0;
+    /** Add the removal of the entries of the best block to the batch. */
+    virtual bool RewindBlock(CDBBatch &batch, const CBlock &block,
+                             const CBlockUndo &blockundo,
+                             const CBlockIndex *pindex) = 0;
+    /**
+     * Whether WriteBlock and RewindBlock use the undo data of the block. If
+     * not, it isn't read from disk and they get an empty CBlockUndo.
+     */
+    virtual bool NeedsUndoData() const { return true; }
+    /**
+     * Called before every batch that moves the best block of the index is
+     * written. Indexes that keep data outside their database make it durable
+     * here and add what they need to find it again to the batch, so the
+     * database never points past what is on disk.
+     */
+    virtual bool Commit(CDBBatch &batch) { return true; }
+
+    void UpdatedBlockTip(const CBlockIndex *pindexNew,
+                         const CBlockIndex *pindexFork,
+                         bool fInitialDownload) override;
+
+    //! Opened by Start()
+    std::unique_ptr<CDBWrapper> db;
+
+private:
+    std::string name;
+    size_t nCacheSize;
+    bool fMemory;
+    bool fWipe;
+
+    std::atomic<const CBlockIndex *> pbest;
+    std::atomic<bool> fSynced;
+
+    std::mutex cs;
+    std::condition_variable cond;
+    //! Whether the tip changed since the sync thread last looked (cs)
+    bool fNotified;
+    std::atomic<bool> fInterrupted;
+    std::thread threadSync;
+    bool fRegistered;
+
+    void WaitForTipChange();
+    static bool IsBlockFailed(const CBlockIndex *pindex);
+    bool ReadBlockAndUndo(const CBlockIndex *pindex, CBlock &block,
+                          CBlockUndo &blockundo);
+    bool Append(CDBBatch &batch, const CBlockIndex *pindex);
+    bool WriteBestBlock(CDBBatch &batch, const CBlockIndex *pindexBest);
+    bool Rewind(const CBlockIndex *pindex);
+    void ThreadSync();
+};
+
+#endif // BITCOIN_INDEX_BASE_H
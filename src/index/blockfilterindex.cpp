@@ -0,0 +1,266 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/blockfilterindex.h"
+
+#include "clientversion.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "undo.h"
+#include "util.h"
+
+static const char DB_BLOCK_HASH = 's';
+static const char DB_FILTER_POS = 'P';
+
+//! The size at which a new filter file is started
+static const unsigned int MAX_FLTR_FILE_SIZE = 0x1000000; // 16 MiB
+
+std::unique_ptr<BlockFilterIndex> g_blockfilterindex;
+
+namespace {
+
+/** What the database stores about the filter of a block. */
+struct FilterEntry {
+    uint256 hash;
+    uint256 header;
+    CDiskBlockPos pos;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream &s, Operation ser_action) {
+        READWRITE(hash);
+        READWRITE(header);
+        READWRITE(pos);
+    }
+};
+}
+
+BlockFilterIndex::BlockFilterIndex(BlockFilterType filterTypeIn,
+                                   size_t nCacheSize, bool fMemory, bool fWipe)
+    : BaseIndex("blockfilterindex", nCacheSize, fMemory, fWipe),
+      filterType(filterTypeIn), nFileUnflushed(-1) {}
+
+BlockFilterIndex::~BlockFilterIndex() {
+    Interrupt();
+    Stop();
+}
+
+bool BlockFilterIndex::Init() {
+    // The filter files get their own directory next to the database rather
+    // than sharing the LevelDB one.
+    dirFilters = GetDataDir() / "indexes" / "blockfilters";
+    TryCreateDirectory(dirFilters);
+    if (!db->Read(DB_FILTER_POS, posNext)) {
+        posNext.nFile = 0;
+        posNext.nPos = 0;
+    }
+    return true;
+}
+
+boost::filesystem::path BlockFilterIndex::GetFilterFilePath(int nFile) const {
+    return dirFilters / strprintf("fltr%05u.dat", nFile);
+}
+
+bool BlockFilterIndex::WriteFilterToDisk(CDiskBlockPos &pos,
+                                         const BlockFilter &filter) {
+    const unsigned int nSize =
+        ::GetSerializeSize(filter, SER_DISK, CLIENT_VERSION);
+    if (pos.nPos + nSize > MAX_FLTR_FILE_SIZE) {
+        pos.nFile++;
+        pos.nPos = 0;
+    }
+
+    const boost::filesystem::path path = GetFilterFilePath(pos.nFile);
+    FILE *file = fopen(path.string().c_str(), "rb+");
+    if (file == nullptr) {
+        file = fopen(path.string().c_str(), "wb+");
+    }
+    if (file == nullptr) {
+        return error("%s: failed to open %s", __func__, path.string());
+    }
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fseek(fileout.Get(), pos.nPos, SEEK_SET)) {
+        return error("%s: failed to seek in %s", __func__, path.string());
+    }
+    try {
+        fileout << filter;
+    } catch (const std::exception &e) {
+        return error("%s: failed to write to %s: %s", __func__, path.string(),
+                     e.what());
+    }
+    // The file is synced to disk by Commit(), before the database points to
+    // the filter.
+    if (nFileUnflushed < 0) {
+        nFileUnflushed = pos.nFile;
+    }
+    return true;
+}
+
+bool BlockFilterIndex::ReadFilterFromDisk(const CDiskBlockPos &pos,
+                                          const uint256 &hashBlock,
+                                          BlockFilter &filter) const {
+    const boost::filesystem::path path = GetFilterFilePath(pos.nFile);
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK,
+                     CLIENT_VERSION);
+    if (filein.IsNull()) {
+        return error("%s: failed to open %s", __func__, path.string());
+    }
+    if (fseek(filein.Get(), pos.nPos, SEEK_SET)) {
+        return error("%s: failed to seek in %s", __func__, path.string());
+    }
+    try {
+        filein >> filter;
+    } catch (const std::exception &e) {
+        return error("%s: failed to read from %s: %s", __func__, path.string(),
+                     e.what());
+    }
+    if (filter.GetFilterType() != filterType ||
+        filter.GetBlockHash() != hashBlock) {
+        return error("%s: filter at %s doesn't match block %s", __func__,
+                     pos.ToString(), hashBlock.ToString());
+    }
+    return true;
+}
+
+bool BlockFilterIndex::WriteBlock(CDBBatch &batch, const CBlock &block,
+                                  const CBlockUndo &blockundo,
+                                  const CBlockIndex *pindex) {
+    const uint256 hashBlock = pindex->GetBlockHash();
+    // The block was indexed before it was disconnected.
+    FilterEntry existing;
+    if (db->Read(std::make_pair(DB_BLOCK_HASH, hashBlock), existing)) {
+        hashLastBlock = hashBlock;
+        lastHeader = existing.header;
+        return true;
+    }
+
+    uint256 prevHeader;
+    if (pindex->pprev != nullptr &&
+        pindex->pprev->GetBlockHash() == hashLastBlock) {
+        // The previous block may still be waiting in the batch.
+        prevHeader = lastHeader;
+    } else if (pindex->pprev != nullptr) {
+        FilterEntry prev;
+        if (!db->Read(
+                std::make_pair(DB_BLOCK_HASH, pindex->pprev->GetBlockHash()),
+                prev)) {
+            return error("%s: no filter header for block %s", __func__,
+                         pindex->pprev->GetBlockHash().ToString());
+        }
+        prevHeader = prev.header;
+    }
+
+    const BlockFilter filter(filterType, block, blockundo);
+    FilterEntry entry;
+    entry.hash = filter.GetHash();
+    entry.header = filter.ComputeHeader(prevHeader);
+    entry.pos = posNext;
+    if (!WriteFilterToDisk(entry.pos, filter)) {
+        return false;
+    }
+    posNext = entry.pos;
+    posNext.nPos += ::GetSerializeSize(filter, SER_DISK, CLIENT_VERSION);
+
+    batch.Write(std::make_pair(DB_BLOCK_HASH, hashBlock), entry);
+    hashLastBlock = hashBlock;
+    lastHeader = entry.header;
+    return true;
+}
+
+bool BlockFilterIndex::RewindBlock(CDBBatch &batch, const CBlock &block,
+                                   const CBlockUndo &blockundo,
+                                   const CBlockIndex *pindex) {
+    // Entries are keyed by block hash, so they stay valid.
+    return true;
+}
+
+bool BlockFilterIndex::Commit(CDBBatch &batch) {
+    // Sync the filter files once per batch rather than once per filter, like
+    // FlushBlockFile does for block files.
+    for (int nFile = nFileUnflushed; nFile >= 0 && nFile <= posNext.nFile;
+         nFile++) {
+        const boost::filesystem::path path = GetFilterFilePath(nFile);
+        FILE *file = fopen(path.string().c_str(), "rb+");
+        if (file == nullptr) {
+            return error("%s: failed to open %s", __func__, path.string());
+        }
+        FileCommit(file);
+        fclose(file);
+    }
+    nFileUnflushed = -1;
+    batch.Write(DB_FILTER_POS, posNext);
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilter(const CBlockIndex *pindex,
+                                    BlockFilter &filter) const {
+    FilterEntry entry;
+    if (!db || !db->Read(std::make_pair(DB_BLOCK_HASH, pindex->GetBlockHash()),
+                         entry)) {
+        return false;
+    }
+    return ReadFilterFromDisk(entry.pos, pindex->GetBlockHash(), filter);
+}
+
+bool BlockFilterIndex::LookupFilterHeader(const CBlockIndex *pindex,
+                                          uint256 &header) const {
+    FilterEntry entry;
+    if (!db || !db->Read(std::make_pair(DB_BLOCK_HASH, pindex->GetBlockHash()),
+                         entry)) {
+        return false;
+    }
+    header = entry.header;
+    return true;
+}
+
+/** The blocks from nStartHeight up to and including pindexStop. */
+static bool GetBlockRange(int nStartHeight, const CBlockIndex *pindexStop,
+                          std::vector<const CBlockIndex *> &blocks) {
+    if (nStartHeight < 0 || nStartHeight > pindexStop->nHeight) {
+        return false;
+    }
+    blocks.resize(pindexStop->nHeight - nStartHeight + 1);
+    const CBlockIndex *pindex = pindexStop;
+    for (size_t i = blocks.size(); i > 0; i--) {
+        blocks[i - 1] = pindex;
+        pindex = pindex->pprev;
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterRange(
+    int nStartHeight, const CBlockIndex *pindexStop,
+    std::vector<BlockFilter> &filters) const {
+    std::vector<const CBlockIndex *> blocks;
+    if (!GetBlockRange(nStartHeight, pindexStop, blocks)) {
+        return false;
+    }
+    filters.resize(blocks.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (!LookupFilter(blocks[i], filters[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterHashRange(
+    int nStartHeight, const CBlockIndex *pindexStop,
+    std::vector<uint256> &hashes) const {
+    std::vector<const CBlockIndex *> blocks;
+    if (!db || !GetBlockRange(nStartHeight, pindexStop, blocks)) {
+        return false;
+    }
+    hashes.resize(blocks.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        FilterEntry entry;
+        if (!db->Read(std::make_pair(DB_BLOCK_HASH, blocks[i]->GetBlockHash()),
+                      entry)) {
+            return false;
+        }
+        hashes[i] = entry.hash;
+    }
+    return true;
+}
@@ -0,0 +1,90 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_BLOCKFILTERINDEX_H
+#define BITCOIN_INDEX_BLOCKFILTERINDEX_H
+
+#include "blockfilter.h"
+#include "chain.h"
+#include "index/base.h"
+#include "uint256.h"
+
+#include <boost/filesystem/path.hpp>
+
+#include <memory>
+#include <vector>
+
+//! -blockfilterindex default
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+//! Max memory allocated to the block filter index database cache (MiB)
+static const int64_t nMaxBlockFilterIndexCache = 64;
+
+/**
+ * Index of the basic block filter (BIP 158) of every block of the active
+ * chain, and of the filter headers that commit to them.
+ *
+ * The filters themselves are appended to flat files in their own directory
+ * (indexes/blockfilters/fltr?????.dat), and the database maps block hashes to
+ * their position, filter hash and filter header. Entries are keyed by block
+ * hash and aren't erased when a block is disconnected, so they are reused if
+ * it is connected again.
+ */
+class BlockFilterIndex : public BaseIndex {
+public:
+    BlockFilterIndex(BlockFilterType filterTypeIn, size_t nCacheSize,
+                     bool fMemory = false, bool fWipe = false);
+    ~BlockFilterIndex();
+
+    BlockFilterType GetFilterType() const { return filterType; }
+
+    /** Read the filter of an indexed block. */
+    bool LookupFilter(const CBlockIndex *pindex, BlockFilter &filter) const;
+    /** Get the filter header of an indexed block. */
+    bool LookupFilterHeader(const CBlockIndex *pindex, uint256 &header) const;
+    /**
+     * Read the filters of the blocks from nStartHeight up to and including
+     * pindexStop, which must all be indexed.
+     */
+    bool LookupFilterRange(int nStartHeight, const CBlockIndex *pindexStop,
+                           std::vector<BlockFilter> &filters) const;
+    /**
+     * Get the filter hashes of the blocks from nStartHeight up to and
+     * including pindexStop, which must all be indexed.
+     */
+    bool LookupFilterHashRange(int nStartHeight, const CBlockIndex *pindexStop,
+                               std::vector<uint256> &hashes) const;
+
+protected:
+    bool Init() override;
+    bool WriteBlock(CDBBatch &batch, const CBlock &block,
+                    const CBlockUndo &blockundo,
+                    const CBlockIndex *pindex) override;
+    bool RewindBlock(CDBBatch &batch, const CBlock &block,
+                     const CBlockUndo &blockundo,
+                     const CBlockIndex *pindex) override;
+    bool Commit(CDBBatch &batch) override;
+
+private:
+    BlockFilterType filterType;
+    boost::filesystem::path dirFilters;
+    //! Where the next filter is appended (only used by the sync thread)
+    CDiskBlockPos posNext;
+    //! First filter file written to since the last commit, or -1 (only used
+    //! by the sync thread)
+    int nFileUnflushed;
+    //! The last block indexed and its filter header, which may not be in the
+    //! database yet (only used by the sync thread)
+    uint256 hashLastBlock;
+    uint256 lastHeader;
+
+    boost::filesystem::path GetFilterFilePath(int nFile) const;
+    bool WriteFilterToDisk(CDiskBlockPos &pos, const BlockFilter &filter);
+    bool ReadFilterFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock,
+                            BlockFilter &filter) const;
+};
+
+/** The block filter index, if -blockfilterindex is enabled. */
+extern std::unique_ptr<BlockFilterIndex> g_blockfilterindex;
+
+#endif // BITCOIN_INDEX_BLOCKFILTERINDEX_H
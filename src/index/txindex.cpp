@@ -0,0 +1,80 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/txindex.h"
+
+#include "chain.h"
+#include "clientversion.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "sync.h"
+#include "txdb.h"
+#include "util.h"
+#include "validation.h"
+
+static const char DB_TXINDEX = 't';
+
+std::unique_ptr<TxIndex> g_txindex;
+
+TxIndex::TxIndex(size_t nCacheSize, bool fMemory, bool fWipe)
+    : BaseIndex("txindex", nCacheSize, fMemory, fWipe) {}
+
+TxIndex::~TxIndex() {
+    Interrupt();
+    Stop();
+}
+
+bool TxIndex::WriteBlock(CDBBatch &batch, const CBlock &block,
+                         const CBlockUndo &blockundo,
+                         const CBlockIndex *pindex) {
+    CDiskBlockPos posBlock;
+    {
+        LOCK(cs_main);
+        posBlock = pindex->GetBlockPos();
+    }
+
+    CDiskTxPos pos(posBlock, GetSizeOfCompactSize(block.vtx.size()));
+    for (const CTransactionRef &tx : block.vtx) {
+        batch.Write(std::make_pair(DB_TXINDEX, tx->GetId()), pos);
+        pos.nTxOffset += ::GetSerializeSize(*tx, SER_DISK, CLIENT_VERSION);
+    }
+    return true;
+}
+
+bool TxIndex::RewindBlock(CDBBatch &batch, const CBlock &block,
+                          const CBlockUndo &blockundo,
+                          const CBlockIndex *pindex) {
+    for (const CTransactionRef &tx : block.vtx) {
+        batch.Erase(std::make_pair(DB_TXINDEX, tx->GetId()));
+    }
+    return true;
+}
+
+bool TxIndex::FindTx(const uint256 &txid, uint256 &hashBlock,
+                     CTransactionRef &tx) const {
+    CDiskTxPos postx;
+    if (!db || !db->Read(std::make_pair(DB_TXINDEX, txid), postx)) {
+        return false;
+    }
+
+    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return error("%s: OpenBlockFile failed", __func__);
+    }
+    CBlockHeader header;
+    try {
+        file >> header;
+        if (fseek(file.Get(), postx.nTxOffset, SEEK_CUR)) {
+            return error("%s: fseek(...) failed", __func__);
+        }
+        file >> tx;
+    } catch (const std::exception &e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    if (tx->GetId() != txid) {
+        return error("%s: txid mismatch", __func__);
+    }
+    hashBlock = header.GetHash();
+    return true;
+}
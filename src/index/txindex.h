@@ -0,0 +1,49 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_TXINDEX_H
+#define BITCOIN_INDEX_TXINDEX_H
+
+#include "index/base.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+
+#include <memory>
+
+//! Max memory allocated to the transaction index database cache (MiB)
+// Unlike for the UTXO database, for the txindex scenario the leveldb cache make
+// a meaningful difference:
+// https://github.com/bitcoin/bitcoin/pull/8273#issuecomment-229601991
+static const int64_t nMaxTxIndexCache = 1024;
+
+/**
+ * Index of the position on disk of every transaction in the active chain, by
+ * txid. It is built in the background, so enabling it doesn't need a reindex.
+ */
+class TxIndex : public BaseIndex {
+public:
+    TxIndex(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~TxIndex();
+
+    /**
+     * Look up a transaction of the active chain by txid, and read it and the
+     * hash of the block it is in from disk.
+     */
+    bool FindTx(const uint256 &txid, uint256 &hashBlock,
+                CTransactionRef &tx) const;
+
+protected:
+    bool WriteBlock(CDBBatch &batch, const CBlock &block,
+                    const CBlockUndo &blockundo,
+                    const CBlockIndex *pindex) override;
+    bool RewindBlock(CDBBatch &batch, const CBlock &block,
+                     const CBlockUndo &blockundo,
+                     const CBlockIndex *pindex) override;
+    bool NeedsUndoData() const override { return false; }
+};
+
+/** The transaction index, if -txindex is enabled. */
+extern std::unique_ptr<TxIndex> g_txindex;
+
+#endif // BITCOIN_INDEX_TXINDEX_H
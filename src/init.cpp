@@ -19,6 +19,9 @@
 #include "consensus/validation.h"
 #include "httprpc.h"
 #include "httpserver.h"
+#include "index/addrindex.h"
+#include "index/blockfilterindex.h"
+#include "index/txindex.h"
 #include "key.h"
 #include "miner.h"
 #include "net.h"
@@ -34,6 +37,7 @@
 #include "torcontrol.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txrelaycache.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -126,6 +130,31 @@ static const char *FEE_ESTIMATES_FILENAME = "fee_estimates.dat";
 std::atomic<bool> fRequestShutdown(false);
 std::atomic<bool> fDumpMempoolLater(false);
 
+static void PeriodicDumpMempool() {
+    // Don't overwrite mempool.dat before LoadMempool has read it.
+    if (fDumpMempoolLater && !ShutdownRequested()) {
+        DumpMempool();
+    }
+}
+
+/**
+ * Start advertising NODE_COMPACT_FILTERS once the block filter index has
+ * caught up with the chain. Until then the filters of the latest blocks are
+ * missing, and BIP 157 requests for them would go unanswered.
+ */
+static void AdvertiseBlockFiltersWhenSynced(CScheduler &scheduler) {
+    if (!g_blockfilterindex->IsSynced()) {
+        scheduler.scheduleFromNow(
+            boost::bind(&AdvertiseBlockFiltersWhenSynced,
+                        boost::ref(scheduler)),
+            1);
+        return;
+    }
+    LogPrintf("Block filter index is synced, advertising compact block "
+              "filters to peers\n");
+    g_connman->AddLocalServices(NODE_COMPACT_FILTERS);
+}
+
 void StartShutdown() {
     fRequestShutdown = true;
 }
@@ -171,6 +200,9 @@ void Interrupt(boost::thread_group &threadGroup) {
     InterruptRPC();
     InterruptREST();
     InterruptTorControl();
+    if (g_txindex) g_txindex->Interrupt();
+    if (g_addressindex) g_addressindex->Interrupt();
+    if (g_blockfilterindex) g_blockfilterindex->Interrupt();
     if (g_connman) g_connman->Interrupt();
     threadGroup.interrupt_all();
 }
@@ -192,6 +224,18 @@ void Shutdown() {
     StopREST();
     StopRPC();
     StopHTTPServer();
+    if (g_txindex) {
+        g_txindex->Stop();
+        g_txindex.reset();
+    }
+    if (g_addressindex) {
+        g_addressindex->Stop();
+        g_addressindex.reset();
+    }
+    if (g_blockfilterindex) {
+        g_blockfilterindex->Stop();
+        g_blockfilterindex.reset();
+    }
 #ifdef ENABLE_WALLET
     if (pwalletMain) pwalletMain->Flush(false);
 #endif
@@ -311,10 +355,22 @@ std::string HelpMessage(HelpMessageMode mode) {
     std::string strUsage = HelpMessageGroup(_("Options:"));
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
+    strUsage += HelpMessageOpt(
+        "-addressindex",
+        strprintf(_("Maintain an index of the outputs and spends of each "
+                    "output script, used by the getaddresshistory and "
+                    "getaddressutxos rpc calls (default: %u)"),
+                  DEFAULT_ADDRESSINDEX));
     strUsage += HelpMessageOpt(
         "-alertnotify=<cmd>",
         _("Execute command when a relevant alert is received or we see a "
           "really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt(
+        "-blockfilterindex",
+        strprintf(_("Maintain an index of compact block filters (BIP 158), "
+                    "used by the getblockfilter rpc call and to serve them to "
+                    "peers with -peerblockfilters (default: %u)"),
+                  DEFAULT_BLOCKFILTERINDEX));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>",
                                _("Execute command when the best block changes "
                                  "(%s in cmd is replaced by block hash)"));
@@ -363,6 +419,11 @@ std::string HelpMessage(HelpMessageMode mode) {
         "-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable "
                                         "transactions in memory (default: %u)"),
                                       DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt(
+        "-maxrelaycache=<n>",
+        strprintf(_("Keep recently announced transactions available to peers "
+                    "within <n> megabytes (default: %u)"),
+                  DEFAULT_MAX_RELAY_CACHE_SIZE));
     strUsage += HelpMessageOpt("-maxmempool=<n>",
                                strprintf(_("Keep the transaction memory pool "
                                            "below <n> megabytes (default: %u)"),
@@ -372,6 +433,11 @@ std::string HelpMessage(HelpMessageMode mode) {
                        strprintf(_("Do not keep transactions in the mempool "
                                    "longer than <n> hours (default: %u)"),
                                  DEFAULT_MEMPOOL_EXPIRY));
+    strUsage += HelpMessageOpt(
+        "-mempooldumpinterval=<n>",
+        strprintf(_("Also save the mempool to disk every <n> minutes while "
+                    "running (default: %u, 0 = only at shutdown)"),
+                  DEFAULT_MEMPOOL_DUMP_INTERVAL));
     strUsage += HelpMessageOpt(
         "-blockreconstructionextratxn=<n>",
         strprintf(_("Extra transactions to keep in memory for compact block "
@@ -395,7 +461,8 @@ std::string HelpMessage(HelpMessageMode mode) {
               "old blocks. This allows the pruneblockchain RPC to be called to "
               "delete specific blocks, and enables automatic pruning of old "
               "blocks if a target size in MiB is provided. This mode is "
-              "incompatible with -txindex and -rescan. "
+              "incompatible with -txindex, -addressindex, -blockfilterindex "
+              "and -rescan. "
               "Warning: Reverting this setting requires re-downloading the "
               "entire blockchain. "
               "(default: 0 = disable pruning blocks, 1 = allow manual pruning "
@@ -415,9 +482,11 @@ std::string HelpMessage(HelpMessageMode mode) {
           "077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt(
-        "-txindex", strprintf(_("Maintain a full transaction index, used by "
-                                "the getrawtransaction rpc call (default: %u)"),
-                              DEFAULT_TXINDEX));
+        "-txindex",
+        strprintf(_("Maintain a full transaction index, used by the "
+                    "getrawtransaction rpc call. It is built in the background "
+                    "and can be enabled at any time (default: %u)"),
+                  DEFAULT_TXINDEX));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt(
@@ -493,6 +562,11 @@ std::string HelpMessage(HelpMessageMode mode) {
         HelpMessageOpt("-permitbaremultisig",
                        strprintf(_("Relay non-P2SH multisig (default: %u)"),
                                  DEFAULT_PERMIT_BAREMULTISIG));
+    strUsage += HelpMessageOpt(
+        "-peerblockfilters",
+        strprintf(_("Serve compact block filters to peers per BIP 157, "
+                    "once the block filter index is synced (default: %u)"),
+                  DEFAULT_PEERBLOCKFILTERS));
     strUsage += HelpMessageOpt(
         "-peerbloomfilters",
         strprintf(_("Support filtering of blocks and transaction with bloom "
@@ -656,9 +730,9 @@ std::string HelpMessage(HelpMessageMode mode) {
                                    "BIP9 deployment (regtest-only)");
     }
     std::string debugCategories =
-        "addrman, alert, bench, cmpctblock, coindb, db, http, libevent, lock, "
-        "mempool, mempoolrej, net, proxy, prune, rand, reindex, rpc, "
-        "selectcoins, tor, zmq"; // Don't translate these and qt below
+        "addrman, alert, bench, cmpctblock, coindb, db, http, index, "
+        "libevent, lock, mempool, mempoolrej, net, proxy, prune, rand, "
+        "reindex, rpc, selectcoins, tor, zmq"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT) debugCategories += ", qt";
     strUsage += HelpMessageOpt(
         "-debug=<category>",
@@ -842,11 +916,18 @@ std::string HelpMessage(HelpMessageMode mode) {
         strprintf(
             _("Set the number of threads to service RPC calls (default: %d)"),
             DEFAULT_HTTP_THREADS));
+    strUsage += HelpMessageOpt(
+        "-rpceventthreads=<n>",
+        strprintf(_("Set the number of threads accepting RPC connections and "
+                    "sending replies (default: %d)"),
+                  DEFAULT_HTTP_EVENT_THREADS));
     if (showDebug) {
         strUsage += HelpMessageOpt(
-            "-rpcworkqueue=<n>", strprintf("Set the depth of the work queue to "
-                                           "service RPC calls (default: %d)",
-                                           DEFAULT_HTTP_WORKQUEUE));
+            "-rpcworkqueue=<n>",
+            strprintf("Set the depth of the work queue to service RPC calls, "
+                      "beyond which new connections wait until it drains "
+                      "(default: %d)",
+                      DEFAULT_HTTP_WORKQUEUE));
         strUsage += HelpMessageOpt(
             "-rpcservertimeout=<n>",
             strprintf("Timeout during HTTP requests (default: %d)",
@@ -1272,6 +1353,12 @@ bool AppInitParameterInteraction(Config &config) {
     if (GetArg("-prune", 0)) {
         if (GetBoolArg("-txindex", DEFAULT_TXINDEX))
             return InitError(_("Prune mode is incompatible with -txindex."));
+        if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX))
+            return InitError(
+                _("Prune mode is incompatible with -addressindex."));
+        if (GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX))
+            return InitError(
+                _("Prune mode is incompatible with -blockfilterindex."));
     }
 
     // if space reserved for high priority transactions is misconfigured
@@ -1514,6 +1601,13 @@ bool AppInitParameterInteraction(Config &config) {
 
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices = ServiceFlags(nLocalServices | NODE_BLOOM);
+    // NODE_COMPACT_FILTERS is only added once the index is synced, see
+    // AdvertiseBlockFiltersWhenSynced.
+    if (GetBoolArg("-peerblockfilters", DEFAULT_PEERBLOCKFILTERS) &&
+        !GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX)) {
+        return InitError(
+            _("Cannot set -peerblockfilters without -blockfilterindex."));
+    }
 
     // Signal Bitcoin Cash support.
     // TODO: remove some time after the hardfork when no longer needed
@@ -1657,11 +1751,19 @@ bool AppInitMain(Config &config, boost::thread_group &threadGroup,
 
     InitSignatureCache();
 
+    // Both counts include the thread that hands out the checks, which takes
+    // part in them.
     LogPrintf("Using %u threads for script verification\n",
               nScriptCheckThreads);
+    LogPrintf("Using %u threads for header verification\n",
+              nScriptCheckThreads ? HEADER_CHECK_THREADS + 1 : 0);
     if (nScriptCheckThreads) {
-        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        for (int i = 0; i < nScriptCheckThreads - 1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+        }
+        for (int i = 0; i < HEADER_CHECK_THREADS; i++) {
+            threadGroup.create_thread(&ThreadHeaderCheck);
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -1888,13 +1990,26 @@ bool AppInitMain(Config &config, boost::thread_group &threadGroup,
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20);
     // total cache cannot be greater than nMaxDbcache
     nTotalCache = std::min(nTotalCache, nMaxDbCache << 20);
-    int64_t nBlockTreeDBCache = nTotalCache / 8;
-    nBlockTreeDBCache =
-        std::min(nBlockTreeDBCache, (GetBoolArg("-txindex", DEFAULT_TXINDEX)
-                                         ? nMaxBlockDBAndTxIndexCache
-                                         : nMaxBlockDBCache)
-                                        << 20);
+    int64_t nBlockTreeDBCache =
+        std::min(nTotalCache / 8, nMaxBlockDBCache << 20);
     nTotalCache -= nBlockTreeDBCache;
+    int64_t nTxIndexCache = 0;
+    if (GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
+        nTxIndexCache = std::min(nTotalCache / 8, nMaxTxIndexCache << 20);
+        nTotalCache -= nTxIndexCache;
+    }
+    int64_t nAddressIndexCache = 0;
+    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) {
+        nAddressIndexCache =
+            std::min(nTotalCache / 8, nMaxAddressIndexCache << 20);
+        nTotalCache -= nAddressIndexCache;
+    }
+    int64_t nBlockFilterIndexCache = 0;
+    if (GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX)) {
+        nBlockFilterIndexCache =
+            std::min(nTotalCache / 8, nMaxBlockFilterIndexCache << 20);
+        nTotalCache -= nBlockFilterIndexCache;
+    }
     // use 25%-50% of the remainder for disk cache
     int64_t nCoinDBCache =
         std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23));
@@ -1908,6 +2023,18 @@ bool AppInitMain(Config &config, boost::thread_group &threadGroup,
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n",
               nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    if (nTxIndexCache > 0) {
+        LogPrintf("* Using %.1fMiB for transaction index database\n",
+                  nTxIndexCache * (1.0 / 1024 / 1024));
+    }
+    if (nAddressIndexCache > 0) {
+        LogPrintf("* Using %.1fMiB for address index database\n",
+                  nAddressIndexCache * (1.0 / 1024 / 1024));
+    }
+    if (nBlockFilterIndexCache > 0) {
+        LogPrintf("* Using %.1fMiB for block filter index database\n",
+                  nBlockFilterIndexCache * (1.0 / 1024 / 1024));
+    }
     LogPrintf("* Using %.1fMiB for chain state database\n",
               nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set (plus up to %.1fMiB of "
@@ -1971,13 +2098,6 @@ bool AppInitMain(Config &config, boost::thread_group &threadGroup,
                     break;
                 }
 
-                // Check for changed -txindex state
-                if (fTxIndex != GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
-                    strLoadError = _("You need to rebuild the database using "
-                                     "-reindex-chainstate to change -txindex");
-                    break;
-                }
-
                 // Check for changed -prune state.  What we are concerned about
                 // is a user who has pruned blocks in the past, but is now
                 // trying to run unpruned.
@@ -2080,6 +2200,29 @@ bool AppInitMain(Config &config, boost::thread_group &threadGroup,
     if (!est_filein.IsNull()) mempool.ReadFeeEstimates(est_filein);
     fFeeEstimatesInitialized = true;
 
+    // The optional indexes catch up with the chain in the background.
+    if (GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
+        g_txindex.reset(new TxIndex(nTxIndexCache, false, fReindex));
+        if (!g_txindex->Start()) {
+            return InitError(_("Error opening the transaction index database"));
+        }
+    }
+    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) {
+        g_addressindex.reset(
+            new AddressIndex(nAddressIndexCache, false, fReindex));
+        if (!g_addressindex->Start()) {
+            return InitError(_("Error opening the address index database"));
+        }
+    }
+    if (GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX)) {
+        g_blockfilterindex.reset(new BlockFilterIndex(
+            BlockFilterType::BASIC, nBlockFilterIndexCache, false, fReindex));
+        if (!g_blockfilterindex->Start()) {
+            return InitError(
+                _("Error opening the block filter index database"));
+        }
+    }
+
 // Step 8: load wallet
 #ifdef ENABLE_WALLET
     if (!CWallet::InitLoadWallet()) return false;
@@ -2126,6 +2269,13 @@ bool AppInitMain(Config &config, boost::thread_group &threadGroup,
     threadGroup.create_thread(
         boost::bind(&ThreadImport, boost::ref(config), vImportFiles));
 
+    int64_t nMempoolDumpInterval =
+        GetArg("-mempooldumpinterval", DEFAULT_MEMPOOL_DUMP_INTERVAL);
+    if (nMempoolDumpInterval > 0) {
+        scheduler.scheduleEvery(&PeriodicDumpMempool,
+                                nMempoolDumpInterval * 60);
+    }
+
     // Wait for genesis block to be processed
     {
         boost::unique_lock<boost::mutex> lock(cs_GenesisWait);
@@ -2170,6 +2320,10 @@ bool AppInitMain(Config &config, boost::thread_group &threadGroup,
     if (!connman.Start(scheduler, strNodeError, connOptions))
         return InitError(strNodeError);
 
+    if (GetBoolArg("-peerblockfilters", DEFAULT_PEERBLOCKFILTERS)) {
+        AdvertiseBlockFiltersWhenSynced(scheduler);
+    }
+
     // Step 12: finished
 
     SetRPCWarmupFinished();
@@ -5,14 +5,50 @@
 
 #include "keystore.h"
 
+#include "hash.h"
 #include "key.h"
 #include "pubkey.h"
+#include "random.h"
 #include "util.h"
 
+#include <limits>
+
 bool CKeyStore::AddKey(const CKey &key) {
     return AddKeyPubKey(key, key.GetPubKey());
 }
 
+CBasicKeyStore::CBasicKeyStore()
+    : k0(GetRand(std::numeric_limits<uint64_t>::max())),
+      k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+uint64_t
+CBasicKeyStore::GetScriptPubKeyHash(const CScript &scriptPubKey) const {
+    return CSipHasher(k0, k1)
+        .Write(scriptPubKey.data(), scriptPubKey.size())
+        .Finalize();
+}
+
+void CBasicKeyStore::AddScriptPubKey(const CScript &scriptPubKey) {
+    LOCK(cs_KeyStore);
+    setScriptPubKeyHashes.insert(GetScriptPubKeyHash(scriptPubKey));
+}
+
+void CBasicKeyStore::AddKeyScriptPubKeys(const CPubKey &pubkey) {
+    AddScriptPubKey(GetScriptForRawPubKey(pubkey));
+    AddScriptPubKey(GetScriptForDestination(pubkey.GetID()));
+}
+
+bool CBasicKeyStore::MayBeMine(const CScript &scriptPubKey) const {
+    // Bare multisig outputs are ours when we have all of their keys, so they
+    // cannot be listed in advance.
+    if (!scriptPubKey.empty() && scriptPubKey.back() == OP_CHECKMULTISIG) {
+        return true;
+    }
+
+    LOCK(cs_KeyStore);
+    return setScriptPubKeyHashes.count(GetScriptPubKeyHash(scriptPubKey)) > 0;
+}
+
 bool CBasicKeyStore::GetPubKey(const CKeyID &address,
                                CPubKey &vchPubKeyOut) const {
     CKey key;
@@ -32,6 +68,7 @@ bool CBasicKeyStore::GetPubKey(const CKeyID &address,
 bool CBasicKeyStore::AddKeyPubKey(const CKey &key, const CPubKey &pubkey) {
     LOCK(cs_KeyStore);
     mapKeys[pubkey.GetID()] = key;
+    AddKeyScriptPubKeys(pubkey);
     return true;
 }
 
@@ -43,6 +80,7 @@ bool CBasicKeyStore::AddCScript(const CScript &redeemScript) {
 
     LOCK(cs_KeyStore);
     mapScripts[CScriptID(redeemScript)] = redeemScript;
+    AddScriptPubKey(GetScriptForDestination(CScriptID(redeemScript)));
     return true;
 }
 
@@ -80,6 +118,7 @@ static bool ExtractPubKey(const CScript &dest, CPubKey &pubKeyOut) {
 bool CBasicKeyStore::AddWatchOnly(const CScript &dest) {
     LOCK(cs_KeyStore);
     setWatchOnly.insert(dest);
+    AddScriptPubKey(dest);
     CPubKey pubKey;
     if (ExtractPubKey(dest, pubKey)) mapWatchKeys[pubKey.GetID()] = pubKey;
     return true;
@@ -12,6 +12,9 @@
 #include "script/standard.h"
 #include "sync.h"
 
+#include <cstdint>
+#include <unordered_set>
+
 #include <boost/signals2/signal.hpp>
 #include <boost/variant.hpp>
 
@@ -56,13 +59,38 @@ typedef std::set<CScript> WatchOnlySet;
 
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore {
+private:
+    /** Salt of the script hashes */
+    uint64_t k0, k1;
+
+    /**
+     * Salted hashes of the output scripts paying to the keys, redeem scripts
+     * and watch-only scripts of the store, see MayBeMine().
+     */
+    std::unordered_set<uint64_t> setScriptPubKeyHashes;
+
 protected:
     KeyMap mapKeys;
     WatchKeyMap mapWatchKeys;
     ScriptMap mapScripts;
     WatchOnlySet setWatchOnly;
 
+    uint64_t GetScriptPubKeyHash(const CScript &scriptPubKey) const;
+    void AddScriptPubKey(const CScript &scriptPubKey);
+    //! Record the pay-to-pubkey and pay-to-pubkey-hash scripts of a key
+    void AddKeyScriptPubKeys(const CPubKey &pubkey);
+
 public:
+    CBasicKeyStore();
+
+    /**
+     * Whether an output script may be ours. If not, IsMine() is ISMINE_NO,
+     * which is told with a hash lookup instead of solving the script and
+     * looking its keys up. Entries are never removed: the set only has to
+     * contain every script that is ours.
+     */
+    bool MayBeMine(const CScript &scriptPubKey) const;
+
     bool AddKeyPubKey(const CKey &key, const CPubKey &pubkey);
     bool GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const;
     bool HaveKey(const CKeyID &address) const {
@@ -49,6 +49,9 @@
 #define MSG_NOSIGNAL 0
 #endif
 
+// Maximum number of send buffers handed to a single sendmsg() call.
+static const size_t MAX_SEND_IOVECS = 64;
+
 // Fix for ancient MinGW versions, that don't have defined these in ws2tcpip.h.
 // Todo: Can be removed when our pull-tester is upgraded to a modern MinGW
 // version.
@@ -637,6 +640,34 @@ void CNode::SetAddrLocal(const CService &addrLocalIn) {
 }
 
 #undef X
+CMsgCmdProfile::CMsgCmdProfile()
+    : nCount(0), nTotalMicros(0), nMaxMicros(0), nWaitMicros(0) {
+    std::fill(vHistogram, vHistogram + MSG_PROFILE_BUCKETS, 0);
+}
+
+void CMsgCmdProfile::Add(int64_t nMicros, int64_t nWaitMicrosIn) {
+    nCount++;
+    nTotalMicros += nMicros;
+    nMaxMicros = std::max(nMaxMicros, nMicros);
+    nWaitMicros += nWaitMicrosIn;
+    int nBucket = 0;
+    while (nBucket < MSG_PROFILE_BUCKETS - 1 && nMicros >= (1LL << nBucket)) {
+        nBucket++;
+    }
+    vHistogram[nBucket]++;
+}
+
+CMsgCmdProfile &CMsgCmdProfile::operator+=(const CMsgCmdProfile &other) {
+    nCount += other.nCount;
+    nTotalMicros += other.nTotalMicros;
+    nMaxMicros = std::max(nMaxMicros, other.nMaxMicros);
+    nWaitMicros += other.nWaitMicros;
+    for (int i = 0; i < MSG_PROFILE_BUCKETS; i++) {
+        vHistogram[i] += other.vHistogram[i];
+    }
+    return *this;
+}
+
 #define X(name) stats.name = name
 void CNode::copyStats(CNodeStats &stats) {
     stats.nodeid = this->GetId();
@@ -662,7 +693,13 @@ void CNode::copyStats(CNodeStats &stats) {
     {
         LOCK(cs_vSend);
         X(mapSendBytesPerMsgCmd);
+        X(mapSendProfilePerMsgCmd);
         X(nSendBytes);
+        X(nSendSyscalls);
+    }
+    {
+        LOCK(cs_vProcessMsg);
+        X(mapRecvProfilePerMsgCmd);
     }
     {
         LOCK(cs_vRecv);
@@ -708,6 +745,12 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes,
         if (vRecvMsg.empty() || vRecvMsg.back().complete()) {
             vRecvMsg.push_back(CNetMessage(GetMagic(Params()), SER_NETWORK,
                                            INIT_PROTO_VERSION));
+            LOCK(cs_vRecvBufferPool);
+            if (!vRecvBufferPool.empty()) {
+                nRecvBufferPoolSize -= vRecvBufferPool.back().capacity();
+                vRecvMsg.back().vRecv.SwapBuffer(vRecvBufferPool.back());
+                vRecvBufferPool.pop_back();
+            }
         }
 
         CNetMessage &msg = vRecvMsg.back();
@@ -753,6 +796,23 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes,
     return true;
 }
 
+void CNode::RecycleRecvBuffer(CDataStream &vRecv) {
+    CSerializeData buf;
+    vRecv.SwapBuffer(buf);
+    if (buf.capacity() == 0) {
+        return;
+    }
+
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool.size() >= MAX_RECV_BUFFER_POOL_COUNT ||
+        nRecvBufferPoolSize + buf.capacity() > MAX_RECV_BUFFER_POOL_SIZE) {
+        return;
+    }
+    buf.clear();
+    nRecvBufferPoolSize += buf.capacity();
+    vRecvBufferPool.push_back(std::move(buf));
+}
+
 void CNode::SetSendVersion(int nVersionIn) {
     // Send version may only be changed in the version message, and only one
     // version message is allowed per session. We can therefore treat this value
@@ -835,14 +895,50 @@ const uint256 &CNetMessage::GetMessageHash() const {
     return data_hash;
 }
 
+#ifndef WIN32
+size_t FillSendIovecs(const std::deque<std::vector<uint8_t>> &vSendMsg,
+                      size_t nFirst, size_t nSendOffset, struct iovec *iov,
+                      size_t nMaxIov, size_t &nRequested) {
+    size_t nIov = 0;
+    nRequested = 0;
+    for (auto it = vSendMsg.begin() + nFirst;
+         it != vSendMsg.end() && nIov < nMaxIov; ++it, ++nIov) {
+        iov[nIov].iov_base = const_cast<uint8_t *>(it->data()) + nSendOffset;
+        iov[nIov].iov_len = it->size() - nSendOffset;
+        nRequested += iov[nIov].iov_len;
+        nSendOffset = 0;
+    }
+    return nIov;
+}
+#endif
+
+size_t ConsumeSentBytes(const std::deque<std::vector<uint8_t>> &vSendMsg,
+                        size_t &nMsgCount, size_t &nSendOffset, size_t nBytes) {
+    size_t nCompleted = 0;
+    while (nBytes > 0) {
+        const auto &data = vSendMsg[nMsgCount];
+        size_t nLeft = data.size() - nSendOffset;
+        if (nBytes < nLeft) {
+            nSendOffset += nBytes;
+            break;
+        }
+        nBytes -= nLeft;
+        nSendOffset = 0;
+        nCompleted += data.size();
+        nMsgCount++;
+    }
+    return nCompleted;
+}
+
 // requires LOCK(cs_vSend)
 size_t CConnman::SocketSendData(CNode *pnode) const {
     AssertLockHeld(pnode->cs_vSend);
     size_t nSentSize = 0;
     size_t nMsgCount = 0;
 
-    for (const auto &data : pnode->vSendMsg) {
-        assert(data.size() > pnode->nSendOffset);
+    while (nMsgCount < pnode->vSendMsg.size()) {
+        assert(pnode->vSendMsg[nMsgCount].size() > pnode->nSendOffset);
+        size_t nRequested = 0;
         int nBytes = 0;
 
         {
@@ -851,11 +947,27 @@ size_t CConnman::SocketSendData(CNode *pnode) const {
                 break;
             }
 
-            nBytes = send(
-                pnode->hSocket, reinterpret_cast<const char *>(data.data()) +
-                                    pnode->nSendOffset,
-                data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+            const auto &data = pnode->vSendMsg[nMsgCount];
+            nRequested = data.size() - pnode->nSendOffset;
+            nBytes = send(pnode->hSocket,
+                          reinterpret_cast<const char *>(data.data()) +
+                              pnode->nSendOffset,
+                          nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            // Hand as many pending buffers as possible (message headers and
+            // payloads are separate entries) to the kernel in a single call.
+            struct iovec iov[MAX_SEND_IOVECS];
+            size_t nIov =
+                FillSendIovecs(pnode->vSendMsg, nMsgCount, pnode->nSendOffset,
+                               iov, MAX_SEND_IOVECS, nRequested);
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nIov;
+            nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         }
+        pnode->nSendSyscalls++;
 
         if (nBytes == 0) {
             // couldn't send anything at all
@@ -877,17 +989,20 @@ size_t CConnman::SocketSendData(CNode *pnode) const {
         assert(nBytes > 0);
         pnode->nLastSend = GetSystemTimeInSeconds();
         pnode->nSendBytes += nBytes;
-        pnode->nSendOffset += nBytes;
         nSentSize += nBytes;
-        if (pnode->nSendOffset != data.size()) {
-            // could not send full message; stop sending more
-            break;
+
+        // Retire the buffers that were sent completely.
+        size_t nCompleted = ConsumeSentBytes(pnode->vSendMsg, nMsgCount,
+                                             pnode->nSendOffset, nBytes);
+        if (nCompleted > 0) {
+            pnode->nSendSize -= nCompleted;
+            pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
         }
 
-        pnode->nSendOffset = 0;
-        pnode->nSendSize -= data.size();
-        pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
-        nMsgCount++;
+        if (size_t(nBytes) != nRequested) {
+            // could not send everything; the socket buffer is full
+            break;
+        }
     }
 
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(),
@@ -2566,9 +2681,29 @@ void CConnman::DeleteNode(CNode *pnode) {
     if (fUpdateConnectionTime) {
         addrman.Connected(pnode->addr);
     }
+    {
+        LOCK(cs_msgProfile);
+        AddMsgProfiles(pnode, mapRecvProfileDeleted, mapSendProfileDeleted);
+    }
     delete pnode;
 }
 
+void CConnman::AddMsgProfiles(CNode *pnode, mapMsgCmdProfile &mapRecv,
+                              mapMsgCmdProfile &mapSend) {
+    {
+        LOCK(pnode->cs_vProcessMsg);
+        for (const mapMsgCmdProfile::value_type &i :
+             pnode->mapRecvProfilePerMsgCmd) {
+            mapRecv[i.first] += i.second;
+        }
+    }
+    LOCK(pnode->cs_vSend);
+    for (const mapMsgCmdProfile::value_type &i :
+         pnode->mapSendProfilePerMsgCmd) {
+        mapSend[i.first] += i.second;
+    }
+}
+
 CConnman::~CConnman() {
     Interrupt();
     Stop();
@@ -2765,6 +2900,34 @@ uint64_t CConnman::GetOutboundTargetBytesLeft() {
                : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
 }
 
+void CConnman::RecordMsgProcessed(CNode *pnode, const std::string &strCommand,
+                                  int64_t nMicros, int64_t nWaitMicros) {
+    // Only known commands get their own entry, to prevent a memory DoS.
+    LOCK(pnode->cs_vProcessMsg);
+    mapMsgCmdProfile::iterator it =
+        pnode->mapRecvProfilePerMsgCmd.find(strCommand);
+    if (it == pnode->mapRecvProfilePerMsgCmd.end()) {
+        it = pnode->mapRecvProfilePerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    }
+    assert(it != pnode->mapRecvProfilePerMsgCmd.end());
+    it->second.Add(nMicros, nWaitMicros);
+}
+
+void CConnman::GetMsgProfiles(mapMsgCmdProfile &mapRecv,
+                              mapMsgCmdProfile &mapSend) {
+    {
+        LOCK(cs_msgProfile);
+        mapRecv = mapRecvProfileDeleted;
+        mapSend = mapSendProfileDeleted;
+    }
+    // Peers that are disconnecting but not deleted yet are missed, which
+    // only delays when their messages show up in the totals.
+    LOCK(cs_vNodes);
+    for (CNode *pnode : vNodes) {
+        AddMsgProfiles(pnode, mapRecv, mapSend);
+    }
+}
+
 uint64_t CConnman::GetTotalBytesRecv() {
     LOCK(cs_totalBytesRecv);
     return nTotalBytesRecv;
@@ -2779,6 +2942,10 @@ ServiceFlags CConnman::GetLocalServices() const {
     return nLocalServices;
 }
 
+void CConnman::AddLocalServices(ServiceFlags services) {
+    nLocalServices = ServiceFlags(nLocalServices | services);
+}
+
 void CConnman::SetBestHeight(int height) {
     nBestHeight.store(height, std::memory_order_release);
 }
@@ -2810,7 +2977,9 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn,
     nLastSend = 0;
     nLastRecv = 0;
     nSendBytes = 0;
+    nSendSyscalls = 0;
     nRecvBytes = 0;
+    nRecvBufferPoolSize = 0;
     nTimeOffset = 0;
     addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
     nVersion = 0;
@@ -2858,6 +3027,9 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn,
         mapRecvBytesPerMsgCmd[msg] = 0;
     }
     mapRecvBytesPerMsgCmd[NET_MESSAGE_COMMAND_OTHER] = 0;
+    for (const auto &i : mapRecvBytesPerMsgCmd) {
+        mapRecvProfilePerMsgCmd[i.first];
+    }
 
     if (fLogIPs) {
         LogPrint("net", "Added connection to %s peer=%d\n", addrName, id);
@@ -2922,6 +3094,7 @@ bool CConnman::NodeFullyConnected(const CNode *pnode) {
 }
 
 void CConnman::PushMessage(CNode *pnode, CSerializedNetMsg &&msg) {
+    int64_t nTimeStart = GetTimeMicros();
     size_t nMessageSize = msg.data.size();
     size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
     LogPrint("net", "sending %s (%d bytes) peer=%d\n",
@@ -2936,6 +3109,10 @@ void CConnman::PushMessage(CNode *pnode, CSerializedNetMsg &&msg) {
 
     CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
 
+    // Serialization cost covers both the payload and the header/checksum.
+    int64_t nSerializeMicros =
+        msg.nSerializeMicros + GetTimeMicros() - nTimeStart;
+
     size_t nBytesSent = 0;
     {
         LOCK(pnode->cs_vSend);
@@ -2943,6 +3120,7 @@ void CConnman::PushMessage(CNode *pnode, CSerializedNetMsg &&msg) {
 
         // log total amount of bytes per command
         pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
+        pnode->mapSendProfilePerMsgCmd[msg.command].Add(nSerializeMicros, 0);
         pnode->nSendSize += nTotalSize;
 
         if (pnode->nSendSize > nSendBufferMaxSize) {
@@ -32,6 +32,7 @@
 
 #ifndef WIN32
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #endif
 
 #include <boost/filesystem/path.hpp>
@@ -94,6 +95,10 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = true;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER = 1 * 1000;
+/** Maximum number of processed message buffers kept per peer for reuse */
+static const size_t MAX_RECV_BUFFER_POOL_COUNT = 8;
+/** Maximum total capacity of the message buffers kept per peer for reuse */
+static const size_t MAX_RECV_BUFFER_POOL_SIZE = 1024 * 1024;
 
 static const ServiceFlags REQUIRED_SERVICES =
     ServiceFlags(NODE_NETWORK | NODE_BITCOIN_CASH);
@@ -111,6 +116,28 @@ struct AddedNodeInfo {
     bool fInbound;
 };
 
+/** Number of buckets in the per-command message time histograms */
+static const int MSG_PROFILE_BUCKETS = 16;
+
+/** Time spent on the messages of one command, in microseconds */
+struct CMsgCmdProfile {
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    // Time received messages spent queued before being processed.
+    int64_t nWaitMicros;
+    // Bucket 0 counts messages that took under 1us, bucket i those that took
+    // [2^(i-1), 2^i) us and the last bucket everything longer.
+    uint64_t vHistogram[MSG_PROFILE_BUCKETS];
+
+    CMsgCmdProfile();
+    void Add(int64_t nMicros, int64_t nWaitMicrosIn);
+    CMsgCmdProfile &operator+=(const CMsgCmdProfile &other);
+};
+
+// Command, time profile
+typedef std::map<std::string, CMsgCmdProfile> mapMsgCmdProfile;
+
 class CTransaction;
 class CNodeStats;
 class CClientUIInterface;
@@ -125,6 +152,8 @@ struct CSerializedNetMsg {
 
     std::vector<uint8_t> data;
     std::string command;
+    // Time spent serializing the payload, in microseconds.
+    int64_t nSerializeMicros = 0;
 };
 
 class CConnman {
@@ -252,6 +281,8 @@ public:
     void AddWhitelistedRange(const CSubNet &subnet);
 
     ServiceFlags GetLocalServices() const;
+    //! Add services to those advertised to peers that connect from now on.
+    void AddLocalServices(ServiceFlags services);
 
     //! set the max outbound target in bytes.
     void SetMaxOutboundTarget(uint64_t limit);
@@ -278,6 +309,18 @@ public:
     uint64_t GetTotalBytesRecv();
     uint64_t GetTotalBytesSent();
 
+    /**
+     * Account for a received message of the given command that was
+     * processed in nMicros after waiting nWaitMicros in the process queue.
+     */
+    void RecordMsgProcessed(CNode *pnode, const std::string &strCommand,
+                            int64_t nMicros, int64_t nWaitMicros);
+    /**
+     * Per-command profiles of all messages processed and sent so far, summed
+     * over the connected peers and those already deleted.
+     */
+    void GetMsgProfiles(mapMsgCmdProfile &mapRecv, mapMsgCmdProfile &mapSend);
+
     void SetBestHeight(int height);
     int GetBestHeight() const;
 
@@ -318,6 +361,9 @@ private:
     bool IsWhitelistedRange(const CNetAddr &addr);
 
     void DeleteNode(CNode *pnode);
+    //! Add the message profiles of a peer to mapRecv and mapSend
+    static void AddMsgProfiles(CNode *pnode, mapMsgCmdProfile &mapRecv,
+                               mapMsgCmdProfile &mapSend);
 
     NodeId GetNewNodeId();
 
@@ -347,6 +393,13 @@ private:
     uint64_t nTotalBytesRecv;
     uint64_t nTotalBytesSent;
 
+    // Message handling times of deleted peers. Those of connected peers are
+    // only kept per peer, under the locks that already protect their
+    // buffers, so that sending and processing take no global lock.
+    CCriticalSection cs_msgProfile;
+    mapMsgCmdProfile mapRecvProfileDeleted;
+    mapMsgCmdProfile mapSendProfileDeleted;
+
     // outbound limit & stats
     uint64_t nMaxOutboundTotalBytesSentInCycle;
     uint64_t nMaxOutboundCycleStartTime;
@@ -378,7 +431,7 @@ private:
     std::atomic<NodeId> nLastNodeId;
 
     /** Services this instance offers */
-    ServiceFlags nLocalServices;
+    std::atomic<ServiceFlags> nLocalServices;
 
     /** Services this instance cares about */
     ServiceFlags nRelevantServices;
@@ -512,9 +565,12 @@ public:
     bool fAddnode;
     int nStartingHeight;
     uint64_t nSendBytes;
+    uint64_t nSendSyscalls;
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    mapMsgCmdProfile mapSendProfilePerMsgCmd;
+    mapMsgCmdProfile mapRecvProfilePerMsgCmd;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -589,6 +645,8 @@ public:
     // Offset inside the first vSendMsg already sent.
     size_t nSendOffset;
     uint64_t nSendBytes;
+    // Number of send calls made on the socket.
+    uint64_t nSendSyscalls;
     std::deque<std::vector<uint8_t>> vSendMsg;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
@@ -650,6 +708,10 @@ public:
 protected:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    // protected by cs_vSend
+    mapMsgCmdProfile mapSendProfilePerMsgCmd;
+    // protected by cs_vProcessMsg
+    mapMsgCmdProfile mapRecvProfilePerMsgCmd;
 
 public:
     uint256 hashContinue;
@@ -665,8 +727,11 @@ public:
 
     // Inventory based relay.
     CRollingBloomFilter filterInventoryKnown;
-    // Set of transaction ids we still have to announce. They are sorted by the
-    // mempool before relay, so the order is not important.
+    // Transaction ids we still have to announce, in the order they were
+    // queued. They are sorted by the mempool before relay, so the order is not
+    // important.
+    std::vector<uint256> vInventoryTxToSend;
+    // The same transaction ids, so that each is queued only once.
     std::set<uint256> setInventoryTxToSend;
     // List of block ids we still have announce. There is no final sorting
     // before sending, as they are always sent immediately and in the order
@@ -726,6 +791,13 @@ private:
     // Used only by SocketHandler thread.
     std::list<CNetMessage> vRecvMsg;
 
+    // Payload buffers of processed messages, handed back to new messages so
+    // that steady relay traffic does not allocate (and clear on free) a
+    // buffer per message.
+    CCriticalSection cs_vRecvBufferPool;
+    std::vector<CSerializeData> vRecvBufferPool;
+    size_t nRecvBufferPoolSize;
+
     mutable CCriticalSection cs_addrName;
     std::string addrName;
 
@@ -745,6 +817,8 @@ public:
     }
 
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool &complete);
+    /** Return the payload buffer of a processed message for reuse. */
+    void RecycleRecvBuffer(CDataStream &vRecv);
 
     void SetRecvVersion(int nVersionIn) { nRecvVersion = nVersionIn; }
     int GetRecvVersion() { return nRecvVersion; }
@@ -794,8 +868,9 @@ public:
     void PushInventory(const CInv &inv) {
         LOCK(cs_inventory);
         if (inv.type == MSG_TX) {
-            if (!filterInventoryKnown.contains(inv.hash)) {
-                setInventoryTxToSend.insert(inv.hash);
+            if (!filterInventoryKnown.contains(inv.hash) &&
+                setInventoryTxToSend.insert(inv.hash).second) {
+                vInventoryTxToSend.push_back(inv.hash);
             }
         } else if (inv.type == MSG_BLOCK) {
             vInventoryBlockToSend.push_back(inv.hash);
@@ -826,6 +901,26 @@ public:
  */
 int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
 
+#ifndef WIN32
+/**
+ * Describe the queued send buffers from vSendMsg[nFirst], nSendOffset bytes
+ * in, for a single gathered write. Fills at most nMaxIov entries and returns
+ * how many were used; nRequested is set to the number of bytes they cover.
+ */
+size_t FillSendIovecs(const std::deque<std::vector<uint8_t>> &vSendMsg,
+                      size_t nFirst, size_t nSendOffset, struct iovec *iov,
+                      size_t nMaxIov, size_t &nRequested);
+#endif
+
+/**
+ * Account for nBytes written from vSendMsg[nMsgCount], nSendOffset bytes in.
+ * nMsgCount is moved past the buffers that were sent completely and
+ * nSendOffset is left at the first unsent byte. Returns the total size of
+ * the completed buffers.
+ */
+size_t ConsumeSentBytes(const std::deque<std::vector<uint8_t>> &vSendMsg,
+                        size_t &nMsgCount, size_t &nSendOffset, size_t nBytes);
+
 std::string getSubVersionEB(uint64_t MaxBlockSize);
 std::string userAgent(const Config &config);
 #endif // BITCOIN_NET_H
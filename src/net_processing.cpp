@@ -12,6 +12,7 @@
 #include "config.h"
 #include "consensus/validation.h"
 #include "hash.h"
+#include "index/blockfilterindex.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "net.h"
@@ -24,6 +25,7 @@
 #include "random.h"
 #include "tinyformat.h"
 #include "txmempool.h"
+#include "txrelaycache.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -31,6 +33,9 @@
 #include "validation.h"
 #include "validationinterface.h"
 
+#include <limits>
+#include <unordered_map>
+
 #include <boost/range/adaptor/reversed.hpp>
 #include <boost/thread.hpp>
 
@@ -66,6 +71,15 @@ static std::vector<std::pair<uint256, CTransactionRef>>
 // SHA256("main address relay")[0:8]
 static const uint64_t RANDOMIZER_ID_ADDRESS_RELAY = 0x3cac0035b5866b90ULL;
 
+/** Maximum number of compact filters that may be requested with one
+ * getcfilters. See BIP 157. */
+static const uint32_t MAX_GETCFILTERS_SIZE = 1000;
+/** Maximum number of cf hashes that may be requested with one getcfheaders.
+ * See BIP 157. */
+static const uint32_t MAX_GETCFHEADERS_SIZE = 2000;
+/** Interval between the filter headers sent in a cfcheckpt. See BIP 157. */
+static const int CFCHECKPT_INTERVAL = 1000;
+
 // Internal stuff
 namespace {
 /** Number of nodes with fSyncStarted. */
@@ -110,6 +124,10 @@ struct QueuedBlock {
     bool fValidatedHeaders;
     //!< Optional, used for CMPCTBLOCK downloads
     std::unique_ptr<PartiallyDownloadedBlock> partialBlock;
+    //!< When the block was requested, in microseconds.
+    int64_t nTimeRequested;
+    //!< Size of the compact block messages received for it so far.
+    size_t nCompactBytes;
 };
 std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator>>
     mapBlocksInFlight;
@@ -123,14 +141,93 @@ int nPreferredDownload = 0;
 /** Number of peers from which we're downloading blocks. */
 int nPeersWithValidatedDownloads = 0;
 
-/** Relay map, protected by cs_main. */
-typedef std::map<uint256, CTransactionRef> MapRelay;
-MapRelay mapRelay;
-/** Expiration-time ordered list of (expire time, relay map entry) pairs,
- * protected by cs_main). */
-std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+/** Recently announced transactions, protected by cs_main. */
+std::unique_ptr<CTxRelayCache> relayCache;
+
+/**
+ * Depth and score of transactions queued for announcement, shared by all peers
+ * and protected by cs_main. Each transaction is looked up in the mempool once
+ * until the scores of transactions in the mempool change, instead of on every
+ * comparison of every peer's sort.
+ */
+struct RelayOrderCache {
+    //! CTxMemPool::GetScoresUpdated() when the scores were looked up
+    unsigned int nScoresUpdated = 0;
+    std::unordered_map<uint256, TxDepthAndScore, SaltedTxidHasher> mapScores;
+};
+std::unique_ptr<RelayOrderCache> relayOrderCache;
 } // anon namespace
 
+/**
+ * The time for one block is measured from when it was requested or from when
+ * the peer's previous block arrived, whichever is later, so that time spent
+ * queued behind other blocks is not counted twice.
+ */
+void CBlockDownloadSpeed::AddBlock(int64_t nTimeRequested, size_t nBytes,
+                                   int64_t nNow) {
+    int64_t nStart = std::max(nTimeRequested, nLastBlockReceived);
+    int64_t nMicros = std::max<int64_t>(1, nNow - nStart);
+    int64_t nRate = int64_t(nBytes) * 1000000 / nMicros;
+    if (nBlocks == 0) {
+        nMicrosPerBlock = nMicros;
+        nBytesPerSec = nRate;
+        nBytesPerBlock = nBytes;
+    } else {
+        // Moving averages giving the new sample a weight of 1/8.
+        nMicrosPerBlock += (nMicros - nMicrosPerBlock) / 8;
+        nBytesPerSec += (nRate - nBytesPerSec) / 8;
+        nBytesPerBlock += (int64_t(nBytes) - nBytesPerBlock) / 8;
+    }
+    nLastBlockReceived = nNow;
+    nBlocks++;
+}
+
+/**
+ * Enough blocks to keep the peer busy for BLOCK_DOWNLOAD_QUEUE_TIME at its
+ * measured speed, once it has delivered a few.
+ */
+int CBlockDownloadSpeed::GetMaxBlocksInFlight() const {
+    if (nBlocks < BLOCK_DOWNLOAD_WARMUP_BLOCKS) {
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    }
+    int64_t nMaxBlocks =
+        BLOCK_DOWNLOAD_QUEUE_TIME / std::max<int64_t>(1, nMicrosPerBlock);
+    return std::max<int64_t>(
+        MIN_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER,
+        std::min<int64_t>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, nMaxBlocks));
+}
+
+/**
+ * The size of a block is only known once it arrives, so it is taken to be like
+ * the recent blocks of either peer. The staller gets twice the time it needs
+ * for such a block at its measured rate, or at this peer's rate if it has not
+ * been measured, and at least BLOCK_REASSIGN_TIMEOUT. Large blocks that are
+ * still coming in at the expected rate are thus not requested twice.
+ */
+int64_t CBlockDownloadSpeed::GetReassignTimeout(
+    const CBlockDownloadSpeed &staller) const {
+    int64_t nBytes = std::max(nBytesPerBlock, staller.nBytesPerBlock);
+    int64_t nRate = staller.nBlocks > 0 ? staller.nBytesPerSec : nBytesPerSec;
+    if (nRate <= 0) {
+        return BLOCK_REASSIGN_TIMEOUT;
+    }
+    return std::max(BLOCK_REASSIGN_TIMEOUT, 2 * nBytes * 1000000 / nRate);
+}
+
+/**
+ * The block must have been in flight for GetReassignTimeout(), and this peer
+ * must have been measured and be at least twice as fast as the staller.
+ */
+bool CBlockDownloadSpeed::ShouldReassignFrom(const CBlockDownloadSpeed &staller,
+                                             int64_t nTimeInFlight) const {
+    if (nBlocks < BLOCK_DOWNLOAD_WARMUP_BLOCKS ||
+        nTimeInFlight < GetReassignTimeout(staller)) {
+        return false;
+    }
+    return staller.nBlocks == 0 ||
+           2 * nMicrosPerBlock < staller.nMicrosPerBlock;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -186,6 +283,11 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! How fast this peer delivers the blocks we request.
+    CBlockDownloadSpeed downloadSpeed;
+    //! Number of blocks requested from another peer because this one was too
+    //! slow to deliver them.
+    uint64_t nBlocksReassigned;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block
@@ -223,6 +325,7 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlocksReassigned = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -413,7 +516,8 @@ MarkBlockAsInFlight(const Config &config, NodeId nodeid, const uint256 &hash,
         state->vBlocksInFlight.end(),
         {hash, pindex, pindex != nullptr,
          std::unique_ptr<PartiallyDownloadedBlock>(
-             pit ? new PartiallyDownloadedBlock(config, &mempool) : nullptr)});
+             pit ? new PartiallyDownloadedBlock(config, &mempool) : nullptr),
+         GetTimeMicros(), 0});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -436,6 +540,42 @@ MarkBlockAsInFlight(const Config &config, NodeId nodeid, const uint256 &hash,
     return true;
 }
 
+/**
+ * Update the download speed of a peer that delivered a block we requested from
+ * it, whether as a full block or as a compact block and its missing
+ * transactions. nBytes is what the peer sent us for the block. Requires
+ * cs_main.
+ */
+static void UpdateBlockDownloadSpeed(NodeId nodeid, const uint256 &hash,
+                                     size_t nBytes) {
+    auto itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() ||
+        itInFlight->second.first != nodeid) {
+        return;
+    }
+    State(nodeid)->downloadSpeed.AddBlock(
+        itInFlight->second.second->nTimeRequested, nBytes, GetTimeMicros());
+}
+
+/**
+ * Whether a block that holds back the download window should be requested
+ * from this peer instead of the staller. Requires cs_main.
+ */
+static bool ShouldReassignBlock(const CNodeState *state, NodeId staller,
+                                const CBlockIndex *pindex, int64_t nNow) {
+    if (pindex == nullptr) {
+        return false;
+    }
+    auto itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+    if (itInFlight == mapBlocksInFlight.end() ||
+        itInFlight->second.first != staller) {
+        return false;
+    }
+    return state->downloadSpeed.ShouldReassignFrom(
+        State(staller)->downloadSpeed,
+        nNow - itInFlight->second.second->nTimeRequested);
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -565,10 +705,13 @@ const CBlockIndex *LastCommonAncestor(const CBlockIndex *pa,
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to
- * vBlocks, until it has at most count entries. */
+ * vBlocks, until it has at most count entries. If the download window keeps
+ * this peer from fetching anything, set nodeStaller to the peer holding the
+ * window back and pindexStalled to the block it was asked for. */
 void FindNextBlocksToDownload(NodeId nodeid, unsigned int count,
                               std::vector<const CBlockIndex *> &vBlocks,
                               NodeId &nodeStaller,
+                              const CBlockIndex *&pindexStalled,
                               const Consensus::Params &consensusParams) {
     if (count == 0) {
         return;
@@ -614,6 +757,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count,
     int nMaxHeight =
         std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    const CBlockIndex *pindexWaitingFor = nullptr;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed)
         // successors of pindexWalk (towards pindexBestKnownBlock) into
@@ -652,6 +796,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count,
                         // We aren't able to fetch anything, but we would be if
                         // the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -662,6 +807,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count,
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -669,6 +815,13 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count,
 
 } // anon namespace
 
+void GetRelayCacheStats(TxRelayCacheStats &stats) {
+    LOCK(cs_main);
+    if (relayCache) {
+        stats = relayCache->GetStats();
+    }
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
@@ -686,6 +839,11 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
         }
     }
+    stats.nMaxBlocksInFlight = state->downloadSpeed.GetMaxBlocksInFlight();
+    stats.nBlockDownloadMicros = state->downloadSpeed.nMicrosPerBlock;
+    stats.nBlockDownloadBytesPerSec = state->downloadSpeed.nBytesPerSec;
+    stats.nBlocksDownloaded = state->downloadSpeed.nBlocks;
+    stats.nBlocksReassigned = state->nBlocksReassigned;
     return true;
 }
 
@@ -879,6 +1037,13 @@ PeerLogicValidation::PeerLogicValidation(CConnman *connmanIn)
     : connman(connmanIn) {
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+
+    LOCK(cs_main);
+    relayCache.reset(new CTxRelayCache(
+        std::max<int64_t>(0, GetArg("-maxrelaycache",
+                                    DEFAULT_MAX_RELAY_CACHE_SIZE)) *
+        1000000));
+    relayOrderCache.reset(new RelayOrderCache());
 }
 
 void PeerLogicValidation::SyncTransaction(const CTransaction &tx,
@@ -1311,12 +1476,11 @@ static void ProcessGetData(const Config &config, CNode *pfrom,
             } else if (inv.type == MSG_TX) {
                 // Send stream from relay memory
                 bool push = false;
-                auto mi = mapRelay.find(inv.hash);
+                CTransactionRef tx = relayCache->Find(inv.hash);
                 int nSendFlags = 0;
-                if (mi != mapRelay.end()) {
+                if (tx) {
                     connman.PushMessage(
-                        pfrom,
-                        msgMaker.Make(nSendFlags, NetMsgType::TX, *mi->second));
+                        pfrom, msgMaker.Make(nSendFlags, NetMsgType::TX, *tx));
                     push = true;
                 } else if (pfrom->timeLastMempoolReq) {
                     auto txinfo = mempool.info(inv.hash);
@@ -1390,1660 +1554,2059 @@ inline static void SendBlockTransactions(const CBlock &block,
                         msgMaker.Make(nSendFlags, NetMsgType::BLOCKTXN, resp));
 }
 
-static bool ProcessMessage(const Config &config, CNode *pfrom,
-                           const std::string &strCommand, CDataStream &vRecv,
-                           int64_t nTimeReceived,
-                           const CChainParams &chainparams, CConnman &connman,
-                           const std::atomic<bool> &interruptMsgProc) {
-    LogPrint("net", "received: %s (%u bytes) peer=%d\n",
-             SanitizeString(strCommand), vRecv.size(), pfrom->id);
-    if (IsArgSet("-dropmessagestest") &&
-        GetRand(GetArg("-dropmessagestest", 0)) == 0) {
-        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
-        return true;
+/**
+ * Check a BIP 157 request: filters of the type must be served, and the stop
+ * block must be in the active chain, less than nMaxHeightRange blocks after
+ * nStartHeight. Peers that send invalid requests are disconnected.
+ */
+static bool PrepareBlockFilterRequest(CNode *pfrom, uint8_t filterType,
+                                      uint32_t nStartHeight,
+                                      const uint256 &hashStop,
+                                      uint32_t nMaxHeightRange,
+                                      const CBlockIndex *&pindexStop) {
+    if (!(pfrom->GetLocalServices() & NODE_COMPACT_FILTERS) ||
+        !g_blockfilterindex ||
+        BlockFilterType(filterType) != g_blockfilterindex->GetFilterType()) {
+        LogPrint("net", "peer %d requested unsupported block filter type: %d\n",
+                 pfrom->id, filterType);
+        pfrom->fDisconnect = true;
+        return false;
     }
 
-    if (!(pfrom->GetLocalServices() & NODE_BLOOM) &&
-        (strCommand == NetMsgType::FILTERLOAD ||
-         strCommand == NetMsgType::FILTERADD)) {
-        if (pfrom->nVersion >= NO_BLOOM_VERSION) {
-            LOCK(cs_main);
-            Misbehaving(pfrom, 100, "no-bloom-version");
-            return false;
-        } else {
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hashStop);
+        if (it == mapBlockIndex.end() || !chainActive.Contains(it->second)) {
+            LogPrint("net", "peer %d requested invalid block hash: %s\n",
+                     pfrom->id, hashStop.ToString());
             pfrom->fDisconnect = true;
             return false;
         }
+        pindexStop = it->second;
     }
 
-    if (strCommand == NetMsgType::REJECT) {
-        if (fDebug) {
-            try {
-                std::string strMsg;
-                uint8_t ccode;
-                std::string strReason;
-                vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >>
-                    ccode >>
-                    LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
+    const uint32_t nStopHeight = pindexStop->nHeight;
+    if (nStartHeight > nStopHeight) {
+        LogPrint("net", "peer %d sent invalid getcfilters/getcfheaders with "
+                        "start height %d and stop height %d\n",
+                 pfrom->id, nStartHeight, nStopHeight);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    if (nStopHeight - nStartHeight >= nMaxHeightRange) {
+        LogPrint("net", "peer %d requested too many cfilters/cfheaders: %d / "
+                        "%d\n",
+                 pfrom->id, nStopHeight - nStartHeight + 1, nMaxHeightRange);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    return true;
+}
 
-                std::ostringstream ss;
-                ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
+static void ProcessGetCFilters(CNode *pfrom, CDataStream &vRecv,
+                               CConnman &connman) {
+    uint8_t filterType;
+    uint32_t nStartHeight;
+    uint256 hashStop;
+    vRecv >> filterType >> nStartHeight >> hashStop;
 
-                if (strMsg == NetMsgType::BLOCK || strMsg == NetMsgType::TX) {
-                    uint256 hash;
-                    vRecv >> hash;
-                    ss << ": hash " << hash.ToString();
-                }
-                LogPrint("net", "Reject %s\n", SanitizeString(ss.str()));
-            } catch (const std::ios_base::failure &) {
-                // Avoid feedback loops by preventing reject messages from
-                // triggering a new reject message.
-                LogPrint("net", "Unparseable reject message received\n");
-            }
-        }
+    const CBlockIndex *pindexStop;
+    if (!PrepareBlockFilterRequest(pfrom, filterType, nStartHeight, hashStop,
+                                   MAX_GETCFILTERS_SIZE, pindexStop)) {
+        return;
     }
 
-    else if (strCommand == NetMsgType::VERSION) {
-        // Each connection can only send one version message
-        if (pfrom->nVersion != 0) {
-            connman.PushMessage(
-                pfrom,
-                CNetMsgMaker(INIT_PROTO_VERSION)
-                    .Make(NetMsgType::REJECT, strCommand, REJECT_DUPLICATE,
-                          std::string("Duplicate version message")));
-            LOCK(cs_main);
-            Misbehaving(pfrom, 1, "multiple-version");
-            return false;
-        }
-
-        int64_t nTime;
-        CAddress addrMe;
-        CAddress addrFrom;
-        uint64_t nNonce = 1;
-        uint64_t nServiceInt;
-        ServiceFlags nServices;
-        int nVersion;
-        int nSendVersion;
-        std::string strSubVer;
-        std::string cleanSubVer;
-        int nStartingHeight = -1;
-        bool fRelay = true;
-
-        vRecv >> nVersion >> nServiceInt >> nTime >> addrMe;
-        nSendVersion = std::min(nVersion, PROTOCOL_VERSION);
-        nServices = ServiceFlags(nServiceInt);
-        if (!pfrom->fInbound) {
-            connman.SetServices(pfrom->addr, nServices);
-        }
-        if (pfrom->nServicesExpected & ~nServices) {
-            LogPrint("net", "peer=%d does not offer the expected services "
-                            "(%08x offered, %08x expected); disconnecting\n",
-                     pfrom->id, nServices, pfrom->nServicesExpected);
-            connman.PushMessage(
-                pfrom,
-                CNetMsgMaker(INIT_PROTO_VERSION)
-                    .Make(NetMsgType::REJECT, strCommand, REJECT_NONSTANDARD,
-                          strprintf("Expected to offer services %08x",
-                                    pfrom->nServicesExpected)));
-            pfrom->fDisconnect = true;
-            return false;
-        }
+    std::vector<BlockFilter> filters;
+    if (!g_blockfilterindex->LookupFilterRange(nStartHeight, pindexStop,
+                                               filters)) {
+        LogPrint("net", "Failed to find block filter in index: filter_type=%d, "
+                        "start_height=%d, stop_hash=%s\n",
+                 filterType, nStartHeight, hashStop.ToString());
+        return;
+    }
 
-        if (nVersion < MIN_PEER_PROTO_VERSION) {
-            // disconnect from peers older than this proto version
-            LogPrintf("peer=%d using obsolete version %i; disconnecting\n",
-                      pfrom->id, nVersion);
-            connman.PushMessage(
-                pfrom,
-                CNetMsgMaker(INIT_PROTO_VERSION)
-                    .Make(NetMsgType::REJECT, strCommand, REJECT_OBSOLETE,
-                          strprintf("Version must be %d or greater",
-                                    MIN_PEER_PROTO_VERSION)));
-            pfrom->fDisconnect = true;
-            return false;
-        }
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    for (const BlockFilter &filter : filters) {
+        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::CFILTER, filter));
+    }
+}
 
-        if (!vRecv.empty()) {
-            vRecv >> addrFrom >> nNonce;
-        }
-        if (!vRecv.empty()) {
-            vRecv >> LIMITED_STRING(strSubVer, MAX_SUBVERSION_LENGTH);
-            cleanSubVer = SanitizeString(strSubVer);
-        }
-        if (!vRecv.empty()) {
-            vRecv >> nStartingHeight;
-        }
-        if (!vRecv.empty()) {
-            vRecv >> fRelay;
-        }
-        // Disconnect if we connected to ourself
-        if (pfrom->fInbound && !connman.CheckIncomingNonce(nNonce)) {
-            LogPrintf("connected to self at %s, disconnecting\n",
-                      pfrom->addr.ToString());
-            pfrom->fDisconnect = true;
-            return true;
-        }
+static void ProcessGetCFHeaders(CNode *pfrom, CDataStream &vRecv,
+                                CConnman &connman) {
+    uint8_t filterType;
+    uint32_t nStartHeight;
+    uint256 hashStop;
+    vRecv >> filterType >> nStartHeight >> hashStop;
 
-        if (pfrom->fInbound && addrMe.IsRoutable()) {
-            SeenLocal(addrMe);
-        }
+    const CBlockIndex *pindexStop;
+    if (!PrepareBlockFilterRequest(pfrom, filterType, nStartHeight, hashStop,
+                                   MAX_GETCFHEADERS_SIZE, pindexStop)) {
+        return;
+    }
 
-        // Be shy and don't send version until we hear
-        if (pfrom->fInbound) {
-            PushNodeVersion(config, pfrom, connman, GetAdjustedTime());
+    uint256 prevHeader;
+    if (nStartHeight > 0) {
+        const CBlockIndex *pindexPrev =
+            pindexStop->GetAncestor(nStartHeight - 1);
+        if (!g_blockfilterindex->LookupFilterHeader(pindexPrev, prevHeader)) {
+            LogPrint("net", "Failed to find block filter header in index: "
+                            "filter_type=%d, block_hash=%s\n",
+                     filterType, pindexPrev->GetBlockHash().ToString());
+            return;
         }
+    }
 
-        connman.PushMessage(
-            pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::VERACK));
+    std::vector<uint256> hashes;
+    if (!g_blockfilterindex->LookupFilterHashRange(nStartHeight, pindexStop,
+                                                   hashes)) {
+        LogPrint("net", "Failed to find block filter hashes in index: "
+                        "filter_type=%d, start_height=%d, stop_hash=%s\n",
+                 filterType, nStartHeight, hashStop.ToString());
+        return;
+    }
 
-        pfrom->nServices = nServices;
-        pfrom->SetAddrLocal(addrMe);
-        {
-            LOCK(pfrom->cs_SubVer);
-            pfrom->strSubVer = strSubVer;
-            pfrom->cleanSubVer = cleanSubVer;
-        }
-        pfrom->nStartingHeight = nStartingHeight;
-        pfrom->fClient = !(nServices & NODE_NETWORK);
-        {
-            LOCK(pfrom->cs_filter);
-            pfrom->fRelayTxes =
-                fRelay; // set to true after we get the first filter* message
-        }
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman.PushMessage(pfrom,
+                        msgMaker.Make(NetMsgType::CFHEADERS, filterType,
+                                      hashStop, prevHeader, hashes));
+}
 
-        // Change version
-        pfrom->SetSendVersion(nSendVersion);
-        pfrom->nVersion = nVersion;
+static void ProcessGetCFCheckPt(CNode *pfrom, CDataStream &vRecv,
+                                CConnman &connman) {
+    uint8_t filterType;
+    uint256 hashStop;
+    vRecv >> filterType >> hashStop;
 
-        // Potentially mark this peer as a preferred download peer.
-        {
-            LOCK(cs_main);
-            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
-        }
-
-        if (!pfrom->fInbound) {
-            // Advertise our address
-            if (fListen && !IsInitialBlockDownload()) {
-                CAddress addr =
-                    GetLocalAddress(&pfrom->addr, pfrom->GetLocalServices());
-                FastRandomContext insecure_rand;
-                if (addr.IsRoutable()) {
-                    LogPrint("net", "ProcessMessages: advertising address %s\n",
-                             addr.ToString());
-                    pfrom->PushAddress(addr, insecure_rand);
-                } else if (IsPeerAddrLocalGood(pfrom)) {
-                    addr.SetIP(addrMe);
-                    LogPrint("net", "ProcessMessages: advertising address %s\n",
-                             addr.ToString());
-                    pfrom->PushAddress(addr, insecure_rand);
-                }
-            }
+    const CBlockIndex *pindexStop;
+    if (!PrepareBlockFilterRequest(pfrom, filterType, 0, hashStop,
+                                   std::numeric_limits<uint32_t>::max(),
+                                   pindexStop)) {
+        return;
+    }
 
-            // Get recent addresses
-            if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION ||
-                connman.GetAddressCount() < 1000) {
-                connman.PushMessage(
-                    pfrom,
-                    CNetMsgMaker(nSendVersion).Make(NetMsgType::GETADDR));
-                pfrom->fGetAddr = true;
-            }
-            connman.MarkAddressGood(pfrom->addr);
-        }
-
-        std::string remoteAddr;
-        if (fLogIPs) {
-            remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
-        }
-
-        LogPrintf("receive version message: [%s] %s: version %d, blocks=%d, "
-                  "us=%s, peer=%d%s\n",
-                  pfrom->addr.ToString().c_str(), cleanSubVer, pfrom->nVersion,
-                  pfrom->nStartingHeight, addrMe.ToString(), pfrom->id,
-                  remoteAddr);
-        if (pfrom->fUsesCashMagic) {
-            LogPrintf("peer %d uses CASH magic in its headers\n", pfrom->id);
-        }
-
-        int64_t nTimeOffset = nTime - GetTime();
-        pfrom->nTimeOffset = nTimeOffset;
-        AddTimeData(pfrom->addr, nTimeOffset);
-
-        // If the peer is old enough to have the old alert system, send it the
-        // final alert.
-        if (pfrom->nVersion <= 70012) {
-            CDataStream finalAlert(
-                ParseHex("60010000000000000000000000ffffff7f00000000ffffff7ffef"
-                         "fff7f01ffffff7f00000000ffffff7f00ffffff7f002f55524745"
-                         "4e543a20416c657274206b657920636f6d70726f6d697365642c2"
-                         "075706772616465207265717569726564004630440220653febd6"
-                         "410f470f6bae11cad19c48413becb1ac2c17f908fd0fd53bdc3ab"
-                         "d5202206d0e9c96fe88d4a0f01ed9dedae2b6f9e00da94cad0fec"
-                         "aae66ecf689bf71b50"),
-                SER_NETWORK, PROTOCOL_VERSION);
-            connman.PushMessage(
-                pfrom, CNetMsgMaker(nSendVersion).Make("alert", finalAlert));
+    std::vector<uint256> headers(pindexStop->nHeight / CFCHECKPT_INTERVAL);
+    for (size_t i = 0; i < headers.size(); i++) {
+        const CBlockIndex *pindex =
+            pindexStop->GetAncestor((i + 1) * CFCHECKPT_INTERVAL);
+        if (!g_blockfilterindex->LookupFilterHeader(pindex, headers[i])) {
+            LogPrint("net", "Failed to find block filter header in index: "
+                            "filter_type=%d, block_hash=%s\n",
+                     filterType, pindex->GetBlockHash().ToString());
+            return;
         }
+    }
 
-        // Feeler connections exist only to verify if address is online.
-        if (pfrom->fFeeler) {
-            assert(pfrom->fInbound == false);
-            pfrom->fDisconnect = true;
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::CFCHECKPT, filterType,
+                                             hashStop, headers));
+}
+
+static bool ProcessRejectMessage(const Config &config, CNode *pfrom,
+                                 const std::string &strCommand,
+                                 CDataStream &vRecv, int64_t nTimeReceived,
+                                 const CChainParams &chainparams,
+                                 CConnman &connman,
+                                 const std::atomic<bool> &interruptMsgProc) {
+    if (fDebug) {
+        try {
+            std::string strMsg;
+            uint8_t ccode;
+            std::string strReason;
+            vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >>
+                ccode >>
+                LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
+
+            std::ostringstream ss;
+            ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
+
+            if (strMsg == NetMsgType::BLOCK || strMsg == NetMsgType::TX) {
+                uint256 hash;
+                vRecv >> hash;
+                ss << ": hash " << hash.ToString();
+            }
+            LogPrint("net", "Reject %s\n", SanitizeString(ss.str()));
+        } catch (const std::ios_base::failure &) {
+            // Avoid feedback loops by preventing reject messages from
+            // triggering a new reject message.
+            LogPrint("net", "Unparseable reject message received\n");
         }
-        return true;
     }
+    return true;
+}
 
-    else if (pfrom->nVersion == 0) {
-        // Must have a version message before anything else
+static bool ProcessVersionMessage(const Config &config, CNode *pfrom,
+                                  const std::string &strCommand,
+                                  CDataStream &vRecv, int64_t nTimeReceived,
+                                  const CChainParams &chainparams,
+                                  CConnman &connman,
+                                  const std::atomic<bool> &interruptMsgProc) {
+    // Each connection can only send one version message
+    if (pfrom->nVersion != 0) {
+        connman.PushMessage(
+            pfrom,
+            CNetMsgMaker(INIT_PROTO_VERSION)
+                .Make(NetMsgType::REJECT, strCommand, REJECT_DUPLICATE,
+                      std::string("Duplicate version message")));
         LOCK(cs_main);
-        Misbehaving(pfrom, 1, "missing-version");
+        Misbehaving(pfrom, 1, "multiple-version");
         return false;
     }
 
-    // At this point, the outgoing message serialization version can't change.
-    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
-
-    if (strCommand == NetMsgType::VERACK) {
-        pfrom->SetRecvVersion(
-            std::min(pfrom->nVersion.load(), PROTOCOL_VERSION));
-
-        if (!pfrom->fInbound) {
-            // Mark this node as currently connected, so we update its timestamp
-            // later.
-            LOCK(cs_main);
-            State(pfrom->GetId())->fCurrentlyConnected = true;
-        }
-
-        if (pfrom->nVersion >= SENDHEADERS_VERSION) {
-            // Tell our peer we prefer to receive headers rather than inv's
-            // We send this to non-NODE NETWORK peers as well, because even
-            // non-NODE NETWORK peers can announce blocks (such as pruning
-            // nodes)
-            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDHEADERS));
-        }
-        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
-            // Tell our peer we are willing to provide version 1 or 2
-            // cmpctblocks. However, we do not request new block announcements
-            // using cmpctblock messages. We send this to non-NODE NETWORK peers
-            // as well, because they may wish to request compact blocks from us.
-            bool fAnnounceUsingCMPCTBLOCK = false;
-            uint64_t nCMPCTBLOCKVersion = 1;
-            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDCMPCT,
-                                                     fAnnounceUsingCMPCTBLOCK,
-                                                     nCMPCTBLOCKVersion));
-        }
-        pfrom->fSuccessfullyConnected = true;
+    int64_t nTime;
+    CAddress addrMe;
+    CAddress addrFrom;
+    uint64_t nNonce = 1;
+    uint64_t nServiceInt;
+    ServiceFlags nServices;
+    int nVersion;
+    int nSendVersion;
+    std::string strSubVer;
+    std::string cleanSubVer;
+    int nStartingHeight = -1;
+    bool fRelay = true;
+
+    vRecv >> nVersion >> nServiceInt >> nTime >> addrMe;
+    nSendVersion = std::min(nVersion, PROTOCOL_VERSION);
+    nServices = ServiceFlags(nServiceInt);
+    if (!pfrom->fInbound) {
+        connman.SetServices(pfrom->addr, nServices);
+    }
+    if (pfrom->nServicesExpected & ~nServices) {
+        LogPrint("net", "peer=%d does not offer the expected services "
+                        "(%08x offered, %08x expected); disconnecting\n",
+                 pfrom->id, nServices, pfrom->nServicesExpected);
+        connman.PushMessage(
+            pfrom,
+            CNetMsgMaker(INIT_PROTO_VERSION)
+                .Make(NetMsgType::REJECT, strCommand, REJECT_NONSTANDARD,
+                      strprintf("Expected to offer services %08x",
+                                pfrom->nServicesExpected)));
+        pfrom->fDisconnect = true;
+        return false;
     }
 
-    else if (!pfrom->fSuccessfullyConnected) {
-        // Must have a verack message before anything else
-        LOCK(cs_main);
-        Misbehaving(pfrom, 1, "missing-verack");
+    if (nVersion < MIN_PEER_PROTO_VERSION) {
+        // disconnect from peers older than this proto version
+        LogPrintf("peer=%d using obsolete version %i; disconnecting\n",
+                  pfrom->id, nVersion);
+        connman.PushMessage(
+            pfrom,
+            CNetMsgMaker(INIT_PROTO_VERSION)
+                .Make(NetMsgType::REJECT, strCommand, REJECT_OBSOLETE,
+                      strprintf("Version must be %d or greater",
+                                MIN_PEER_PROTO_VERSION)));
+        pfrom->fDisconnect = true;
         return false;
     }
 
-    else if (strCommand == NetMsgType::ADDR) {
-        std::vector<CAddress> vAddr;
-        vRecv >> vAddr;
+    if (!vRecv.empty()) {
+        vRecv >> addrFrom >> nNonce;
+    }
+    if (!vRecv.empty()) {
+        vRecv >> LIMITED_STRING(strSubVer, MAX_SUBVERSION_LENGTH);
+        cleanSubVer = SanitizeString(strSubVer);
+    }
+    if (!vRecv.empty()) {
+        vRecv >> nStartingHeight;
+    }
+    if (!vRecv.empty()) {
+        vRecv >> fRelay;
+    }
+    // Disconnect if we connected to ourself
+    if (pfrom->fInbound && !connman.CheckIncomingNonce(nNonce)) {
+        LogPrintf("connected to self at %s, disconnecting\n",
+                  pfrom->addr.ToString());
+        pfrom->fDisconnect = true;
+        return true;
+    }
 
-        // Don't want addr from older versions unless seeding
-        if (pfrom->nVersion < CADDR_TIME_VERSION &&
-            connman.GetAddressCount() > 1000) {
-            return true;
-        }
-        if (vAddr.size() > 1000) {
-            LOCK(cs_main);
-            Misbehaving(pfrom, 20, "oversized-addr");
-            return error("message addr size() = %u", vAddr.size());
-        }
+    if (pfrom->fInbound && addrMe.IsRoutable()) {
+        SeenLocal(addrMe);
+    }
 
-        // Store the new addresses
-        std::vector<CAddress> vAddrOk;
-        int64_t nNow = GetAdjustedTime();
-        int64_t nSince = nNow - 10 * 60;
-        for (CAddress &addr : vAddr) {
-            if (interruptMsgProc) {
-                return true;
-            }
+    // Be shy and don't send version until we hear
+    if (pfrom->fInbound) {
+        PushNodeVersion(config, pfrom, connman, GetAdjustedTime());
+    }
 
-            if ((addr.nServices & REQUIRED_SERVICES) != REQUIRED_SERVICES) {
-                continue;
-            }
+    connman.PushMessage(
+        pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::VERACK));
 
-            if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60) {
-                addr.nTime = nNow - 5 * 24 * 60 * 60;
-            }
-            pfrom->AddAddressKnown(addr);
-            bool fReachable = IsReachable(addr);
-            if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 &&
-                addr.IsRoutable()) {
-                // Relay to a limited number of other nodes
-                RelayAddress(addr, fReachable, connman);
-            }
-            // Do not store addresses outside our network
-            if (fReachable) {
-                vAddrOk.push_back(addr);
-            }
-        }
-        connman.AddNewAddresses(vAddrOk, pfrom->addr, 2 * 60 * 60);
-        if (vAddr.size() < 1000) {
-            pfrom->fGetAddr = false;
-        }
-        if (pfrom->fOneShot) {
-            pfrom->fDisconnect = true;
-        }
+    pfrom->nServices = nServices;
+    pfrom->SetAddrLocal(addrMe);
+    {
+        LOCK(pfrom->cs_SubVer);
+        pfrom->strSubVer = strSubVer;
+        pfrom->cleanSubVer = cleanSubVer;
+    }
+    pfrom->nStartingHeight = nStartingHeight;
+    pfrom->fClient = !(nServices & NODE_NETWORK);
+    {
+        LOCK(pfrom->cs_filter);
+        pfrom->fRelayTxes =
+            fRelay; // set to true after we get the first filter* message
     }
 
-    else if (strCommand == NetMsgType::SENDHEADERS) {
+    // Change version
+    pfrom->SetSendVersion(nSendVersion);
+    pfrom->nVersion = nVersion;
+
+    // Potentially mark this peer as a preferred download peer.
+    {
         LOCK(cs_main);
-        State(pfrom->GetId())->fPreferHeaders = true;
+        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
     }
 
-    else if (strCommand == NetMsgType::SENDCMPCT) {
-        bool fAnnounceUsingCMPCTBLOCK = false;
-        uint64_t nCMPCTBLOCKVersion = 0;
-        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
-        if (nCMPCTBLOCKVersion == 1) {
-            LOCK(cs_main);
-            // fProvidesHeaderAndIDs is used to "lock in" version of compact
-            // blocks we send.
-            if (!State(pfrom->GetId())->fProvidesHeaderAndIDs) {
-                State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
-            }
-
-            State(pfrom->GetId())->fPreferHeaderAndIDs =
-                fAnnounceUsingCMPCTBLOCK;
-            if (!State(pfrom->GetId())->fSupportsDesiredCmpctVersion) {
-                State(pfrom->GetId())->fSupportsDesiredCmpctVersion = true;
+    if (!pfrom->fInbound) {
+        // Advertise our address
+        if (fListen && !IsInitialBlockDownload()) {
+            CAddress addr =
+                GetLocalAddress(&pfrom->addr, pfrom->GetLocalServices());
+            FastRandomContext insecure_rand;
+            if (addr.IsRoutable()) {
+                LogPrint("net", "ProcessMessages: advertising address %s\n",
+                         addr.ToString());
+                pfrom->PushAddress(addr, insecure_rand);
+            } else if (IsPeerAddrLocalGood(pfrom)) {
+                addr.SetIP(addrMe);
+                LogPrint("net", "ProcessMessages: advertising address %s\n",
+                         addr.ToString());
+                pfrom->PushAddress(addr, insecure_rand);
             }
         }
-    }
 
-    else if (strCommand == NetMsgType::INV) {
-        std::vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ) {
-            LOCK(cs_main);
-            Misbehaving(pfrom, 20, "oversized-inv");
-            return error("message inv size() = %u", vInv.size());
+        // Get recent addresses
+        if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION ||
+            connman.GetAddressCount() < 1000) {
+            connman.PushMessage(
+                pfrom,
+                CNetMsgMaker(nSendVersion).Make(NetMsgType::GETADDR));
+            pfrom->fGetAddr = true;
         }
+        connman.MarkAddressGood(pfrom->addr);
+    }
 
-        bool fBlocksOnly = !fRelayTxes;
-
-        // Allow whitelisted peers to send data other than blocks in blocks only
-        // mode if whitelistrelay is true
-        if (pfrom->fWhitelisted &&
-            GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY)) {
-            fBlocksOnly = false;
-        }
+    std::string remoteAddr;
+    if (fLogIPs) {
+        remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
+    }
 
-        LOCK(cs_main);
+    LogPrintf("receive version message: [%s] %s: version %d, blocks=%d, "
+              "us=%s, peer=%d%s\n",
+              pfrom->addr.ToString().c_str(), cleanSubVer, pfrom->nVersion,
+              pfrom->nStartingHeight, addrMe.ToString(), pfrom->id,
+              remoteAddr);
+    if (pfrom->fUsesCashMagic) {
+        LogPrintf("peer %d uses CASH magic in its headers\n", pfrom->id);
+    }
 
-        uint32_t nFetchFlags =
-            GetFetchFlags(pfrom, chainActive.Tip(), chainparams.GetConsensus());
+    int64_t nTimeOffset = nTime - GetTime();
+    pfrom->nTimeOffset = nTimeOffset;
+    AddTimeData(pfrom->addr, nTimeOffset);
+
+    // If the peer is old enough to have the old alert system, send it the
+    // final alert.
+    if (pfrom->nVersion <= 70012) {
+        CDataStream finalAlert(
+            ParseHex("60010000000000000000000000ffffff7f00000000ffffff7ffef"
+                     "fff7f01ffffff7f00000000ffffff7f00ffffff7f002f55524745"
+                     "4e543a20416c657274206b657920636f6d70726f6d697365642c2"
+                     "075706772616465207265717569726564004630440220653febd6"
+                     "410f470f6bae11cad19c48413becb1ac2c17f908fd0fd53bdc3ab"
+                     "d5202206d0e9c96fe88d4a0f01ed9dedae2b6f9e00da94cad0fec"
+                     "aae66ecf689bf71b50"),
+            SER_NETWORK, PROTOCOL_VERSION);
+        connman.PushMessage(
+            pfrom, CNetMsgMaker(nSendVersion).Make("alert", finalAlert));
+    }
 
-        std::vector<CInv> vToFetch;
+    // Feeler connections exist only to verify if address is online.
+    if (pfrom->fFeeler) {
+        assert(pfrom->fInbound == false);
+        pfrom->fDisconnect = true;
+    }
+    return true;
+}
 
-        for (size_t nInv = 0; nInv < vInv.size(); nInv++) {
-            CInv &inv = vInv[nInv];
+static bool ProcessVerackMessage(const Config &config, CNode *pfrom,
+                                 const std::string &strCommand,
+                                 CDataStream &vRecv, int64_t nTimeReceived,
+                                 const CChainParams &chainparams,
+                                 CConnman &connman,
+                                 const std::atomic<bool> &interruptMsgProc) {
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
-            if (interruptMsgProc) {
-                return true;
-            }
+    pfrom->SetRecvVersion(
+        std::min(pfrom->nVersion.load(), PROTOCOL_VERSION));
 
-            bool fAlreadyHave = AlreadyHave(inv);
-            LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(),
-                     fAlreadyHave ? "have" : "new", pfrom->id);
+    if (!pfrom->fInbound) {
+        // Mark this node as currently connected, so we update its timestamp
+        // later.
+        LOCK(cs_main);
+        State(pfrom->GetId())->fCurrentlyConnected = true;
+    }
 
-            if (inv.type == MSG_TX) {
-                inv.type |= nFetchFlags;
-            }
+    if (pfrom->nVersion >= SENDHEADERS_VERSION) {
+        // Tell our peer we prefer to receive headers rather than inv's
+        // We send this to non-NODE NETWORK peers as well, because even
+        // non-NODE NETWORK peers can announce blocks (such as pruning
+        // nodes)
+        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDHEADERS));
+    }
+    if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+        // Tell our peer we are willing to provide version 1 or 2
+        // cmpctblocks. However, we do not request new block announcements
+        // using cmpctblock messages. We send this to non-NODE NETWORK peers
+        // as well, because they may wish to request compact blocks from us.
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDCMPCT,
+                                                 fAnnounceUsingCMPCTBLOCK,
+                                                 nCMPCTBLOCKVersion));
+    }
+    pfrom->fSuccessfullyConnected = true;
+    return true;
+}
 
-            if (inv.type == MSG_BLOCK) {
-                UpdateBlockAvailability(pfrom->GetId(), inv.hash);
-                if (!fAlreadyHave && !fImporting && !fReindex &&
-                    !mapBlocksInFlight.count(inv.hash)) {
-                    // We used to request the full block here, but since
-                    // headers-announcements are now the primary method of
-                    // announcement on the network, and since, in the case that
-                    // a node fell back to inv we probably have a reorg which we
-                    // should get the headers for first, we now only provide a
-                    // getheaders response here. When we receive the headers, we
-                    // will then ask for the blocks we need.
-                    connman.PushMessage(
-                        pfrom,
-                        msgMaker.Make(NetMsgType::GETHEADERS,
-                                      chainActive.GetLocator(pindexBestHeader),
-                                      inv.hash));
-                    LogPrint("net", "getheaders (%d) %s to peer=%d\n",
-                             pindexBestHeader->nHeight, inv.hash.ToString(),
-                             pfrom->id);
-                }
-            } else {
-                pfrom->AddInventoryKnown(inv);
-                if (fBlocksOnly) {
-                    LogPrint("net", "transaction (%s) inv sent in violation of "
-                                    "protocol peer=%d\n",
-                             inv.hash.ToString(), pfrom->id);
-                } else if (!fAlreadyHave && !fImporting && !fReindex &&
-                           !IsInitialBlockDownload()) {
-                    pfrom->AskFor(inv);
-                }
-            }
+static bool ProcessAddrMessage(const Config &config, CNode *pfrom,
+                               const std::string &strCommand,
+                               CDataStream &vRecv, int64_t nTimeReceived,
+                               const CChainParams &chainparams,
+                               CConnman &connman,
+                               const std::atomic<bool> &interruptMsgProc) {
+    std::vector<CAddress> vAddr;
+    vRecv >> vAddr;
+
+    // Don't want addr from older versions unless seeding
+    if (pfrom->nVersion < CADDR_TIME_VERSION &&
+        connman.GetAddressCount() > 1000) {
+        return true;
+    }
+    if (vAddr.size() > 1000) {
+        LOCK(cs_main);
+        Misbehaving(pfrom, 20, "oversized-addr");
+        return error("message addr size() = %u", vAddr.size());
+    }
 
-            // Track requests for our stuff
-            GetMainSignals().Inventory(inv.hash);
+    // Store the new addresses
+    std::vector<CAddress> vAddrOk;
+    int64_t nNow = GetAdjustedTime();
+    int64_t nSince = nNow - 10 * 60;
+    for (CAddress &addr : vAddr) {
+        if (interruptMsgProc) {
+            return true;
         }
 
-        if (!vToFetch.empty()) {
-            connman.PushMessage(pfrom,
-                                msgMaker.Make(NetMsgType::GETDATA, vToFetch));
+        if ((addr.nServices & REQUIRED_SERVICES) != REQUIRED_SERVICES) {
+            continue;
         }
-    }
 
-    else if (strCommand == NetMsgType::GETDATA) {
-        std::vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ) {
-            LOCK(cs_main);
-            Misbehaving(pfrom, 20, "too-many-inv");
-            return error("message getdata size() = %u", vInv.size());
+        if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60) {
+            addr.nTime = nNow - 5 * 24 * 60 * 60;
         }
-
-        if (fDebug || (vInv.size() != 1)) {
-            LogPrint("net", "received getdata (%u invsz) peer=%d\n",
-                     vInv.size(), pfrom->id);
+        pfrom->AddAddressKnown(addr);
+        bool fReachable = IsReachable(addr);
+        if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 &&
+            addr.IsRoutable()) {
+            // Relay to a limited number of other nodes
+            RelayAddress(addr, fReachable, connman);
         }
-
-        if ((fDebug && vInv.size() > 0) || (vInv.size() == 1)) {
-            LogPrint("net", "received getdata for: %s peer=%d\n",
-                     vInv[0].ToString(), pfrom->id);
+        // Do not store addresses outside our network
+        if (fReachable) {
+            vAddrOk.push_back(addr);
         }
-
-        pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(),
-                                   vInv.end());
-        ProcessGetData(config, pfrom, chainparams.GetConsensus(), connman,
-                       interruptMsgProc);
     }
-
-    else if (strCommand == NetMsgType::GETBLOCKS) {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
-
-        // We might have announced the currently-being-connected tip using a
-        // compact block, which resulted in the peer sending a getblocks
-        // request, which we would otherwise respond to without the new block.
-        // To avoid this situation we simply verify that we are on our best
-        // known chain now. This is super overkill, but we handle it better
-        // for getheaders requests, and there are no known nodes which support
-        // compact blocks but still use getblocks to request blocks.
-        {
-            std::shared_ptr<const CBlock> a_recent_block;
-            {
-                LOCK(cs_most_recent_block);
-                a_recent_block = most_recent_block;
-            }
-            CValidationState dummy;
-            ActivateBestChain(config, dummy, a_recent_block);
+    connman.AddNewAddresses(vAddrOk, pfrom->addr, 2 * 60 * 60);
+    if (vAddr.size() < 1000) {
+        pfrom->fGetAddr = false;
+    }
+    if (pfrom->fOneShot) {
+        pfrom->fDisconnect = true;
+    }
+    return true;
+}
+
+static bool ProcessSendHeadersMessage(
+    const Config &config, CNode *pfrom, const std::string &strCommand,
+    CDataStream &vRecv, int64_t nTimeReceived, const CChainParams &chainparams,
+    CConnman &connman, const std::atomic<bool> &interruptMsgProc) {
+    LOCK(cs_main);
+    State(pfrom->GetId())->fPreferHeaders = true;
+    return true;
+}
+
+static bool ProcessSendCmpctMessage(const Config &config, CNode *pfrom,
+                                    const std::string &strCommand,
+                                    CDataStream &vRecv, int64_t nTimeReceived,
+                                    const CChainParams &chainparams,
+                                    CConnman &connman,
+                                    const std::atomic<bool> &interruptMsgProc) {
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 0;
+    vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+    if (nCMPCTBLOCKVersion == 1) {
+        LOCK(cs_main);
+        // fProvidesHeaderAndIDs is used to "lock in" version of compact
+        // blocks we send.
+        if (!State(pfrom->GetId())->fProvidesHeaderAndIDs) {
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
         }
 
+        State(pfrom->GetId())->fPreferHeaderAndIDs =
+            fAnnounceUsingCMPCTBLOCK;
+        if (!State(pfrom->GetId())->fSupportsDesiredCmpctVersion) {
+            State(pfrom->GetId())->fSupportsDesiredCmpctVersion = true;
+        }
+    }
+    return true;
+}
+
+static bool ProcessInvMessage(const Config &config, CNode *pfrom,
+                              const std::string &strCommand, CDataStream &vRecv,
+                              int64_t nTimeReceived,
+                              const CChainParams &chainparams,
+                              CConnman &connman,
+                              const std::atomic<bool> &interruptMsgProc) {
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+
+    std::vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ) {
         LOCK(cs_main);
+        Misbehaving(pfrom, 20, "oversized-inv");
+        return error("message inv size() = %u", vInv.size());
+    }
 
-        // Find the last block the caller has in the main chain
-        const CBlockIndex *pindex = FindForkInGlobalIndex(chainActive, locator);
+    bool fBlocksOnly = !fRelayTxes;
 
-        // Send the rest of the chain
-        if (pindex) {
-            pindex = chainActive.Next(pindex);
+    // Allow whitelisted peers to send data other than blocks in blocks only
+    // mode if whitelistrelay is true
+    if (pfrom->fWhitelisted &&
+        GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY)) {
+        fBlocksOnly = false;
+    }
+
+    LOCK(cs_main);
+
+    uint32_t nFetchFlags =
+        GetFetchFlags(pfrom, chainActive.Tip(), chainparams.GetConsensus());
+
+    std::vector<CInv> vToFetch;
+
+    for (size_t nInv = 0; nInv < vInv.size(); nInv++) {
+        CInv &inv = vInv[nInv];
+
+        if (interruptMsgProc) {
+            return true;
         }
-        int nLimit = 500;
-        LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n",
-                 (pindex ? pindex->nHeight : -1),
-                 hashStop.IsNull() ? "end" : hashStop.ToString(), nLimit,
-                 pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex)) {
-            if (pindex->GetBlockHash() == hashStop) {
-                LogPrint("net", "  getblocks stopping at %d %s\n",
-                         pindex->nHeight, pindex->GetBlockHash().ToString());
-                break;
-            }
-            // If pruning, don't inv blocks unless we have on disk and are
-            // likely to still have for some reasonable time window (1 hour)
-            // that block relay might require.
-            const int nPrunedBlocksLikelyToHave =
-                MIN_BLOCKS_TO_KEEP -
-                3600 / chainparams.GetConsensus().nPowTargetSpacing;
-            if (fPruneMode &&
-                (!(pindex->nStatus & BLOCK_HAVE_DATA) ||
-                 pindex->nHeight <=
-                     chainActive.Tip()->nHeight - nPrunedBlocksLikelyToHave)) {
-                LogPrint(
-                    "net",
-                    " getblocks stopping, pruned or too old block at %d %s\n",
-                    pindex->nHeight, pindex->GetBlockHash().ToString());
-                break;
+
+        bool fAlreadyHave = AlreadyHave(inv);
+        LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(),
+                 fAlreadyHave ? "have" : "new", pfrom->id);
+
+        if (inv.type == MSG_TX) {
+            inv.type |= nFetchFlags;
+        }
+
+        if (inv.type == MSG_BLOCK) {
+            UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+            if (!fAlreadyHave && !fImporting && !fReindex &&
+                !mapBlocksInFlight.count(inv.hash)) {
+                // We used to request the full block here, but since
+                // headers-announcements are now the primary method of
+                // announcement on the network, and since, in the case that
+                // a node fell back to inv we probably have a reorg which we
+                // should get the headers for first, we now only provide a
+                // getheaders response here. When we receive the headers, we
+                // will then ask for the blocks we need.
+                connman.PushMessage(
+                    pfrom,
+                    msgMaker.Make(NetMsgType::GETHEADERS,
+                                  chainActive.GetLocator(pindexBestHeader),
+                                  inv.hash));
+                LogPrint("net", "getheaders (%d) %s to peer=%d\n",
+                         pindexBestHeader->nHeight, inv.hash.ToString(),
+                         pfrom->id);
             }
-            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-            if (--nLimit <= 0) {
-                // When this block is requested, we'll send an inv that'll
-                // trigger the peer to getblocks the next batch of inventory.
-                LogPrint("net", "  getblocks stopping at limit %d %s\n",
-                         pindex->nHeight, pindex->GetBlockHash().ToString());
-                pfrom->hashContinue = pindex->GetBlockHash();
-                break;
+        } else {
+            pfrom->AddInventoryKnown(inv);
+            if (fBlocksOnly) {
+                LogPrint("net", "transaction (%s) inv sent in violation of "
+                                "protocol peer=%d\n",
+                         inv.hash.ToString(), pfrom->id);
+            } else if (!fAlreadyHave && !fImporting && !fReindex &&
+                       !IsInitialBlockDownload()) {
+                pfrom->AskFor(inv);
             }
         }
+
+        // Track requests for our stuff
+        GetMainSignals().Inventory(inv.hash);
+    }
+
+    if (!vToFetch.empty()) {
+        connman.PushMessage(pfrom,
+                            msgMaker.Make(NetMsgType::GETDATA, vToFetch));
+    }
+    return true;
+}
+
+static bool ProcessGetDataMessage(const Config &config, CNode *pfrom,
+                                  const std::string &strCommand,
+                                  CDataStream &vRecv, int64_t nTimeReceived,
+                                  const CChainParams &chainparams,
+                                  CConnman &connman,
+                                  const std::atomic<bool> &interruptMsgProc) {
+    std::vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ) {
+        LOCK(cs_main);
+        Misbehaving(pfrom, 20, "too-many-inv");
+        return error("message getdata size() = %u", vInv.size());
     }
 
-    else if (strCommand == NetMsgType::GETBLOCKTXN) {
-        BlockTransactionsRequest req;
-        vRecv >> req;
+    if (fDebug || (vInv.size() != 1)) {
+        LogPrint("net", "received getdata (%u invsz) peer=%d\n",
+                 vInv.size(), pfrom->id);
+    }
 
-        std::shared_ptr<const CBlock> recent_block;
+    if ((fDebug && vInv.size() > 0) || (vInv.size() == 1)) {
+        LogPrint("net", "received getdata for: %s peer=%d\n",
+                 vInv[0].ToString(), pfrom->id);
+    }
+
+    pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(),
+                               vInv.end());
+    ProcessGetData(config, pfrom, chainparams.GetConsensus(), connman,
+                   interruptMsgProc);
+    return true;
+}
+
+static bool ProcessGetBlocksMessage(const Config &config, CNode *pfrom,
+                                    const std::string &strCommand,
+                                    CDataStream &vRecv, int64_t nTimeReceived,
+                                    const CChainParams &chainparams,
+                                    CConnman &connman,
+                                    const std::atomic<bool> &interruptMsgProc) {
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
+
+    // We might have announced the currently-being-connected tip using a
+    // compact block, which resulted in the peer sending a getblocks
+    // request, which we would otherwise respond to without the new block.
+    // To avoid this situation we simply verify that we are on our best
+    // known chain now. This is super overkill, but we handle it better
+    // for getheaders requests, and there are no known nodes which support
+    // compact blocks but still use getblocks to request blocks.
+    {
+        std::shared_ptr<const CBlock> a_recent_block;
         {
             LOCK(cs_most_recent_block);
-            if (most_recent_block_hash == req.blockhash) {
-                recent_block = most_recent_block;
-            }
-            // Unlock cs_most_recent_block to avoid cs_main lock inversion
-        }
-        if (recent_block) {
-            SendBlockTransactions(*recent_block, req, pfrom, connman);
-            return true;
+            a_recent_block = most_recent_block;
         }
+        CValidationState dummy;
+        ActivateBestChain(config, dummy, a_recent_block);
+    }
 
-        LOCK(cs_main);
+    LOCK(cs_main);
 
-        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
-        if (it == mapBlockIndex.end() ||
-            !(it->second->nStatus & BLOCK_HAVE_DATA)) {
-            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have",
-                      pfrom->id);
-            return true;
+    // Find the last block the caller has in the main chain
+    const CBlockIndex *pindex = FindForkInGlobalIndex(chainActive, locator);
+
+    // Send the rest of the chain
+    if (pindex) {
+        pindex = chainActive.Next(pindex);
+    }
+    int nLimit = 500;
+    LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n",
+             (pindex ? pindex->nHeight : -1),
+             hashStop.IsNull() ? "end" : hashStop.ToString(), nLimit,
+             pfrom->id);
+    for (; pindex; pindex = chainActive.Next(pindex)) {
+        if (pindex->GetBlockHash() == hashStop) {
+            LogPrint("net", "  getblocks stopping at %d %s\n",
+                     pindex->nHeight, pindex->GetBlockHash().ToString());
+            break;
         }
+        // If pruning, don't inv blocks unless we have on disk and are
+        // likely to still have for some reasonable time window (1 hour)
+        // that block relay might require.
+        const int nPrunedBlocksLikelyToHave =
+            MIN_BLOCKS_TO_KEEP -
+            3600 / chainparams.GetConsensus().nPowTargetSpacing;
+        if (fPruneMode &&
+            (!(pindex->nStatus & BLOCK_HAVE_DATA) ||
+             pindex->nHeight <=
+                 chainActive.Tip()->nHeight - nPrunedBlocksLikelyToHave)) {
+            LogPrint(
+                "net",
+                " getblocks stopping, pruned or too old block at %d %s\n",
+                pindex->nHeight, pindex->GetBlockHash().ToString());
+            break;
+        }
+        pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        if (--nLimit <= 0) {
+            // When this block is requested, we'll send an inv that'll
+            // trigger the peer to getblocks the next batch of inventory.
+            LogPrint("net", "  getblocks stopping at limit %d %s\n",
+                     pindex->nHeight, pindex->GetBlockHash().ToString());
+            pfrom->hashContinue = pindex->GetBlockHash();
+            break;
+        }
+    }
+    return true;
+}
 
-        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
-            // If an older block is requested (should never happen in practice,
-            // but can happen in tests) send a block response instead of a
-            // blocktxn response. Sending a full block response instead of a
-            // small blocktxn response is preferable in the case where a peer
-            // might maliciously send lots of getblocktxn requests to trigger
-            // expensive disk reads, because it will require the peer to
-            // actually receive all the data read from disk over the network.
-            LogPrint("net",
-                     "Peer %d sent us a getblocktxn for a block > %i deep",
-                     pfrom->id, MAX_BLOCKTXN_DEPTH);
-            CInv inv;
-            inv.type = MSG_BLOCK;
-            inv.hash = req.blockhash;
-            pfrom->vRecvGetData.push_back(inv);
-            ProcessGetData(config, pfrom, chainparams.GetConsensus(), connman,
-                           interruptMsgProc);
-            return true;
+static bool ProcessGetBlockTxnMessage(
+    const Config &config, CNode *pfrom, const std::string &strCommand,
+    CDataStream &vRecv, int64_t nTimeReceived, const CChainParams &chainparams,
+    CConnman &connman, const std::atomic<bool> &interruptMsgProc) {
+    BlockTransactionsRequest req;
+    vRecv >> req;
+
+    std::shared_ptr<const CBlock> recent_block;
+    {
+        LOCK(cs_most_recent_block);
+        if (most_recent_block_hash == req.blockhash) {
+            recent_block = most_recent_block;
         }
+        // Unlock cs_most_recent_block to avoid cs_main lock inversion
+    }
+    if (recent_block) {
+        SendBlockTransactions(*recent_block, req, pfrom, connman);
+        return true;
+    }
 
-        CBlock block;
-        bool ret =
-            ReadBlockFromDisk(block, it->second, chainparams.GetConsensus());
-        assert(ret);
+    LOCK(cs_main);
 
-        SendBlockTransactions(block, req, pfrom, connman);
+    BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+    if (it == mapBlockIndex.end() ||
+        !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+        LogPrintf("Peer %d sent us a getblocktxn for a block we don't have",
+                  pfrom->id);
+        return true;
+    }
+
+    if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+        // If an older block is requested (should never happen in practice,
+        // but can happen in tests) send a block response instead of a
+        // blocktxn response. Sending a full block response instead of a
+        // small blocktxn response is preferable in the case where a peer
+        // might maliciously send lots of getblocktxn requests to trigger
+        // expensive disk reads, because it will require the peer to
+        // actually receive all the data read from disk over the network.
+        LogPrint("net",
+                 "Peer %d sent us a getblocktxn for a block > %i deep",
+                 pfrom->id, MAX_BLOCKTXN_DEPTH);
+        CInv inv;
+        inv.type = MSG_BLOCK;
+        inv.hash = req.blockhash;
+        pfrom->vRecvGetData.push_back(inv);
+        ProcessGetData(config, pfrom, chainparams.GetConsensus(), connman,
+                       interruptMsgProc);
+        return true;
     }
 
-    else if (strCommand == NetMsgType::GETHEADERS) {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+    CBlock block;
+    bool ret =
+        ReadBlockFromDisk(block, it->second, chainparams.GetConsensus());
+    assert(ret);
 
-        LOCK(cs_main);
-        if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
-            LogPrint("net", "Ignoring getheaders from peer=%d because node is "
-                            "in initial block download\n",
-                     pfrom->id);
+    SendBlockTransactions(block, req, pfrom, connman);
+    return true;
+}
+
+static bool ProcessGetHeadersMessage(
+    const Config &config, CNode *pfrom, const std::string &strCommand,
+    CDataStream &vRecv, int64_t nTimeReceived, const CChainParams &chainparams,
+    CConnman &connman, const std::atomic<bool> &interruptMsgProc) {
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
+
+    LOCK(cs_main);
+    if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
+        LogPrint("net", "Ignoring getheaders from peer=%d because node is "
+                        "in initial block download\n",
+                 pfrom->id);
+        return true;
+    }
+
+    CNodeState *nodestate = State(pfrom->GetId());
+    const CBlockIndex *pindex = nullptr;
+    if (locator.IsNull()) {
+        // If locator is null, return the hashStop block
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi == mapBlockIndex.end()) {
             return true;
         }
-
-        CNodeState *nodestate = State(pfrom->GetId());
-        const CBlockIndex *pindex = nullptr;
-        if (locator.IsNull()) {
-            // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end()) {
-                return true;
-            }
-            pindex = (*mi).second;
-        } else {
-            // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
-            if (pindex) {
-                pindex = chainActive.Next(pindex);
-            }
+        pindex = (*mi).second;
+    } else {
+        // Find the last block the caller has in the main chain
+        pindex = FindForkInGlobalIndex(chainActive, locator);
+        if (pindex) {
+            pindex = chainActive.Next(pindex);
         }
+    }
 
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx
-        // count at the end
-        std::vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
-        LogPrint("net", "getheaders %d to %s from peer=%d\n",
-                 (pindex ? pindex->nHeight : -1),
-                 hashStop.IsNull() ? "end" : hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex)) {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop) {
-                break;
-            }
+    // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx
+    // count at the end
+    std::vector<CBlock> vHeaders;
+    int nLimit = MAX_HEADERS_RESULTS;
+    LogPrint("net", "getheaders %d to %s from peer=%d\n",
+             (pindex ? pindex->nHeight : -1),
+             hashStop.IsNull() ? "end" : hashStop.ToString(), pfrom->id);
+    for (; pindex; pindex = chainActive.Next(pindex)) {
+        vHeaders.push_back(pindex->GetBlockHeader());
+        if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop) {
+            break;
         }
-        // pindex can be nullptr either if we sent chainActive.Tip() OR
-        // if our peer has chainActive.Tip() (and thus we are sending an empty
-        // headers message). In both cases it's safe to update
-        // pindexBestHeaderSent to be our tip.
-        //
-        // It is important that we simply reset the BestHeaderSent value here,
-        // and not max(BestHeaderSent, newHeaderSent). We might have announced
-        // the currently-being-connected tip using a compact block, which
-        // resulted in the peer sending a headers request, which we respond to
-        // without the new block. By resetting the BestHeaderSent, we ensure we
-        // will re-announce the new block via headers (or compact blocks again)
-        // in the SendMessages logic.
-        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
-        connman.PushMessage(pfrom,
-                            msgMaker.Make(NetMsgType::HEADERS, vHeaders));
     }
+    // pindex can be nullptr either if we sent chainActive.Tip() OR
+    // if our peer has chainActive.Tip() (and thus we are sending an empty
+    // headers message). In both cases it's safe to update
+    // pindexBestHeaderSent to be our tip.
+    //
+    // It is important that we simply reset the BestHeaderSent value here,
+    // and not max(BestHeaderSent, newHeaderSent). We might have announced
+    // the currently-being-connected tip using a compact block, which
+    // resulted in the peer sending a headers request, which we respond to
+    // without the new block. By resetting the BestHeaderSent, we ensure we
+    // will re-announce the new block via headers (or compact blocks again)
+    // in the SendMessages logic.
+    nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
+    connman.PushMessage(pfrom,
+                        msgMaker.Make(NetMsgType::HEADERS, vHeaders));
+    return true;
+}
 
-    else if (strCommand == NetMsgType::TX) {
-        // Stop processing the transaction early if
-        // We are in blocks only mode and peer is either not whitelisted or
-        // whitelistrelay is off
-        if (!fRelayTxes &&
-            (!pfrom->fWhitelisted ||
-             !GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))) {
-            LogPrint("net",
-                     "transaction sent in violation of protocol peer=%d\n",
-                     pfrom->id);
-            return true;
-        }
+static bool ProcessTxMessage(const Config &config, CNode *pfrom,
+                             const std::string &strCommand, CDataStream &vRecv,
+                             int64_t nTimeReceived,
+                             const CChainParams &chainparams, CConnman &connman,
+                             const std::atomic<bool> &interruptMsgProc) {
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
-        std::deque<COutPoint> vWorkQueue;
-        std::vector<uint256> vEraseQueue;
-        CTransactionRef ptx;
-        vRecv >> ptx;
-        const CTransaction &tx = *ptx;
+    // Stop processing the transaction early if
+    // We are in blocks only mode and peer is either not whitelisted or
+    // whitelistrelay is off
+    if (!fRelayTxes &&
+        (!pfrom->fWhitelisted ||
+         !GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))) {
+        LogPrint("net",
+                 "transaction sent in violation of protocol peer=%d\n",
+                 pfrom->id);
+        return true;
+    }
 
-        CInv inv(MSG_TX, tx.GetId());
-        pfrom->AddInventoryKnown(inv);
+    std::deque<COutPoint> vWorkQueue;
+    std::vector<uint256> vEraseQueue;
+    CTransactionRef ptx;
+    vRecv >> ptx;
+    const CTransaction &tx = *ptx;
 
-        LOCK(cs_main);
+    CInv inv(MSG_TX, tx.GetId());
+    pfrom->AddInventoryKnown(inv);
 
-        bool fMissingInputs = false;
-        CValidationState state;
+    LOCK(cs_main);
 
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv.hash);
+    bool fMissingInputs = false;
+    CValidationState state;
 
-        std::list<CTransactionRef> lRemovedTxn;
+    pfrom->setAskFor.erase(inv.hash);
+    mapAlreadyAskedFor.erase(inv.hash);
 
-        if (!AlreadyHave(inv) &&
-            AcceptToMemoryPool(config, mempool, state, ptx, true,
-                               &fMissingInputs, &lRemovedTxn)) {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx, connman);
-            for (size_t i = 0; i < tx.vout.size(); i++) {
-                vWorkQueue.emplace_back(inv.hash, i);
-            }
+    std::list<CTransactionRef> lRemovedTxn;
+
+    if (!AlreadyHave(inv) &&
+        AcceptToMemoryPool(config, mempool, state, ptx, true,
+                           &fMissingInputs, &lRemovedTxn)) {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx, connman);
+        for (size_t i = 0; i < tx.vout.size(); i++) {
+            vWorkQueue.emplace_back(inv.hash, i);
+        }
+
+        pfrom->nLastTXTime = GetTime();
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d: accepted %s "
+                            "(poolsz %u txn, %u kB)\n",
+                 pfrom->id, tx.GetId().ToString(), mempool.size(),
+                 mempool.DynamicMemoryUsage() / 1000);
 
-            pfrom->nLastTXTime = GetTime();
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d: accepted %s "
-                                "(poolsz %u txn, %u kB)\n",
-                     pfrom->id, tx.GetId().ToString(), mempool.size(),
-                     mempool.DynamicMemoryUsage() / 1000);
-
-            // Recursively process any orphan transactions that depended on this
-            // one
-            std::set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev =
-                    mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end()) {
+        // Recursively process any orphan transactions that depended on this
+        // one
+        std::set<NodeId> setMisbehaving;
+        while (!vWorkQueue.empty()) {
+            auto itByPrev =
+                mapOrphanTransactionsByPrev.find(vWorkQueue.front());
+            vWorkQueue.pop_front();
+            if (itByPrev == mapOrphanTransactionsByPrev.end()) {
+                continue;
+            }
+            for (auto mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end(); ++mi) {
+                const CTransactionRef &porphanTx = (*mi)->second.tx;
+                const CTransaction &orphanTx = *porphanTx;
+                const uint256 &orphanId = orphanTx.GetId();
+                NodeId fromPeer = (*mi)->second.fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes
+                // to counter-DoS based on orphan resolution (that is,
+                // feeding people an invalid transaction based on LegitTxX
+                // in order to get anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+                if (setMisbehaving.count(fromPeer)) {
                     continue;
                 }
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end(); ++mi) {
-                    const CTransactionRef &porphanTx = (*mi)->second.tx;
-                    const CTransaction &orphanTx = *porphanTx;
-                    const uint256 &orphanId = orphanTx.GetId();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes
-                    // to counter-DoS based on orphan resolution (that is,
-                    // feeding people an invalid transaction based on LegitTxX
-                    // in order to get anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    if (setMisbehaving.count(fromPeer)) {
-                        continue;
+                if (AcceptToMemoryPool(config, mempool, stateDummy,
+                                       porphanTx, true, &fMissingInputs2,
+                                       &lRemovedTxn)) {
+                    LogPrint("mempool", "   accepted orphan tx %s\n",
+                             orphanId.ToString());
+                    RelayTransaction(orphanTx, connman);
+                    for (size_t i = 0; i < orphanTx.vout.size(); i++) {
+                        vWorkQueue.emplace_back(orphanId, i);
                     }
-                    if (AcceptToMemoryPool(config, mempool, stateDummy,
-                                           porphanTx, true, &fMissingInputs2,
-                                           &lRemovedTxn)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n",
+                    vEraseQueue.push_back(orphanId);
+                } else if (!fMissingInputs2) {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0) {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos, "invalid-orphan-tx");
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n",
                                  orphanId.ToString());
-                        RelayTransaction(orphanTx, connman);
-                        for (size_t i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanId, i);
-                        }
-                        vEraseQueue.push_back(orphanId);
-                    } else if (!fMissingInputs2) {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos, "invalid-orphan-tx");
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n",
-                                     orphanId.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n",
-                                 orphanId.ToString());
-                        vEraseQueue.push_back(orphanId);
-                        if (!stateDummy.CorruptionPossible()) {
-                            // Do not use rejection cache for witness
-                            // transactions or witness-stripped transactions, as
-                            // they can have been malleated. See
-                            // https://github.com/bitcoin/bitcoin/issues/8279
-                            // for details.
-                            assert(recentRejects);
-                            recentRejects->insert(orphanId);
-                        }
                     }
-                    mempool.check(pcoinsTip);
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n",
+                             orphanId.ToString());
+                    vEraseQueue.push_back(orphanId);
+                    if (!stateDummy.CorruptionPossible()) {
+                        // Do not use rejection cache for witness
+                        // transactions or witness-stripped transactions, as
+                        // they can have been malleated. See
+                        // https://github.com/bitcoin/bitcoin/issues/8279
+                        // for details.
+                        assert(recentRejects);
+                        recentRejects->insert(orphanId);
+                    }
                 }
+                mempool.check(pcoinsTip);
             }
+        }
 
-            for (uint256 hash : vEraseQueue) {
-                EraseOrphanTx(hash);
+        for (uint256 hash : vEraseQueue) {
+            EraseOrphanTx(hash);
+        }
+    } else if (fMissingInputs) {
+        // It may be the case that the orphans parents have all been
+        // rejected.
+        bool fRejectedParents = false;
+        for (const CTxIn &txin : tx.vin) {
+            if (recentRejects->contains(txin.prevout.hash)) {
+                fRejectedParents = true;
+                break;
             }
-        } else if (fMissingInputs) {
-            // It may be the case that the orphans parents have all been
-            // rejected.
-            bool fRejectedParents = false;
+        }
+        if (!fRejectedParents) {
+            uint32_t nFetchFlags = GetFetchFlags(
+                pfrom, chainActive.Tip(), chainparams.GetConsensus());
             for (const CTxIn &txin : tx.vin) {
-                if (recentRejects->contains(txin.prevout.hash)) {
-                    fRejectedParents = true;
-                    break;
+                CInv _inv(MSG_TX | nFetchFlags, txin.prevout.hash);
+                pfrom->AddInventoryKnown(_inv);
+                if (!AlreadyHave(_inv)) {
+                    pfrom->AskFor(_inv);
                 }
             }
-            if (!fRejectedParents) {
-                uint32_t nFetchFlags = GetFetchFlags(
-                    pfrom, chainActive.Tip(), chainparams.GetConsensus());
-                for (const CTxIn &txin : tx.vin) {
-                    CInv _inv(MSG_TX | nFetchFlags, txin.prevout.hash);
-                    pfrom->AddInventoryKnown(_inv);
-                    if (!AlreadyHave(_inv)) {
-                        pfrom->AskFor(_inv);
-                    }
-                }
-                AddOrphanTx(ptx, pfrom->GetId());
-
-                // DoS prevention: do not allow mapOrphanTransactions to grow
-                // unbounded
-                unsigned int nMaxOrphanTx = (unsigned int)std::max(
-                    int64_t(0),
-                    GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-                if (nEvicted > 0) {
-                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n",
-                             nEvicted);
-                }
-            } else {
-                LogPrint("mempool",
-                         "not keeping orphan with rejected parents %s\n",
-                         tx.GetId().ToString());
-                // We will continue to reject this tx since it has rejected
-                // parents so avoid re-requesting it from other peers.
-                recentRejects->insert(tx.GetId());
+            AddOrphanTx(ptx, pfrom->GetId());
+
+            // DoS prevention: do not allow mapOrphanTransactions to grow
+            // unbounded
+            unsigned int nMaxOrphanTx = (unsigned int)std::max(
+                int64_t(0),
+                GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            if (nEvicted > 0) {
+                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n",
+                         nEvicted);
             }
         } else {
-            if (!state.CorruptionPossible()) {
-                // Do not use rejection cache for witness transactions or
-                // witness-stripped transactions, as they can have been
-                // malleated. See https://github.com/bitcoin/bitcoin/issues/8279
-                // for details.
-                assert(recentRejects);
-                recentRejects->insert(tx.GetId());
-                if (RecursiveDynamicUsage(*ptx) < 100000) {
-                    AddToCompactExtraTransactions(ptx);
-                }
+            LogPrint("mempool",
+                     "not keeping orphan with rejected parents %s\n",
+                     tx.GetId().ToString());
+            // We will continue to reject this tx since it has rejected
+            // parents so avoid re-requesting it from other peers.
+            recentRejects->insert(tx.GetId());
+        }
+    } else {
+        if (!state.CorruptionPossible()) {
+            // Do not use rejection cache for witness transactions or
+            // witness-stripped transactions, as they can have been
+            // malleated. See https://github.com/bitcoin/bitcoin/issues/8279
+            // for details.
+            assert(recentRejects);
+            recentRejects->insert(tx.GetId());
+            if (RecursiveDynamicUsage(*ptx) < 100000) {
+                AddToCompactExtraTransactions(ptx);
             }
+        }
 
-            if (pfrom->fWhitelisted &&
-                GetBoolArg("-whitelistforcerelay",
-                           DEFAULT_WHITELISTFORCERELAY)) {
-                // Always relay transactions received from whitelisted peers,
-                // even if they were already in the mempool or rejected from it
-                // due to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n",
-                              tx.GetId().ToString(), pfrom->id);
-                    RelayTransaction(tx, connman);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from "
-                              "whitelisted peer=%d (%s)\n",
-                              tx.GetId().ToString(), pfrom->id,
-                              FormatStateMessage(state));
-                }
+        if (pfrom->fWhitelisted &&
+            GetBoolArg("-whitelistforcerelay",
+                       DEFAULT_WHITELISTFORCERELAY)) {
+            // Always relay transactions received from whitelisted peers,
+            // even if they were already in the mempool or rejected from it
+            // due to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n",
+                          tx.GetId().ToString(), pfrom->id);
+                RelayTransaction(tx, connman);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from "
+                          "whitelisted peer=%d (%s)\n",
+                          tx.GetId().ToString(), pfrom->id,
+                          FormatStateMessage(state));
             }
         }
+    }
 
-        for (const CTransactionRef &removedTx : lRemovedTxn) {
-            AddToCompactExtraTransactions(removedTx);
-        }
+    for (const CTransactionRef &removedTx : lRemovedTxn) {
+        AddToCompactExtraTransactions(removedTx);
+    }
 
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS)) {
-            LogPrint("mempoolrej", "%s from peer=%d was not accepted: %s\n",
-                     tx.GetId().ToString(), pfrom->id,
-                     FormatStateMessage(state));
-            // Never send AcceptToMemoryPool's internal codes over P2P.
-            if (state.GetRejectCode() < REJECT_INTERNAL) {
-                connman.PushMessage(
-                    pfrom, msgMaker.Make(NetMsgType::REJECT, strCommand,
-                                         uint8_t(state.GetRejectCode()),
-                                         state.GetRejectReason().substr(
-                                             0, MAX_REJECT_MESSAGE_LENGTH),
-                                         inv.hash));
-            }
-            if (nDoS > 0) {
-                Misbehaving(pfrom, nDoS, state.GetRejectReason());
-            }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS)) {
+        LogPrint("mempoolrej", "%s from peer=%d was not accepted: %s\n",
+                 tx.GetId().ToString(), pfrom->id,
+                 FormatStateMessage(state));
+        // Never send AcceptToMemoryPool's internal codes over P2P.
+        if (state.GetRejectCode() < REJECT_INTERNAL) {
+            connman.PushMessage(
+                pfrom, msgMaker.Make(NetMsgType::REJECT, strCommand,
+                                     uint8_t(state.GetRejectCode()),
+                                     state.GetRejectReason().substr(
+                                         0, MAX_REJECT_MESSAGE_LENGTH),
+                                     inv.hash));
+        }
+        if (nDoS > 0) {
+            Misbehaving(pfrom, nDoS, state.GetRejectReason());
         }
     }
+    return true;
+}
 
+static bool ProcessBlockTxnMessage(const Config &config, CNode *pfrom,
+                                   const std::string &strCommand,
+                                   CDataStream &vRecv, int64_t nTimeReceived,
+                                   const CChainParams &chainparams,
+                                   CConnman &connman,
+                                   const std::atomic<bool> &interruptMsgProc) {
     // Ignore blocks received while importing
-    else if (strCommand == NetMsgType::CMPCTBLOCK && !fImporting && !fReindex) {
-        CBlockHeaderAndShortTxIDs cmpctblock;
-        vRecv >> cmpctblock;
+    if (fImporting || fReindex) {
+        return true;
+    }
 
-        {
-            LOCK(cs_main);
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
-            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) ==
-                mapBlockIndex.end()) {
-                // Doesn't connect (or is genesis), instead of DoSing in
-                // AcceptBlockHeader, request deeper headers
-                if (!IsInitialBlockDownload()) {
-                    connman.PushMessage(
-                        pfrom,
-                        msgMaker.Make(NetMsgType::GETHEADERS,
-                                      chainActive.GetLocator(pindexBestHeader),
-                                      uint256()));
-                }
-                return true;
-            }
+    BlockTransactions resp;
+    size_t nBlockTxnBytes = vRecv.size();
+    vRecv >> resp;
+
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    bool fBlockRead = false;
+    {
+        LOCK(cs_main);
+
+        std::map<uint256,
+                 std::pair<NodeId,
+                           std::list<QueuedBlock>::iterator>>::iterator it =
+            mapBlocksInFlight.find(resp.blockhash);
+        if (it == mapBlocksInFlight.end() ||
+            !it->second.second->partialBlock ||
+            it->second.first != pfrom->GetId()) {
+            LogPrint("net", "Peer %d sent us block transactions for block "
+                            "we weren't expecting\n",
+                     pfrom->id);
+            return true;
         }
 
-        const CBlockIndex *pindex = nullptr;
-        CValidationState state;
-        if (!ProcessNewBlockHeaders(config, {cmpctblock.header}, state,
-                                    &pindex)) {
-            int nDoS;
-            if (state.IsInvalid(nDoS)) {
-                if (nDoS > 0) {
-                    LOCK(cs_main);
-                    Misbehaving(pfrom, nDoS, state.GetRejectReason());
-                }
-                LogPrintf("Peer %d sent us invalid header via cmpctblock\n",
-                          pfrom->id);
-                return true;
-            }
+        PartiallyDownloadedBlock &partialBlock =
+            *it->second.second->partialBlock;
+        ReadStatus status = partialBlock.FillBlock(*pblock, resp.txn);
+        if (status == READ_STATUS_INVALID) {
+            // Reset in-flight state in case of whitelist.
+            MarkBlockAsReceived(resp.blockhash);
+            Misbehaving(pfrom, 100, "invalid-cmpctblk-txns");
+            LogPrintf("Peer %d sent us invalid compact block/non-matching "
+                      "block transactions\n",
+                      pfrom->id);
+            return true;
+        } else if (status == READ_STATUS_FAILED) {
+            // Might have collided, fall back to getdata now :(
+            std::vector<CInv> invs;
+            invs.push_back(
+                CInv(MSG_BLOCK | GetFetchFlags(pfrom, chainActive.Tip(),
+                                               chainparams.GetConsensus()),
+                     resp.blockhash));
+            connman.PushMessage(pfrom,
+                                msgMaker.Make(NetMsgType::GETDATA, invs));
+        } else {
+            // Block is either okay, or possibly we received
+            // READ_STATUS_CHECKBLOCK_FAILED.
+            // Note that CheckBlock can only fail for one of a few reasons:
+            // 1. bad-proof-of-work (impossible here, because we've already
+            //    accepted the header)
+            // 2. merkleroot doesn't match the transactions given (already
+            //    caught in FillBlock with READ_STATUS_FAILED, so
+            //    impossible here)
+            // 3. the block is otherwise invalid (eg invalid coinbase,
+            //    block is too big, too many legacy sigops, etc).
+            // So if CheckBlock failed, #3 is the only possibility.
+            // Under BIP 152, we don't DoS-ban unless proof of work is
+            // invalid (we don't require all the stateless checks to have
+            // been run). This is handled below, so just treat this as
+            // though the block was successfully read, and rely on the
+            // handling in ProcessNewBlock to ensure the block index is
+            // updated, reject messages go out, etc.
+
+            // The compact block and its missing transactions are what
+            // this peer sent us for the block.
+            UpdateBlockDownloadSpeed(pfrom->GetId(), resp.blockhash,
+                                     it->second.second->nCompactBytes +
+                                         nBlockTxnBytes);
+            // it is now an empty pointer
+            MarkBlockAsReceived(resp.blockhash);
+            fBlockRead = true;
+            // mapBlockSource is only used for sending reject messages and
+            // DoS scores, so the race between here and cs_main in
+            // ProcessNewBlock is fine. BIP 152 permits peers to relay
+            // compact blocks after validating the header only; we should
+            // not punish peers if the block turns out to be invalid.
+            mapBlockSource.emplace(resp.blockhash,
+                                   std::make_pair(pfrom->GetId(), false));
+        }
+    } // Don't hold cs_main when we call into ProcessNewBlock
+    if (fBlockRead) {
+        bool fNewBlock = false;
+        // Since we requested this block (it was in mapBlocksInFlight),
+        // force it to be processed, even if it would not be a candidate for
+        // new tip (missing previous block, chain not long enough, etc)
+        ProcessNewBlock(config, pblock, true, &fNewBlock);
+        if (fNewBlock) {
+            pfrom->nLastBlockTime = GetTime();
         }
+    }
+    return true;
+}
 
-        // When we succeed in decoding a block's txids from a cmpctblock
-        // message we typically jump to the BLOCKTXN handling code, with a
-        // dummy (empty) BLOCKTXN message, to re-use the logic there in
-        // completing processing of the putative block (without cs_main).
-        bool fProcessBLOCKTXN = false;
-        CDataStream blockTxnMsg(SER_NETWORK, PROTOCOL_VERSION);
+static bool ProcessHeadersMessage(const Config &config, CNode *pfrom,
+                                  const std::string &strCommand,
+                                  CDataStream &vRecv, int64_t nTimeReceived,
+                                  const CChainParams &chainparams,
+                                  CConnman &connman,
+                                  const std::atomic<bool> &interruptMsgProc) {
+    // Ignore headers received while importing
+    if (fImporting || fReindex) {
+        return true;
+    }
 
-        // If we end up treating this as a plain headers message, call that as
-        // well
-        // without cs_main.
-        bool fRevertToHeaderProcessing = false;
-        CDataStream vHeadersMsg(SER_NETWORK, PROTOCOL_VERSION);
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
-        // Keep a CBlock for "optimistic" compactblock reconstructions (see
-        // below)
-        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-        bool fBlockReconstructed = false;
+    std::vector<CBlockHeader> headers;
 
-        {
-            LOCK(cs_main);
-            // If AcceptBlockHeader returned true, it set pindex
-            assert(pindex);
-            UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
-
-            std::map<uint256,
-                     std::pair<NodeId, std::list<QueuedBlock>::iterator>>::
-                iterator blockInFlightIt =
-                    mapBlocksInFlight.find(pindex->GetBlockHash());
-            bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
-
-            if (pindex->nStatus & BLOCK_HAVE_DATA) {
-                // Nothing to do here
-                return true;
-            }
+    // Bypass the normal CBlock deserialization, as we don't want to risk
+    // deserializing 2000 full blocks.
+    unsigned int nCount = ReadCompactSize(vRecv);
+    if (nCount > MAX_HEADERS_RESULTS) {
+        LOCK(cs_main);
+        Misbehaving(pfrom, 20, "too-many-headers");
+        return error("headers message size = %u", nCount);
+    }
+    headers.resize(nCount);
+    for (unsigned int n = 0; n < nCount; n++) {
+        vRecv >> headers[n];
+        // Ignore tx count; assume it is 0.
+        ReadCompactSize(vRecv);
+    }
 
-            if (pindex->nChainWork <=
-                    chainActive.Tip()->nChainWork || // We know something better
-                pindex->nTx != 0) {
-                // We had this block at some point, but pruned it
-                if (fAlreadyInFlight) {
-                    // We requested this block for some reason, but our mempool
-                    // will probably be useless so we just grab the block via
-                    // normal getdata.
-                    std::vector<CInv> vInv(1);
-                    vInv[0] = CInv(
-                        MSG_BLOCK | GetFetchFlags(pfrom, pindex->pprev,
-                                                  chainparams.GetConsensus()),
-                        cmpctblock.header.GetHash());
-                    connman.PushMessage(
-                        pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
-                }
-                return true;
-            }
+    if (nCount == 0) {
+        // Nothing interesting. Stop asking this peers for more headers.
+        return true;
+    }
 
-            // If we're not close to tip yet, give up and let parallel block
-            // fetch work its magic.
-            if (!fAlreadyInFlight &&
-                !CanDirectFetch(chainparams.GetConsensus())) {
-                return true;
+    const CBlockIndex *pindexLast = nullptr;
+    {
+        LOCK(cs_main);
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // If this looks like it could be a block announcement (nCount <
+        // MAX_BLOCKS_TO_ANNOUNCE), use special logic for handling headers
+        // that
+        // don't connect:
+        // - Send a getheaders message in response to try to connect the
+        // chain.
+        // - The peer can send up to MAX_UNCONNECTING_HEADERS in a row that
+        //   don't connect before giving DoS points
+        // - Once a headers message is received that is valid and does
+        // connect,
+        //   nUnconnectingHeaders gets reset back to 0.
+        if (mapBlockIndex.find(headers[0].hashPrevBlock) ==
+                mapBlockIndex.end() &&
+            nCount < MAX_BLOCKS_TO_ANNOUNCE) {
+            nodestate->nUnconnectingHeaders++;
+            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS,
+                                                     chainActive.GetLocator(
+                                                         pindexBestHeader),
+                                                     uint256()));
+            LogPrint("net", "received header %s: missing prev block %s, "
+                            "sending getheaders (%d) to end (peer=%d, "
+                            "nUnconnectingHeaders=%d)\n",
+                     headers[0].GetHash().ToString(),
+                     headers[0].hashPrevBlock.ToString(),
+                     pindexBestHeader->nHeight, pfrom->id,
+                     nodestate->nUnconnectingHeaders);
+            // Set hashLastUnknownBlock for this peer, so that if we
+            // eventually get the headers - even from a different peer -
+            // we can use this peer to download.
+            UpdateBlockAvailability(pfrom->GetId(),
+                                    headers.back().GetHash());
+
+            if (nodestate->nUnconnectingHeaders %
+                    MAX_UNCONNECTING_HEADERS ==
+                0) {
+                // The peer is sending us many headers we can't connect.
+                Misbehaving(pfrom, 20, "too-many-unconnected-headers");
             }
+            return true;
+        }
 
-            CNodeState *nodestate = State(pfrom->GetId());
-
-            // We want to be a bit conservative just to be extra careful about
-            // DoS possibilities in compact block processing...
-            if (pindex->nHeight <= chainActive.Height() + 2) {
-                if ((!fAlreadyInFlight &&
-                     nodestate->nBlocksInFlight <
-                         MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
-                    (fAlreadyInFlight &&
-                     blockInFlightIt->second.first == pfrom->GetId())) {
-                    std::list<QueuedBlock>::iterator *queuedBlockIt = nullptr;
-                    if (!MarkBlockAsInFlight(config, pfrom->GetId(),
-                                             pindex->GetBlockHash(),
-                                             chainparams.GetConsensus(), pindex,
-                                             &queuedBlockIt)) {
-                        if (!(*queuedBlockIt)->partialBlock) {
-                            (*queuedBlockIt)
-                                ->partialBlock.reset(
-                                    new PartiallyDownloadedBlock(config,
-                                                                 &mempool));
-                        } else {
-                            // The block was already in flight using compact
-                            // blocks from the same peer.
-                            LogPrint("net", "Peer sent us compact block we "
-                                            "were already syncing!\n");
-                            return true;
-                        }
-                    }
+        uint256 hashLastBlock;
+        for (const CBlockHeader &header : headers) {
+            if (!hashLastBlock.IsNull() &&
+                header.hashPrevBlock != hashLastBlock) {
+                Misbehaving(pfrom, 20, "disconnected-header");
+                return error("non-continuous headers sequence");
+            }
+            hashLastBlock = header.GetHash();
+        }
+    }
 
-                    PartiallyDownloadedBlock &partialBlock =
-                        *(*queuedBlockIt)->partialBlock;
-                    ReadStatus status =
-                        partialBlock.InitData(cmpctblock, vExtraTxnForCompact);
-                    if (status == READ_STATUS_INVALID) {
-                        // Reset in-flight state in case of whitelist
-                        MarkBlockAsReceived(pindex->GetBlockHash());
-                        Misbehaving(pfrom, 100, "invalid-cmpctblk");
-                        LogPrintf("Peer %d sent us invalid compact block\n",
-                                  pfrom->id);
-                        return true;
-                    } else if (status == READ_STATUS_FAILED) {
-                        // Duplicate txindexes, the block is now in-flight, so
-                        // just request it.
-                        std::vector<CInv> vInv(1);
-                        vInv[0] =
-                            CInv(MSG_BLOCK |
-                                     GetFetchFlags(pfrom, pindex->pprev,
-                                                   chainparams.GetConsensus()),
-                                 cmpctblock.header.GetHash());
-                        connman.PushMessage(
-                            pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
-                        return true;
-                    }
+    CValidationState state;
+    if (!ProcessNewBlockHeaders(config, headers, state, &pindexLast)) {
+        int nDoS;
+        if (state.IsInvalid(nDoS)) {
+            if (nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(pfrom, nDoS, state.GetRejectReason());
+            }
+            return error("invalid header received");
+        }
+    }
 
-                    BlockTransactionsRequest req;
-                    for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
-                        if (!partialBlock.IsTxAvailable(i)) {
-                            req.indexes.push_back(i);
-                        }
-                    }
-                    if (req.indexes.empty()) {
-                        // Dirty hack to jump to BLOCKTXN code (TODO: move
-                        // message handling into their own functions)
-                        BlockTransactions txn;
-                        txn.blockhash = cmpctblock.header.GetHash();
-                        blockTxnMsg << txn;
-                        fProcessBLOCKTXN = true;
-                    } else {
-                        req.blockhash = pindex->GetBlockHash();
-                        connman.PushMessage(
-                            pfrom, msgMaker.Make(NetMsgType::GETBLOCKTXN, req));
-                    }
-                } else {
-                    // This block is either already in flight from a different
-                    // peer, or this peer has too many blocks outstanding to
-                    // download from. Optimistically try to reconstruct anyway
-                    // since we might be able to without any round trips.
-                    PartiallyDownloadedBlock tempBlock(config, &mempool);
-                    ReadStatus status =
-                        tempBlock.InitData(cmpctblock, vExtraTxnForCompact);
-                    if (status != READ_STATUS_OK) {
-                        // TODO: don't ignore failures
-                        return true;
-                    }
-                    std::vector<CTransactionRef> dummy;
-                    status = tempBlock.FillBlock(*pblock, dummy);
-                    if (status == READ_STATUS_OK) {
-                        fBlockReconstructed = true;
-                    }
+    {
+        LOCK(cs_main);
+        CNodeState *nodestate = State(pfrom->GetId());
+        if (nodestate->nUnconnectingHeaders > 0) {
+            LogPrint("net",
+                     "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n",
+                     pfrom->id, nodestate->nUnconnectingHeaders);
+        }
+        nodestate->nUnconnectingHeaders = 0;
+
+        assert(pindexLast);
+        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+
+        if (nCount == MAX_HEADERS_RESULTS) {
+            // Headers message had its maximum size; the peer may have more
+            // headers.
+            // TODO: optimize: if pindexLast is an ancestor of
+            // chainActive.Tip or pindexBestHeader, continue from there
+            // instead.
+            LogPrint(
+                "net",
+                "more getheaders (%d) to end to peer=%d (startheight:%d)\n",
+                pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
+            connman.PushMessage(
+                pfrom, msgMaker.Make(NetMsgType::GETHEADERS,
+                                     chainActive.GetLocator(pindexLast),
+                                     uint256()));
+        }
+
+        bool fCanDirectFetch = CanDirectFetch(chainparams.GetConsensus());
+        // If this set of headers is valid and ends in a block with at least
+        // as much work as our tip, download as much as possible.
+        if (fCanDirectFetch && pindexLast->IsValid(BLOCK_VALID_TREE) &&
+            chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+            std::vector<const CBlockIndex *> vToFetch;
+            const CBlockIndex *pindexWalk = pindexLast;
+            // Calculate all the blocks we'd need to switch to pindexLast,
+            // up to a limit.
+            while (pindexWalk && !chainActive.Contains(pindexWalk) &&
+                   vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
+                    !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                    // We don't have this block, and it's not yet in flight.
+                    vToFetch.push_back(pindexWalk);
                 }
+                pindexWalk = pindexWalk->pprev;
+            }
+            // If pindexWalk still isn't on our main chain, we're looking at
+            // a very large reorg at a time we think we're close to caught
+            // up to the main chain -- this shouldn't really happen. Bail
+            // out on the direct fetch and rely on parallel download
+            // instead.
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net",
+                         "Large reorg, won't direct fetch to %s (%d)\n",
+                         pindexLast->GetBlockHash().ToString(),
+                         pindexLast->nHeight);
             } else {
-                if (fAlreadyInFlight) {
-                    // We requested this block, but its far into the future, so
-                    // our mempool will probably be useless - request the block
-                    // normally.
-                    std::vector<CInv> vInv(1);
-                    vInv[0] = CInv(
-                        MSG_BLOCK | GetFetchFlags(pfrom, pindex->pprev,
-                                                  chainparams.GetConsensus()),
-                        cmpctblock.header.GetHash());
+                std::vector<CInv> vGetData;
+                // Download as much as possible, from earliest to latest.
+                for (const CBlockIndex *pindex :
+                     boost::adaptors::reverse(vToFetch)) {
+                    if (nodestate->nBlocksInFlight >=
+                        MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        // Can't download any more from this peer
+                        break;
+                    }
+                    uint32_t nFetchFlags = GetFetchFlags(
+                        pfrom, pindex->pprev, chainparams.GetConsensus());
+                    vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags,
+                                            pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(config, pfrom->GetId(),
+                                        pindex->GetBlockHash(),
+                                        chainparams.GetConsensus(), pindex);
+                    LogPrint("net", "Requesting block %s from  peer=%d\n",
+                             pindex->GetBlockHash().ToString(), pfrom->id);
+                }
+                if (vGetData.size() > 1) {
+                    LogPrint("net", "Downloading blocks toward %s (%d) via "
+                                    "headers direct fetch\n",
+                             pindexLast->GetBlockHash().ToString(),
+                             pindexLast->nHeight);
+                }
+                if (vGetData.size() > 0) {
+                    if (nodestate->fSupportsDesiredCmpctVersion &&
+                        vGetData.size() == 1 &&
+                        mapBlocksInFlight.size() == 1 &&
+                        pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
+                        // In any case, we want to download using a compact
+                        // block, not a regular one.
+                        vGetData[0] =
+                            CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                    }
                     connman.PushMessage(
-                        pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
-                    return true;
-                } else {
-                    // If this was an announce-cmpctblock, we want the same
-                    // treatment as a header message. Dirty hack to process as
-                    // if it were just a headers message (TODO: move message
-                    // handling into their own functions)
-                    std::vector<CBlock> headers;
-                    headers.push_back(cmpctblock.header);
-                    vHeadersMsg << headers;
-                    fRevertToHeaderProcessing = true;
+                        pfrom,
+                        msgMaker.Make(NetMsgType::GETDATA, vGetData));
                 }
             }
-        } // cs_main
-
-        if (fProcessBLOCKTXN) {
-            return ProcessMessage(config, pfrom, NetMsgType::BLOCKTXN,
-                                  blockTxnMsg, nTimeReceived, chainparams,
-                                  connman, interruptMsgProc);
         }
+    }
+    return true;
+}
 
-        if (fRevertToHeaderProcessing) {
-            return ProcessMessage(config, pfrom, NetMsgType::HEADERS,
-                                  vHeadersMsg, nTimeReceived, chainparams,
-                                  connman, interruptMsgProc);
-        }
+static bool ProcessCmpctBlockMessage(
+    const Config &config, CNode *pfrom, const std::string &strCommand,
+    CDataStream &vRecv, int64_t nTimeReceived, const CChainParams &chainparams,
+    CConnman &connman, const std::atomic<bool> &interruptMsgProc) {
+    // Ignore blocks received while importing
+    if (fImporting || fReindex) {
+        return true;
+    }
 
-        if (fBlockReconstructed) {
-            // If we got here, we were able to optimistically reconstruct a
-            // block that is in flight from some other peer.
-            {
-                LOCK(cs_main);
-                mapBlockSource.emplace(pblock->GetHash(),
-                                       std::make_pair(pfrom->GetId(), false));
-            }
-            bool fNewBlock = false;
-            ProcessNewBlock(config, pblock, true, &fNewBlock);
-            if (fNewBlock) {
-                pfrom->nLastBlockTime = GetTime();
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    size_t nCompactBytes = vRecv.size();
+    vRecv >> cmpctblock;
+
+    {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) ==
+            mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis), instead of DoSing in
+            // AcceptBlockHeader, request deeper headers
+            if (!IsInitialBlockDownload()) {
+                connman.PushMessage(
+                    pfrom,
+                    msgMaker.Make(NetMsgType::GETHEADERS,
+                                  chainActive.GetLocator(pindexBestHeader),
+                                  uint256()));
             }
+            return true;
+        }
+    }
 
-            // hold cs_main for CBlockIndex::IsValid()
-            LOCK(cs_main);
-            if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS)) {
-                // Clear download state for this block, which is in process from
-                // some other peer. We do this after calling. ProcessNewBlock so
-                // that a malleated cmpctblock announcement can't be used to
-                // interfere with block relay.
-                MarkBlockAsReceived(pblock->GetHash());
+    const CBlockIndex *pindex = nullptr;
+    CValidationState state;
+    if (!ProcessNewBlockHeaders(config, {cmpctblock.header}, state,
+                                &pindex)) {
+        int nDoS;
+        if (state.IsInvalid(nDoS)) {
+            if (nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(pfrom, nDoS, state.GetRejectReason());
             }
+            LogPrintf("Peer %d sent us invalid header via cmpctblock\n",
+                      pfrom->id);
+            return true;
         }
-
     }
 
-    else if (strCommand == NetMsgType::BLOCKTXN && !fImporting &&
-             !fReindex) // Ignore blocks received while importing
-    {
-        BlockTransactions resp;
-        vRecv >> resp;
+    // When we succeed in decoding a block's txids from a cmpctblock
+    // message we typically jump to the BLOCKTXN handling code, with a
+    // dummy (empty) BLOCKTXN message, to re-use the logic there in
+    // completing processing of the putative block (without cs_main).
+    bool fProcessBLOCKTXN = false;
+    CDataStream blockTxnMsg(SER_NETWORK, PROTOCOL_VERSION);
 
-        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-        bool fBlockRead = false;
-        {
-            LOCK(cs_main);
+    // If we end up treating this as a plain headers message, call that as
+    // well
+    // without cs_main.
+    bool fRevertToHeaderProcessing = false;
+    CDataStream vHeadersMsg(SER_NETWORK, PROTOCOL_VERSION);
 
-            std::map<uint256,
-                     std::pair<NodeId,
-                               std::list<QueuedBlock>::iterator>>::iterator it =
-                mapBlocksInFlight.find(resp.blockhash);
-            if (it == mapBlocksInFlight.end() ||
-                !it->second.second->partialBlock ||
-                it->second.first != pfrom->GetId()) {
-                LogPrint("net", "Peer %d sent us block transactions for block "
-                                "we weren't expecting\n",
-                         pfrom->id);
-                return true;
-            }
+    // Keep a CBlock for "optimistic" compactblock reconstructions (see
+    // below)
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    bool fBlockReconstructed = false;
 
-            PartiallyDownloadedBlock &partialBlock =
-                *it->second.second->partialBlock;
-            ReadStatus status = partialBlock.FillBlock(*pblock, resp.txn);
-            if (status == READ_STATUS_INVALID) {
-                // Reset in-flight state in case of whitelist.
-                MarkBlockAsReceived(resp.blockhash);
-                Misbehaving(pfrom, 100, "invalid-cmpctblk-txns");
-                LogPrintf("Peer %d sent us invalid compact block/non-matching "
-                          "block transactions\n",
-                          pfrom->id);
-                return true;
-            } else if (status == READ_STATUS_FAILED) {
-                // Might have collided, fall back to getdata now :(
-                std::vector<CInv> invs;
-                invs.push_back(
-                    CInv(MSG_BLOCK | GetFetchFlags(pfrom, chainActive.Tip(),
-                                                   chainparams.GetConsensus()),
-                         resp.blockhash));
-                connman.PushMessage(pfrom,
-                                    msgMaker.Make(NetMsgType::GETDATA, invs));
-            } else {
-                // Block is either okay, or possibly we received
-                // READ_STATUS_CHECKBLOCK_FAILED.
-                // Note that CheckBlock can only fail for one of a few reasons:
-                // 1. bad-proof-of-work (impossible here, because we've already
-                //    accepted the header)
-                // 2. merkleroot doesn't match the transactions given (already
-                //    caught in FillBlock with READ_STATUS_FAILED, so
-                //    impossible here)
-                // 3. the block is otherwise invalid (eg invalid coinbase,
-                //    block is too big, too many legacy sigops, etc).
-                // So if CheckBlock failed, #3 is the only possibility.
-                // Under BIP 152, we don't DoS-ban unless proof of work is
-                // invalid (we don't require all the stateless checks to have
-                // been run). This is handled below, so just treat this as
-                // though the block was successfully read, and rely on the
-                // handling in ProcessNewBlock to ensure the block index is
-                // updated, reject messages go out, etc.
-
-                // it is now an empty pointer
-                MarkBlockAsReceived(resp.blockhash);
-                fBlockRead = true;
-                // mapBlockSource is only used for sending reject messages and
-                // DoS scores, so the race between here and cs_main in
-                // ProcessNewBlock is fine. BIP 152 permits peers to relay
-                // compact blocks after validating the header only; we should
-                // not punish peers if the block turns out to be invalid.
-                mapBlockSource.emplace(resp.blockhash,
-                                       std::make_pair(pfrom->GetId(), false));
-            }
-        } // Don't hold cs_main when we call into ProcessNewBlock
-        if (fBlockRead) {
-            bool fNewBlock = false;
-            // Since we requested this block (it was in mapBlocksInFlight),
-            // force it to be processed, even if it would not be a candidate for
-            // new tip (missing previous block, chain not long enough, etc)
-            ProcessNewBlock(config, pblock, true, &fNewBlock);
-            if (fNewBlock) {
-                pfrom->nLastBlockTime = GetTime();
-            }
+    {
+        LOCK(cs_main);
+        // If AcceptBlockHeader returned true, it set pindex
+        assert(pindex);
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+
+        std::map<uint256,
+                 std::pair<NodeId, std::list<QueuedBlock>::iterator>>::
+            iterator blockInFlightIt =
+                mapBlocksInFlight.find(pindex->GetBlockHash());
+        bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            // Nothing to do here
+            return true;
         }
-    }
-
-    // Ignore headers received while importing
-    else if (strCommand == NetMsgType::HEADERS && !fImporting && !fReindex) {
-        std::vector<CBlockHeader> headers;
 
-        // Bypass the normal CBlock deserialization, as we don't want to risk
-        // deserializing 2000 full blocks.
-        unsigned int nCount = ReadCompactSize(vRecv);
-        if (nCount > MAX_HEADERS_RESULTS) {
-            LOCK(cs_main);
-            Misbehaving(pfrom, 20, "too-many-headers");
-            return error("headers message size = %u", nCount);
-        }
-        headers.resize(nCount);
-        for (unsigned int n = 0; n < nCount; n++) {
-            vRecv >> headers[n];
-            // Ignore tx count; assume it is 0.
-            ReadCompactSize(vRecv);
+        if (pindex->nChainWork <=
+                chainActive.Tip()->nChainWork || // We know something better
+            pindex->nTx != 0) {
+            // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We requested this block for some reason, but our mempool
+                // will probably be useless so we just grab the block via
+                // normal getdata.
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(
+                    MSG_BLOCK | GetFetchFlags(pfrom, pindex->pprev,
+                                              chainparams.GetConsensus()),
+                    cmpctblock.header.GetHash());
+                connman.PushMessage(
+                    pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
+            }
+            return true;
         }
 
-        if (nCount == 0) {
-            // Nothing interesting. Stop asking this peers for more headers.
+        // If we're not close to tip yet, give up and let parallel block
+        // fetch work its magic.
+        if (!fAlreadyInFlight &&
+            !CanDirectFetch(chainparams.GetConsensus())) {
             return true;
         }
 
-        const CBlockIndex *pindexLast = nullptr;
-        {
-            LOCK(cs_main);
-            CNodeState *nodestate = State(pfrom->GetId());
-
-            // If this looks like it could be a block announcement (nCount <
-            // MAX_BLOCKS_TO_ANNOUNCE), use special logic for handling headers
-            // that
-            // don't connect:
-            // - Send a getheaders message in response to try to connect the
-            // chain.
-            // - The peer can send up to MAX_UNCONNECTING_HEADERS in a row that
-            //   don't connect before giving DoS points
-            // - Once a headers message is received that is valid and does
-            // connect,
-            //   nUnconnectingHeaders gets reset back to 0.
-            if (mapBlockIndex.find(headers[0].hashPrevBlock) ==
-                    mapBlockIndex.end() &&
-                nCount < MAX_BLOCKS_TO_ANNOUNCE) {
-                nodestate->nUnconnectingHeaders++;
-                connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS,
-                                                         chainActive.GetLocator(
-                                                             pindexBestHeader),
-                                                         uint256()));
-                LogPrint("net", "received header %s: missing prev block %s, "
-                                "sending getheaders (%d) to end (peer=%d, "
-                                "nUnconnectingHeaders=%d)\n",
-                         headers[0].GetHash().ToString(),
-                         headers[0].hashPrevBlock.ToString(),
-                         pindexBestHeader->nHeight, pfrom->id,
-                         nodestate->nUnconnectingHeaders);
-                // Set hashLastUnknownBlock for this peer, so that if we
-                // eventually get the headers - even from a different peer -
-                // we can use this peer to download.
-                UpdateBlockAvailability(pfrom->GetId(),
-                                        headers.back().GetHash());
-
-                if (nodestate->nUnconnectingHeaders %
-                        MAX_UNCONNECTING_HEADERS ==
-                    0) {
-                    // The peer is sending us many headers we can't connect.
-                    Misbehaving(pfrom, 20, "too-many-unconnected-headers");
-                }
-                return true;
-            }
+        CNodeState *nodestate = State(pfrom->GetId());
 
-            uint256 hashLastBlock;
-            for (const CBlockHeader &header : headers) {
-                if (!hashLastBlock.IsNull() &&
-                    header.hashPrevBlock != hashLastBlock) {
-                    Misbehaving(pfrom, 20, "disconnected-header");
-                    return error("non-continuous headers sequence");
+        // We want to be a bit conservative just to be extra careful about
+        // DoS possibilities in compact block processing...
+        if (pindex->nHeight <= chainActive.Height() + 2) {
+            if ((!fAlreadyInFlight &&
+                 nodestate->nBlocksInFlight <
+                     MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+                (fAlreadyInFlight &&
+                 blockInFlightIt->second.first == pfrom->GetId())) {
+                std::list<QueuedBlock>::iterator *queuedBlockIt = nullptr;
+                if (!MarkBlockAsInFlight(config, pfrom->GetId(),
+                                         pindex->GetBlockHash(),
+                                         chainparams.GetConsensus(), pindex,
+                                         &queuedBlockIt)) {
+                    if (!(*queuedBlockIt)->partialBlock) {
+                        (*queuedBlockIt)
+                            ->partialBlock.reset(
+                                new PartiallyDownloadedBlock(config,
+                                                             &mempool));
+                    } else {
+                        // The block was already in flight using compact
+                        // blocks from the same peer.
+                        LogPrint("net", "Peer sent us compact block we "
+                                        "were already syncing!\n");
+                        return true;
+                    }
                 }
-                hashLastBlock = header.GetHash();
-            }
-        }
 
-        CValidationState state;
-        if (!ProcessNewBlockHeaders(config, headers, state, &pindexLast)) {
-            int nDoS;
-            if (state.IsInvalid(nDoS)) {
-                if (nDoS > 0) {
-                    LOCK(cs_main);
-                    Misbehaving(pfrom, nDoS, state.GetRejectReason());
+                (*queuedBlockIt)->nCompactBytes += nCompactBytes;
+                PartiallyDownloadedBlock &partialBlock =
+                    *(*queuedBlockIt)->partialBlock;
+                ReadStatus status =
+                    partialBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                if (status == READ_STATUS_INVALID) {
+                    // Reset in-flight state in case of whitelist
+                    MarkBlockAsReceived(pindex->GetBlockHash());
+                    Misbehaving(pfrom, 100, "invalid-cmpctblk");
+                    LogPrintf("Peer %d sent us invalid compact block\n",
+                              pfrom->id);
+                    return true;
+                } else if (status == READ_STATUS_FAILED) {
+                    // Duplicate txindexes, the block is now in-flight, so
+                    // just request it.
+                    std::vector<CInv> vInv(1);
+                    vInv[0] =
+                        CInv(MSG_BLOCK |
+                                 GetFetchFlags(pfrom, pindex->pprev,
+                                               chainparams.GetConsensus()),
+                             cmpctblock.header.GetHash());
+                    connman.PushMessage(
+                        pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
+                    return true;
                 }
-                return error("invalid header received");
-            }
-        }
-
-        {
-            LOCK(cs_main);
-            CNodeState *nodestate = State(pfrom->GetId());
-            if (nodestate->nUnconnectingHeaders > 0) {
-                LogPrint("net",
-                         "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n",
-                         pfrom->id, nodestate->nUnconnectingHeaders);
-            }
-            nodestate->nUnconnectingHeaders = 0;
-
-            assert(pindexLast);
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
-
-            if (nCount == MAX_HEADERS_RESULTS) {
-                // Headers message had its maximum size; the peer may have more
-                // headers.
-                // TODO: optimize: if pindexLast is an ancestor of
-                // chainActive.Tip or pindexBestHeader, continue from there
-                // instead.
-                LogPrint(
-                    "net",
-                    "more getheaders (%d) to end to peer=%d (startheight:%d)\n",
-                    pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-                connman.PushMessage(
-                    pfrom, msgMaker.Make(NetMsgType::GETHEADERS,
-                                         chainActive.GetLocator(pindexLast),
-                                         uint256()));
-            }
 
-            bool fCanDirectFetch = CanDirectFetch(chainparams.GetConsensus());
-            // If this set of headers is valid and ends in a block with at least
-            // as much work as our tip, download as much as possible.
-            if (fCanDirectFetch && pindexLast->IsValid(BLOCK_VALID_TREE) &&
-                chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
-                std::vector<const CBlockIndex *> vToFetch;
-                const CBlockIndex *pindexWalk = pindexLast;
-                // Calculate all the blocks we'd need to switch to pindexLast,
-                // up to a limit.
-                while (pindexWalk && !chainActive.Contains(pindexWalk) &&
-                       vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                    if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
-                        !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
-                        // We don't have this block, and it's not yet in flight.
-                        vToFetch.push_back(pindexWalk);
+                BlockTransactionsRequest req;
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                    if (!partialBlock.IsTxAvailable(i)) {
+                        req.indexes.push_back(i);
                     }
-                    pindexWalk = pindexWalk->pprev;
                 }
-                // If pindexWalk still isn't on our main chain, we're looking at
-                // a very large reorg at a time we think we're close to caught
-                // up to the main chain -- this shouldn't really happen. Bail
-                // out on the direct fetch and rely on parallel download
-                // instead.
-                if (!chainActive.Contains(pindexWalk)) {
-                    LogPrint("net",
-                             "Large reorg, won't direct fetch to %s (%d)\n",
-                             pindexLast->GetBlockHash().ToString(),
-                             pindexLast->nHeight);
+                if (req.indexes.empty()) {
+                    // Dirty hack to jump to BLOCKTXN code (TODO: move
+                    // message handling into their own functions)
+                    BlockTransactions txn;
+                    txn.blockhash = cmpctblock.header.GetHash();
+                    blockTxnMsg << txn;
+                    fProcessBLOCKTXN = true;
                 } else {
-                    std::vector<CInv> vGetData;
-                    // Download as much as possible, from earliest to latest.
-                    for (const CBlockIndex *pindex :
-                         boost::adaptors::reverse(vToFetch)) {
-                        if (nodestate->nBlocksInFlight >=
-                            MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                            // Can't download any more from this peer
-                            break;
-                        }
-                        uint32_t nFetchFlags = GetFetchFlags(
-                            pfrom, pindex->pprev, chainparams.GetConsensus());
-                        vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags,
-                                                pindex->GetBlockHash()));
-                        MarkBlockAsInFlight(config, pfrom->GetId(),
-                                            pindex->GetBlockHash(),
-                                            chainparams.GetConsensus(), pindex);
-                        LogPrint("net", "Requesting block %s from  peer=%d\n",
-                                 pindex->GetBlockHash().ToString(), pfrom->id);
-                    }
-                    if (vGetData.size() > 1) {
-                        LogPrint("net", "Downloading blocks toward %s (%d) via "
-                                        "headers direct fetch\n",
-                                 pindexLast->GetBlockHash().ToString(),
-                                 pindexLast->nHeight);
-                    }
-                    if (vGetData.size() > 0) {
-                        if (nodestate->fSupportsDesiredCmpctVersion &&
-                            vGetData.size() == 1 &&
-                            mapBlocksInFlight.size() == 1 &&
-                            pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
-                            // In any case, we want to download using a compact
-                            // block, not a regular one.
-                            vGetData[0] =
-                                CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
-                        }
-                        connman.PushMessage(
-                            pfrom,
-                            msgMaker.Make(NetMsgType::GETDATA, vGetData));
-                    }
+                    req.blockhash = pindex->GetBlockHash();
+                    connman.PushMessage(
+                        pfrom, msgMaker.Make(NetMsgType::GETBLOCKTXN, req));
+                }
+            } else {
+                // This block is either already in flight from a different
+                // peer, or this peer has too many blocks outstanding to
+                // download from. Optimistically try to reconstruct anyway
+                // since we might be able to without any round trips.
+                PartiallyDownloadedBlock tempBlock(config, &mempool);
+                ReadStatus status =
+                    tempBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                if (status != READ_STATUS_OK) {
+                    // TODO: don't ignore failures
+                    return true;
+                }
+                std::vector<CTransactionRef> dummy;
+                status = tempBlock.FillBlock(*pblock, dummy);
+                if (status == READ_STATUS_OK) {
+                    fBlockReconstructed = true;
                 }
             }
+        } else {
+            if (fAlreadyInFlight) {
+                // We requested this block, but its far into the future, so
+                // our mempool will probably be useless - request the block
+                // normally.
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(
+                    MSG_BLOCK | GetFetchFlags(pfrom, pindex->pprev,
+                                              chainparams.GetConsensus()),
+                    cmpctblock.header.GetHash());
+                connman.PushMessage(
+                    pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
+                return true;
+            } else {
+                // If this was an announce-cmpctblock, we want the same
+                // treatment as a header message, so it is handed to the
+                // headers handler below.
+                std::vector<CBlock> headers;
+                headers.push_back(cmpctblock.header);
+                vHeadersMsg << headers;
+                fRevertToHeaderProcessing = true;
+            }
         }
+    } // cs_main
+
+    if (fProcessBLOCKTXN) {
+        return ProcessBlockTxnMessage(config, pfrom, NetMsgType::BLOCKTXN,
+                                      blockTxnMsg, nTimeReceived, chainparams,
+                                      connman, interruptMsgProc);
     }
 
-    else if (strCommand == NetMsgType::BLOCK && !fImporting &&
-             !fReindex) // Ignore blocks received while importing
-    {
-        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-        vRecv >> *pblock;
-
-        LogPrint("net", "received block %s peer=%d\n",
-                 pblock->GetHash().ToString(), pfrom->id);
-
-        // Process all blocks from whitelisted peers, even if not requested,
-        // unless we're still syncing with the network. Such an unrequested
-        // block may still be processed, subject to the conditions in
-        // AcceptBlock().
-        bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
-        const uint256 hash(pblock->GetHash());
+    if (fRevertToHeaderProcessing) {
+        return ProcessHeadersMessage(config, pfrom, NetMsgType::HEADERS,
+                                     vHeadersMsg, nTimeReceived, chainparams,
+                                     connman, interruptMsgProc);
+    }
+
+    if (fBlockReconstructed) {
+        // If we got here, we were able to optimistically reconstruct a
+        // block that is in flight from some other peer.
         {
             LOCK(cs_main);
-            // Also always process if we requested the block explicitly, as we
-            // may need it even though it is not a candidate for a new best tip.
-            forceProcessing |= MarkBlockAsReceived(hash);
-            // mapBlockSource is only used for sending reject messages and DoS
-            // scores, so the race between here and cs_main in ProcessNewBlock
-            // is fine.
-            mapBlockSource.emplace(hash, std::make_pair(pfrom->GetId(), true));
+            mapBlockSource.emplace(pblock->GetHash(),
+                                   std::make_pair(pfrom->GetId(), false));
         }
         bool fNewBlock = false;
-        ProcessNewBlock(config, pblock, forceProcessing, &fNewBlock);
+        ProcessNewBlock(config, pblock, true, &fNewBlock);
         if (fNewBlock) {
             pfrom->nLastBlockTime = GetTime();
         }
-    }
 
-    else if (strCommand == NetMsgType::GETADDR) {
-        // This asymmetric behavior for inbound and outbound connections was
-        // introduced to prevent a fingerprinting attack: an attacker can send
-        // specific fake addresses to users' AddrMan and later request them by
-        // sending getaddr messages. Making nodes which are behind NAT and can
-        // only make outgoing connections ignore the getaddr message mitigates
-        // the attack.
-        if (!pfrom->fInbound) {
-            LogPrint("net",
-                     "Ignoring \"getaddr\" from outbound connection. peer=%d\n",
-                     pfrom->id);
-            return true;
+        // hold cs_main for CBlockIndex::IsValid()
+        LOCK(cs_main);
+        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS)) {
+            // Clear download state for this block, which is in process from
+            // some other peer. We do this after calling. ProcessNewBlock so
+            // that a malleated cmpctblock announcement can't be used to
+            // interfere with block relay.
+            MarkBlockAsReceived(pblock->GetHash());
         }
+    }
+    return true;
+}
 
-        // Only send one GetAddr response per connection to reduce resource
-        // waste and discourage addr stamping of INV announcements.
-        if (pfrom->fSentAddr) {
-            LogPrint("net", "Ignoring repeated \"getaddr\". peer=%d\n",
-                     pfrom->id);
-            return true;
-        }
-        pfrom->fSentAddr = true;
+static bool ProcessBlockMessage(const Config &config, CNode *pfrom,
+                                const std::string &strCommand,
+                                CDataStream &vRecv, int64_t nTimeReceived,
+                                const CChainParams &chainparams,
+                                CConnman &connman,
+                                const std::atomic<bool> &interruptMsgProc) {
+    // Ignore blocks received while importing
+    if (fImporting || fReindex) {
+        return true;
+    }
 
-        pfrom->vAddrToSend.clear();
-        std::vector<CAddress> vAddr = connman.GetAddresses();
-        FastRandomContext insecure_rand;
-        for (const CAddress &addr : vAddr) {
-            pfrom->PushAddress(addr, insecure_rand);
-        }
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    size_t nBlockBytes = vRecv.size();
+    vRecv >> *pblock;
+
+    LogPrint("net", "received block %s peer=%d\n",
+             pblock->GetHash().ToString(), pfrom->id);
+
+    // Process all blocks from whitelisted peers, even if not requested,
+    // unless we're still syncing with the network. Such an unrequested
+    // block may still be processed, subject to the conditions in
+    // AcceptBlock().
+    bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
+    const uint256 hash(pblock->GetHash());
+    {
+        LOCK(cs_main);
+        // Also always process if we requested the block explicitly, as we
+        // may need it even though it is not a candidate for a new best tip.
+        UpdateBlockDownloadSpeed(pfrom->GetId(), hash, nBlockBytes);
+        forceProcessing |= MarkBlockAsReceived(hash);
+        // mapBlockSource is only used for sending reject messages and DoS
+        // scores, so the race between here and cs_main in ProcessNewBlock
+        // is fine.
+        mapBlockSource.emplace(hash, std::make_pair(pfrom->GetId(), true));
     }
+    bool fNewBlock = false;
+    ProcessNewBlock(config, pblock, forceProcessing, &fNewBlock);
+    if (fNewBlock) {
+        pfrom->nLastBlockTime = GetTime();
+    }
+    return true;
+}
 
-    else if (strCommand == NetMsgType::MEMPOOL) {
-        if (!(pfrom->GetLocalServices() & NODE_BLOOM) && !pfrom->fWhitelisted) {
-            LogPrint("net", "mempool request with bloom filters disabled, "
-                            "disconnect peer=%d\n",
-                     pfrom->GetId());
-            pfrom->fDisconnect = true;
-            return true;
-        }
+static bool ProcessGetAddrMessage(const Config &config, CNode *pfrom,
+                                  const std::string &strCommand,
+                                  CDataStream &vRecv, int64_t nTimeReceived,
+                                  const CChainParams &chainparams,
+                                  CConnman &connman,
+                                  const std::atomic<bool> &interruptMsgProc) {
+    // This asymmetric behavior for inbound and outbound connections was
+    // introduced to prevent a fingerprinting attack: an attacker can send
+    // specific fake addresses to users' AddrMan and later request them by
+    // sending getaddr messages. Making nodes which are behind NAT and can
+    // only make outgoing connections ignore the getaddr message mitigates
+    // the attack.
+    if (!pfrom->fInbound) {
+        LogPrint("net",
+                 "Ignoring \"getaddr\" from outbound connection. peer=%d\n",
+                 pfrom->id);
+        return true;
+    }
 
-        if (connman.OutboundTargetReached(false) && !pfrom->fWhitelisted) {
-            LogPrint("net", "mempool request with bandwidth limit reached, "
-                            "disconnect peer=%d\n",
-                     pfrom->GetId());
-            pfrom->fDisconnect = true;
-            return true;
-        }
+    // Only send one GetAddr response per connection to reduce resource
+    // waste and discourage addr stamping of INV announcements.
+    if (pfrom->fSentAddr) {
+        LogPrint("net", "Ignoring repeated \"getaddr\". peer=%d\n",
+                 pfrom->id);
+        return true;
+    }
+    pfrom->fSentAddr = true;
 
-        LOCK(pfrom->cs_inventory);
-        pfrom->fSendMempool = true;
+    pfrom->vAddrToSend.clear();
+    std::vector<CAddress> vAddr = connman.GetAddresses();
+    FastRandomContext insecure_rand;
+    for (const CAddress &addr : vAddr) {
+        pfrom->PushAddress(addr, insecure_rand);
     }
+    return true;
+}
 
-    else if (strCommand == NetMsgType::PING) {
-        if (pfrom->nVersion > BIP0031_VERSION) {
-            uint64_t nonce = 0;
-            vRecv >> nonce;
-            // Echo the message back with the nonce. This allows for two useful
-            // features:
-            //
-            // 1) A remote node can quickly check if the connection is
-            // operational.
-            // 2) Remote nodes can measure the latency of the network thread. If
-            // this node is overloaded it won't respond to pings quickly and the
-            // remote node can avoid sending us more work, like chain download
-            // requests.
-            //
-            // The nonce stops the remote getting confused between different
-            // pings: without it, if the remote node sends a ping once per
-            // second and this node takes 5 seconds to respond to each, the 5th
-            // ping the remote sends would appear to return very quickly.
-            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::PONG, nonce));
-        }
+static bool ProcessMempoolMessage(const Config &config, CNode *pfrom,
+                                  const std::string &strCommand,
+                                  CDataStream &vRecv, int64_t nTimeReceived,
+                                  const CChainParams &chainparams,
+                                  CConnman &connman,
+                                  const std::atomic<bool> &interruptMsgProc) {
+    if (!(pfrom->GetLocalServices() & NODE_BLOOM) && !pfrom->fWhitelisted) {
+        LogPrint("net", "mempool request with bloom filters disabled, "
+                        "disconnect peer=%d\n",
+                 pfrom->GetId());
+        pfrom->fDisconnect = true;
+        return true;
+    }
+
+    if (connman.OutboundTargetReached(false) && !pfrom->fWhitelisted) {
+        LogPrint("net", "mempool request with bandwidth limit reached, "
+                        "disconnect peer=%d\n",
+                 pfrom->GetId());
+        pfrom->fDisconnect = true;
+        return true;
     }
 
-    else if (strCommand == NetMsgType::PONG) {
-        int64_t pingUsecEnd = nTimeReceived;
+    LOCK(pfrom->cs_inventory);
+    pfrom->fSendMempool = true;
+    return true;
+}
+
+static bool ProcessPingMessage(const Config &config, CNode *pfrom,
+                               const std::string &strCommand,
+                               CDataStream &vRecv, int64_t nTimeReceived,
+                               const CChainParams &chainparams,
+                               CConnman &connman,
+                               const std::atomic<bool> &interruptMsgProc) {
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+
+    if (pfrom->nVersion > BIP0031_VERSION) {
         uint64_t nonce = 0;
-        size_t nAvail = vRecv.in_avail();
-        bool bPingFinished = false;
-        std::string sProblem;
-
-        if (nAvail >= sizeof(nonce)) {
-            vRecv >> nonce;
-
-            // Only process pong message if there is an outstanding ping (old
-            // ping without nonce should never pong)
-            if (pfrom->nPingNonceSent != 0) {
-                if (nonce == pfrom->nPingNonceSent) {
-                    // Matching pong received, this ping is no longer
-                    // outstanding
-                    bPingFinished = true;
-                    int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
-                    if (pingUsecTime > 0) {
-                        // Successful ping time measurement, replace previous
-                        pfrom->nPingUsecTime = pingUsecTime;
-                        pfrom->nMinPingUsecTime = std::min(
-                            pfrom->nMinPingUsecTime.load(), pingUsecTime);
-                    } else {
-                        // This should never happen
-                        sProblem = "Timing mishap";
-                    }
+        vRecv >> nonce;
+        // Echo the message back with the nonce. This allows for two useful
+        // features:
+        //
+        // 1) A remote node can quickly check if the connection is
+        // operational.
+        // 2) Remote nodes can measure the latency of the network thread. If
+        // this node is overloaded it won't respond to pings quickly and the
+        // remote node can avoid sending us more work, like chain download
+        // requests.
+        //
+        // The nonce stops the remote getting confused between different
+        // pings: without it, if the remote node sends a ping once per
+        // second and this node takes 5 seconds to respond to each, the 5th
+        // ping the remote sends would appear to return very quickly.
+        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::PONG, nonce));
+    }
+    return true;
+}
+
+static bool ProcessPongMessage(const Config &config, CNode *pfrom,
+                               const std::string &strCommand,
+                               CDataStream &vRecv, int64_t nTimeReceived,
+                               const CChainParams &chainparams,
+                               CConnman &connman,
+                               const std::atomic<bool> &interruptMsgProc) {
+    int64_t pingUsecEnd = nTimeReceived;
+    uint64_t nonce = 0;
+    size_t nAvail = vRecv.in_avail();
+    bool bPingFinished = false;
+    std::string sProblem;
+
+    if (nAvail >= sizeof(nonce)) {
+        vRecv >> nonce;
+
+        // Only process pong message if there is an outstanding ping (old
+        // ping without nonce should never pong)
+        if (pfrom->nPingNonceSent != 0) {
+            if (nonce == pfrom->nPingNonceSent) {
+                // Matching pong received, this ping is no longer
+                // outstanding
+                bPingFinished = true;
+                int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
+                if (pingUsecTime > 0) {
+                    // Successful ping time measurement, replace previous
+                    pfrom->nPingUsecTime = pingUsecTime;
+                    pfrom->nMinPingUsecTime = std::min(
+                        pfrom->nMinPingUsecTime.load(), pingUsecTime);
                 } else {
-                    // Nonce mismatches are normal when pings are overlapping
-                    sProblem = "Nonce mismatch";
-                    if (nonce == 0) {
-                        // This is most likely a bug in another implementation
-                        // somewhere; cancel this ping
-                        bPingFinished = true;
-                        sProblem = "Nonce zero";
-                    }
+                    // This should never happen
+                    sProblem = "Timing mishap";
                 }
             } else {
-                sProblem = "Unsolicited pong without ping";
+                // Nonce mismatches are normal when pings are overlapping
+                sProblem = "Nonce mismatch";
+                if (nonce == 0) {
+                    // This is most likely a bug in another implementation
+                    // somewhere; cancel this ping
+                    bPingFinished = true;
+                    sProblem = "Nonce zero";
+                }
             }
         } else {
-            // This is most likely a bug in another implementation somewhere;
-            // cancel this ping
-            bPingFinished = true;
-            sProblem = "Short payload";
+            sProblem = "Unsolicited pong without ping";
         }
+    } else {
+        // This is most likely a bug in another implementation somewhere;
+        // cancel this ping
+        bPingFinished = true;
+        sProblem = "Short payload";
+    }
 
-        if (!(sProblem.empty())) {
-            LogPrint("net",
-                     "pong peer=%d: %s, %x expected, %x received, %u bytes\n",
-                     pfrom->id, sProblem, pfrom->nPingNonceSent, nonce, nAvail);
-        }
-        if (bPingFinished) {
-            pfrom->nPingNonceSent = 0;
-        }
+    if (!(sProblem.empty())) {
+        LogPrint("net",
+                 "pong peer=%d: %s, %x expected, %x received, %u bytes\n",
+                 pfrom->id, sProblem, pfrom->nPingNonceSent, nonce, nAvail);
+    }
+    if (bPingFinished) {
+        pfrom->nPingNonceSent = 0;
     }
+    return true;
+}
 
-    else if (strCommand == NetMsgType::FILTERLOAD) {
-        CBloomFilter filter;
-        vRecv >> filter;
+static bool ProcessFilterLoadMessage(
+    const Config &config, CNode *pfrom, const std::string &strCommand,
+    CDataStream &vRecv, int64_t nTimeReceived, const CChainParams &chainparams,
+    CConnman &connman, const std::atomic<bool> &interruptMsgProc) {
+    CBloomFilter filter;
+    vRecv >> filter;
 
-        if (!filter.IsWithinSizeConstraints()) {
-            // There is no excuse for sending a too-large filter
-            LOCK(cs_main);
-            Misbehaving(pfrom, 100, "oversized-bloom-filter");
+    if (!filter.IsWithinSizeConstraints()) {
+        // There is no excuse for sending a too-large filter
+        LOCK(cs_main);
+        Misbehaving(pfrom, 100, "oversized-bloom-filter");
+    } else {
+        LOCK(pfrom->cs_filter);
+        delete pfrom->pfilter;
+        pfrom->pfilter = new CBloomFilter(filter);
+        pfrom->pfilter->UpdateEmptyFull();
+        pfrom->fRelayTxes = true;
+    }
+    return true;
+}
+
+static bool ProcessFilterAddMessage(const Config &config, CNode *pfrom,
+                                    const std::string &strCommand,
+                                    CDataStream &vRecv, int64_t nTimeReceived,
+                                    const CChainParams &chainparams,
+                                    CConnman &connman,
+                                    const std::atomic<bool> &interruptMsgProc) {
+    std::vector<uint8_t> vData;
+    vRecv >> vData;
+
+    // Nodes must NEVER send a data item > 520 bytes (the max size for a
+    // script data object, and thus, the maximum size any matched object can
+    // have) in a filteradd message.
+    bool bad = false;
+    if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE) {
+        bad = true;
+    } else {
+        LOCK(pfrom->cs_filter);
+        if (pfrom->pfilter) {
+            pfrom->pfilter->insert(vData);
         } else {
-            LOCK(pfrom->cs_filter);
-            delete pfrom->pfilter;
-            pfrom->pfilter = new CBloomFilter(filter);
-            pfrom->pfilter->UpdateEmptyFull();
-            pfrom->fRelayTxes = true;
+            bad = true;
         }
     }
+    if (bad) {
+        LOCK(cs_main);
+        // The structure of this code doesn't really allow for a good error
+        // code. We'll go generic.
+        Misbehaving(pfrom, 100, "invalid-filteradd");
+    }
+    return true;
+}
 
-    else if (strCommand == NetMsgType::FILTERADD) {
-        std::vector<uint8_t> vData;
-        vRecv >> vData;
+static bool ProcessFilterClearMessage(
+    const Config &config, CNode *pfrom, const std::string &strCommand,
+    CDataStream &vRecv, int64_t nTimeReceived, const CChainParams &chainparams,
+    CConnman &connman, const std::atomic<bool> &interruptMsgProc) {
+    LOCK(pfrom->cs_filter);
+    if (pfrom->GetLocalServices() & NODE_BLOOM) {
+        delete pfrom->pfilter;
+        pfrom->pfilter = new CBloomFilter();
+    }
+    pfrom->fRelayTxes = true;
+    return true;
+}
 
-        // Nodes must NEVER send a data item > 520 bytes (the max size for a
-        // script data object, and thus, the maximum size any matched object can
-        // have) in a filteradd message.
-        bool bad = false;
-        if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE) {
-            bad = true;
-        } else {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter) {
-                pfrom->pfilter->insert(vData);
-            } else {
-                bad = true;
-            }
-        }
-        if (bad) {
-            LOCK(cs_main);
-            // The structure of this code doesn't really allow for a good error
-            // code. We'll go generic.
-            Misbehaving(pfrom, 100, "invalid-filteradd");
+static bool ProcessFeeFilterMessage(const Config &config, CNode *pfrom,
+                                    const std::string &strCommand,
+                                    CDataStream &vRecv, int64_t nTimeReceived,
+                                    const CChainParams &chainparams,
+                                    CConnman &connman,
+                                    const std::atomic<bool> &interruptMsgProc) {
+    CAmount newFeeFilter = 0;
+    vRecv >> newFeeFilter;
+    if (MoneyRange(newFeeFilter)) {
+        {
+            LOCK(pfrom->cs_feeFilter);
+            pfrom->minFeeFilter = newFeeFilter;
         }
+        LogPrint("net", "received: feefilter of %s from peer=%d\n",
+                 CFeeRate(newFeeFilter).ToString(), pfrom->id);
     }
+    return true;
+}
 
-    else if (strCommand == NetMsgType::FILTERCLEAR) {
-        LOCK(pfrom->cs_filter);
-        if (pfrom->GetLocalServices() & NODE_BLOOM) {
-            delete pfrom->pfilter;
-            pfrom->pfilter = new CBloomFilter();
-        }
-        pfrom->fRelayTxes = true;
+static bool ProcessGetCFiltersMessage(
+    const Config &config, CNode *pfrom, const std::string &strCommand,
+    CDataStream &vRecv, int64_t nTimeReceived, const CChainParams &chainparams,
+    CConnman &connman, const std::atomic<bool> &interruptMsgProc) {
+    ProcessGetCFilters(pfrom, vRecv, connman);
+    return true;
+}
+
+static bool ProcessGetCFHeadersMessage(
+    const Config &config, CNode *pfrom, const std::string &strCommand,
+    CDataStream &vRecv, int64_t nTimeReceived, const CChainParams &chainparams,
+    CConnman &connman, const std::atomic<bool> &interruptMsgProc) {
+    ProcessGetCFHeaders(pfrom, vRecv, connman);
+    return true;
+}
+
+static bool ProcessGetCFCheckPtMessage(
+    const Config &config, CNode *pfrom, const std::string &strCommand,
+    CDataStream &vRecv, int64_t nTimeReceived, const CChainParams &chainparams,
+    CConnman &connman, const std::atomic<bool> &interruptMsgProc) {
+    ProcessGetCFCheckPt(pfrom, vRecv, connman);
+    return true;
+}
+
+static bool ProcessNotFoundMessage(const Config &config, CNode *pfrom,
+                                   const std::string &strCommand,
+                                   CDataStream &vRecv, int64_t nTimeReceived,
+                                   const CChainParams &chainparams,
+                                   CConnman &connman,
+                                   const std::atomic<bool> &interruptMsgProc) {
+    // We do not care about the NOTFOUND message, but logging an Unknown
+    // Command message would be undesirable as we transmit it ourselves.
+    return true;
+}
+
+/**
+ * Handles one type of message. Takes the arguments of ProcessMessage, and
+ * returns false if processing the message failed.
+ */
+typedef bool (*MessageHandler)(const Config &config, CNode *pfrom,
+                               const std::string &strCommand,
+                               CDataStream &vRecv, int64_t nTimeReceived,
+                               const CChainParams &chainparams,
+                               CConnman &connman,
+                               const std::atomic<bool> &interruptMsgProc);
+
+/** The handler of every message type we process, indexed by NetMsgId. */
+static std::vector<MessageHandler> BuildMessageHandlers() {
+    std::vector<MessageHandler> handlers(size_t(NetMsgId::UNKNOWN), nullptr);
+    handlers[size_t(NetMsgId::REJECT)] = ProcessRejectMessage;
+    handlers[size_t(NetMsgId::VERSION)] = ProcessVersionMessage;
+    handlers[size_t(NetMsgId::VERACK)] = ProcessVerackMessage;
+    handlers[size_t(NetMsgId::ADDR)] = ProcessAddrMessage;
+    handlers[size_t(NetMsgId::SENDHEADERS)] = ProcessSendHeadersMessage;
+    handlers[size_t(NetMsgId::SENDCMPCT)] = ProcessSendCmpctMessage;
+    handlers[size_t(NetMsgId::INV)] = ProcessInvMessage;
+    handlers[size_t(NetMsgId::GETDATA)] = ProcessGetDataMessage;
+    handlers[size_t(NetMsgId::GETBLOCKS)] = ProcessGetBlocksMessage;
+    handlers[size_t(NetMsgId::GETBLOCKTXN)] = ProcessGetBlockTxnMessage;
+    handlers[size_t(NetMsgId::GETHEADERS)] = ProcessGetHeadersMessage;
+    handlers[size_t(NetMsgId::TX)] = ProcessTxMessage;
+    handlers[size_t(NetMsgId::CMPCTBLOCK)] = ProcessCmpctBlockMessage;
+    handlers[size_t(NetMsgId::BLOCKTXN)] = ProcessBlockTxnMessage;
+    handlers[size_t(NetMsgId::HEADERS)] = ProcessHeadersMessage;
+    handlers[size_t(NetMsgId::BLOCK)] = ProcessBlockMessage;
+    handlers[size_t(NetMsgId::GETADDR)] = ProcessGetAddrMessage;
+    handlers[size_t(NetMsgId::MEMPOOL)] = ProcessMempoolMessage;
+    handlers[size_t(NetMsgId::PING)] = ProcessPingMessage;
+    handlers[size_t(NetMsgId::PONG)] = ProcessPongMessage;
+    handlers[size_t(NetMsgId::FILTERLOAD)] = ProcessFilterLoadMessage;
+    handlers[size_t(NetMsgId::FILTERADD)] = ProcessFilterAddMessage;
+    handlers[size_t(NetMsgId::FILTERCLEAR)] = ProcessFilterClearMessage;
+    handlers[size_t(NetMsgId::FEEFILTER)] = ProcessFeeFilterMessage;
+    handlers[size_t(NetMsgId::GETCFILTERS)] = ProcessGetCFiltersMessage;
+    handlers[size_t(NetMsgId::GETCFHEADERS)] = ProcessGetCFHeadersMessage;
+    handlers[size_t(NetMsgId::GETCFCHECKPT)] = ProcessGetCFCheckPtMessage;
+    handlers[size_t(NetMsgId::NOTFOUND)] = ProcessNotFoundMessage;
+    return handlers;
+}
+
+static const std::vector<MessageHandler> vMessageHandlers =
+    BuildMessageHandlers();
+
+static bool ProcessMessage(const Config &config, CNode *pfrom,
+                           const std::string &strCommand, CDataStream &vRecv,
+                           int64_t nTimeReceived,
+                           const CChainParams &chainparams, CConnman &connman,
+                           const std::atomic<bool> &interruptMsgProc) {
+    LogPrint("net", "received: %s (%u bytes) peer=%d\n",
+             SanitizeString(strCommand), vRecv.size(), pfrom->id);
+    if (IsArgSet("-dropmessagestest") &&
+        GetRand(GetArg("-dropmessagestest", 0)) == 0) {
+        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
+        return true;
     }
 
-    else if (strCommand == NetMsgType::FEEFILTER) {
-        CAmount newFeeFilter = 0;
-        vRecv >> newFeeFilter;
-        if (MoneyRange(newFeeFilter)) {
-            {
-                LOCK(pfrom->cs_feeFilter);
-                pfrom->minFeeFilter = newFeeFilter;
-            }
-            LogPrint("net", "received: feefilter of %s from peer=%d\n",
-                     CFeeRate(newFeeFilter).ToString(), pfrom->id);
+    // Look the command up once, then dispatch on its id.
+    const NetMsgId msgId = GetNetMsgId(strCommand);
+
+    if (!(pfrom->GetLocalServices() & NODE_BLOOM) &&
+        (msgId == NetMsgId::FILTERLOAD || msgId == NetMsgId::FILTERADD)) {
+        if (pfrom->nVersion >= NO_BLOOM_VERSION) {
+            LOCK(cs_main);
+            Misbehaving(pfrom, 100, "no-bloom-version");
+            return false;
+        } else {
+            pfrom->fDisconnect = true;
+            return false;
         }
     }
 
-    else if (strCommand == NetMsgType::NOTFOUND) {
-        // We do not care about the NOTFOUND message, but logging an Unknown
-        // Command message would be undesirable as we transmit it ourselves.
+    // Rejects are accepted at any time. Anything else must follow a version
+    // message, and anything but verack must follow the verack as well.
+    if (msgId != NetMsgId::REJECT && msgId != NetMsgId::VERSION) {
+        if (pfrom->nVersion == 0) {
+            // Must have a version message before anything else
+            LOCK(cs_main);
+            Misbehaving(pfrom, 1, "missing-version");
+            return false;
+        }
+        if (msgId != NetMsgId::VERACK && !pfrom->fSuccessfullyConnected) {
+            // Must have a verack message before anything else
+            LOCK(cs_main);
+            Misbehaving(pfrom, 1, "missing-verack");
+            return false;
+        }
     }
 
-    else {
+    MessageHandler handler = msgId == NetMsgId::UNKNOWN
+                                 ? nullptr
+                                 : vMessageHandlers[size_t(msgId)];
+    if (handler == nullptr) {
         // Ignore unknown commands for extensibility
         LogPrint("net", "Unknown command \"%s\" from peer=%d\n",
                  SanitizeString(strCommand), pfrom->id);
+        return true;
     }
-
-    return true;
+    return handler(config, pfrom, strCommand, vRecv, nTimeReceived, chainparams,
+                   connman, interruptMsgProc);
 }
 
 static bool SendRejectsAndCheckIfBanned(CNode *pnode, CConnman &connman) {
@@ -3081,6 +3644,21 @@ static bool SendRejectsAndCheckIfBanned(CNode *pnode, CConnman &connman) {
     return false;
 }
 
+/**
+ * Hands a message's payload buffer back to its peer's pool when the message
+ * goes out of scope, whichever way ProcessMessages returns.
+ */
+class RecvBufferRecycler {
+public:
+    RecvBufferRecycler(CNode *pnodeIn, CDataStream &vRecvIn)
+        : pnode(pnodeIn), vRecv(vRecvIn) {}
+    ~RecvBufferRecycler() { pnode->RecycleRecvBuffer(vRecv); }
+
+private:
+    CNode *pnode;
+    CDataStream &vRecv;
+};
+
 bool ProcessMessages(const Config &config, CNode *pfrom, CConnman &connman,
                      const std::atomic<bool> &interruptMsgProc) {
     const CChainParams &chainparams = Params();
@@ -3129,6 +3707,9 @@ bool ProcessMessages(const Config &config, CNode *pfrom, CConnman &connman,
         fMoreWork = !pfrom->vProcessMsg.empty();
     }
     CNetMessage &msg(msgs.front());
+    // Declared before the cs_main lock below, so the buffer is returned after
+    // that lock is released.
+    RecvBufferRecycler recycler(pfrom, msg.vRecv);
 
     msg.SetVersion(pfrom->GetRecvVersion());
 
@@ -3177,6 +3758,7 @@ bool ProcessMessages(const Config &config, CNode *pfrom, CConnman &connman,
 
     // Process message
     bool fRet = false;
+    int64_t nProcessStart = GetTimeMicros();
     try {
         fRet = ProcessMessage(config, pfrom, strCommand, vRecv, msg.nTime,
                               chainparams, connman, interruptMsgProc);
@@ -3218,6 +3800,9 @@ bool ProcessMessages(const Config &config, CNode *pfrom, CConnman &connman,
         LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__,
                   SanitizeString(strCommand), nMessageSize, pfrom->id);
     }
+    connman.RecordMsgProcessed(pfrom, strCommand,
+                               GetTimeMicros() - nProcessStart,
+                               nProcessStart - msg.nTime);
 
     LOCK(cs_main);
     SendRejectsAndCheckIfBanned(pfrom, connman);
@@ -3225,19 +3810,53 @@ bool ProcessMessages(const Config &config, CNode *pfrom, CConnman &connman,
     return fMoreWork;
 }
 
-class CompareInvMempoolOrder {
-    CTxMemPool *mp;
+/**
+ * Sort transaction ids into announcement order: parents before children, then
+ * by feerate. Duplicates and transactions no longer in the mempool are dropped.
+ */
+static void SortInventoryForRelay(std::vector<uint256> &vHashes) {
+    AssertLockHeld(cs_main);
+    RelayOrderCache &cache = *relayOrderCache;
+    // New transactions don't change the scores of those already cached, so
+    // the cache is only dropped when transactions are removed, reorganized
+    // or prioritised.
+    unsigned int nScoresUpdated = mempool.GetScoresUpdated();
+    if (nScoresUpdated != cache.nScoresUpdated) {
+        cache.mapScores.clear();
+        cache.nScoresUpdated = nScoresUpdated;
+    }
 
-public:
-    CompareInvMempoolOrder(CTxMemPool *_mempool) { mp = _mempool; }
+    std::vector<uint256> vMissing;
+    for (const uint256 &hash : vHashes) {
+        if (!cache.mapScores.count(hash)) {
+            vMissing.push_back(hash);
+        }
+    }
+    if (!vMissing.empty()) {
+        std::vector<TxDepthAndScore> vFound;
+        mempool.GetDepthAndScore(vMissing, vFound);
+        for (const TxDepthAndScore &score : vFound) {
+            cache.mapScores.emplace(score.txid, score);
+        }
+    }
 
-    bool operator()(std::set<uint256>::iterator a,
-                    std::set<uint256>::iterator b) {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
+    std::vector<TxDepthAndScore> vScores;
+    vScores.reserve(vHashes.size());
+    for (const uint256 &hash : vHashes) {
+        auto it = cache.mapScores.find(hash);
+        if (it != cache.mapScores.end()) {
+            vScores.push_back(it->second);
+        }
     }
-};
+    std::sort(vScores.begin(), vScores.end(), CompareTxDepthAndScore());
+
+    vHashes.clear();
+    for (const TxDepthAndScore &score : vScores) {
+        if (vHashes.empty() || vHashes.back() != score.txid) {
+            vHashes.push_back(score.txid);
+        }
+    }
+}
 
 bool SendMessages(const Config &config, CNode *pto, CConnman &connman,
                   const std::atomic<bool> &interruptMsgProc) {
@@ -3570,6 +4189,7 @@ bool SendMessages(const Config &config, CNode *pto, CConnman &connman,
         if (fSendTrickle) {
             LOCK(pto->cs_filter);
             if (!pto->fRelayTxes) {
+                pto->vInventoryTxToSend.clear();
                 pto->setInventoryTxToSend.clear();
             }
         }
@@ -3589,7 +4209,6 @@ bool SendMessages(const Config &config, CNode *pto, CConnman &connman,
             for (const auto &txinfo : vtxinfo) {
                 const uint256 &txid = txinfo.tx->GetId();
                 CInv inv(MSG_TX, txid);
-                pto->setInventoryTxToSend.erase(txid);
                 if (filterrate) {
                     if (txinfo.feeRate.GetFeePerK() < filterrate) {
                         continue;
@@ -3613,44 +4232,33 @@ bool SendMessages(const Config &config, CNode *pto, CConnman &connman,
 
         // Determine transactions to relay
         if (fSendTrickle) {
-            // Produce a vector with all candidates for sending
-            std::vector<std::set<uint256>::iterator> vInvTx;
-            vInvTx.reserve(pto->setInventoryTxToSend.size());
-            for (std::set<uint256>::iterator it =
-                     pto->setInventoryTxToSend.begin();
-                 it != pto->setInventoryTxToSend.end(); it++) {
-                vInvTx.push_back(it);
-            }
             CAmount filterrate = 0;
             {
                 LOCK(pto->cs_feeFilter);
                 filterrate = pto->minFeeFilter;
             }
-            // Topologically and fee-rate sort the inventory we send for privacy
-            // and priority reasons. A heap is used so that not all items need
-            // sorting if only a few are being sent.
-            CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-            std::make_heap(vInvTx.begin(), vInvTx.end(),
-                           compareInvMempoolOrder);
+            // Take the candidates the peer does not know about yet and sort
+            // them topologically and by fee rate for privacy and priority
+            // reasons.
+            std::vector<uint256> vInvTx;
+            vInvTx.swap(pto->vInventoryTxToSend);
+            pto->setInventoryTxToSend.clear();
+            vInvTx.erase(std::remove_if(vInvTx.begin(), vInvTx.end(),
+                                        [&](const uint256 &hash) {
+                                            return pto->filterInventoryKnown
+                                                .contains(hash);
+                                        }),
+                         vInvTx.end());
+            SortInventoryForRelay(vInvTx);
             // No reason to drain out at many times the network's capacity,
             // especially since we have many peers and some will draw much
             // shorter delays.
             unsigned int nRelayedTransactions = 0;
+            size_t nProcessed = 0;
             LOCK(pto->cs_filter);
-            while (!vInvTx.empty() &&
+            while (nProcessed < vInvTx.size() &&
                    nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
-                // Fetch the top element from the heap
-                std::pop_heap(vInvTx.begin(), vInvTx.end(),
-                              compareInvMempoolOrder);
-                std::set<uint256>::iterator it = vInvTx.back();
-                vInvTx.pop_back();
-                uint256 hash = *it;
-                // Remove it from the to-be-sent set
-                pto->setInventoryTxToSend.erase(it);
-                // Check if not in the filter already
-                if (pto->filterInventoryKnown.contains(hash)) {
-                    continue;
-                }
+                const uint256 &hash = vInvTx[nProcessed++];
                 // Not in the mempool anymore? don't bother sending it.
                 auto txinfo = mempool.info(hash);
                 if (!txinfo.tx) {
@@ -3666,21 +4274,7 @@ bool SendMessages(const Config &config, CNode *pto, CConnman &connman,
                 // Send
                 vInv.push_back(CInv(MSG_TX, hash));
                 nRelayedTransactions++;
-                {
-                    // Expire old relay messages
-                    while (!vRelayExpiration.empty() &&
-                           vRelayExpiration.front().first < nNow) {
-                        mapRelay.erase(vRelayExpiration.front().second);
-                        vRelayExpiration.pop_front();
-                    }
-
-                    auto ret = mapRelay.insert(
-                        std::make_pair(hash, std::move(txinfo.tx)));
-                    if (ret.second) {
-                        vRelayExpiration.push_back(std::make_pair(
-                            nNow + 15 * 60 * 1000000, ret.first));
-                    }
-                }
+                relayCache->Add(txinfo.tx, nNow);
                 if (vInv.size() == MAX_INV_SZ) {
                     connman.PushMessage(pto,
                                         msgMaker.Make(NetMsgType::INV, vInv));
@@ -3688,6 +4282,11 @@ bool SendMessages(const Config &config, CNode *pto, CConnman &connman,
                 }
                 pto->filterInventoryKnown.insert(hash);
             }
+            // Keep what did not fit in this round for the next one.
+            for (size_t i = nProcessed; i < vInvTx.size(); i++) {
+                pto->vInventoryTxToSend.push_back(vInvTx[i]);
+                pto->setInventoryTxToSend.insert(vInvTx[i]);
+            }
         }
     }
     if (!vInv.empty()) {
@@ -3736,13 +4335,15 @@ bool SendMessages(const Config &config, CNode *pto, CConnman &connman,
     // Message: getdata (blocks)
     //
     std::vector<CInv> vGetData;
+    int nMaxBlocksInFlight = state.downloadSpeed.GetMaxBlocksInFlight();
     if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) &&
-        state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        state.nBlocksInFlight < nMaxBlocksInFlight) {
         std::vector<const CBlockIndex *> vToDownload;
         NodeId staller = -1;
-        FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER -
-                                                   state.nBlocksInFlight,
-                                 vToDownload, staller, consensusParams);
+        const CBlockIndex *pindexStalled = nullptr;
+        FindNextBlocksToDownload(
+            pto->GetId(), nMaxBlocksInFlight - state.nBlocksInFlight,
+            vToDownload, staller, pindexStalled, consensusParams);
         for (const CBlockIndex *pindex : vToDownload) {
             uint32_t nFetchFlags =
                 GetFetchFlags(pto, pindex->pprev, consensusParams);
@@ -3754,6 +4355,23 @@ bool SendMessages(const Config &config, CNode *pto, CConnman &connman,
                      pindex->GetBlockHash().ToString(), pindex->nHeight,
                      pto->id);
         }
+        if (staller != -1 &&
+            ShouldReassignBlock(&state, staller, pindexStalled, nNow)) {
+            // Ask this faster peer for the block holding back the window
+            // rather than waiting for the staller.
+            uint32_t nFetchFlags =
+                GetFetchFlags(pto, pindexStalled->pprev, consensusParams);
+            vGetData.push_back(
+                CInv(MSG_BLOCK | nFetchFlags, pindexStalled->GetBlockHash()));
+            State(staller)->nBlocksReassigned++;
+            MarkBlockAsInFlight(config, pto->GetId(),
+                                pindexStalled->GetBlockHash(), consensusParams,
+                                pindexStalled);
+            LogPrint("net", "Requesting stalled block %s (%d) peer=%d instead "
+                            "of peer=%d\n",
+                     pindexStalled->GetBlockHash().ToString(),
+                     pindexStalled->nHeight, pto->id, staller);
+        }
         if (state.nBlocksInFlight == 0 && staller != -1) {
             if (State(staller)->nStallingSince == 0) {
                 State(staller)->nStallingSince = nNow;
@@ -10,6 +10,7 @@
 #include "validationinterface.h"
 
 class Config;
+struct TxRelayCacheStats;
 
 /** Default for -maxorphantx, maximum number of orphan transactions kept in
  * memory */
@@ -21,6 +22,8 @@ static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** Default number of orphan+recently-replaced txn to keep around for block
  * reconstruction */
 static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
+/** Default for -peerblockfilters, serving compact block filters to peers */
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
 
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals &nodeSignals);
@@ -45,15 +48,53 @@ public:
                                   const std::shared_ptr<const CBlock> &pblock);
 };
 
+/** Moving averages of how fast a peer delivers the blocks we request from it.
+ * Requires cs_main. */
+struct CBlockDownloadSpeed {
+    //! Time to deliver one requested block, in microseconds
+    int64_t nMicrosPerBlock;
+    //! Download rate, in bytes per second
+    int64_t nBytesPerSec;
+    //! Size of the blocks delivered, in bytes
+    int64_t nBytesPerBlock;
+    //! When the last requested block arrived, in microseconds
+    int64_t nLastBlockReceived;
+    //! Number of requested blocks delivered
+    uint64_t nBlocks;
+
+    CBlockDownloadSpeed()
+        : nMicrosPerBlock(0), nBytesPerSec(0), nBytesPerBlock(0),
+          nLastBlockReceived(0), nBlocks(0) {}
+
+    /** Account for a requested block of nBytes that arrived at nNow. */
+    void AddBlock(int64_t nTimeRequested, size_t nBytes, int64_t nNow);
+    /** Number of blocks to keep in flight with the peer. */
+    int GetMaxBlocksInFlight() const;
+    /** How long, in microseconds, a block may be in flight from a staller
+     * before this peer is asked for it. */
+    int64_t GetReassignTimeout(const CBlockDownloadSpeed &staller) const;
+    /** Whether a block that has been in flight from a staller for
+     * nTimeInFlight microseconds should be requested from this peer. */
+    bool ShouldReassignFrom(const CBlockDownloadSpeed &staller,
+                            int64_t nTimeInFlight) const;
+};
+
 struct CNodeStateStats {
     int nMisbehavior;
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nMaxBlocksInFlight;
+    int64_t nBlockDownloadMicros;
+    int64_t nBlockDownloadBytesPerSec;
+    uint64_t nBlocksDownloaded;
+    uint64_t nBlocksReassigned;
 };
 
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
+/** Get statistics about the cache of recently announced transactions */
+void GetRelayCacheStats(TxRelayCacheStats &stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch, const std::string &reason);
 
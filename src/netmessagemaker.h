@@ -8,6 +8,7 @@
 
 #include "net.h"
 #include "serialize.h"
+#include "utiltime.h"
 
 class CNetMsgMaker {
 public:
@@ -16,10 +17,12 @@ public:
     template <typename... Args>
     CSerializedNetMsg Make(int nFlags, std::string sCommand,
                            Args &&... args) const {
+        int64_t nTimeStart = GetTimeMicros();
         CSerializedNetMsg msg;
         msg.command = std::move(sCommand);
         CVectorWriter{SER_NETWORK, nFlags | nVersion, msg.data, 0,
                       std::forward<Args>(args)...};
+        msg.nSerializeMicros = GetTimeMicros() - nTimeStart;
         return msg;
     }
 
@@ -8,6 +8,8 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <unordered_map>
+
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
@@ -39,25 +41,45 @@ const char *SENDCMPCT = "sendcmpct";
 const char *CMPCTBLOCK = "cmpctblock";
 const char *GETBLOCKTXN = "getblocktxn";
 const char *BLOCKTXN = "blocktxn";
+const char *GETCFILTERS = "getcfilters";
+const char *CFILTER = "cfilter";
+const char *GETCFHEADERS = "getcfheaders";
+const char *CFHEADERS = "cfheaders";
+const char *GETCFCHECKPT = "getcfcheckpt";
+const char *CFCHECKPT = "cfcheckpt";
 };
 
 /** All known message types. Keep this in the same order as the list of
  * messages above and in protocol.h.
  */
 static const std::string allNetMessageTypes[] = {
-    NetMsgType::VERSION,     NetMsgType::VERACK,     NetMsgType::ADDR,
-    NetMsgType::INV,         NetMsgType::GETDATA,    NetMsgType::MERKLEBLOCK,
-    NetMsgType::GETBLOCKS,   NetMsgType::GETHEADERS, NetMsgType::TX,
-    NetMsgType::HEADERS,     NetMsgType::BLOCK,      NetMsgType::GETADDR,
-    NetMsgType::MEMPOOL,     NetMsgType::PING,       NetMsgType::PONG,
-    NetMsgType::NOTFOUND,    NetMsgType::FILTERLOAD, NetMsgType::FILTERADD,
-    NetMsgType::FILTERCLEAR, NetMsgType::REJECT,     NetMsgType::SENDHEADERS,
-    NetMsgType::FEEFILTER,   NetMsgType::SENDCMPCT,  NetMsgType::CMPCTBLOCK,
-    NetMsgType::GETBLOCKTXN, NetMsgType::BLOCKTXN,
+    NetMsgType::VERSION,      NetMsgType::VERACK,       NetMsgType::ADDR,
+    NetMsgType::INV,          NetMsgType::GETDATA,      NetMsgType::MERKLEBLOCK,
+    NetMsgType::GETBLOCKS,    NetMsgType::GETHEADERS,   NetMsgType::TX,
+    NetMsgType::HEADERS,      NetMsgType::BLOCK,        NetMsgType::GETADDR,
+    NetMsgType::MEMPOOL,      NetMsgType::PING,         NetMsgType::PONG,
+    NetMsgType::NOTFOUND,     NetMsgType::FILTERLOAD,   NetMsgType::FILTERADD,
+    NetMsgType::FILTERCLEAR,  NetMsgType::REJECT,       NetMsgType::SENDHEADERS,
+    NetMsgType::FEEFILTER,    NetMsgType::SENDCMPCT,    NetMsgType::CMPCTBLOCK,
+    NetMsgType::GETBLOCKTXN,  NetMsgType::BLOCKTXN,     NetMsgType::GETCFILTERS,
+    NetMsgType::CFILTER,      NetMsgType::GETCFHEADERS, NetMsgType::CFHEADERS,
+    NetMsgType::GETCFCHECKPT, NetMsgType::CFCHECKPT,
 };
 static const std::vector<std::string>
     allNetMessageTypesVec(allNetMessageTypes,
                           allNetMessageTypes + ARRAYLEN(allNetMessageTypes));
+static_assert(ARRAYLEN(allNetMessageTypes) == size_t(NetMsgId::UNKNOWN),
+              "NetMsgId must list every message type in allNetMessageTypes");
+
+static std::unordered_map<std::string, NetMsgId> BuildNetMsgIds() {
+    std::unordered_map<std::string, NetMsgId> ids;
+    for (size_t i = 0; i < ARRAYLEN(allNetMessageTypes); i++) {
+        ids.emplace(allNetMessageTypes[i], NetMsgId(i));
+    }
+    return ids;
+}
+static const std::unordered_map<std::string, NetMsgId> mapNetMsgIds =
+    BuildNetMsgIds();
 
 CMessageHeader::CMessageHeader(const MessageStartChars &pchMessageStartIn) {
     memcpy(pchMessageStart, pchMessageStartIn, MESSAGE_START_SIZE);
@@ -164,3 +186,11 @@ std::string CInv::ToString() const {
 const std::vector<std::string> &getAllNetMessageTypes() {
     return allNetMessageTypesVec;
 }
+
+NetMsgId GetNetMsgId(const std::string &command) {
+    auto it = mapNetMsgIds.find(command);
+    if (it == mapNetMsgIds.end()) {
+        return NetMsgId::UNKNOWN;
+    }
+    return it->second;
+}
@@ -240,11 +240,90 @@ extern const char *GETBLOCKTXN;
  * @since protocol version 70014 as described by BIP 152
  */
 extern const char *BLOCKTXN;
+/**
+ * getcfilters requests the compact filters of a range of blocks.
+ * Peer should respond with one "cfilter" message per block.
+ * Only available with service bit NODE_COMPACT_FILTERS as described by BIP 157
+ */
+extern const char *GETCFILTERS;
+/**
+ * cfilter is a response to a getcfilters request containing the compact
+ * filter of one block.
+ */
+extern const char *CFILTER;
+/**
+ * getcfheaders requests the compact filter headers of a range of blocks.
+ * Peer should respond with a "cfheaders" message.
+ * Only available with service bit NODE_COMPACT_FILTERS as described by BIP 157
+ */
+extern const char *GETCFHEADERS;
+/**
+ * cfheaders is a response to a getcfheaders request containing the filter
+ * hashes of a range of blocks and the filter header preceding them.
+ */
+extern const char *CFHEADERS;
+/**
+ * getcfcheckpt requests the filter headers of evenly spaced blocks.
+ * Peer should respond with a "cfcheckpt" message.
+ * Only available with service bit NODE_COMPACT_FILTERS as described by BIP 157
+ */
+extern const char *GETCFCHECKPT;
+/**
+ * cfcheckpt is a response to a getcfcheckpt request containing the filter
+ * headers of every 1000th block up to the requested one.
+ */
+extern const char *CFCHECKPT;
 };
 
 /* Get a vector of all valid message types (see above) */
 const std::vector<std::string> &getAllNetMessageTypes();
 
+/**
+ * Interned identifiers for the message types above, in the same order as
+ * allNetMessageTypes in protocol.cpp. Message handling dispatches on these so
+ * that a command is looked up once instead of being compared against every
+ * known command string.
+ */
+enum class NetMsgId {
+    VERSION,
+    VERACK,
+    ADDR,
+    INV,
+    GETDATA,
+    MERKLEBLOCK,
+    GETBLOCKS,
+    GETHEADERS,
+    TX,
+    HEADERS,
+    BLOCK,
+    GETADDR,
+    MEMPOOL,
+    PING,
+    PONG,
+    NOTFOUND,
+    FILTERLOAD,
+    FILTERADD,
+    FILTERCLEAR,
+    REJECT,
+    SENDHEADERS,
+    FEEFILTER,
+    SENDCMPCT,
+    CMPCTBLOCK,
+    GETBLOCKTXN,
+    BLOCKTXN,
+    GETCFILTERS,
+    CFILTER,
+    GETCFHEADERS,
+    CFHEADERS,
+    GETCFCHECKPT,
+    CFCHECKPT,
+    // Any command not listed above.
+    UNKNOWN,
+};
+
+/** Map a message command to its identifier, or NetMsgId::UNKNOWN. */
+NetMsgId GetNetMsgId(const std::string &command);
+
 /** nServices flags */
 enum ServiceFlags : uint64_t {
     // Nothing
@@ -274,6 +353,10 @@ enum ServiceFlags : uint64_t {
     // TODO: remove (free up) the NODE_BITCOIN_CASH service bit once no longer
     // needed.
     NODE_BITCOIN_CASH = (1 << 5),
+    // NODE_COMPACT_FILTERS means the node will service basic block filter
+    // requests. See BIP 157 and BIP 158 for details on how this is
+    // implemented.
+    NODE_COMPACT_FILTERS = (1 << 6),
 
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
@@ -5,14 +5,20 @@
 
 #include "chain.h"
 #include "chainparams.h"
+#include "clientversion.h"
+#include "crypto/common.h"
 #include "httpserver.h"
+#include "index/addrindex.h"
+#include "index/blockfilterindex.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "rpc/blockchain.h"
+#include "rpc/jsonwriter.h"
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
 #include "txmempool.h"
+#include "util.h"
 #include "utilstrencodings.h"
 #include "validation.h"
 #include "version.h"
@@ -24,6 +30,12 @@
 // Allow a max of 15 outpoints to be queried at once.
 static const size_t MAX_GETUTXOS_OUTPOINTS = 15;
 
+// Allow a max of 1000 blocks to be streamed by one blockrange request.
+static const int MAX_REST_BLOCKRANGE = 1000;
+
+// Size of the pieces a blockrange reply is sent in.
+static const size_t REST_CHUNK_SIZE = 64 * 1024;
+
 enum RetFormat {
     RF_UNDEF,
     RF_BINARY,
@@ -57,15 +69,23 @@ struct CCoin {
 };
 
 extern void TxToJSON(const CTransaction &tx, const uint256 hashBlock,
-                     UniValue &entry);
-extern UniValue blockToJSON(const CBlock &block, const CBlockIndex *blockindex,
-                            bool txDetails = false);
+                     UniValue &entry, const CTxUndo *txundo = nullptr);
+extern void blockToJSON(JSONWriter &writer, const CBlock &block,
+                        const CBlockIndex *blockindex, bool txDetails = false,
+                        const CBlockUndo *blockundo = nullptr);
 extern UniValue mempoolInfoToJSON();
-extern UniValue mempoolToJSON(bool fVerbose = false);
+extern void mempoolToJSON(JSONWriter &writer, bool fVerbose = false);
 extern void ScriptPubKeyToJSON(const CScript &scriptPubKey, UniValue &out,
                                bool fIncludeHex);
 extern UniValue blockheaderToJSON(const CBlockIndex *blockindex);
 
+/** Writer that streams JSON straight into the reply buffer of a request. */
+static JSONTextWriter ReplyWriter(HTTPRequest *req) {
+    return JSONTextWriter([req](const char *data, size_t size) {
+        req->WriteReplyBody(data, size);
+    });
+}
+
 static bool RESTERR(HTTPRequest *req, enum HTTPStatusCode status,
                     std::string message) {
     req->WriteHeader("Content-Type", "text/plain");
@@ -180,8 +200,11 @@ static bool rest_headers(Config &config, HTTPRequest *req,
         }
         case RF_JSON: {
             UniValue jsonHeaders(UniValue::VARR);
-            for (const CBlockIndex *pindex : headers) {
-                jsonHeaders.push_back(blockheaderToJSON(pindex));
+            {
+                LOCK(cs_main);
+                for (const CBlockIndex *pindex : headers) {
+                    jsonHeaders.push_back(blockheaderToJSON(pindex));
+                }
             }
             std::string strJSON = jsonHeaders.write() + "\n";
             req->WriteHeader("Content-Type", "application/json");
@@ -246,10 +269,11 @@ static bool rest_block(HTTPRequest *req, const std::string &strURIPart,
         }
 
         case RF_JSON: {
-            UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-            std::string strJSON = objBlock.write() + "\n";
+            JSONTextWriter writer = ReplyWriter(req);
+            blockToJSON(writer, block, pblockindex, showTxDetails);
+            writer.Flush();
             req->WriteHeader("Content-Type", "application/json");
-            req->WriteReply(HTTP_OK, strJSON);
+            req->WriteReply(HTTP_OK, "\n");
             return true;
         }
 
@@ -275,6 +299,416 @@ static bool rest_block_notxdetails(Config &config, HTTPRequest *req,
     return rest_block(req, strURIPart, false);
 }
 
+/** Collects the body of a chunked reply into pieces of about REST_CHUNK_SIZE,
+ * hex encoding it on the way for RF_HEX. */
+class RESTChunkWriter {
+public:
+    RESTChunkWriter(HTTPRequest *reqIn, RetFormat rfIn)
+        : req(reqIn), rf(rfIn) {}
+
+    bool Write(const char *data, size_t size) {
+        if (rf == RF_HEX) {
+            buffer += HexStr(data, data + size);
+        } else {
+            buffer.append(data, size);
+        }
+        return buffer.size() < REST_CHUNK_SIZE || Flush();
+    }
+
+    /** Copy nSize bytes from file, preceded by the length. */
+    bool WriteRecord(FILE *file, uint32_t nSize) {
+        uint8_t length[4];
+        WriteLE32(length, nSize);
+        if (!Write((const char *)length, sizeof(length))) return false;
+
+        readBuffer.resize(REST_CHUNK_SIZE);
+        while (nSize > 0) {
+            size_t nRead = std::min<size_t>(nSize, readBuffer.size());
+            if (fread(readBuffer.data(), 1, nRead, file) != nRead) return false;
+            if (!Write(readBuffer.data(), nRead)) return false;
+            nSize -= nRead;
+        }
+        return true;
+    }
+
+    /** Send what is left, ending hex output with a newline. */
+    bool Finish() {
+        if (rf == RF_HEX) buffer += "\n";
+        return Flush();
+    }
+
+    bool Flush() {
+        bool fOk = buffer.empty() ||
+                   req->WriteReplyChunk(buffer.data(), buffer.size());
+        buffer.clear();
+        return fOk;
+    }
+
+private:
+    HTTPRequest *req;
+    RetFormat rf;
+    std::string buffer;
+    std::vector<char> readBuffer;
+};
+
+/**
+ * Stream the raw blocks of the active chain from height <start> on, each
+ * followed by its undo data, as they are stored on disk. Every block and undo
+ * record is preceded by its length as a 4 byte little endian integer; blocks
+ * without undo data (the genesis block) have an undo length of 0.
+ */
+static bool rest_blockrange(Config &config, HTTPRequest *req,
+                            const std::string &strURIPart) {
+    if (!CheckWarmup(req)) return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "No start or count specified. "
+                                              "Use /rest/blockrange/<start>/"
+                                              "<count>.<ext>.");
+
+    int32_t nStart, nCount;
+    if (!ParseInt32(path[0], &nStart) || nStart < 0)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid start: " + path[0]);
+    if (!ParseInt32(path[1], &nCount) || nCount < 1 ||
+        nCount > MAX_REST_BLOCKRANGE)
+        return RESTERR(req, HTTP_BAD_REQUEST,
+                       "Block count out of range: " + path[1]);
+
+    if (rf != RF_BINARY && rf != RF_HEX)
+        return RESTERR(req, HTTP_NOT_FOUND,
+                       "output format not found (available: .bin, .hex)");
+
+    std::shared_ptr<const ChainTipSnapshot> tip = GetChainTipSnapshot();
+    if (nStart > tip->nHeight)
+        return RESTERR(req, HTTP_NOT_FOUND,
+                       "Block height out of range: " + path[0]);
+
+    // Stop at the tip this request started with.
+    std::vector<const CBlockIndex *> blocks(
+        std::min(nCount, tip->nHeight - nStart + 1));
+    blocks.back() = (*tip)[nStart + blocks.size() - 1];
+    for (size_t i = blocks.size() - 1; i > 0; i--) {
+        blocks[i - 1] = blocks[i]->pprev;
+    }
+
+    {
+        LOCK(cs_main);
+        for (const CBlockIndex *pindex : blocks) {
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                return RESTERR(req, HTTP_NOT_FOUND,
+                               pindex->GetBlockHash().GetHex() +
+                                   " not available (pruned data)");
+        }
+    }
+
+    req->WriteHeader("Content-Type", rf == RF_HEX ? "text/plain"
+                                                  : "application/octet-stream");
+    req->StartReply(HTTP_OK);
+    if (req->GetRequestMethod() == HTTPRequest::HEAD) {
+        req->EndReply();
+        return true;
+    }
+
+    RESTChunkWriter writer(req, rf);
+    for (const CBlockIndex *pindex : blocks) {
+        uint32_t nBlockSize = 0, nUndoSize = 0;
+        FILE *blockFile = nullptr, *undoFile = nullptr;
+        bool fHaveUndo;
+        {
+            // Pruning may remove the files, but only while holding cs_main.
+            // Once open, they can be read without it.
+            LOCK(cs_main);
+            if (pindex->nStatus & BLOCK_HAVE_DATA)
+                blockFile = OpenRawBlockData(pindex->GetBlockPos(), false,
+                                             nBlockSize);
+            fHaveUndo = pindex->nStatus & BLOCK_HAVE_UNDO;
+            if (fHaveUndo)
+                undoFile =
+                    OpenRawBlockData(pindex->GetUndoPos(), true, nUndoSize);
+        }
+        CAutoFile blockIn(blockFile, SER_DISK, CLIENT_VERSION);
+        CAutoFile undoIn(undoFile, SER_DISK, CLIENT_VERSION);
+
+        bool fOk = !blockIn.IsNull() &&
+                   writer.WriteRecord(blockIn.Get(), nBlockSize);
+        if (fOk && fHaveUndo) {
+            fOk = !undoIn.IsNull() &&
+                  writer.WriteRecord(undoIn.Get(), nUndoSize);
+        } else if (fOk) {
+            fOk = writer.WriteRecord(nullptr, 0);
+        }
+        if (!fOk) {
+            // Drop the connection, so that the client sees the reply is cut
+            // short.
+            LogPrint("http", "%s: reply aborted at block %s\n", __func__,
+                     pindex->GetBlockHash().ToString());
+            req->EndReply(false);
+            return false;
+        }
+    }
+
+    if (!writer.Finish()) {
+        req->EndReply(false);
+        return false;
+    }
+    req->EndReply();
+    return true;
+}
+
+/**
+ * Answer an address index query with the result of its RPC call. The path is
+ * the address followed by the call's other parameters; the numeric ones come
+ * first and are all required.
+ */
+static bool rest_address_query(Config &config, HTTPRequest *req,
+                               const std::string &strURIPart,
+                               const_rpcfn_type actor, size_t nNumeric,
+                               const std::string &strUsage) {
+    if (!CheckWarmup(req)) return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    if (rf != RF_JSON) {
+        return RESTERR(req, HTTP_NOT_FOUND,
+                       "output format not found (available: json)");
+    }
+    if (!g_addressindex) {
+        return RESTERR(req, HTTP_NOT_FOUND,
+                       "The address index is disabled (start the node with "
+                       "-addressindex)");
+    }
+
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+    if (path.size() < nNumeric + 1 || path.size() > nNumeric + 2) {
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Use " +
+                                                  strUsage + ".");
+    }
+
+    JSONRPCRequest jsonRequest;
+    jsonRequest.params = UniValue(UniValue::VARR);
+    jsonRequest.params.push_back(path[0]);
+    for (size_t i = 1; i <= nNumeric; i++) {
+        int32_t n;
+        if (!ParseInt32(path[i], &n)) {
+            return RESTERR(req, HTTP_BAD_REQUEST, "Invalid number: " + path[i]);
+        }
+        jsonRequest.params.push_back(n);
+    }
+    if (path.size() > nNumeric + 1) {
+        jsonRequest.params.push_back(path.back());
+    }
+
+    UniValue result;
+    try {
+        result = actor(config, jsonRequest);
+    } catch (const UniValue &objError) {
+        return RESTERR(req, HTTP_BAD_REQUEST,
+                       find_value(objError, "message").get_str());
+    }
+
+    std::string strJSON = result.write() + "\n";
+    req->WriteHeader("Content-Type", "application/json");
+    req->WriteReply(HTTP_OK, strJSON);
+    return true;
+}
+
+static bool rest_addresshistory(Config &config, HTTPRequest *req,
+                                const std::string &strURIPart) {
+    return rest_address_query(
+        config, req, strURIPart, getaddresshistory, 2,
+        "/rest/addresshistory/<address>/<start_height>/<count>"
+        "[/<cursor>].json");
+}
+
+static bool rest_addressutxos(Config &config, HTTPRequest *req,
+                              const std::string &strURIPart) {
+    return rest_address_query(
+        config, req, strURIPart, getaddressutxos, 1,
+        "/rest/addressutxos/<address>/<count>[/<cursor>].json");
+}
+
+/**
+ * Check that the index of the filter type in the URI is enabled, and strip the
+ * filter type from the path.
+ */
+static bool CheckBlockFilterType(HTTPRequest *req,
+                                 std::vector<std::string> &path) {
+    BlockFilterType filterType;
+    if (path.empty() || !BlockFilterTypeByName(path[0], filterType)) {
+        return RESTERR(req, HTTP_BAD_REQUEST,
+                       "Unknown filtertype: " +
+                           (path.empty() ? std::string() : path[0]));
+    }
+    if (!g_blockfilterindex ||
+        g_blockfilterindex->GetFilterType() != filterType) {
+        return RESTERR(req, HTTP_NOT_FOUND,
+                       "Index is not enabled for filtertype " + path[0] +
+                           " (start the node with -blockfilterindex)");
+    }
+    path.erase(path.begin());
+    return true;
+}
+
+static bool rest_blockfilter(Config &config, HTTPRequest *req,
+                             const std::string &strURIPart) {
+    if (!CheckWarmup(req)) return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+    if (path.size() != 2) {
+        return RESTERR(req, HTTP_BAD_REQUEST,
+                       "Invalid URI format. Use "
+                       "/rest/blockfilter/<filtertype>/<hash>.<ext>.");
+    }
+    if (!CheckBlockFilterType(req, path)) {
+        return false;
+    }
+
+    uint256 hash;
+    if (!ParseHashStr(path[0], hash)) {
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + path[0]);
+    }
+
+    const CBlockIndex *pindex;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        if (it == mapBlockIndex.end()) {
+            return RESTERR(req, HTTP_NOT_FOUND, path[0] + " not found");
+        }
+        pindex = it->second;
+    }
+
+    BlockFilter filter;
+    if (!g_blockfilterindex->LookupFilter(pindex, filter)) {
+        return RESTERR(req, HTTP_NOT_FOUND,
+                       "Filter of " + path[0] + " not found" +
+                           (g_blockfilterindex->IsSynced()
+                                ? std::string()
+                                : " (the index is still syncing)"));
+    }
+
+    CDataStream ssFilter(SER_NETWORK, PROTOCOL_VERSION);
+    ssFilter << filter;
+
+    switch (rf) {
+        case RF_BINARY: {
+            req->WriteHeader("Content-Type", "application/octet-stream");
+            req->WriteReply(HTTP_OK, ssFilter.str());
+            return true;
+        }
+        case RF_HEX: {
+            req->WriteHeader("Content-Type", "text/plain");
+            req->WriteReply(HTTP_OK,
+                            HexStr(ssFilter.begin(), ssFilter.end()) + "\n");
+            return true;
+        }
+        case RF_JSON: {
+            UniValue result(UniValue::VOBJ);
+            result.push_back(
+                Pair("filter", HexStr(filter.GetEncodedFilter())));
+            req->WriteHeader("Content-Type", "application/json");
+            req->WriteReply(HTTP_OK, result.write() + "\n");
+            return true;
+        }
+        default: {
+            return RESTERR(req, HTTP_NOT_FOUND,
+                           "output format not found (available: " +
+                               AvailableDataFormatsString() + ")");
+        }
+    }
+}
+
+static bool rest_blockfilterheaders(Config &config, HTTPRequest *req,
+                                    const std::string &strURIPart) {
+    if (!CheckWarmup(req)) return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+    if (path.size() != 3) {
+        return RESTERR(req, HTTP_BAD_REQUEST,
+                       "Invalid URI format. Use /rest/blockfilterheaders/"
+                       "<filtertype>/<count>/<hash>.<ext>.");
+    }
+    if (!CheckBlockFilterType(req, path)) {
+        return false;
+    }
+
+    long count = strtol(path[0].c_str(), nullptr, 10);
+    if (count < 1 || count > 2000) {
+        return RESTERR(req, HTTP_BAD_REQUEST,
+                       "Header count out of range: " + path[0]);
+    }
+
+    uint256 hash;
+    if (!ParseHashStr(path[1], hash)) {
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + path[1]);
+    }
+
+    std::vector<const CBlockIndex *> blocks;
+    blocks.reserve(count);
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        const CBlockIndex *pindex =
+            (it != mapBlockIndex.end()) ? it->second : nullptr;
+        while (pindex != nullptr && chainActive.Contains(pindex)) {
+            blocks.push_back(pindex);
+            if (blocks.size() == (unsigned long)count) break;
+            pindex = chainActive.Next(pindex);
+        }
+    }
+
+    std::vector<uint256> headers;
+    headers.reserve(blocks.size());
+    for (const CBlockIndex *pindex : blocks) {
+        uint256 header;
+        if (!g_blockfilterindex->LookupFilterHeader(pindex, header)) {
+            break;
+        }
+        headers.push_back(header);
+    }
+
+    CDataStream ssHeaders(SER_NETWORK, PROTOCOL_VERSION);
+    for (const uint256 &header : headers) {
+        ssHeaders << header;
+    }
+
+    switch (rf) {
+        case RF_BINARY: {
+            req->WriteHeader("Content-Type", "application/octet-stream");
+            req->WriteReply(HTTP_OK, ssHeaders.str());
+            return true;
+        }
+        case RF_HEX: {
+            req->WriteHeader("Content-Type", "text/plain");
+            req->WriteReply(HTTP_OK,
+                            HexStr(ssHeaders.begin(), ssHeaders.end()) + "\n");
+            return true;
+        }
+        case RF_JSON: {
+            UniValue result(UniValue::VARR);
+            for (const uint256 &header : headers) {
+                result.push_back(header.GetHex());
+            }
+            req->WriteHeader("Content-Type", "application/json");
+            req->WriteReply(HTTP_OK, result.write() + "\n");
+            return true;
+        }
+        default: {
+            return RESTERR(req, HTTP_NOT_FOUND,
+                           "output format not found (available: " +
+                               AvailableDataFormatsString() + ")");
+        }
+    }
+}
+
 static bool rest_chaininfo(Config &config, HTTPRequest *req,
                            const std::string &strURIPart) {
     if (!CheckWarmup(req)) return false;
@@ -336,11 +770,11 @@ static bool rest_mempool_contents(Config &config, HTTPRequest *req,
 
     switch (rf) {
         case RF_JSON: {
-            UniValue mempoolObject = mempoolToJSON(true);
-
-            std::string strJSON = mempoolObject.write() + "\n";
+            JSONTextWriter writer = ReplyWriter(req);
+            mempoolToJSON(writer, true);
+            writer.Flush();
             req->WriteHeader("Content-Type", "application/json");
-            req->WriteReply(HTTP_OK, strJSON);
+            req->WriteReply(HTTP_OK, "\n");
             return true;
         }
         default: {
@@ -632,11 +1066,16 @@ static const struct {
     {"/rest/tx/", rest_tx},
     {"/rest/block/notxdetails/", rest_block_notxdetails},
     {"/rest/block/", rest_block_extended},
+    {"/rest/blockrange/", rest_blockrange},
     {"/rest/chaininfo", rest_chaininfo},
     {"/rest/mempool/info", rest_mempool_info},
     {"/rest/mempool/contents", rest_mempool_contents},
     {"/rest/headers/", rest_headers},
     {"/rest/getutxos", rest_getutxos},
+    {"/rest/addresshistory/", rest_addresshistory},
+    {"/rest/addressutxos/", rest_addressutxos},
+    {"/rest/blockfilter/", rest_blockfilter},
+    {"/rest/blockfilterheaders/", rest_blockfilterheaders},
 };
 
 bool StartREST() {
@@ -6,19 +6,27 @@
 #include "rpc/blockchain.h"
 
 #include "amount.h"
+#include "base58.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "clientversion.h"
 #include "coins.h"
 #include "config.h"
 #include "consensus/validation.h"
 #include "hash.h"
+#include "index/addrindex.h"
+#include "index/blockfilterindex.h"
+#include "index/txindex.h"
 #include "policy/policy.h"
 #include "primitives/transaction.h"
+#include "rpc/jsonwriter.h"
 #include "rpc/server.h"
+#include "script/standard.h"
 #include "streams.h"
 #include "sync.h"
 #include "txmempool.h"
+#include "undo.h"
 #include "util.h"
 #include "utilstrencodings.h"
 #include "validation.h"
@@ -40,7 +48,7 @@ static std::condition_variable cond_blockchange;
 static CUpdatedBlock latestblock;
 
 extern void TxToJSON(const CTransaction &tx, const uint256 hashBlock,
-                     UniValue &entry);
+                     UniValue &entry, const CTxUndo *txundo = nullptr);
 void ScriptPubKeyToJSON(const CScript &scriptPubKey, UniValue &out,
                         bool fIncludeHex);
 
@@ -71,7 +79,9 @@ double GetDifficulty(const CBlockIndex *blockindex) {
     return dDiff;
 }
 
+/** Requires cs_main. */
 UniValue blockheaderToJSON(const CBlockIndex *blockindex) {
+    AssertLockHeld(cs_main);
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
     int confirmations = -1;
@@ -97,56 +107,69 @@ UniValue blockheaderToJSON(const CBlockIndex *blockindex) {
         result.push_back(Pair("previousblockhash",
                               blockindex->pprev->GetBlockHash().GetHex()));
     }
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+    const CBlockIndex *pnext = chainActive.Next(blockindex);
     if (pnext) {
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     }
     return result;
 }
 
-UniValue blockToJSON(const CBlock &block, const CBlockIndex *blockindex,
-                     bool txDetails = false) {
-    UniValue result(UniValue::VOBJ);
-    result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
+/**
+ * Write a block one transaction at a time. Does not need cs_main, the chain is
+ * read from the published tip. With txDetails and the undo data of the block,
+ * the inputs also describe the outputs they spend.
+ */
+void blockToJSON(JSONWriter &writer, const CBlock &block,
+                 const CBlockIndex *blockindex, bool txDetails = false,
+                 const CBlockUndo *blockundo = nullptr) {
+    std::shared_ptr<const ChainTipSnapshot> tip = GetChainTipSnapshot();
+    writer.BeginObject();
+    writer.KeyValue("hash", blockindex->GetBlockHash().GetHex());
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex)) {
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
-    }
-    result.push_back(Pair("confirmations", confirmations));
-    result.push_back(Pair(
-        "size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("versionHex", strprintf("%08x", block.nVersion)));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    UniValue txs(UniValue::VARR);
-    for (const auto &tx : block.vtx) {
+    if (tip->Contains(blockindex)) {
+        confirmations = tip->nHeight - blockindex->nHeight + 1;
+    }
+    writer.KeyValue("confirmations", confirmations);
+    writer.KeyValue(
+        "size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.KeyValue("height", blockindex->nHeight);
+    writer.KeyValue("version", block.nVersion);
+    writer.KeyValue("versionHex", strprintf("%08x", block.nVersion));
+    writer.KeyValue("merkleroot", block.hashMerkleRoot.GetHex());
+    writer.Key("tx");
+    writer.BeginArray();
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = *block.vtx[i];
         if (txDetails) {
+            const CTxUndo *txundo =
+                blockundo != nullptr && i > 0 &&
+                        blockundo->vtxundo.size() + 1 == block.vtx.size()
+                    ? &blockundo->vtxundo[i - 1]
+                    : nullptr;
             UniValue objTx(UniValue::VOBJ);
-            TxToJSON(*tx, uint256(), objTx);
-            txs.push_back(objTx);
+            TxToJSON(tx, uint256(), objTx, txundo);
+            writer.Value(objTx);
         } else
-            txs.push_back(tx->GetId().GetHex());
+            writer.Value(tx.GetId().GetHex());
     }
-    result.push_back(Pair("tx", txs));
-    result.push_back(Pair("time", block.GetBlockTime()));
-    result.push_back(
-        Pair("mediantime", int64_t(blockindex->GetMedianTimePast())));
-    result.push_back(Pair("nonce", uint64_t(block.nNonce)));
-    result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
+    writer.EndArray();
+    writer.KeyValue("time", block.GetBlockTime());
+    writer.KeyValue("mediantime", int64_t(blockindex->GetMedianTimePast()));
+    writer.KeyValue("nonce", uint64_t(block.nNonce));
+    writer.KeyValue("bits", strprintf("%08x", block.nBits));
+    writer.KeyValue("difficulty", GetDifficulty(blockindex));
+    writer.KeyValue("chainwork", blockindex->nChainWork.GetHex());
 
     if (blockindex->pprev) {
-        result.push_back(Pair("previousblockhash",
-                              blockindex->pprev->GetBlockHash().GetHex()));
+        writer.KeyValue("previousblockhash",
+                        blockindex->pprev->GetBlockHash().GetHex());
     }
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+    const CBlockIndex *pnext = tip->Next(blockindex);
     if (pnext) {
-        result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
+        writer.KeyValue("nextblockhash", pnext->GetBlockHash().GetHex());
     }
-    return result;
+    writer.EndObject();
 }
 
 UniValue getblockcount(const Config &config, const JSONRPCRequest &request) {
@@ -161,8 +184,7 @@ UniValue getblockcount(const Config &config, const JSONRPCRequest &request) {
             HelpExampleRpc("getblockcount", ""));
     }
 
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainTipSnapshot()->nHeight;
 }
 
 UniValue getbestblockhash(const Config &config, const JSONRPCRequest &request) {
@@ -178,8 +200,7 @@ UniValue getbestblockhash(const Config &config, const JSONRPCRequest &request) {
             HelpExampleRpc("getbestblockhash", ""));
     }
 
-    LOCK(cs_main);
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetChainTipSnapshot()->hash.GetHex();
 }
 
 void RPCNotifyBlockChange(bool ibd, const CBlockIndex *pindex) {
@@ -364,8 +385,8 @@ UniValue getdifficulty(const Config &config, const JSONRPCRequest &request) {
                                  HelpExampleRpc("getdifficulty", ""));
     }
 
-    LOCK(cs_main);
-    return GetDifficulty();
+    std::shared_ptr<const ChainTipSnapshot> tip = GetChainTipSnapshot();
+    return tip->pindex ? GetDifficulty(tip->pindex) : 1.0;
 }
 
 std::string EntryDescriptionString() {
@@ -434,31 +455,32 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e) {
     info.push_back(Pair("depends", depends));
 }
 
-UniValue mempoolToJSON(bool fVerbose = false) {
+void mempoolToJSON(JSONWriter &writer, bool fVerbose = false) {
     if (fVerbose) {
         LOCK(mempool.cs);
-        UniValue o(UniValue::VOBJ);
+        writer.BeginObject();
         for (const CTxMemPoolEntry &e : mempool.mapTx) {
             const uint256 &txid = e.GetTx().GetId();
             UniValue info(UniValue::VOBJ);
             entryToJSON(info, e);
-            o.push_back(Pair(txid.ToString(), info));
+            writer.KeyValue(txid.ToString(), info);
         }
-        return o;
+        writer.EndObject();
     } else {
         std::vector<uint256> vtxids;
         mempool.queryHashes(vtxids);
 
-        UniValue a(UniValue::VARR);
+        writer.BeginArray();
         for (const uint256 &txid : vtxids) {
-            a.push_back(txid.ToString());
+            writer.Value(txid.ToString());
         }
-
-        return a;
+        writer.EndArray();
     }
 }
 
-UniValue getrawmempool(const Config &config, const JSONRPCRequest &request) {
+static void getrawmempoolStream(const Config &config,
+                                const JSONRPCRequest &request,
+                                JSONWriter &writer) {
     if (request.fHelp || request.params.size() > 1) {
         throw std::runtime_error(
             "getrawmempool ( verbose )\n"
@@ -487,7 +509,13 @@ UniValue getrawmempool(const Config &config, const JSONRPCRequest &request) {
         fVerbose = request.params[0].get_bool();
     }
 
-    return mempoolToJSON(fVerbose);
+    mempoolToJSON(writer, fVerbose);
+}
+
+UniValue getrawmempool(const Config &config, const JSONRPCRequest &request) {
+    JSONValueWriter writer;
+    getrawmempoolStream(config, request, writer);
+    return writer.GetValue();
 }
 
 UniValue getmempoolancestors(const Config &config,
@@ -671,14 +699,14 @@ UniValue getblockhash(const Config &config, const JSONRPCRequest &request) {
             HelpExampleRpc("getblockhash", "1000"));
     }
 
-    LOCK(cs_main);
+    std::shared_ptr<const ChainTipSnapshot> tip = GetChainTipSnapshot();
 
     int nHeight = request.params[0].get_int();
-    if (nHeight < 0 || nHeight > chainActive.Height()) {
+    if (nHeight < 0 || nHeight > tip->nHeight) {
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
     }
 
-    CBlockIndex *pblockindex = chainActive[nHeight];
+    const CBlockIndex *pblockindex = (*tip)[nHeight];
     return pblockindex->GetBlockHash().GetHex();
 }
 
@@ -732,8 +760,6 @@ UniValue getblockheader(const Config &config, const JSONRPCRequest &request) {
                                              "\""));
     }
 
-    LOCK(cs_main);
-
     std::string strHash = request.params[0].get_str();
     uint256 hash(uint256S(strHash));
 
@@ -742,11 +768,13 @@ UniValue getblockheader(const Config &config, const JSONRPCRequest &request) {
         fVerbose = request.params[1].get_bool();
     }
 
-    if (mapBlockIndex.count(hash) == 0) {
+    LOCK(cs_main);
+
+    BlockMap::const_iterator it = mapBlockIndex.find(hash);
+    if (it == mapBlockIndex.end()) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
     }
-
-    CBlockIndex *pblockindex = mapBlockIndex[hash];
+    const CBlockIndex *pblockindex = it->second;
 
     if (!fVerbose) {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -758,19 +786,27 @@ UniValue getblockheader(const Config &config, const JSONRPCRequest &request) {
     return blockheaderToJSON(pblockindex);
 }
 
-UniValue getblock(const Config &config, const JSONRPCRequest &request) {
+static void getblockStream(const Config &config, const JSONRPCRequest &request,
+                           JSONWriter &writer) {
     if (request.fHelp || request.params.size() < 1 ||
         request.params.size() > 2) {
         throw std::runtime_error(
             "getblock \"blockhash\" ( verbose )\n"
-            "\nIf verbose is false, returns a string that is serialized, "
+            "\nIf verbose is false or 0, returns a string that is serialized, "
             "hex-encoded data for block 'hash'.\n"
-            "If verbose is true, returns an Object with information about "
+            "If verbose is true or 1, returns an Object with information about "
             "block <hash>.\n"
+            "If verbose is 2, the transactions are described as by "
+            "getrawtransaction rather than by their id, and if it is 3, their "
+            "inputs also describe the outputs they spend (as by "
+            "getrawtransaction with verbose=2), read from the undo data of the "
+            "block.\n"
             "\nArguments:\n"
             "1. \"blockhash\"          (string, required) The block hash\n"
-            "2. verbose                (boolean, optional, default=true) true "
-            "for a json object, false for the hex encoded data\n"
+            "2. verbose                (boolean or numeric, optional, "
+            "default=true) true or 1 for a json object, false or 0 for the "
+            "hex encoded data, 2 or 3 for a json object with transaction "
+            "details\n"
             "\nResult (for verbose = true):\n"
             "{\n"
             "  \"hash\" : \"hash\",     (string) the block hash (same as "
@@ -811,45 +847,593 @@ UniValue getblock(const Config &config, const JSONRPCRequest &request) {
                                        "214adbda81d7e2a3dd146f6ed09\""));
     }
 
-    LOCK(cs_main);
-
     std::string strHash = request.params[0].get_str();
     uint256 hash(uint256S(strHash));
 
-    bool fVerbose = true;
+    int nVerbosity = 1;
     if (request.params.size() > 1) {
-        fVerbose = request.params[1].get_bool();
-    }
-
-    if (mapBlockIndex.count(hash) == 0) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        if (request.params[1].isNum()) {
+            nVerbosity = request.params[1].get_int();
+        } else {
+            nVerbosity = request.params[1].get_bool() ? 1 : 0;
+        }
     }
 
     CBlock block;
-    CBlockIndex *pblockindex = mapBlockIndex[hash];
+    const CBlockIndex *pblockindex;
+    {
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) == 0) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        }
 
-    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) &&
-        pblockindex->nTx > 0) {
-        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
-    }
+        pblockindex = mapBlockIndex[hash];
+
+        if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) &&
+            pblockindex->nTx > 0) {
+            throw JSONRPCError(RPC_MISC_ERROR,
+                               "Block not available (pruned data)");
+        }
 
-    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus())) {
-        // Block not found on disk. This could be because we have the block
-        // header in our index but don't have the block (for example if a
-        // non-whitelisted node sends us an unrequested long chain of valid
-        // blocks, we add the headers to our index, but don't accept the block).
-        throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
+        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus())) {
+            // Block not found on disk. This could be because we have the
+            // block header in our index but don't have the block (for example
+            // if a non-whitelisted node sends us an unrequested long chain of
+            // valid blocks, we add the headers to our index, but don't accept
+            // the block).
+            throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
+        }
     }
 
-    if (!fVerbose) {
+    if (nVerbosity <= 0) {
         CDataStream ssBlock(SER_NETWORK,
                             PROTOCOL_VERSION | RPCSerializationFlags());
         ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        writer.Value(HexStr(ssBlock.begin(), ssBlock.end()));
+        return;
+    }
+
+    std::shared_ptr<const CBlockUndo> blockundo;
+    if (nVerbosity >= 3 && !GetBlockUndo(pblockindex, blockundo)) {
+        throw JSONRPCError(RPC_MISC_ERROR,
+                           "Undo data of the block not available");
+    }
+    blockToJSON(writer, block, pblockindex, nVerbosity >= 2, blockundo.get());
+}
+
+UniValue getblock(const Config &config, const JSONRPCRequest &request) {
+    JSONValueWriter writer;
+    getblockStream(config, request, writer);
+    return writer.GetValue();
+}
+
+// Allow a max of 100 blocks to be returned by one getblockrange call.
+static const int MAX_RPC_BLOCKRANGE = 100;
+// Stop adding blocks to a getblockrange reply once their raw block and undo
+// data reach this size; the reply is twice as large once hex-encoded.
+static const size_t MAX_RPC_BLOCKRANGE_SIZE = 32 * 1000 * 1000;
+
+/** Read the block or undo record stored at pos, as it is on disk. */
+static bool ReadRawBlockData(const CDiskBlockPos &pos, bool fUndo,
+                             std::vector<uint8_t> &data) {
+    uint32_t nSize;
+    CAutoFile filein(OpenRawBlockData(pos, fUndo, nSize), SER_DISK,
+                     CLIENT_VERSION);
+    if (filein.IsNull()) return false;
+    data.resize(nSize);
+    return nSize == 0 ||
+           fread(data.data(), 1, nSize, filein.Get()) == nSize;
+}
+
+static void getblockrangeStream(const Config &config,
+                                const JSONRPCRequest &request,
+                                JSONWriter &writer) {
+    if (request.fHelp || request.params.size() != 2) {
+        throw std::runtime_error(
+            "getblockrange height count\n"
+            "\nReturns up to 'count' raw blocks of the main chain starting at "
+            "'height', with their undo data, as they are stored on disk.\n"
+            "Fewer blocks are returned if the chain ends before, or once the "
+            "raw data of the blocks returned reaches " +
+            std::to_string(MAX_RPC_BLOCKRANGE_SIZE) +
+            " bytes.\n"
+            "\nArguments:\n"
+            "1. height         (numeric, required) The height of the first "
+            "block\n"
+            "2. count          (numeric, required) The number of blocks, at "
+            "most " +
+            std::to_string(MAX_RPC_BLOCKRANGE) +
+            "\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"hash\" : \"hash\",   (string) The block hash\n"
+            "    \"height\" : n,        (numeric) The block height\n"
+            "    \"block\" : \"data\",  (string) The serialized, hex-encoded "
+            "block\n"
+            "    \"undo\" : \"data\",   (string) The serialized, hex-encoded "
+            "undo data of the block, empty for the genesis block\n"
+            "    \"error\" : \"msg\"    (string) Only present, instead of "
+            "block and undo, if the block could not be read\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getblockrange", "1000 10") +
+            HelpExampleRpc("getblockrange", "1000, 10"));
+    }
+
+    int nStart = request.params[0].get_int();
+    int nCount = request.params[1].get_int();
+    if (nCount < 1 || nCount > MAX_RPC_BLOCKRANGE) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block count out of range");
+    }
+
+    std::shared_ptr<const ChainTipSnapshot> tip = GetChainTipSnapshot();
+    if (nStart < 0 || nStart > tip->nHeight) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+    }
+
+    std::vector<const CBlockIndex *> blocks(
+        std::min(nCount, tip->nHeight - nStart + 1));
+    blocks.back() = (*tip)[nStart + blocks.size() - 1];
+    for (size_t i = blocks.size() - 1; i > 0; i--) {
+        blocks[i - 1] = blocks[i]->pprev;
+    }
+
+    {
+        LOCK(cs_main);
+        for (const CBlockIndex *pindex : blocks) {
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+                throw JSONRPCError(RPC_MISC_ERROR,
+                                   "Block not available (pruned data)");
+            }
+        }
+    }
+
+    // Output may already be on its way once the first blocks are written, so
+    // later read errors are reported per block rather than thrown.
+    writer.BeginArray();
+    std::vector<uint8_t> blockData, undoData;
+    size_t nTotalSize = 0;
+    for (const CBlockIndex *pindex : blocks) {
+        if (nTotalSize >= MAX_RPC_BLOCKRANGE_SIZE) {
+            break;
+        }
+
+        // Only the positions need cs_main. Files pruned in the meantime fail
+        // to open and are reported below.
+        bool fHaveData, fHaveUndo;
+        CDiskBlockPos blockPos, undoPos;
+        {
+            LOCK(cs_main);
+            fHaveData = pindex->nStatus & BLOCK_HAVE_DATA;
+            fHaveUndo = pindex->nStatus & BLOCK_HAVE_UNDO;
+            blockPos = pindex->GetBlockPos();
+            undoPos = pindex->GetUndoPos();
+        }
+        bool fOk = fHaveData && ReadRawBlockData(blockPos, false, blockData);
+        undoData.clear();
+        if (fOk && fHaveUndo) {
+            fOk = ReadRawBlockData(undoPos, true, undoData);
+        }
+
+        writer.BeginObject();
+        writer.KeyValue("hash", pindex->GetBlockHash().GetHex());
+        writer.KeyValue("height", pindex->nHeight);
+        if (fOk) {
+            writer.KeyValue("block", HexStr(blockData));
+            writer.KeyValue("undo", HexStr(undoData));
+            nTotalSize += blockData.size() + undoData.size();
+        } else {
+            writer.KeyValue("error", "Block not found on disk");
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+UniValue getblockrange(const Config &config, const JSONRPCRequest &request) {
+    JSONValueWriter writer;
+    getblockrangeStream(config, request, writer);
+    return writer.GetValue();
+}
+
+// Number of entries returned by one address index query by default, and at
+// most.
+static const int DEFAULT_ADDRESS_QUERY_COUNT = 1000;
+static const int MAX_ADDRESS_QUERY_COUNT = 10000;
+
+/** The script hash of an address or hex-encoded output script parameter. */
+static uint256 ParseScriptHash(const UniValue &param) {
+    const std::string &str = param.get_str();
+    CBitcoinAddress address(str);
+    if (address.IsValid()) {
+        return GetScriptHash(GetScriptForDestination(address.Get()));
+    }
+    if (!str.empty() && IsHex(str)) {
+        std::vector<uint8_t> data(ParseHex(str));
+        return GetScriptHash(CScript(data.begin(), data.end()));
+    }
+    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY,
+                       "Invalid address or output script");
+}
+
+static int ParseQueryCount(const UniValue &param) {
+    if (param.isNull()) {
+        return DEFAULT_ADDRESS_QUERY_COUNT;
+    }
+    int nCount = param.get_int();
+    if (nCount < 1 || nCount > MAX_ADDRESS_QUERY_COUNT) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Count out of range");
+    }
+    return nCount;
+}
+
+/** Cursors are the hex-encoded position of the first entry of a page. */
+template <typename T> static std::string EncodeCursor(const T &pos) {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << pos;
+    return HexStr(ss.begin(), ss.end());
+}
+
+template <typename T> static void DecodeCursor(const UniValue &param, T &pos) {
+    const std::string &str = param.get_str();
+    std::vector<uint8_t> data(ParseHex(str));
+    if (!IsHex(str) ||
+        data.size() != GetSerializeSize(pos, SER_NETWORK, PROTOCOL_VERSION)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    }
+    CDataStream ss(data, SER_NETWORK, PROTOCOL_VERSION);
+    ss >> pos;
+}
+
+static const AddressIndex &GetAddressIndex() {
+    if (!g_addressindex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "The address index is disabled "
+                                           "(start the node with "
+                                           "-addressindex)");
+    }
+    return *g_addressindex;
+}
+
+static UniValue OutPointToJSON(const COutPoint &outpoint) {
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("txid", outpoint.hash.GetHex()));
+    obj.push_back(Pair("vout", int64_t(outpoint.n)));
+    return obj;
+}
+
+UniValue getaddresshistory(const Config &config,
+                           const JSONRPCRequest &request) {
+    if (request.fHelp || request.params.size() < 1 ||
+        request.params.size() > 4) {
+        throw std::runtime_error(
+            "getaddresshistory \"address\" ( start_height count \"cursor\" )\n"
+            "\nReturns the outputs paying to an address or output script, and "
+            "their spends, in chain order. Requires -addressindex.\n"
+            "The index is built in the background and may lag behind the "
+            "chain tip; the mempool is not included.\n"
+            "\nArguments:\n"
+            "1. \"address\"      (string, required) The address, or the "
+            "hex-encoded output script\n"
+            "2. start_height   (numeric, optional, default=0) The height to "
+            "start at\n"
+            "3. count          (numeric, optional, default=" +
+            std::to_string(DEFAULT_ADDRESS_QUERY_COUNT) +
+            ") The number of entries, at most " +
+            std::to_string(MAX_ADDRESS_QUERY_COUNT) +
+            "\n"
+            "4. \"cursor\"       (string, optional) The cursor returned by "
+            "the previous call, to get the next entries; replaces "
+            "start_height\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\" : n,           (numeric) The height up to which "
+            "the index was complete\n"
+            "  \"history\" : [\n"
+            "    {\n"
+            "      \"height\" : n,       (numeric) The block height\n"
+            "      \"txid\" : \"hex\",     (string) The transaction id\n"
+            "      \"txpos\" : n,        (numeric) The position of the "
+            "transaction in the block\n"
+            "      \"type\" : \"type\",    (string) \"output\" or \"spend\"\n"
+            "      \"index\" : n,        (numeric) The output or input index "
+            "in the transaction\n"
+            "      \"outpoint\" : {      (json object) The output created, or "
+            "spent\n"
+            "        \"txid\" : \"hex\",\n"
+            "        \"vout\" : n\n"
+            "      },\n"
+            "      \"value\" : x.xxx     (numeric) The value of the output "
+            "in " +
+            CURRENCY_UNIT +
+            "\n"
+            "    }\n"
+            "    ,...\n"
+            "  ],\n"
+            "  \"cursor\" : \"hex\"        (string) The cursor of the next "
+            "entries, or null if there are none\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddresshistory",
+                           "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"") +
+            HelpExampleCli("getaddresshistory",
+                           "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\" 0 100") +
+            HelpExampleRpc("getaddresshistory",
+                           "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\", 0, 100"));
+    }
+
+    const AddressIndex &index = GetAddressIndex();
+    const uint256 scripthash = ParseScriptHash(request.params[0]);
+
+    AddressHistoryPos pos;
+    if (request.params.size() > 1 && !request.params[1].isNull()) {
+        int nHeight = request.params[1].get_int();
+        if (nHeight < 0) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER,
+                               "Block height out of range");
+        }
+        pos = AddressHistoryPos(nHeight, 0, false, 0);
+    }
+    const int nCount = ParseQueryCount(
+        request.params.size() > 2 ? request.params[2] : NullUniValue);
+    if (request.params.size() > 3 && !request.params[3].isNull()) {
+        DecodeCursor(request.params[3], pos);
+    }
+
+    // Read the best block first, so that the index is known to be complete up
+    // to it.
+    const CBlockIndex *pindexBest = index.GetBestBlock();
+
+    // One entry more than requested tells where the next page starts.
+    std::vector<AddressHistoryEntry> entries;
+    if (!index.FindHistory(scripthash, pos, nCount + 1, entries)) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read address index");
+    }
+
+    UniValue history(UniValue::VARR);
+    for (size_t i = 0; i < entries.size() && i < size_t(nCount); i++) {
+        const AddressHistoryEntry &entry = entries[i];
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("height", int64_t(entry.pos.nHeight)));
+        obj.push_back(Pair("txid", entry.txid.GetHex()));
+        obj.push_back(Pair("txpos", int64_t(entry.pos.nTxPos)));
+        obj.push_back(Pair("type", entry.pos.fOutput ? "output" : "spend"));
+        obj.push_back(Pair("index", int64_t(entry.pos.nIndex)));
+        obj.push_back(Pair("outpoint", OutPointToJSON(entry.outpoint)));
+        obj.push_back(Pair("value", ValueFromAmount(entry.nValue)));
+        history.push_back(obj);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("height", pindexBest ? pindexBest->nHeight : -1));
+    result.push_back(Pair("history", history));
+    result.push_back(Pair("cursor", entries.size() > size_t(nCount)
+                                        ? UniValue(EncodeCursor(
+                                              entries.back().pos))
+                                        : NullUniValue));
+    return result;
+}
+
+UniValue getaddressutxos(const Config &config, const JSONRPCRequest &request) {
+    if (request.fHelp || request.params.size() < 1 ||
+        request.params.size() > 3) {
+        throw std::runtime_error(
+            "getaddressutxos \"address\" ( count \"cursor\" )\n"
+            "\nReturns the unspent outputs paying to an address or output "
+            "script, ordered by outpoint. Requires -addressindex.\n"
+            "The index is built in the background and may lag behind the "
+            "chain tip; the mempool is not included.\n"
+            "\nArguments:\n"
+            "1. \"address\"      (string, required) The address, or the "
+            "hex-encoded output script\n"
+            "2. count          (numeric, optional, default=" +
+            std::to_string(DEFAULT_ADDRESS_QUERY_COUNT) +
+            ") The number of outputs, at most " +
+            std::to_string(MAX_ADDRESS_QUERY_COUNT) +
+            "\n"
+            "3. \"cursor\"       (string, optional) The cursor returned by "
+            "the previous call, to get the next outputs\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\" : n,           (numeric) The height up to which "
+            "the index was complete\n"
+            "  \"utxos\" : [\n"
+            "    {\n"
+            "      \"txid\" : \"hex\",     (string) The transaction id\n"
+            "      \"vout\" : n,         (numeric) The output index\n"
+            "      \"value\" : x.xxx,    (numeric) The value of the output "
+            "in " +
+            CURRENCY_UNIT +
+            "\n"
+            "      \"height\" : n        (numeric) The height of the block "
+            "that created the output\n"
+            "    }\n"
+            "    ,...\n"
+            "  ],\n"
+            "  \"cursor\" : \"hex\"        (string) The cursor of the next "
+            "outputs, or null if there are none\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressutxos",
+                           "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"") +
+            HelpExampleRpc("getaddressutxos",
+                           "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\", 100"));
+    }
+
+    const AddressIndex &index = GetAddressIndex();
+    const uint256 scripthash = ParseScriptHash(request.params[0]);
+    const int nCount = ParseQueryCount(
+        request.params.size() > 1 ? request.params[1] : NullUniValue);
+    COutPoint outpoint;
+    if (request.params.size() > 2 && !request.params[2].isNull()) {
+        DecodeCursor(request.params[2], outpoint);
+    }
+
+    const CBlockIndex *pindexBest = index.GetBestBlock();
+
+    std::vector<AddressUnspentEntry> entries;
+    if (!index.FindUnspent(scripthash, outpoint, nCount + 1, entries)) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read address index");
+    }
+
+    UniValue utxos(UniValue::VARR);
+    for (size_t i = 0; i < entries.size() && i < size_t(nCount); i++) {
+        const AddressUnspentEntry &entry = entries[i];
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("txid", entry.outpoint.hash.GetHex()));
+        obj.push_back(Pair("vout", int64_t(entry.outpoint.n)));
+        obj.push_back(Pair("value", ValueFromAmount(entry.nValue)));
+        obj.push_back(Pair("height", int64_t(entry.nHeight)));
+        utxos.push_back(obj);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("height", pindexBest ? pindexBest->nHeight : -1));
+    result.push_back(Pair("utxos", utxos));
+    result.push_back(Pair("cursor", entries.size() > size_t(nCount)
+                                        ? UniValue(EncodeCursor(
+                                              entries.back().outpoint))
+                                        : NullUniValue));
+    return result;
+}
+
+static void IndexInfoToJSON(const BaseIndex &index, const std::string &filter,
+                            UniValue &result) {
+    if (!filter.empty() && filter != index.GetName()) {
+        return;
+    }
+    const CBlockIndex *pindexBest = index.GetBestBlock();
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("synced", index.IsSynced()));
+    obj.push_back(
+        Pair("best_block_height", pindexBest ? pindexBest->nHeight : -1));
+    obj.push_back(
+        Pair("best_block_hash",
+             pindexBest ? UniValue(pindexBest->GetBlockHash().GetHex())
+                        : NullUniValue));
+    result.push_back(Pair(index.GetName(), obj));
+}
+
+static UniValue getindexinfo(const Config &config,
+                             const JSONRPCRequest &request) {
+    if (request.fHelp || request.params.size() > 1) {
+        throw std::runtime_error(
+            "getindexinfo ( \"index_name\" )\n"
+            "\nReturns the status of the enabled optional indexes. They are "
+            "built in the background, so they may lag behind the chain tip.\n"
+            "\nArguments:\n"
+            "1. \"index_name\"   (string, optional) Only return the status of "
+            "this index (txindex, addressindex or blockfilterindex)\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\" : {                 (object) One entry per index\n"
+            "    \"synced\" : true|false,   (boolean) Whether the index has "
+            "caught up with the chain tip since the node started\n"
+            "    \"best_block_height\" : n, (numeric) The height of the last "
+            "block the index covers\n"
+            "    \"best_block_hash\" : \"hex\" (string) The hash of that "
+            "block\n"
+            "  }\n"
+            "  ,...\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getindexinfo", "") +
+            HelpExampleCli("getindexinfo", "\"txindex\"") +
+            HelpExampleRpc("getindexinfo", "\"txindex\""));
     }
 
-    return blockToJSON(block, pblockindex);
+    const std::string filter =
+        request.params.size() > 0 && !request.params[0].isNull()
+            ? request.params[0].get_str()
+            : std::string();
+
+    UniValue result(UniValue::VOBJ);
+    if (g_txindex) {
+        IndexInfoToJSON(*g_txindex, filter, result);
+    }
+    if (g_addressindex) {
+        IndexInfoToJSON(*g_addressindex, filter, result);
+    }
+    if (g_blockfilterindex) {
+        IndexInfoToJSON(*g_blockfilterindex, filter, result);
+    }
+    return result;
+}
+
+static UniValue getblockfilter(const Config &config,
+                               const JSONRPCRequest &request) {
+    if (request.fHelp || request.params.size() < 1 ||
+        request.params.size() > 2) {
+        throw std::runtime_error(
+            "getblockfilter \"blockhash\" ( \"filtertype\" )\n"
+            "\nReturns the compact filter (BIP 158) of a block, and its "
+            "filter header. Requires -blockfilterindex.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"  (string, required) The hash of the block\n"
+            "2. \"filtertype\" (string, optional, default=basic) The type "
+            "of the filter\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : \"hex\",  (string) The hex-encoded filter\n"
+            "  \"header\" : \"hex\"   (string) The hex-encoded filter "
+            "header\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec3"
+                                             "7b049d214adbda81d7e2a3dd146f6ed09"
+                                             "\" \"basic\"") +
+            HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec3"
+                                             "7b049d214adbda81d7e2a3dd146f6ed09"
+                                             "\", \"basic\""));
+    }
+
+    const uint256 hashBlock = ParseHashV(request.params[0], "blockhash");
+    BlockFilterType filterType = BlockFilterType::BASIC;
+    if (request.params.size() > 1 && !request.params[1].isNull()) {
+        if (!BlockFilterTypeByName(request.params[1].get_str(), filterType)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY,
+                               "Unknown filtertype");
+        }
+    }
+
+    if (!g_blockfilterindex ||
+        g_blockfilterindex->GetFilterType() != filterType) {
+        throw JSONRPCError(RPC_MISC_ERROR,
+                           "Index is not enabled for filtertype " +
+                               BlockFilterTypeName(filterType));
+    }
+
+    const CBlockIndex *pindex;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hashBlock);
+        if (it == mapBlockIndex.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        }
+        pindex = it->second;
+    }
+
+    BlockFilter filter;
+    uint256 header;
+    if (!g_blockfilterindex->LookupFilter(pindex, filter) ||
+        !g_blockfilterindex->LookupFilterHeader(pindex, header)) {
+        std::string errmsg = "Filter not found.";
+        if (!g_blockfilterindex->IsSynced()) {
+            errmsg += " Block filters are still in the process of being "
+                      "indexed.";
+        } else {
+            errmsg += " This error is unexpected and indicates index "
+                      "corruption.";
+        }
+        throw JSONRPCError(RPC_MISC_ERROR, errmsg);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+    result.push_back(Pair("header", header.GetHex()));
+    return result;
 }
 
 struct CCoinsStats {
@@ -1470,7 +2054,17 @@ UniValue mempoolInfoToJSON() {
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("size", (int64_t)mempool.size()));
     ret.push_back(Pair("bytes", (int64_t)mempool.GetTotalTxSize()));
-    ret.push_back(Pair("usage", (int64_t)mempool.DynamicMemoryUsage()));
+    MemPoolUsageBreakdown usage = mempool.GetMemoryUsageBreakdown();
+    ret.push_back(Pair("usage", (int64_t)usage.Total()));
+    UniValue breakdown(UniValue::VOBJ);
+    breakdown.push_back(Pair("entries", (int64_t)usage.entries));
+    breakdown.push_back(Pair("index", (int64_t)usage.index));
+    breakdown.push_back(Pair("transactions", (int64_t)usage.transactions));
+    breakdown.push_back(Pair("links", (int64_t)usage.links));
+    breakdown.push_back(Pair("spends", (int64_t)usage.spends));
+    breakdown.push_back(Pair("deltas", (int64_t)usage.deltas));
+    breakdown.push_back(Pair("txhashes", (int64_t)usage.txhashes));
+    ret.push_back(Pair("usagebreakdown", breakdown));
     size_t maxmempool =
         GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     ret.push_back(Pair("maxmempool", (int64_t)maxmempool));
@@ -1492,6 +2086,21 @@ UniValue getmempoolinfo(const Config &config, const JSONRPCRequest &request) {
             "  \"bytes\": xxxxx,              (numeric) Transaction size.\n"
             "  \"usage\": xxxxx,              (numeric) Total memory usage for "
             "the mempool\n"
+            "  \"usagebreakdown\": {          (json object) Memory usage by "
+            "data structure, in bytes\n"
+            "    \"entries\": xxxxx,          (numeric) Mempool entries and "
+            "their index nodes\n"
+            "    \"index\": xxxxx,            (numeric) Txid hash table\n"
+            "    \"transactions\": xxxxx,     (numeric) Transaction data\n"
+            "    \"links\": xxxxx,            (numeric) Parent/child links "
+            "between entries\n"
+            "    \"spends\": xxxxx,           (numeric) Outpoints spent by "
+            "mempool transactions\n"
+            "    \"deltas\": xxxxx,           (numeric) Prioritisation "
+            "deltas\n"
+            "    \"txhashes\": xxxxx          (numeric) Hashes kept for "
+            "compact block reconstruction\n"
+            "  },\n"
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage "
             "for the mempool\n"
             "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to "
@@ -1630,18 +2239,23 @@ static const CRPCCommand commands[] = {
     //  category            name                      actor (function)        okSafe argNames
     //  ------------------- ------------------------  ----------------------  ------ ----------
     { "blockchain",         "getblockchaininfo",      getblockchaininfo,      true,  {} },
+    { "blockchain",         "getaddresshistory",      getaddresshistory,      true,  {"address","start_height","count","cursor"} },
+    { "blockchain",         "getaddressutxos",        getaddressutxos,        true,  {"address","count","cursor"} },
     { "blockchain",         "getbestblockhash",       getbestblockhash,       true,  {} },
     { "blockchain",         "getblockcount",          getblockcount,          true,  {} },
-    { "blockchain",         "getblock",               getblock,               true,  {"blockhash","verbose"} },
+    { "blockchain",         "getblock",               getblock,               true,  {"blockhash","verbose"}, getblockStream },
     { "blockchain",         "getblockhash",           getblockhash,           true,  {"height"} },
+    { "blockchain",         "getblockrange",          getblockrange,          true,  {"height","count"}, getblockrangeStream },
     { "blockchain",         "getblockheader",         getblockheader,         true,  {"blockhash","verbose"} },
     { "blockchain",         "getchaintips",           getchaintips,           true,  {} },
     { "blockchain",         "getdifficulty",          getdifficulty,          true,  {} },
+    { "blockchain",         "getindexinfo",           getindexinfo,           true,  {"index_name"} },
+    { "blockchain",         "getblockfilter",         getblockfilter,         true,  {"blockhash","filtertype"} },
     { "blockchain",         "getmempoolancestors",    getmempoolancestors,    true,  {"txid","verbose"} },
     { "blockchain",         "getmempooldescendants",  getmempooldescendants,  true,  {"txid","verbose"} },
     { "blockchain",         "getmempoolentry",        getmempoolentry,        true,  {"txid"} },
     { "blockchain",         "getmempoolinfo",         getmempoolinfo,         true,  {} },
-    { "blockchain",         "getrawmempool",          getrawmempool,          true,  {"verbose"} },
+    { "blockchain",         "getrawmempool",          getrawmempool,          true,  {"verbose"}, getrawmempoolStream },
     { "blockchain",         "gettxout",               gettxout,               true,  {"txid","n","include_mempool"} },
     { "blockchain",         "gettxoutsetinfo",        gettxoutsetinfo,        true,  {} },
     { "blockchain",         "pruneblockchain",        pruneblockchain,        true,  {"height"} },
@@ -11,5 +11,8 @@ class Config;
 class JSONRPCRequest;
 
 UniValue getblockchaininfo(const Config &config, const JSONRPCRequest &request);
+UniValue getaddresshistory(const Config &config,
+                           const JSONRPCRequest &request);
+UniValue getaddressutxos(const Config &config, const JSONRPCRequest &request);
 
 #endif // BITCOIN_RPCBLOCKCHAIN_H
@@ -48,6 +48,11 @@ static const CRPCConvertParam vRPCConvertParams[] = {
     {"getbalance", 1, "minconf"},
     {"getbalance", 2, "include_watchonly"},
     {"getblockhash", 0, "height"},
+    {"getblockrange", 0, "height"},
+    {"getblockrange", 1, "count"},
+    {"getaddresshistory", 1, "start_height"},
+    {"getaddresshistory", 2, "count"},
+    {"getaddressutxos", 1, "count"},
     {"waitforblockheight", 0, "height"},
     {"waitforblockheight", 1, "timeout"},
     {"waitforblock", 1, "timeout"},
@@ -114,6 +119,7 @@ static const CRPCConvertParam vRPCConvertParams[] = {
     {"getmempoolancestors", 1, "verbose"},
     {"getmempooldescendants", 1, "verbose"},
     {"disconnectnode", 1, "nodeid"},
+    {"getnetmsgprofile", 0, "nodeid"},
     // Echo with conversion (For testing only)
     {"echojson", 0, "arg0"},
     {"echojson", 1, "arg1"},
@@ -0,0 +1,206 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpc/jsonwriter.h"
+
+#include <cassert>
+#include <cstdint>
+
+/**
+ * Append str to out as a quoted JSON string, escaped the way UniValue escapes
+ * it. Runs of characters that need no escaping are copied in one go.
+ */
+static void AppendJSONString(std::string &out, const std::string &str) {
+    static const char *const hexDigits = "0123456789abcdef";
+    out += '"';
+    size_t nRunStart = 0;
+    for (size_t i = 0; i < str.size(); i++) {
+        uint8_t ch = str[i];
+        if (ch >= 0x20 && ch != '"' && ch != '\\' && ch != 0x7f) {
+            continue;
+        }
+        out.append(str, nRunStart, i - nRunStart);
+        nRunStart = i + 1;
+        switch (ch) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\b':
+                out += "\\b";
+                break;
+            case '\f':
+                out += "\\f";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                out += "\\u00";
+                out += hexDigits[ch >> 4];
+                out += hexDigits[ch & 0xf];
+        }
+    }
+    out.append(str, nRunStart, std::string::npos);
+    out += '"';
+}
+
+JSONTextWriter::JSONTextWriter(Sink sinkIn, size_t nChunkSizeIn)
+    : sink(sinkIn), nChunkSize(nChunkSizeIn), fAfterKey(false) {
+    buffer.reserve(nChunkSize);
+}
+
+void JSONTextWriter::BeginElement() {
+    if (fAfterKey) {
+        fAfterKey = false;
+        return;
+    }
+    if (!vEmpty.empty()) {
+        if (!vEmpty.back()) {
+            Append(",");
+        }
+        vEmpty.back() = false;
+    }
+}
+
+void JSONTextWriter::Append(const std::string &str) {
+    buffer += str;
+    MaybeFlush();
+}
+
+void JSONTextWriter::MaybeFlush() {
+    if (buffer.size() >= nChunkSize) {
+        Flush();
+    }
+}
+
+void JSONTextWriter::BeginObject() {
+    BeginElement();
+    Append("{");
+    vEmpty.push_back(true);
+}
+
+void JSONTextWriter::EndObject() {
+    assert(!vEmpty.empty());
+    vEmpty.pop_back();
+    Append("}");
+}
+
+void JSONTextWriter::BeginArray() {
+    BeginElement();
+    Append("[");
+    vEmpty.push_back(true);
+}
+
+void JSONTextWriter::EndArray() {
+    assert(!vEmpty.empty());
+    vEmpty.pop_back();
+    Append("]");
+}
+
+void JSONTextWriter::Key(const std::string &key) {
+    BeginElement();
+    AppendJSONString(buffer, key);
+    buffer += ':';
+    MaybeFlush();
+    fAfterKey = true;
+}
+
+void JSONTextWriter::Value(const UniValue &value) {
+    // Write containers element by element, so that large trees are not first
+    // turned into one string.
+    if (value.isObject()) {
+        BeginObject();
+        const std::vector<std::string> &keys = value.getKeys();
+        const std::vector<UniValue> &values = value.getValues();
+        for (size_t i = 0; i < keys.size(); i++) {
+            Key(keys[i]);
+            Value(values[i]);
+        }
+        EndObject();
+    } else if (value.isArray()) {
+        BeginArray();
+        for (const UniValue &element : value.getValues()) {
+            Value(element);
+        }
+        EndArray();
+    } else {
+        // Scalars go straight into the buffer rather than through
+        // UniValue::write(), which builds a string for each of them.
+        BeginElement();
+        switch (value.getType()) {
+            case UniValue::VSTR:
+                AppendJSONString(buffer, value.get_str());
+                break;
+            case UniValue::VNUM:
+                buffer += value.getValStr();
+                break;
+            case UniValue::VBOOL:
+                buffer += value.isTrue() ? "true" : "false";
+                break;
+            default:
+                buffer += "null";
+        }
+        MaybeFlush();
+    }
+}
+
+void JSONTextWriter::Flush() {
+    if (!buffer.empty()) {
+        sink(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+}
+
+void JSONValueWriter::Begin(UniValue::VType type) {
+    vStack.push_back(UniValue(type));
+    vKeys.push_back(std::string());
+}
+
+void JSONValueWriter::End() {
+    assert(!vStack.empty());
+    UniValue value = vStack.back();
+    vStack.pop_back();
+    vKeys.pop_back();
+    Value(value);
+}
+
+void JSONValueWriter::BeginObject() {
+    Begin(UniValue::VOBJ);
+}
+
+void JSONValueWriter::EndObject() {
+    End();
+}
+
+void JSONValueWriter::BeginArray() {
+    Begin(UniValue::VARR);
+}
+
+void JSONValueWriter::EndArray() {
+    End();
+}
+
+void JSONValueWriter::Key(const std::string &key) {
+    assert(!vStack.empty() && vStack.back().isObject());
+    vKeys.back() = key;
+}
+
+void JSONValueWriter::Value(const UniValue &value) {
+    if (vStack.empty()) {
+        root = value;
+    } else if (vStack.back().isObject()) {
+        vStack.back().pushKV(vKeys.back(), value);
+    } else {
+        vStack.back().push_back(value);
+    }
+}
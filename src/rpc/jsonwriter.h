@@ -0,0 +1,102 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPC_JSONWRITER_H
+#define BITCOIN_RPC_JSONWRITER_H
+
+#include <univalue.h>
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * Receiver of a JSON document as a sequence of tokens, so that large results
+ * can be produced piece by piece rather than as one UniValue tree.
+ */
+class JSONWriter {
+public:
+    virtual ~JSONWriter() {}
+
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+    /** Key of the next value, inside an object. */
+    virtual void Key(const std::string &key) = 0;
+    /** A complete value: an array element, an object member after Key(), or
+     * the whole document. */
+    virtual void Value(const UniValue &value) = 0;
+
+    void KeyValue(const std::string &key, const UniValue &value) {
+        Key(key);
+        Value(value);
+    }
+};
+
+/**
+ * Writes compact JSON text and hands it to a sink in chunks of about
+ * nChunkSize bytes, so that the document is never held as a whole in a
+ * string. Flush() must be called once the document is complete; anything not
+ * flushed is discarded.
+ */
+class JSONTextWriter : public JSONWriter {
+public:
+    typedef std::function<void(const char *data, size_t size)> Sink;
+
+    static const size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    explicit JSONTextWriter(Sink sinkIn,
+                            size_t nChunkSizeIn = DEFAULT_CHUNK_SIZE);
+
+    void BeginObject() override;
+    void EndObject() override;
+    void BeginArray() override;
+    void EndArray() override;
+    void Key(const std::string &key) override;
+    void Value(const UniValue &value) override;
+
+    /** Hand everything written so far to the sink. */
+    void Flush();
+
+private:
+    Sink sink;
+    size_t nChunkSize;
+    std::string buffer;
+    //! For each open container, whether it has no elements yet
+    std::vector<bool> vEmpty;
+    //! Whether a key was just written, so the value needs no separator
+    bool fAfterKey;
+
+    void BeginElement();
+    void Append(const std::string &str);
+    void MaybeFlush();
+};
+
+/** Builds the document as a UniValue, for callers that need the tree. */
+class JSONValueWriter : public JSONWriter {
+public:
+    void BeginObject() override;
+    void EndObject() override;
+    void BeginArray() override;
+    void EndArray() override;
+    void Key(const std::string &key) override;
+    void Value(const UniValue &value) override;
+
+    /** The completed document. */
+    const UniValue &GetValue() const { return root; }
+
+private:
+    UniValue root;
+    //! Open containers, innermost last
+    std::vector<UniValue> vStack;
+    //! Key of the next value of each open object
+    std::vector<std::string> vKeys;
+
+    void Begin(UniValue::VType type);
+    void End();
+};
+
+#endif // BITCOIN_RPC_JSONWRITER_H
@@ -14,6 +14,7 @@
 #include "protocol.h"
 #include "sync.h"
 #include "timedata.h"
+#include "txrelaycache.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -88,6 +89,8 @@ static UniValue getpeerinfo(const Config &config,
             "    \"lastrecv\": ttt,           (numeric) The time in seconds "
             "since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
+            "    \"sendsyscalls\": n,         (numeric) The number of send "
+            "system calls made\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes "
             "received\n"
             "    \"conntime\": ttt,           (numeric) The connection time in "
@@ -120,6 +123,18 @@ static UniValue getpeerinfo(const Config &config,
             "we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
+            "    \"blockdownload\": {\n"
+            "       \"maxinflight\": n,       (numeric) The number of blocks "
+            "we keep in flight with this peer\n"
+            "       \"blocktime\": n,         (numeric) Average time in "
+            "microseconds this peer takes to deliver a block\n"
+            "       \"throughput\": n,        (numeric) Average download rate "
+            "from this peer in bytes per second\n"
+            "       \"downloaded\": n,        (numeric) The number of "
+            "requested blocks this peer delivered\n"
+            "       \"reassigned\": n         (numeric) The number of blocks "
+            "requested from faster peers because this one stalled\n"
+            "    },\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is "
             "whitelisted\n"
             "    \"bytessent_per_msg\": {\n"
@@ -131,6 +146,17 @@ static UniValue getpeerinfo(const Config &config,
             "       \"addr\": n,              (numeric) The total bytes "
             "received aggregated by message type\n"
             "       ...\n"
+            "    },\n"
+            "    \"serializetime_per_msg\": {\n"
+            "       \"addr\": n,              (numeric) The total time in "
+            "microseconds spent serializing sent messages, by message type\n"
+            "       ...\n"
+            "    },\n"
+            "    \"processtime_per_msg\": {\n"
+            "       \"addr\": n,              (numeric) The total time in "
+            "microseconds spent processing received messages, by message "
+            "type\n"
+            "       ...\n"
             "    }\n"
             "  }\n"
             "  ,...\n"
@@ -162,6 +188,7 @@ static UniValue getpeerinfo(const Config &config,
         obj.push_back(Pair("lastsend", stats.nLastSend));
         obj.push_back(Pair("lastrecv", stats.nLastRecv));
         obj.push_back(Pair("bytessent", stats.nSendBytes));
+        obj.push_back(Pair("sendsyscalls", stats.nSendSyscalls));
         obj.push_back(Pair("bytesrecv", stats.nRecvBytes));
         obj.push_back(Pair("conntime", stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
@@ -188,6 +215,18 @@ static UniValue getpeerinfo(const Config &config,
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            UniValue download(UniValue::VOBJ);
+            download.push_back(
+                Pair("maxinflight", statestats.nMaxBlocksInFlight));
+            download.push_back(
+                Pair("blocktime", statestats.nBlockDownloadMicros));
+            download.push_back(
+                Pair("throughput", statestats.nBlockDownloadBytesPerSec));
+            download.push_back(
+                Pair("downloaded", statestats.nBlocksDownloaded));
+            download.push_back(
+                Pair("reassigned", statestats.nBlocksReassigned));
+            obj.push_back(Pair("blockdownload", download));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -203,6 +242,24 @@ static UniValue getpeerinfo(const Config &config,
         }
         obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
 
+        UniValue serializeTimePerMsgCmd(UniValue::VOBJ);
+        for (const mapMsgCmdProfile::value_type &i :
+             stats.mapSendProfilePerMsgCmd) {
+            if (i.second.nCount > 0)
+                serializeTimePerMsgCmd.push_back(
+                    Pair(i.first, i.second.nTotalMicros));
+        }
+        obj.push_back(Pair("serializetime_per_msg", serializeTimePerMsgCmd));
+
+        UniValue processTimePerMsgCmd(UniValue::VOBJ);
+        for (const mapMsgCmdProfile::value_type &i :
+             stats.mapRecvProfilePerMsgCmd) {
+            if (i.second.nCount > 0)
+                processTimePerMsgCmd.push_back(
+                    Pair(i.first, i.second.nTotalMicros));
+        }
+        obj.push_back(Pair("processtime_per_msg", processTimePerMsgCmd));
+
         ret.push_back(obj);
     }
 
@@ -403,6 +460,12 @@ static UniValue getnettotals(const Config &config,
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
             "  \"timemillis\": t,       (numeric) Current UNIX time in "
             "milliseconds\n"
+            "  \"totalserializetime\": n, (numeric) Total time in "
+            "microseconds spent serializing sent messages\n"
+            "  \"totalprocesstime\": n,   (numeric) Total time in "
+            "microseconds spent processing received messages\n"
+            "  \"totalqueuewait\": n,     (numeric) Total time in "
+            "microseconds received messages waited to be processed\n"
             "  \"uploadtarget\":\n"
             "  {\n"
             "    \"timeframe\": n,                         (numeric) Length of "
@@ -417,6 +480,21 @@ static UniValue getnettotals(const Config &config,
             "left in current time cycle\n"
             "    \"time_left_in_cycle\": t                 (numeric) Seconds "
             "left in current time cycle\n"
+            "  },\n"
+            "  \"relaycache\":           (json object) Recently announced "
+            "transactions kept for getdata\n"
+            "  {\n"
+            "    \"size\": n,           (numeric) Number of transactions\n"
+            "    \"usage\": n,          (numeric) Memory used in bytes\n"
+            "    \"maxusage\": n,       (numeric) Memory budget in bytes\n"
+            "    \"hits\": n,           (numeric) Requests served from the "
+            "cache\n"
+            "    \"misses\": n,         (numeric) Requests for transactions "
+            "not in the cache\n"
+            "    \"expired\": n,        (numeric) Transactions dropped after "
+            "the expiry time\n"
+            "    \"evicted\": n         (numeric) Transactions dropped early "
+            "to stay within the memory budget\n"
             "  }\n"
             "}\n"
             "\nExamples:\n" +
@@ -432,6 +510,19 @@ static UniValue getnettotals(const Config &config,
     obj.push_back(Pair("totalbytessent", g_connman->GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
 
+    mapMsgCmdProfile mapRecvProfile, mapSendProfile;
+    g_connman->GetMsgProfiles(mapRecvProfile, mapSendProfile);
+    CMsgCmdProfile recvTotal, sendTotal;
+    for (const mapMsgCmdProfile::value_type &i : mapRecvProfile) {
+        recvTotal += i.second;
+    }
+    for (const mapMsgCmdProfile::value_type &i : mapSendProfile) {
+        sendTotal += i.second;
+    }
+    obj.push_back(Pair("totalserializetime", sendTotal.nTotalMicros));
+    obj.push_back(Pair("totalprocesstime", recvTotal.nTotalMicros));
+    obj.push_back(Pair("totalqueuewait", recvTotal.nWaitMicros));
+
     UniValue outboundLimit(UniValue::VOBJ);
     outboundLimit.push_back(
         Pair("timeframe", g_connman->GetMaxOutboundTimeframe()));
@@ -445,6 +536,121 @@ static UniValue getnettotals(const Config &config,
     outboundLimit.push_back(
         Pair("time_left_in_cycle", g_connman->GetMaxOutboundTimeLeftInCycle()));
     obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    TxRelayCacheStats relayStats;
+    GetRelayCacheStats(relayStats);
+    UniValue relayCache(UniValue::VOBJ);
+    relayCache.push_back(Pair("size", (uint64_t)relayStats.nEntries));
+    relayCache.push_back(Pair("usage", (uint64_t)relayStats.nMemoryUsage));
+    relayCache.push_back(
+        Pair("maxusage", (uint64_t)relayStats.nMaxMemoryUsage));
+    relayCache.push_back(Pair("hits", relayStats.nHits));
+    relayCache.push_back(Pair("misses", relayStats.nMisses));
+    relayCache.push_back(Pair("expired", relayStats.nExpired));
+    relayCache.push_back(Pair("evicted", relayStats.nEvicted));
+    obj.push_back(Pair("relaycache", relayCache));
+    return obj;
+}
+
+static UniValue MsgProfileToJSON(const mapMsgCmdProfile &mapProfile,
+                                 bool fQueueWait) {
+    UniValue ret(UniValue::VOBJ);
+    for (const mapMsgCmdProfile::value_type &i : mapProfile) {
+        const CMsgCmdProfile &profile = i.second;
+        if (profile.nCount == 0) {
+            continue;
+        }
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("count", profile.nCount));
+        obj.push_back(Pair("time", profile.nTotalMicros));
+        obj.push_back(Pair("maxtime", profile.nMaxMicros));
+        if (fQueueWait) {
+            obj.push_back(Pair("queuewait", profile.nWaitMicros));
+        }
+        UniValue histogram(UniValue::VARR);
+        for (int b = 0; b < MSG_PROFILE_BUCKETS; b++) {
+            histogram.push_back(profile.vHistogram[b]);
+        }
+        obj.push_back(Pair("histogram", histogram));
+        ret.push_back(Pair(i.first, obj));
+    }
+    return ret;
+}
+
+static UniValue getnetmsgprofile(const Config &config,
+                                 const JSONRPCRequest &request) {
+    if (request.fHelp || request.params.size() > 1)
+        throw std::runtime_error(
+            "getnetmsgprofile ( nodeid )\n"
+            "\nReturns the time spent on each type of P2P message, either in "
+            "total since\n"
+            "startup or for a single connected peer.\n"
+            "\nArguments:\n"
+            "1. nodeid   (numeric, optional) Only report messages of this "
+            "peer (see getpeerinfo for node ids)\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"recv\": {                  (json object) Received messages, "
+            "by message type\n"
+            "    \"tx\": {\n"
+            "      \"count\": n,            (numeric) Number of messages "
+            "processed\n"
+            "      \"time\": n,             (numeric) Total processing time "
+            "in microseconds\n"
+            "      \"maxtime\": n,          (numeric) Longest processing "
+            "time in microseconds\n"
+            "      \"queuewait\": n,        (numeric) Total time in "
+            "microseconds spent waiting to be processed\n"
+            "      \"histogram\": [ n, ... ] (json array) Number of messages "
+            "by processing time:\n"
+            "                               under 1us, then [2^(i-1), 2^i) us "
+            "for entry i,\n"
+            "                               the last entry counting everything "
+            "longer\n"
+            "    },\n"
+            "    ...\n"
+            "  },\n"
+            "  \"send\": {                  (json object) Sent messages, by "
+            "message type, with the same\n"
+            "                               fields except queuewait, timing "
+            "their serialization\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getnetmsgprofile", "") +
+            HelpExampleCli("getnetmsgprofile", "1") +
+            HelpExampleRpc("getnetmsgprofile", ""));
+    if (!g_connman)
+        throw JSONRPCError(
+            RPC_CLIENT_P2P_DISABLED,
+            "Error: Peer-to-peer functionality missing or disabled");
+
+    mapMsgCmdProfile mapRecvProfile, mapSendProfile;
+    if (request.params.size() == 0 || request.params[0].isNull()) {
+        g_connman->GetMsgProfiles(mapRecvProfile, mapSendProfile);
+    } else {
+        NodeId nodeid = request.params[0].get_int64();
+        std::vector<CNodeStats> vstats;
+        g_connman->GetNodeStats(vstats);
+        bool fFound = false;
+        for (const CNodeStats &stats : vstats) {
+            if (stats.nodeid == nodeid) {
+                mapRecvProfile = stats.mapRecvProfilePerMsgCmd;
+                mapSendProfile = stats.mapSendProfilePerMsgCmd;
+                fFound = true;
+                break;
+            }
+        }
+        if (!fFound) {
+            throw JSONRPCError(RPC_CLIENT_NODE_NOT_CONNECTED,
+                               "Node not found in connected nodes");
+        }
+    }
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("recv", MsgProfileToJSON(mapRecvProfile, true)));
+    obj.push_back(Pair("send", MsgProfileToJSON(mapSendProfile, false)));
     return obj;
 }
 
@@ -744,6 +950,7 @@ static const CRPCCommand commands[] = {
     { "network",            "disconnectnode",         disconnectnode,         true,  {"address", "nodeid"} },
     { "network",            "getaddednodeinfo",       getaddednodeinfo,       true,  {"node"} },
     { "network",            "getnettotals",           getnettotals,           true,  {} },
+    { "network",            "getnetmsgprofile",       getnetmsgprofile,       true,  {"nodeid"} },
     { "network",            "getnetworkinfo",         getnetworkinfo,         true,  {} },
     { "network",            "setban",                 setban,                 true,  {"subnet", "command", "bantime", "absolute"} },
     { "network",            "listbanned",             listbanned,             true,  {} },
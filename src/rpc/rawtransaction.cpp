@@ -9,6 +9,7 @@
 #include "config.h"
 #include "consensus/validation.h"
 #include "core_io.h"
+#include "index/txindex.h"
 #include "init.h"
 #include "keystore.h"
 #include "merkleblock.h"
@@ -22,6 +23,7 @@
 #include "script/standard.h"
 #include "txmempool.h"
 #include "uint256.h"
+#include "undo.h"
 #include "utilstrencodings.h"
 #include "validation.h"
 #ifdef ENABLE_WALLET
@@ -60,8 +62,12 @@ void ScriptPubKeyToJSON(const CScript &scriptPubKey, UniValue &out,
     out.push_back(Pair("addresses", a));
 }
 
-void TxToJSON(const CTransaction &tx, const uint256 hashBlock,
-              UniValue &entry) {
+/**
+ * Write a transaction. If txundo is given, each input also includes the
+ * output it spends (prevout), and the transaction includes its fee.
+ */
+void TxToJSON(const CTransaction &tx, const uint256 hashBlock, UniValue &entry,
+              const CTxUndo *txundo = nullptr) {
     entry.push_back(Pair("txid", tx.GetId().GetHex()));
     entry.push_back(Pair("hash", tx.GetHash().GetHex()));
     entry.push_back(Pair(
@@ -69,6 +75,9 @@ void TxToJSON(const CTransaction &tx, const uint256 hashBlock,
     entry.push_back(Pair("version", tx.nVersion));
     entry.push_back(Pair("locktime", (int64_t)tx.nLockTime));
 
+    const bool fPrevouts = txundo != nullptr && !tx.IsCoinBase() &&
+                           txundo->vprevout.size() == tx.vin.size();
+    CAmount nValueIn = 0;
     UniValue vin(UniValue::VARR);
     for (unsigned int i = 0; i < tx.vin.size(); i++) {
         const CTxIn &txin = tx.vin[i];
@@ -85,6 +94,21 @@ void TxToJSON(const CTransaction &tx, const uint256 hashBlock,
                 "hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
             in.push_back(Pair("scriptSig", o));
         }
+        if (fPrevouts) {
+            const Coin &coin = txundo->vprevout[i];
+            UniValue prevout(UniValue::VOBJ);
+            prevout.push_back(Pair("generated", coin.IsCoinBase()));
+            if (coin.GetHeight() != MEMPOOL_HEIGHT) {
+                prevout.push_back(Pair("height", int64_t(coin.GetHeight())));
+            }
+            prevout.push_back(
+                Pair("value", ValueFromAmount(coin.GetTxOut().nValue)));
+            UniValue o(UniValue::VOBJ);
+            ScriptPubKeyToJSON(coin.GetTxOut().scriptPubKey, o, true);
+            prevout.push_back(Pair("scriptPubKey", o));
+            in.push_back(Pair("prevout", prevout));
+            nValueIn += coin.GetTxOut().nValue;
+        }
 
         in.push_back(Pair("sequence", (int64_t)txin.nSequence));
         vin.push_back(in);
@@ -104,6 +128,10 @@ void TxToJSON(const CTransaction &tx, const uint256 hashBlock,
     }
 
     entry.push_back(Pair("vout", vout));
+    if (fPrevouts) {
+        entry.push_back(
+            Pair("fee", ValueFromAmount(nValueIn - tx.GetValueOut())));
+    }
 
     if (!hashBlock.IsNull()) {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
@@ -136,15 +164,17 @@ static UniValue getrawtransaction(const Config &config,
             "outputs.\n"
 
             "\nReturn the raw transaction data.\n"
-            "\nIf verbose is 'true', returns an Object with information about "
-            "'txid'.\n"
-            "If verbose is 'false' or omitted, returns a string that is "
+            "\nIf verbose is 'true' or 1, returns an Object with information "
+            "about 'txid'; if it is 2, the inputs also describe the outputs "
+            "they spend.\n"
+            "If verbose is 'false', 0 or omitted, returns a string that is "
             "serialized, hex-encoded data for 'txid'.\n"
 
             "\nArguments:\n"
             "1. \"txid\"      (string, required) The transaction id\n"
-            "2. verbose       (bool, optional, default=false) If false, return "
-            "a string, otherwise return a json object\n"
+            "2. verbose       (bool or numeric, optional, default=false) If "
+            "false or 0, return a string, otherwise return a json object, with "
+            "the spent outputs if 2\n"
 
             "\nResult (if verbose is not set or set to false):\n"
             "\"data\"      (string) The serialized, hex-encoded data for "
@@ -170,7 +200,18 @@ static UniValue getrawtransaction(const Config &config,
             "         \"asm\": \"asm\",  (string) asm\n"
             "         \"hex\": \"hex\"   (string) hex\n"
             "       },\n"
-            "       \"sequence\": n      (numeric) The script sequence number\n"
+            "       \"sequence\": n,     (numeric) The script sequence number\n"
+            "       \"prevout\": {       (json object, verbose=2 only) The "
+            "output spent by the input\n"
+            "         \"generated\": true|false, (boolean) Whether it's a "
+            "coinbase output\n"
+            "         \"height\": n,     (numeric) The height of its block, "
+            "absent if it is in the mempool\n"
+            "         \"value\": x.xxx,  (numeric) The value in " +
+            CURRENCY_UNIT +
+            "\n"
+            "         \"scriptPubKey\": {...} (json object) As in vout\n"
+            "       }\n"
             "     }\n"
             "     ,...\n"
             "  ],\n"
@@ -194,6 +235,10 @@ static UniValue getrawtransaction(const Config &config,
             "     }\n"
             "     ,...\n"
             "  ],\n"
+            "  \"fee\" : x.xxx,            (numeric, verbose=2 only) The fee "
+            "in " +
+            CURRENCY_UNIT +
+            "\n"
             "  \"blockhash\" : \"hash\",   (string) the block hash\n"
             "  \"confirmations\" : n,      (numeric) The confirmations\n"
             "  \"time\" : ttt,             (numeric) The transaction time in "
@@ -205,23 +250,21 @@ static UniValue getrawtransaction(const Config &config,
             "\nExamples:\n" +
             HelpExampleCli("getrawtransaction", "\"mytxid\"") +
             HelpExampleCli("getrawtransaction", "\"mytxid\" true") +
+            HelpExampleCli("getrawtransaction", "\"mytxid\" 2") +
             HelpExampleRpc("getrawtransaction", "\"mytxid\", true"));
     }
 
-    LOCK(cs_main);
-
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    // Accept either a bool (true) or a num (>=1) to indicate verbose output.
-    bool fVerbose = false;
+    // Accept either a bool (true) or a num (>=1) to indicate verbose output,
+    // and 2 to also describe the spent outputs.
+    int nVerbosity = 0;
     if (request.params.size() > 1) {
         if (request.params[1].isNum()) {
-            if (request.params[1].get_int() != 0) {
-                fVerbose = true;
-            }
+            nVerbosity = request.params[1].get_int();
         } else if (request.params[1].isBool()) {
             if (request.params[1].isTrue()) {
-                fVerbose = true;
+                nVerbosity = 1;
             }
         } else {
             throw JSONRPCError(
@@ -230,26 +273,68 @@ static UniValue getrawtransaction(const Config &config,
         }
     }
 
+    // Mempool and transaction index lookups don't take cs_main, only the
+    // fallback to the UTXO set does.
     CTransactionRef tx;
     uint256 hashBlock;
     if (!GetTransaction(config, hash, tx, hashBlock, true)) {
-        throw JSONRPCError(
-            RPC_INVALID_ADDRESS_OR_KEY,
-            std::string(fTxIndex ? "No such mempool or blockchain transaction"
-                                 : "No such mempool transaction. Use -txindex "
-                                   "to enable blockchain transaction queries") +
-                ". Use gettransaction for wallet transactions.");
+        std::string errmsg;
+        if (!g_txindex) {
+            errmsg = "No such mempool transaction. Use -txindex to enable "
+                     "blockchain transaction queries";
+        } else if (!g_txindex->IsSynced()) {
+            errmsg = "No such mempool transaction. Blockchain transactions are "
+                     "still in the process of being indexed";
+        } else {
+            errmsg = "No such mempool or blockchain transaction";
+        }
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY,
+                           errmsg +
+                               ". Use gettransaction for wallet transactions.");
     }
 
     std::string strHex = EncodeHexTx(*tx, RPCSerializationFlags());
 
-    if (!fVerbose) {
+    if (nVerbosity == 0) {
         return strHex;
     }
 
+    // The spent outputs come from the undo data of the block, or for a
+    // mempool transaction, from the UTXO set and the mempool.
+    CTxUndo txundo;
+    bool fPrevouts = false;
+    if (nVerbosity >= 2 && !tx->IsCoinBase()) {
+        if (!hashBlock.IsNull()) {
+            const CBlockIndex *pindex = nullptr;
+            {
+                LOCK(cs_main);
+                BlockMap::const_iterator it = mapBlockIndex.find(hashBlock);
+                if (it != mapBlockIndex.end()) pindex = it->second;
+            }
+            // The undo data is read from disk without cs_main.
+            fPrevouts =
+                pindex != nullptr && GetTxUndo(pindex, tx->GetId(), txundo);
+        } else {
+            LOCK2(cs_main, mempool.cs);
+            CCoinsViewMemPool view(pcoinsTip, mempool);
+            fPrevouts = true;
+            for (const CTxIn &txin : tx->vin) {
+                txundo.vprevout.emplace_back();
+                if (!view.GetCoin(txin.prevout, txundo.vprevout.back())) {
+                    fPrevouts = false;
+                    break;
+                }
+            }
+        }
+    }
+
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hex", strHex));
-    TxToJSON(*tx, hashBlock, result);
+    {
+        // For the confirmations of the block containing the transaction.
+        LOCK(cs_main);
+        TxToJSON(*tx, hashBlock, result, fPrevouts ? &txundo : nullptr);
+    }
     return result;
 }
 
@@ -9,6 +9,7 @@
 #include "config.h"
 #include "init.h"
 #include "random.h"
+#include "rpc/jsonwriter.h"
 #include "sync.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -390,7 +391,13 @@ std::string JSONRPCExecBatch(Config &config, const UniValue &vReq) {
         ret.push_back(JSONRPCExecOne(config, vReq[reqIdx]));
     }
 
-    return ret.write() + "\n";
+    std::string strReply;
+    JSONTextWriter writer([&strReply](const char *data, size_t size) {
+        strReply.append(data, size);
+    });
+    writer.Value(ret);
+    writer.Flush();
+    return strReply + "\n";
 }
 
 /**
@@ -437,8 +444,8 @@ transformNamedArguments(const JSONRPCRequest &in,
     return out;
 }
 
-UniValue CRPCTable::execute(Config &config,
-                            const JSONRPCRequest &request) const {
+/** Find the method of a request, failing if RPC is still warming up. */
+static const CRPCCommand *FindCommand(const JSONRPCRequest &request) {
     // Return immediately if in warmup
     {
         LOCK(cs_rpcWarmup);
@@ -448,6 +455,12 @@ UniValue CRPCTable::execute(Config &config,
     // Find method
     const CRPCCommand *pcmd = tableRPC[request.strMethod];
     if (!pcmd) throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+    return pcmd;
+}
+
+UniValue CRPCTable::execute(Config &config,
+                            const JSONRPCRequest &request) const {
+    const CRPCCommand *pcmd = FindCommand(request);
 
     g_rpcSignals.PreCommand(*pcmd);
 
@@ -466,6 +479,32 @@ UniValue CRPCTable::execute(Config &config,
     g_rpcSignals.PostCommand(*pcmd);
 }
 
+void CRPCTable::execute(Config &config, const JSONRPCRequest &request,
+                        JSONWriter &writer) const {
+    const CRPCCommand *pcmd = FindCommand(request);
+    if (!pcmd->streamActor) {
+        writer.Value(execute(config, request));
+        return;
+    }
+
+    g_rpcSignals.PreCommand(*pcmd);
+
+    try {
+        // Execute, convert arguments to array if necessary
+        if (request.params.isObject()) {
+            pcmd->streamActor(
+                config, transformNamedArguments(request, pcmd->argNames),
+                writer);
+        } else {
+            pcmd->streamActor(config, request, writer);
+        }
+    } catch (const std::exception &e) {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+
+    g_rpcSignals.PostCommand(*pcmd);
+}
+
 std::vector<std::string> CRPCTable::listCommands() const {
     std::vector<std::string> commandList;
     typedef std::map<std::string, const CRPCCommand *> commandMap;
@@ -144,6 +144,17 @@ typedef UniValue (*rpcfn_type)(Config &config,
 typedef UniValue (*const_rpcfn_type)(const Config &config,
                                      const JSONRPCRequest &jsonRequest);
 
+class JSONWriter;
+
+/**
+ * Optional implementation of a method that writes its result to a JSONWriter
+ * instead of returning it, so that large results can be streamed into the
+ * reply. It must throw any error before writing anything.
+ */
+typedef void (*rpcstreamfn_type)(const Config &config,
+                                 const JSONRPCRequest &jsonRequest,
+                                 JSONWriter &writer);
+
 class CRPCCommand {
 public:
     std::string category;
@@ -151,11 +162,13 @@ public:
     rpcfn_type actor;
     bool okSafeMode;
     std::vector<std::string> argNames;
+    rpcstreamfn_type streamActor;
 
     CRPCCommand(std::string _category, std::string _name, rpcfn_type _actor,
                 bool _okSafeMode, std::vector<std::string> _argNames)
         : category{std::move(_category)}, name{std::move(_name)}, actor{_actor},
-          okSafeMode{_okSafeMode}, argNames{std::move(_argNames)} {}
+          okSafeMode{_okSafeMode}, argNames{std::move(_argNames)},
+          streamActor{nullptr} {}
 
     /**
      * It is safe to cast from void(const int*) to void(int*) but C++ do not
@@ -167,7 +180,16 @@ public:
                 std::vector<std::string> _argNames)
         : category{std::move(_category)}, name{std::move(_name)},
           actor{reinterpret_cast<rpcfn_type>(_actor)}, okSafeMode{_okSafeMode},
-          argNames{std::move(_argNames)} {}
+          argNames{std::move(_argNames)}, streamActor{nullptr} {}
+
+    /** A method that can also stream its result, see rpcstreamfn_type. */
+    CRPCCommand(std::string _category, std::string _name,
+                const_rpcfn_type _actor, bool _okSafeMode,
+                std::vector<std::string> _argNames,
+                rpcstreamfn_type _streamActor)
+        : category{std::move(_category)}, name{std::move(_name)},
+          actor{reinterpret_cast<rpcfn_type>(_actor)}, okSafeMode{_okSafeMode},
+          argNames{std::move(_argNames)}, streamActor{_streamActor} {}
 };
 
 /**
@@ -190,6 +212,15 @@ public:
      */
     UniValue execute(Config &config, const JSONRPCRequest &request) const;
 
+    /**
+     * Execute a method, writing its result to writer. Methods without a
+     * streaming implementation are run as usual and their result written.
+     * @throws an exception (UniValue) when an error happens, before anything
+     * is written.
+     */
+    void execute(Config &config, const JSONRPCRequest &request,
+                 JSONWriter &writer) const;
+
     /**
     * Returns a list of registered commands
     * @returns List of registered commands.
@@ -383,6 +383,15 @@ public:
         clear();
     }
 
+    /**
+     * Exchange the underlying buffer with d and rewind the stream, so that
+     * allocations can be recycled between streams.
+     */
+    void SwapBuffer(CSerializeData &d) {
+        vch.swap(d);
+        nReadPos = 0;
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
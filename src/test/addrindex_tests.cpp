@@ -0,0 +1,165 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/addrindex.h"
+
+#include "chain.h"
+#include "config.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "script/standard.h"
+#include "test/test_bitcoin.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <algorithm>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(addrindex_tests, TestChain100Setup)
+
+/** Wait for the index to reach the tip of chainActive. */
+static bool WaitForSync(const AddressIndex &index) {
+    for (int i = 0; i < 1000; i++) {
+        {
+            LOCK(cs_main);
+            if (index.GetBestBlock() == chainActive.Tip()) {
+                return true;
+            }
+        }
+        MilliSleep(10);
+    }
+    return false;
+}
+
+static std::vector<AddressHistoryEntry> GetHistory(const AddressIndex &index,
+                                                   const CScript &script) {
+    std::vector<AddressHistoryEntry> entries;
+    BOOST_CHECK(index.FindHistory(GetScriptHash(script), AddressHistoryPos(),
+                                  1000, entries));
+    return entries;
+}
+
+static std::vector<AddressUnspentEntry> GetUnspent(const AddressIndex &index,
+                                                   const CScript &script) {
+    std::vector<AddressUnspentEntry> entries;
+    BOOST_CHECK(
+        index.FindUnspent(GetScriptHash(script), COutPoint(), 1000, entries));
+    return entries;
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_sync_and_rewind) {
+    const CScript scriptCoinbase = CScript()
+                                   << ToByteVector(coinbaseKey.GetPubKey())
+                                   << OP_CHECKSIG;
+    CKey key;
+    key.MakeNewKey(true);
+    const CScript scriptDest =
+        GetScriptForDestination(key.GetPubKey().GetID());
+
+    AddressIndex index(1 << 20, true);
+    BOOST_CHECK(index.Start());
+    BOOST_CHECK(WaitForSync(index));
+
+    // One coinbase output per block.
+    std::vector<AddressHistoryEntry> history =
+        GetHistory(index, scriptCoinbase);
+    BOOST_CHECK_EQUAL(history.size(), 100);
+    for (size_t i = 0; i < history.size(); i++) {
+        BOOST_CHECK_EQUAL(history[i].pos.nHeight, i + 1);
+        BOOST_CHECK(history[i].pos.fOutput);
+        BOOST_CHECK(history[i].txid == coinbaseTxns[i].GetId());
+        BOOST_CHECK(history[i].outpoint ==
+                    COutPoint(coinbaseTxns[i].GetId(), 0));
+        BOOST_CHECK_EQUAL(history[i].nValue, coinbaseTxns[i].vout[0].nValue);
+    }
+    BOOST_CHECK_EQUAL(GetUnspent(index, scriptCoinbase).size(), 100);
+
+    // Pages continue where the previous one ended.
+    std::vector<AddressHistoryEntry> page;
+    BOOST_CHECK(index.FindHistory(GetScriptHash(scriptCoinbase),
+                                  AddressHistoryPos(), 30, page));
+    BOOST_CHECK(index.FindHistory(GetScriptHash(scriptCoinbase),
+                                  history[30].pos, 1000, page));
+    BOOST_CHECK_EQUAL(page.size(), 100);
+    BOOST_CHECK(page[30].txid == history[30].txid);
+    page.clear();
+    BOOST_CHECK(index.FindHistory(GetScriptHash(scriptCoinbase),
+                                  AddressHistoryPos(51, 0, false, 0), 1000,
+                                  page));
+    BOOST_CHECK_EQUAL(page.size(), 50);
+
+    // Spend the first coinbase to another script.
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(coinbaseTxns[0].GetId(), 0);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11 * CENT;
+    spend.vout[0].scriptPubKey = scriptDest;
+    std::vector<uint8_t> vchSig;
+    uint256 hash = SignatureHash(scriptCoinbase, spend, 0,
+                                 SIGHASH_ALL | SIGHASH_FORKID,
+                                 coinbaseTxns[0].vout[0].nValue);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back(uint8_t(SIGHASH_ALL | SIGHASH_FORKID));
+    spend.vin[0].scriptSig << vchSig;
+
+    CBlock block = CreateAndProcessBlock({spend}, scriptCoinbase);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    BOOST_CHECK(WaitForSync(index));
+
+    history = GetHistory(index, scriptCoinbase);
+    BOOST_CHECK_EQUAL(history.size(), 102);
+    // The coinbase output of the new block comes before the spend.
+    BOOST_CHECK_EQUAL(history[100].pos.nHeight, 101);
+    BOOST_CHECK_EQUAL(history[100].pos.nTxPos, 0);
+    BOOST_CHECK(history[100].pos.fOutput);
+    BOOST_CHECK_EQUAL(history[101].pos.nHeight, 101);
+    BOOST_CHECK_EQUAL(history[101].pos.nTxPos, 1);
+    BOOST_CHECK(!history[101].pos.fOutput);
+    BOOST_CHECK(history[101].txid == spend.GetId());
+    BOOST_CHECK(history[101].outpoint == spend.vin[0].prevout);
+    BOOST_CHECK_EQUAL(history[101].nValue, coinbaseTxns[0].vout[0].nValue);
+    std::vector<AddressUnspentEntry> unspent =
+        GetUnspent(index, scriptCoinbase);
+    BOOST_CHECK_EQUAL(unspent.size(), 100);
+    for (const AddressUnspentEntry &entry : unspent) {
+        BOOST_CHECK(entry.outpoint != spend.vin[0].prevout);
+    }
+
+    history = GetHistory(index, scriptDest);
+    BOOST_CHECK_EQUAL(history.size(), 1);
+    BOOST_CHECK(history[0].outpoint == COutPoint(spend.GetId(), 0));
+    unspent = GetUnspent(index, scriptDest);
+    BOOST_CHECK_EQUAL(unspent.size(), 1);
+    BOOST_CHECK_EQUAL(unspent[0].nValue, 11 * CENT);
+    BOOST_CHECK_EQUAL(unspent[0].nHeight, 101);
+
+    // Disconnecting the block rewinds the index.
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(GetConfig(), state, chainActive.Tip()));
+    }
+    BOOST_CHECK(WaitForSync(index));
+    BOOST_CHECK_EQUAL(index.GetBestBlock()->nHeight, 100);
+    BOOST_CHECK_EQUAL(GetHistory(index, scriptCoinbase).size(), 100);
+    unspent = GetUnspent(index, scriptCoinbase);
+    BOOST_CHECK_EQUAL(unspent.size(), 100);
+    BOOST_CHECK_EQUAL(
+        std::count_if(unspent.begin(), unspent.end(),
+                      [&](const AddressUnspentEntry &entry) {
+                          return entry.outpoint == spend.vin[0].prevout &&
+                                 entry.nHeight == 1;
+                      }),
+        1);
+    BOOST_CHECK(GetHistory(index, scriptDest).empty());
+    BOOST_CHECK(GetUnspent(index, scriptDest).empty());
+
+    index.Interrupt();
+    index.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,132 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net_processing.h"
+#include "validation.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockdownload_tests, BasicTestingSetup)
+
+/** A peer that delivered nBlocks blocks of nBytes, one every nMicros. */
+static CBlockDownloadSpeed MeasuredSpeed(int nBlocks, int64_t nMicros,
+                                         size_t nBytes = 1000000) {
+    CBlockDownloadSpeed speed;
+    int64_t nNow = 1000000;
+    for (int i = 0; i < nBlocks; i++) {
+        speed.AddBlock(nNow, nBytes, nNow + nMicros);
+        nNow += nMicros;
+    }
+    return speed;
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_speed_average) {
+    CBlockDownloadSpeed speed;
+    speed.AddBlock(0, 1000000, 500000);
+    BOOST_CHECK_EQUAL(speed.nBlocks, 1U);
+    BOOST_CHECK_EQUAL(speed.nMicrosPerBlock, 500000);
+    BOOST_CHECK_EQUAL(speed.nBytesPerSec, 2000000);
+    BOOST_CHECK_EQUAL(speed.nBytesPerBlock, 1000000);
+
+    // Requested together with the first block, the second one only counts
+    // from when the first arrived.
+    speed.AddBlock(0, 1000000, 1000000);
+    BOOST_CHECK_EQUAL(speed.nBlocks, 2U);
+    BOOST_CHECK_EQUAL(speed.nMicrosPerBlock, 500000);
+
+    // A slower sample moves the average by an eighth of the difference.
+    speed.AddBlock(1000000, 1000000, 1000000 + 1300000);
+    BOOST_CHECK_EQUAL(speed.nMicrosPerBlock, 500000 + 800000 / 8);
+    BOOST_CHECK_EQUAL(speed.nLastBlockReceived, 2300000);
+
+    speed.AddBlock(2300000, 9000000, 2300000 + 500000);
+    BOOST_CHECK_EQUAL(speed.nBytesPerBlock, 1000000 + 8000000 / 8);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_max_blocks_in_flight) {
+    // Unmeasured peers get the fixed limit.
+    BOOST_CHECK_EQUAL(CBlockDownloadSpeed().GetMaxBlocksInFlight(),
+                      MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS - 1, 10000)
+                          .GetMaxBlocksInFlight(),
+                      MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Measured peers get enough blocks for BLOCK_DOWNLOAD_QUEUE_TIME.
+    BOOST_CHECK_EQUAL(
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS, BLOCK_DOWNLOAD_QUEUE_TIME / 8)
+            .GetMaxBlocksInFlight(),
+        8);
+    BOOST_CHECK_EQUAL(
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS,
+                      BLOCK_DOWNLOAD_QUEUE_TIME / 32)
+            .GetMaxBlocksInFlight(),
+        32);
+
+    // Clamped for very fast and very slow peers.
+    BOOST_CHECK_EQUAL(
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS, 1).GetMaxBlocksInFlight(),
+        MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS,
+                                    10 * BLOCK_DOWNLOAD_QUEUE_TIME)
+                          .GetMaxBlocksInFlight(),
+                      MIN_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_reassign) {
+    const CBlockDownloadSpeed fast =
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS, 100000);
+    const CBlockDownloadSpeed slow =
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS, 300000);
+    const CBlockDownloadSpeed similar =
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS, 150000);
+
+    // Only after the block has been in flight for BLOCK_REASSIGN_TIMEOUT.
+    BOOST_CHECK(!fast.ShouldReassignFrom(slow, BLOCK_REASSIGN_TIMEOUT - 1));
+    BOOST_CHECK(fast.ShouldReassignFrom(slow, BLOCK_REASSIGN_TIMEOUT));
+
+    // Only to a peer at least twice as fast.
+    BOOST_CHECK(!fast.ShouldReassignFrom(similar, BLOCK_REASSIGN_TIMEOUT));
+    BOOST_CHECK(!slow.ShouldReassignFrom(fast, BLOCK_REASSIGN_TIMEOUT));
+
+    // An unmeasured staller is assumed slow, an unmeasured peer never takes
+    // over.
+    BOOST_CHECK(
+        fast.ShouldReassignFrom(CBlockDownloadSpeed(), BLOCK_REASSIGN_TIMEOUT));
+    BOOST_CHECK(
+        !CBlockDownloadSpeed().ShouldReassignFrom(slow, BLOCK_REASSIGN_TIMEOUT));
+    BOOST_CHECK(!MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS - 1, 1000)
+                     .ShouldReassignFrom(slow, BLOCK_REASSIGN_TIMEOUT));
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_reassign_timeout) {
+    // Small blocks get the minimum timeout.
+    const CBlockDownloadSpeed fast =
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS, 100000);
+    const CBlockDownloadSpeed slow =
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS, 300000);
+    BOOST_CHECK_EQUAL(fast.GetReassignTimeout(slow), BLOCK_REASSIGN_TIMEOUT);
+
+    // 8 MB blocks take the staller 3 seconds, so it gets twice that.
+    const CBlockDownloadSpeed fastLarge =
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS, 1000000, 8000000);
+    const CBlockDownloadSpeed slowLarge =
+        MeasuredSpeed(BLOCK_DOWNLOAD_WARMUP_BLOCKS, 3000000, 8000000);
+    BOOST_CHECK(!fastLarge.ShouldReassignFrom(slowLarge, 5900000));
+    BOOST_CHECK(fastLarge.ShouldReassignFrom(slowLarge, 6100000));
+
+    // The block is taken to be as large as the recent blocks of either peer.
+    BOOST_CHECK(!fast.ShouldReassignFrom(slowLarge, 5900000));
+    BOOST_CHECK(fast.ShouldReassignFrom(slowLarge, 6100000));
+
+    // An unmeasured staller is given the time this peer needs, twice over.
+    BOOST_CHECK_EQUAL(fastLarge.GetReassignTimeout(CBlockDownloadSpeed()),
+                      2000000);
+    BOOST_CHECK_EQUAL(CBlockDownloadSpeed().GetReassignTimeout(
+                          CBlockDownloadSpeed()),
+                      BLOCK_REASSIGN_TIMEOUT);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,151 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+#include "test/test_random.h"
+#include "undo.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilter_tests, BasicTestingSetup)
+
+static GCSFilter::Element RandomElement() {
+    GCSFilter::Element element(32);
+    for (uint8_t &byte : element) {
+        byte = insecure_rand();
+    }
+    return element;
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_test) {
+    GCSFilter::ElementSet included;
+    GCSFilter::ElementSet excluded;
+    for (int i = 0; i < 100; i++) {
+        included.insert(RandomElement());
+        excluded.insert(RandomElement());
+    }
+
+    const GCSFilter::Params params(0, 0, 10, 1 << 10);
+    const GCSFilter filter(params, included);
+    BOOST_CHECK_EQUAL(filter.GetN(), included.size());
+    for (const GCSFilter::Element &element : included) {
+        BOOST_CHECK(filter.Match(element));
+        BOOST_CHECK(filter.MatchAny(GCSFilter::ElementSet{element}));
+    }
+    BOOST_CHECK(filter.MatchAny(included));
+
+    // About one in 2^10 queries is a false positive.
+    size_t nFalsePositives = 0;
+    for (const GCSFilter::Element &element : excluded) {
+        nFalsePositives += filter.Match(element);
+    }
+    BOOST_CHECK(nFalsePositives < 5);
+
+    // The filter decodes from its encoding.
+    const GCSFilter decoded(params, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), filter.GetN());
+    for (const GCSFilter::Element &element : included) {
+        BOOST_CHECK(decoded.Match(element));
+    }
+
+    // Truncated encodings and excess data are rejected.
+    std::vector<uint8_t> encoded = filter.GetEncoded();
+    encoded.resize(encoded.size() / 2);
+    BOOST_CHECK_THROW(GCSFilter(params, encoded), std::ios_base::failure);
+    encoded = filter.GetEncoded();
+    encoded.push_back(0);
+    BOOST_CHECK_THROW(GCSFilter(params, encoded), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_empty_test) {
+    const GCSFilter empty;
+    BOOST_CHECK_EQUAL(empty.GetN(), 0);
+    BOOST_CHECK(empty.GetEncoded() == std::vector<uint8_t>(1, 0));
+    BOOST_CHECK(!empty.Match(RandomElement()));
+
+    const GCSFilter filter{GCSFilter::Params(), GCSFilter::ElementSet()};
+    BOOST_CHECK(filter.GetEncoded() == empty.GetEncoded());
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic_test) {
+    const CScript includedScripts[] = {
+        CScript() << OP_1 << OP_2,
+        CScript() << OP_3 << OP_4,
+        CScript() << OP_5 << OP_6,
+        CScript() << OP_7 << OP_8,
+    };
+    const CScript excludedScripts[] = {
+        CScript() << OP_RETURN << OP_4 << OP_ADD << OP_8 << OP_EQUAL,
+        CScript(),
+        CScript() << OP_9 << OP_10,
+    };
+
+    CMutableTransaction tx;
+    tx.vout.emplace_back(100, includedScripts[0]);
+    tx.vout.emplace_back(200, includedScripts[1]);
+    tx.vout.emplace_back(0, excludedScripts[0]);
+    tx.vout.emplace_back(300, excludedScripts[1]);
+
+    CBlock block;
+    block.nNonce = 42;
+    block.vtx.push_back(MakeTransactionRef(tx));
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.emplace_back();
+    blockundo.vtxundo.back().vprevout.emplace_back(
+        CTxOut(500, includedScripts[2]), 1000, true);
+    blockundo.vtxundo.back().vprevout.emplace_back(
+        CTxOut(600, includedScripts[3]), 10000, false);
+    blockundo.vtxundo.back().vprevout.emplace_back(
+        CTxOut(700, excludedScripts[1]), 100000, false);
+
+    const BlockFilter filter(BlockFilterType::BASIC, block, blockundo);
+    BOOST_CHECK(filter.GetBlockHash() == block.GetHash());
+    const GCSFilter &gcs = filter.GetFilter();
+    BOOST_CHECK_EQUAL(gcs.GetN(), 4);
+    for (const CScript &script : includedScripts) {
+        BOOST_CHECK(
+            gcs.Match(GCSFilter::Element(script.begin(), script.end())));
+    }
+    for (const CScript &script : excludedScripts) {
+        BOOST_CHECK(
+            !gcs.Match(GCSFilter::Element(script.begin(), script.end())));
+    }
+
+    // The filter round trips through its serialization.
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << filter;
+    BlockFilter decoded;
+    ss >> decoded;
+    BOOST_CHECK(decoded.GetFilterType() == BlockFilterType::BASIC);
+    BOOST_CHECK(decoded.GetBlockHash() == block.GetHash());
+    BOOST_CHECK(decoded.GetEncodedFilter() == filter.GetEncodedFilter());
+    BOOST_CHECK(decoded.GetHash() == filter.GetHash());
+
+    // The header commits to the previous header.
+    const uint256 header = filter.ComputeHeader(uint256());
+    BOOST_CHECK(header != filter.ComputeHeader(header));
+
+    // The filter is keyed by the block hash.
+    block.nNonce++;
+    const BlockFilter other(BlockFilterType::BASIC, block, blockundo);
+    BOOST_CHECK(other.GetEncodedFilter() != filter.GetEncodedFilter());
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_type_names) {
+    BlockFilterType filterType;
+    BOOST_CHECK_EQUAL(BlockFilterTypeName(BlockFilterType::BASIC), "basic");
+    BOOST_CHECK_EQUAL(BlockFilterTypeName(BlockFilterType::INVALID), "");
+    BOOST_CHECK(BlockFilterTypeByName("basic", filterType));
+    BOOST_CHECK(filterType == BlockFilterType::BASIC);
+    BOOST_CHECK(!BlockFilterTypeByName("unknown", filterType));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
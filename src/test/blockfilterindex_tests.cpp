@@ -0,0 +1,119 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/blockfilterindex.h"
+
+#include "chain.h"
+#include "config.h"
+#include "consensus/validation.h"
+#include "test/test_bitcoin.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilterindex_tests, TestChain100Setup)
+
+/** Wait for the index to reach the tip of chainActive. */
+static bool WaitForSync(const BlockFilterIndex &index) {
+    for (int i = 0; i < 1000; i++) {
+        {
+            LOCK(cs_main);
+            if (index.GetBestBlock() == chainActive.Tip()) {
+                return true;
+            }
+        }
+        MilliSleep(10);
+    }
+    return false;
+}
+
+/** Check the filters and headers of the active chain against each other. */
+static bool CheckFilterChain(const BlockFilterIndex &index) {
+    const CBlockIndex *pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+    }
+
+    std::vector<BlockFilter> filters;
+    std::vector<uint256> hashes;
+    if (!index.LookupFilterRange(0, pindexTip, filters) ||
+        !index.LookupFilterHashRange(0, pindexTip, hashes) ||
+        filters.size() != size_t(pindexTip->nHeight + 1) ||
+        hashes.size() != filters.size()) {
+        return false;
+    }
+
+    uint256 prevHeader;
+    for (size_t i = 0; i < filters.size(); i++) {
+        const CBlockIndex *pindex = pindexTip->GetAncestor(i);
+        uint256 header;
+        if (filters[i].GetBlockHash() != pindex->GetBlockHash() ||
+            hashes[i] != filters[i].GetHash() ||
+            !index.LookupFilterHeader(pindex, header) ||
+            header != filters[i].ComputeHeader(prevHeader)) {
+            return false;
+        }
+        prevHeader = header;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(blockfilterindex_sync_and_reorg) {
+    BlockFilterIndex index(BlockFilterType::BASIC, 1 << 20, true, true);
+    BlockFilter filter;
+
+    // Nothing is found before the index is started.
+    BOOST_CHECK(!index.LookupFilter(chainActive.Tip(), filter));
+
+    // The index catches up with the existing chain.
+    BOOST_CHECK(index.Start());
+    BOOST_CHECK(WaitForSync(index));
+    BOOST_CHECK(index.IsSynced());
+    BOOST_CHECK(CheckFilterChain(index));
+
+    // The coinbase output script of each block is in its filter.
+    const CScript scriptCoinbase = CScript()
+                                   << ToByteVector(coinbaseKey.GetPubKey())
+                                   << OP_CHECKSIG;
+    const GCSFilter::Element element(scriptCoinbase.begin(),
+                                     scriptCoinbase.end());
+    BOOST_CHECK(index.LookupFilter(chainActive.Tip(), filter));
+    BOOST_CHECK(filter.GetFilter().Match(element));
+
+    // New blocks are indexed as they are connected.
+    CBlock block = CreateAndProcessBlock({}, scriptCoinbase);
+    BOOST_CHECK(WaitForSync(index));
+    BOOST_CHECK(CheckFilterChain(index));
+
+    // Replace the tip by another block: the new block gets its own filter,
+    // chained to the same previous header, and the filter of the
+    // disconnected block stays available.
+    CBlockIndex *pindexOld;
+    {
+        LOCK(cs_main);
+        pindexOld = chainActive.Tip();
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(GetConfig(), state, pindexOld));
+    }
+    BOOST_CHECK(WaitForSync(index));
+    const CScript scriptOther = CScript() << OP_TRUE;
+    CBlock other = CreateAndProcessBlock({}, scriptOther);
+    BOOST_CHECK(other.GetHash() != block.GetHash());
+    BOOST_CHECK(WaitForSync(index));
+    BOOST_CHECK(CheckFilterChain(index));
+
+    BOOST_CHECK(index.LookupFilter(pindexOld, filter));
+    BOOST_CHECK(filter.GetBlockHash() == block.GetHash());
+    uint256 oldHeader, newHeader;
+    BOOST_CHECK(index.LookupFilterHeader(pindexOld, oldHeader));
+    BOOST_CHECK(index.LookupFilterHeader(chainActive.Tip(), newHeader));
+    BOOST_CHECK(oldHeader != newHeader);
+
+    index.Interrupt();
+    index.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
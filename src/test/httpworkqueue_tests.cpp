@@ -0,0 +1,71 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "httpworkqueue.h"
+#include "test/test_bitcoin.h"
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <thread>
+
+#include <boost/test/unit_test.hpp>
+
+typedef WorkQueue<std::function<void()>> TestWorkQueue;
+
+BOOST_FIXTURE_TEST_SUITE(httpworkqueue_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(httpworkqueue_runs_behind_blocked_worker) {
+    const int nThreads = 2;
+    const int nItems = 20;
+    TestWorkQueue queue(100, nThreads);
+    std::vector<std::thread> threads;
+    for (int n = 0; n < nThreads; n++) {
+        threads.emplace_back(&TestWorkQueue::Run, &queue, n);
+    }
+
+    // Keep one worker busy until the end of the test.
+    std::promise<void> release;
+    std::shared_future<void> released(release.get_future());
+    std::promise<void> blocking;
+    BOOST_CHECK(queue.Enqueue(new std::function<void()>([&]() {
+        blocking.set_value();
+        released.wait();
+    })));
+    blocking.get_future().wait();
+
+    // Some of these go to the shard of the blocked worker, the other worker
+    // still has to run all of them.
+    std::atomic<int> nDone(0);
+    std::promise<void> allDone;
+    for (int n = 0; n < nItems; n++) {
+        BOOST_CHECK(queue.Enqueue(new std::function<void()>([&]() {
+            if (++nDone == nItems) allDone.set_value();
+        })));
+    }
+    BOOST_CHECK(allDone.get_future().wait_for(std::chrono::seconds(10)) ==
+                std::future_status::ready);
+    BOOST_CHECK_EQUAL(nDone, nItems);
+    BOOST_CHECK_EQUAL(queue.Depth(), 0);
+
+    release.set_value();
+    queue.Interrupt();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    queue.WaitExit();
+}
+
+BOOST_AUTO_TEST_CASE(httpworkqueue_max_depth) {
+    // Without workers nothing is taken off the queue.
+    TestWorkQueue queue(2, 2);
+    BOOST_CHECK(queue.Enqueue(new std::function<void()>([]() {})));
+    BOOST_CHECK(queue.Enqueue(new std::function<void()>([]() {})));
+    std::function<void()> *rejected = new std::function<void()>([]() {});
+    BOOST_CHECK(!queue.Enqueue(rejected));
+    delete rejected;
+    BOOST_CHECK_EQUAL(queue.Depth(), 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
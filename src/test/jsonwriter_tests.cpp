@@ -0,0 +1,102 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpc/jsonwriter.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(jsonwriter_tests, BasicTestingSetup)
+
+static UniValue MakeDocument() {
+    UniValue doc;
+    BOOST_CHECK(doc.read("{\"a\":1,\"b\":[true,null,\"x\\\"y\",[],{}],"
+                         "\"c\\n\":{\"d\":-1.5,\"e\":[[1],[2,3]]},"
+                         "\"f\":\"\"}"));
+    return doc;
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_text) {
+    const UniValue doc = MakeDocument();
+
+    // Any chunk size produces the same text as UniValue::write().
+    for (size_t nChunkSize : {1, 7, 1000}) {
+        std::string out;
+        size_t nChunks = 0;
+        JSONTextWriter writer(
+            [&](const char *data, size_t size) {
+                BOOST_CHECK(size > 0);
+                out.append(data, size);
+                nChunks++;
+            },
+            nChunkSize);
+        writer.Value(doc);
+        writer.Flush();
+        BOOST_CHECK_EQUAL(out, doc.write());
+        BOOST_CHECK_EQUAL(nChunks > 1, nChunkSize < out.size());
+    }
+
+    // Keys and strings are escaped exactly as UniValue escapes them, for
+    // every byte value and between runs of plain characters.
+    std::string str;
+    for (int ch = 0; ch < 256; ch++) {
+        str += char(ch);
+        str += "ab";
+    }
+    UniValue strDoc(UniValue::VOBJ);
+    strDoc.pushKV(str, str);
+    strDoc.pushKV("", "");
+    std::string strOut;
+    JSONTextWriter strWriter(
+        [&](const char *data, size_t size) { strOut.append(data, size); });
+    strWriter.Value(strDoc);
+    strWriter.Flush();
+    BOOST_CHECK_EQUAL(strOut, strDoc.write());
+
+    // Documents can be written token by token.
+    std::string out;
+    JSONTextWriter writer(
+        [&](const char *data, size_t size) { out.append(data, size); });
+    writer.BeginObject();
+    writer.KeyValue("result", doc["b"]);
+    writer.Key("list");
+    writer.BeginArray();
+    writer.Value(1);
+    writer.BeginObject();
+    writer.EndObject();
+    writer.Value("z");
+    writer.EndArray();
+    writer.KeyValue("id", NullUniValue);
+    writer.EndObject();
+
+    // Nothing is handed over before Flush() for small documents.
+    BOOST_CHECK(out.empty());
+    writer.Flush();
+    BOOST_CHECK_EQUAL(
+        out, "{\"result\":[true,null,\"x\\\"y\",[],{}],\"list\":[1,{},\"z\"],"
+             "\"id\":null}");
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_value) {
+    const UniValue doc = MakeDocument();
+
+    JSONValueWriter writer;
+    writer.Value(doc);
+    BOOST_CHECK_EQUAL(writer.GetValue().write(), doc.write());
+
+    JSONValueWriter tokens;
+    tokens.BeginObject();
+    tokens.KeyValue("a", 1);
+    tokens.Key("b");
+    tokens.BeginArray();
+    tokens.Value(true);
+    tokens.BeginArray();
+    tokens.EndArray();
+    tokens.EndArray();
+    tokens.EndObject();
+    BOOST_CHECK_EQUAL(tokens.GetValue().write(), "{\"a\":1,\"b\":[true,[]]}");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
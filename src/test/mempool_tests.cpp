@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "hash.h"
 #include "policy/policy.h"
 #include "txmempool.h"
 #include "util.h"
@@ -136,6 +137,139 @@ BOOST_AUTO_TEST_CASE(MempoolClearTest) {
     BOOST_CHECK_EQUAL(testPool.vTxHashes.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolUsageBreakdownTest) {
+    TestMemPoolEntryHelper entry;
+    CTxMemPool pool(CFeeRate(0));
+
+    MemPoolUsageBreakdown empty = pool.GetMemoryUsageBreakdown();
+    BOOST_CHECK_EQUAL(empty.entries, 0);
+    BOOST_CHECK_EQUAL(empty.transactions, 0);
+    BOOST_CHECK_EQUAL(empty.Total(), pool.DynamicMemoryUsage());
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild;
+    txChild.vin.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txChild.vin[i].prevout = COutPoint(txParent.GetId(), i);
+        txChild.vin[i].scriptSig = CScript() << OP_11;
+    }
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 60000LL;
+
+    CTxMemPoolEntry parentEntry = entry.FromTx(txParent);
+    CTxMemPoolEntry childEntry = entry.FromTx(txChild);
+    pool.addUnchecked(txParent.GetId(), parentEntry);
+    pool.addUnchecked(txChild.GetId(), childEntry);
+
+    MemPoolUsageBreakdown usage = pool.GetMemoryUsageBreakdown();
+    BOOST_CHECK(usage.entries > 0);
+    BOOST_CHECK(usage.links > 0);
+    BOOST_CHECK(usage.spends > 0);
+    BOOST_CHECK(usage.txhashes > 0);
+    BOOST_CHECK_EQUAL(usage.transactions, parentEntry.DynamicMemoryUsage() +
+                                              childEntry.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(usage.Total(), pool.DynamicMemoryUsage());
+
+    pool.removeRecursive(txParent);
+    usage = pool.GetMemoryUsageBreakdown();
+    BOOST_CHECK_EQUAL(usage.entries, 0);
+    BOOST_CHECK_EQUAL(usage.transactions, 0);
+    BOOST_CHECK_EQUAL(usage.links, 0);
+}
+
+static void CheckTxHashSipHashes(CTxMemPool &pool, uint64_t k0, uint64_t k1) {
+    LOCK(pool.cs);
+    std::vector<uint64_t> siphashes;
+    pool.GetTxHashSipHashes(k0, k1, siphashes);
+    BOOST_CHECK_EQUAL(siphashes.size(), pool.vTxHashes.size());
+    for (size_t i = 0; i < pool.vTxHashes.size(); i++) {
+        BOOST_CHECK_EQUAL(siphashes[i],
+                          SipHashUint256(k0, k1, pool.vTxHashes[i].first));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MempoolTxHashSipHashesTest) {
+    TestMemPoolEntryHelper entry;
+    CTxMemPool pool(CFeeRate(0));
+
+    std::vector<CMutableTransaction> txs(5);
+    for (size_t i = 0; i < txs.size(); i++) {
+        txs[i].vin.resize(1);
+        txs[i].vin[0].scriptSig = CScript() << int64_t(i) << OP_11;
+        txs[i].vout.resize(1);
+        txs[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txs[i].vout[0].nValue = 33000LL;
+    }
+
+    for (size_t i = 0; i < 3; i++) {
+        pool.addUnchecked(txs[i].GetId(), entry.FromTx(txs[i]));
+    }
+    CheckTxHashSipHashes(pool, 1, 2);
+
+    // Hashes vTxHashes in its current order after entries are added and
+    // removed, which swaps the last entry into the removed slot.
+    pool.addUnchecked(txs[3].GetId(), entry.FromTx(txs[3]));
+    pool.addUnchecked(txs[4].GetId(), entry.FromTx(txs[4]));
+    pool.removeRecursive(txs[0]);
+    CheckTxHashSipHashes(pool, 1, 2);
+
+    // Nothing is kept between calls: each call hashes with its own keys.
+    pool.removeRecursive(txs[3]);
+    CheckTxHashSipHashes(pool, 3, 4);
+
+    pool.clear();
+    CheckTxHashSipHashes(pool, 3, 4);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolDepthAndScoreTest) {
+    TestMemPoolEntryHelper entry;
+    CTxMemPool pool(CFeeRate(0));
+
+    // Two unrelated transactions and a parent whose child pays a high fee.
+    std::vector<CMutableTransaction> txs(4);
+    for (size_t i = 0; i < txs.size(); i++) {
+        txs[i].vin.resize(1);
+        txs[i].vin[0].scriptSig = CScript() << int64_t(i) << OP_11;
+        txs[i].vout.resize(1);
+        txs[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txs[i].vout[0].nValue = 33000LL;
+    }
+    txs[3].vin[0].prevout.hash = txs[2].GetId();
+    txs[3].vin[0].prevout.n = 0;
+    const CAmount fees[] = {5000LL, 500LL, 1000LL, 100000LL};
+    std::vector<uint256> hashes;
+    for (size_t i = 0; i < txs.size(); i++) {
+        pool.addUnchecked(txs[i].GetId(), entry.Fee(fees[i]).FromTx(txs[i]));
+        hashes.push_back(txs[i].GetId());
+    }
+    // Unknown transactions are skipped.
+    hashes.push_back(uint256S("0x01"));
+
+    std::vector<TxDepthAndScore> scores;
+    pool.GetDepthAndScore(hashes, scores);
+    BOOST_CHECK_EQUAL(scores.size(), txs.size());
+    std::sort(scores.begin(), scores.end(), CompareTxDepthAndScore());
+
+    // Same order as the mempool's own depth and score sort.
+    std::vector<uint256> sorted;
+    pool.queryHashes(sorted);
+    BOOST_CHECK_EQUAL(sorted.size(), scores.size());
+    for (size_t i = 0; i < sorted.size(); i++) {
+        BOOST_CHECK(scores[i].txid == sorted[i]);
+    }
+    // The child comes last despite its fee.
+    BOOST_CHECK(scores.back().txid == txs[3].GetId());
+    BOOST_CHECK_EQUAL(scores.back().nCountWithAncestors, 2U);
+}
+
 template <typename name>
 void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder) {
     BOOST_CHECK_EQUAL(pool.size(), sortedOrder.size());
@@ -599,8 +733,11 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest) {
         pool.addUnchecked(tx5.GetId(), entry.Fee(1000LL).FromTx(tx5, &pool));
     pool.addUnchecked(tx7.GetId(), entry.Fee(9000LL).FromTx(tx7, &pool));
 
-    // should maximize mempool size by only removing 5/7
-    pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+    // should maximize mempool size by only removing 5/7; the txid hash table
+    // does not shrink with the mempool, so leave it out of the halving
+    size_t nIndexUsage = pool.GetMemoryUsageBreakdown().index;
+    pool.TrimToSize(nIndexUsage +
+                    (pool.DynamicMemoryUsage() - nIndexUsage) / 2);
     BOOST_CHECK(pool.exists(tx4.GetId()));
     BOOST_CHECK(!pool.exists(tx5.GetId()));
     BOOST_CHECK(pool.exists(tx6.GetId()));
@@ -202,4 +202,68 @@ BOOST_AUTO_TEST_CASE(test_userAgentLength) {
                       "very very very very very very very ve)/");
 }
 
+BOOST_AUTO_TEST_CASE(net_msg_id_lookup) {
+    const std::vector<std::string> &allTypes = getAllNetMessageTypes();
+    BOOST_CHECK_EQUAL(allTypes.size(), size_t(NetMsgId::UNKNOWN));
+    for (size_t i = 0; i < allTypes.size(); i++) {
+        BOOST_CHECK(GetNetMsgId(allTypes[i]) == NetMsgId(i));
+    }
+
+    BOOST_CHECK(GetNetMsgId(NetMsgType::TX) == NetMsgId::TX);
+    BOOST_CHECK(GetNetMsgId(NetMsgType::INV) == NetMsgId::INV);
+    BOOST_CHECK(GetNetMsgId(NetMsgType::GETDATA) == NetMsgId::GETDATA);
+    BOOST_CHECK(GetNetMsgId("") == NetMsgId::UNKNOWN);
+    BOOST_CHECK(GetNetMsgId("txx") == NetMsgId::UNKNOWN);
+    BOOST_CHECK(GetNetMsgId("TX") == NetMsgId::UNKNOWN);
+    BOOST_CHECK(GetNetMsgId(std::string("tx\0", 3)) == NetMsgId::UNKNOWN);
+}
+
+BOOST_AUTO_TEST_CASE(send_queue_partial_writes) {
+    // A header and payload per message, as PushMessage queues them.
+    std::deque<std::vector<uint8_t>> vSendMsg;
+    vSendMsg.emplace_back(24, 0x01);
+    vSendMsg.emplace_back(100, 0x02);
+    vSendMsg.emplace_back(24, 0x03);
+    vSendMsg.emplace_back(10, 0x04);
+
+#ifndef WIN32
+    struct iovec iov[3];
+    size_t nRequested = 0;
+    // The first buffer starts at the send offset and the count is capped.
+    BOOST_CHECK_EQUAL(FillSendIovecs(vSendMsg, 0, 4, iov, 3, nRequested), 3);
+    BOOST_CHECK_EQUAL(nRequested, 20 + 100 + 24);
+    BOOST_CHECK(iov[0].iov_base == vSendMsg[0].data() + 4);
+    BOOST_CHECK_EQUAL(iov[0].iov_len, 20);
+    BOOST_CHECK(iov[2].iov_base == vSendMsg[2].data());
+    BOOST_CHECK_EQUAL(FillSendIovecs(vSendMsg, 3, 0, iov, 3, nRequested), 1);
+    BOOST_CHECK_EQUAL(nRequested, 10);
+#endif
+
+    size_t nMsgCount = 0;
+    size_t nSendOffset = 0;
+    // Part of the first buffer.
+    BOOST_CHECK_EQUAL(
+        ConsumeSentBytes(vSendMsg, nMsgCount, nSendOffset, 10), 0);
+    BOOST_CHECK_EQUAL(nMsgCount, 0);
+    BOOST_CHECK_EQUAL(nSendOffset, 10);
+    // The rest of the first buffer and part of the second.
+    BOOST_CHECK_EQUAL(
+        ConsumeSentBytes(vSendMsg, nMsgCount, nSendOffset, 64), 24);
+    BOOST_CHECK_EQUAL(nMsgCount, 1);
+    BOOST_CHECK_EQUAL(nSendOffset, 50);
+    // Ending exactly on a buffer boundary.
+    BOOST_CHECK_EQUAL(
+        ConsumeSentBytes(vSendMsg, nMsgCount, nSendOffset, 74), 124);
+    BOOST_CHECK_EQUAL(nMsgCount, 3);
+    BOOST_CHECK_EQUAL(nSendOffset, 0);
+    // Nothing written.
+    BOOST_CHECK_EQUAL(ConsumeSentBytes(vSendMsg, nMsgCount, nSendOffset, 0),
+                      0);
+    BOOST_CHECK_EQUAL(nMsgCount, 3);
+    BOOST_CHECK_EQUAL(
+        ConsumeSentBytes(vSendMsg, nMsgCount, nSendOffset, 10), 10);
+    BOOST_CHECK_EQUAL(nMsgCount, vSendMsg.size());
+    BOOST_CHECK_EQUAL(nSendOffset, 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -212,6 +212,50 @@ BOOST_AUTO_TEST_CASE(set) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(MayBeMine) {
+    // Every script that IsMine() accepts passes the quick MayBeMine() check,
+    // and scripts paying to others are ruled out.
+    CBasicKeyStore keystore;
+    CKey key[4];
+    std::vector<CPubKey> keys;
+    for (int i = 0; i < 4; i++) {
+        key[i].MakeNewKey(i % 2 == 0);
+        keys.push_back(key[i].GetPubKey());
+    }
+    keystore.AddKey(key[0]);
+    keystore.AddKey(key[1]);
+
+    const CScript multisig = GetScriptForMultisig(
+        2, std::vector<CPubKey>(keys.begin(), keys.begin() + 2));
+    const CScript watched = GetScriptForDestination(keys[3].GetID());
+    keystore.AddCScript(multisig);
+    keystore.AddWatchOnly(watched);
+
+    const CScript mine[] = {
+        GetScriptForDestination(keys[0].GetID()),
+        GetScriptForRawPubKey(keys[1]),
+        GetScriptForDestination(CScriptID(multisig)),
+        multisig,
+        watched,
+    };
+    for (const CScript &script : mine) {
+        BOOST_CHECK(IsMine(keystore, script));
+        BOOST_CHECK(keystore.MayBeMine(script));
+    }
+
+    const CScript others[] = {
+        GetScriptForDestination(keys[2].GetID()),
+        GetScriptForRawPubKey(keys[2]),
+        GetScriptForDestination(CScriptID(GetScriptForRawPubKey(keys[0]))),
+        CScript() << OP_RETURN,
+        CScript(),
+    };
+    for (const CScript &script : others) {
+        BOOST_CHECK(!IsMine(keystore, script));
+        BOOST_CHECK(!keystore.MayBeMine(script));
+    }
+}
+
 BOOST_AUTO_TEST_CASE(is) {
     // Test CScript::IsPayToScriptHash()
     uint160 dummy;
@@ -136,4 +136,30 @@ BOOST_AUTO_TEST_CASE(streams_empty_vector) {
     ds.insert(ds.begin(), &adata[0], &adata[6]);
 }
 
+BOOST_AUTO_TEST_CASE(streams_swap_buffer) {
+    CDataStream ds(0, 0);
+    ds << uint32_t(1) << uint32_t(2);
+    uint32_t n;
+    ds >> n;
+    BOOST_CHECK_EQUAL(ds.size(), 4);
+
+    // Taking the buffer out leaves an empty, rewound stream and hands over
+    // the whole allocation, including the part already read.
+    CSerializeData buf;
+    ds.SwapBuffer(buf);
+    BOOST_CHECK(ds.empty());
+    BOOST_CHECK_EQUAL(buf.size(), 8);
+
+    // A recycled buffer keeps its capacity.
+    size_t capacity = buf.capacity();
+    buf.clear();
+    ds.SwapBuffer(buf);
+    BOOST_CHECK(buf.empty());
+    ds << uint32_t(3);
+    ds >> n;
+    BOOST_CHECK_EQUAL(n, 3);
+    ds.SwapBuffer(buf);
+    BOOST_CHECK_EQUAL(buf.capacity(), capacity);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -95,15 +95,20 @@ TestingSetup::TestingSetup(const std::string &chainName)
     for (int i = 0; i < nScriptCheckThreads - 1; i++) {
         threadGroup.create_thread(&ThreadScriptCheck);
     }
+    for (int i = 0; i < HEADER_CHECK_THREADS; i++) {
+        threadGroup.create_thread(&ThreadHeaderCheck);
+    }
 
     // Deterministic randomness for tests.
     g_connman = std::unique_ptr<CConnman>(new CConnman(config, 0x1337, 0x1337));
     connman = g_connman.get();
+    peerLogic.reset(new PeerLogicValidation(connman));
     RegisterNodeSignals(GetNodeSignals());
 }
 
 TestingSetup::~TestingSetup() {
     UnregisterNodeSignals(GetNodeSignals());
+    peerLogic.reset();
     threadGroup.interrupt_all();
     threadGroup.join_all();
     UnloadBlockIndex();
@@ -14,6 +14,8 @@
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
+#include <memory>
+
 /** Basic testing setup.
  * This just configures logging and chain parameters.
  */
@@ -28,11 +30,13 @@ struct BasicTestingSetup {
  * Included are data directory, coins database, script check threads setup.
  */
 class CConnman;
+class PeerLogicValidation;
 struct TestingSetup : public BasicTestingSetup {
     CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
     CConnman *connman;
+    std::unique_ptr<PeerLogicValidation> peerLogic;
 
     TestingSetup(const std::string &chainName = CBaseChainParams::MAIN);
     ~TestingSetup();
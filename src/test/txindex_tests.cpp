@@ -0,0 +1,112 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/txindex.h"
+
+#include "chain.h"
+#include "config.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "script/interpreter.h"
+#include "test/test_bitcoin.h"
+#include "txdb.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txindex_tests, TestChain100Setup)
+
+/** Wait for the index to reach the tip of chainActive. */
+static bool WaitForSync(const TxIndex &index) {
+    for (int i = 0; i < 1000; i++) {
+        {
+            LOCK(cs_main);
+            if (index.GetBestBlock() == chainActive.Tip()) {
+                return true;
+            }
+        }
+        MilliSleep(10);
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(txindex_sync_and_rewind) {
+    TxIndex index(1 << 20, true);
+    uint256 hashBlock;
+    CTransactionRef tx;
+
+    // Nothing is found before the index is started.
+    BOOST_CHECK(!index.FindTx(coinbaseTxns[0].GetId(), hashBlock, tx));
+
+    // The index catches up with the existing chain.
+    BOOST_CHECK(index.Start());
+    BOOST_CHECK(WaitForSync(index));
+    BOOST_CHECK(index.IsSynced());
+    for (size_t i = 0; i < coinbaseTxns.size(); i++) {
+        BOOST_CHECK(index.FindTx(coinbaseTxns[i].GetId(), hashBlock, tx));
+        BOOST_CHECK(tx->GetId() == coinbaseTxns[i].GetId());
+        LOCK(cs_main);
+        BOOST_CHECK(hashBlock == chainActive[i + 1]->GetBlockHash());
+    }
+
+    // New blocks are indexed as they are connected, including transactions
+    // that aren't the first in the block.
+    const CScript scriptCoinbase = CScript()
+                                   << ToByteVector(coinbaseKey.GetPubKey())
+                                   << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(coinbaseTxns[0].GetId(), 0);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11 * CENT;
+    spend.vout[0].scriptPubKey = scriptCoinbase;
+    std::vector<uint8_t> vchSig;
+    uint256 hash = SignatureHash(scriptCoinbase, spend, 0,
+                                 SIGHASH_ALL | SIGHASH_FORKID,
+                                 coinbaseTxns[0].vout[0].nValue);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back(uint8_t(SIGHASH_ALL | SIGHASH_FORKID));
+    spend.vin[0].scriptSig << vchSig;
+
+    CBlock block = CreateAndProcessBlock({spend}, scriptCoinbase);
+    BOOST_CHECK(WaitForSync(index));
+    BOOST_CHECK(index.FindTx(spend.GetId(), hashBlock, tx));
+    BOOST_CHECK(tx->GetId() == spend.GetId());
+    BOOST_CHECK(hashBlock == block.GetHash());
+
+    // Transactions of disconnected blocks are removed.
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(GetConfig(), state, chainActive.Tip()));
+    }
+    BOOST_CHECK(WaitForSync(index));
+    BOOST_CHECK(!index.FindTx(spend.GetId(), hashBlock, tx));
+    BOOST_CHECK(!index.FindTx(block.vtx[0]->GetId(), hashBlock, tx));
+    BOOST_CHECK(index.FindTx(coinbaseTxns[99].GetId(), hashBlock, tx));
+
+    index.Interrupt();
+    index.Stop();
+}
+
+BOOST_AUTO_TEST_CASE(txindex_erase_legacy) {
+    CBlockTreeDB blocktree(1 << 20, true);
+    const uint256 txid = coinbaseTxns[0].GetId();
+    const CDiskBlockPos posBlock(0, 8);
+    const CDiskTxPos pos(posBlock, 1);
+    for (char key : {'t', 'u'}) {
+        BOOST_CHECK(blocktree.Write(std::make_pair(key, txid), pos));
+    }
+    BOOST_CHECK(blocktree.Write(std::make_pair('t', uint256()), pos));
+
+    // Only the entries of the old transaction index are erased.
+    BOOST_CHECK_NO_THROW(blocktree.EraseLegacyTxIndex());
+    BOOST_CHECK(!blocktree.Exists(std::make_pair('t', txid)));
+    BOOST_CHECK(!blocktree.Exists(std::make_pair('t', uint256())));
+    BOOST_CHECK(blocktree.Exists(std::make_pair('u', txid)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
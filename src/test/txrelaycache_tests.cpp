@@ -0,0 +1,104 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txrelaycache.h"
+
+#include "script/script.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txrelaycache_tests, BasicTestingSetup)
+
+static CTransactionRef MakeTx(int n) {
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << n << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 33000LL;
+    return MakeTransactionRef(tx);
+}
+
+BOOST_AUTO_TEST_CASE(txrelaycache_expiry) {
+    // 10 second window in 5 buckets of 2 seconds.
+    const int64_t nSecond = 1000000;
+    CTxRelayCache cache(100 * 1000000, 10 * nSecond, 5);
+
+    std::vector<CTransactionRef> txs;
+    for (int i = 0; i < 4; i++) {
+        txs.push_back(MakeTx(i));
+    }
+
+    BOOST_CHECK(cache.Add(txs[0], 0));
+    BOOST_CHECK(!cache.Add(txs[0], nSecond));
+    BOOST_CHECK(cache.Add(txs[1], nSecond));
+    BOOST_CHECK(cache.Add(txs[2], 5 * nSecond));
+    BOOST_CHECK_EQUAL(cache.Size(), 3);
+    BOOST_CHECK(cache.Find(txs[0]->GetId()) == txs[0]);
+    BOOST_CHECK(cache.Find(txs[3]->GetId()) == nullptr);
+
+    // Entries are kept for at least the expiry time.
+    cache.Expire(11 * nSecond);
+    BOOST_CHECK_EQUAL(cache.Size(), 3);
+
+    // The first bucket goes once its last possible entry has expired.
+    cache.Expire(12 * nSecond);
+    BOOST_CHECK_EQUAL(cache.Size(), 1);
+    BOOST_CHECK(cache.Find(txs[1]->GetId()) == nullptr);
+    BOOST_CHECK(cache.Find(txs[2]->GetId()) == txs[2]);
+
+    // Adding expires old buckets too.
+    BOOST_CHECK(cache.Add(txs[3], 20 * nSecond));
+    BOOST_CHECK_EQUAL(cache.Size(), 1);
+
+    TxRelayCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nEntries, 1);
+    BOOST_CHECK_EQUAL(stats.nMemoryUsage, cache.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(stats.nHits, 2);
+    BOOST_CHECK_EQUAL(stats.nMisses, 2);
+    BOOST_CHECK_EQUAL(stats.nExpired, 3);
+    BOOST_CHECK_EQUAL(stats.nEvicted, 0);
+
+    cache.Expire(40 * nSecond);
+    BOOST_CHECK_EQUAL(cache.Size(), 0);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(txrelaycache_memory_limit) {
+    const int64_t nSecond = 1000000;
+    CTxRelayCache cache(100 * 1000000, 10 * nSecond, 5);
+
+    std::vector<CTransactionRef> txs;
+    for (int i = 0; i < 10; i++) {
+        txs.push_back(MakeTx(i));
+        // Two entries per bucket.
+        cache.Add(txs.back(), i * nSecond);
+    }
+    BOOST_CHECK_EQUAL(cache.Size(), 10);
+    size_t nEntryUsage = cache.DynamicMemoryUsage() / 10;
+
+    // Shrinking the budget evicts the oldest entries first.
+    cache.SetMaxUsage(nEntryUsage * 7);
+    BOOST_CHECK_EQUAL(cache.Size(), 7);
+    for (int i = 0; i < 10; i++) {
+        BOOST_CHECK_EQUAL(cache.Find(txs[i]->GetId()) != nullptr, i >= 3);
+    }
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= nEntryUsage * 7);
+
+    // New entries push out old ones.
+    CTransactionRef tx = MakeTx(10);
+    BOOST_CHECK(cache.Add(tx, 10 * nSecond));
+    BOOST_CHECK_EQUAL(cache.Size(), 7);
+    BOOST_CHECK(cache.Find(txs[3]->GetId()) == nullptr);
+    BOOST_CHECK(cache.Find(tx->GetId()) == tx);
+    BOOST_CHECK_EQUAL(cache.GetStats().nEvicted, 4);
+
+    // Partly evicted buckets still expire cleanly.
+    cache.Expire(100 * nSecond);
+    BOOST_CHECK_EQUAL(cache.Size(), 0);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
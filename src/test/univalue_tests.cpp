@@ -322,6 +322,27 @@ BOOST_AUTO_TEST_CASE(univalue_readwrite) {
     BOOST_CHECK(!v.read("[]{}"));
     BOOST_CHECK(!v.read("{}[]"));
     BOOST_CHECK(!v.read("{} 42"));
+
+    // Escapes in the middle of longer plain runs, in keys and values.
+    BOOST_CHECK(
+        v.read("{\"k\\tey\":\"ab\\\"cd\\u00e9\\n\\u0001ef\"}"));
+    BOOST_CHECK_EQUAL(v["k\tey"].get_str(), "ab\"cd\xc3\xa9\n\x01" "ef");
+    BOOST_CHECK_EQUAL(v.write(),
+                      "{\"k\\tey\":\"ab\\\"cd\xc3\xa9\\n\\u0001ef\"}");
+
+    // Multi-byte UTF-8 next to plain chars, and broken sequences.
+    BOOST_CHECK(v.read("[\"a\xc3\xa9" "b\"]"));
+    BOOST_CHECK_EQUAL(v[0].get_str(), "a\xc3\xa9" "b");
+    BOOST_CHECK(!v.read("[\"a\xc3" "b\"]"));
+    BOOST_CHECK(!v.read("[\"a\xa9" "b\"]"));
+
+    // Numbers are kept as written.
+    BOOST_CHECK(v.read("[-0.5e+10,12,0]"));
+    BOOST_CHECK_EQUAL(v[0].getValStr(), "-0.5e+10");
+    BOOST_CHECK_EQUAL(v.write(), "[-0.5e+10,12,0]");
+    BOOST_CHECK(!v.read("[-]"));
+    BOOST_CHECK(!v.read("[1.]"));
+    BOOST_CHECK(!v.read("[01]"));
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,7 +7,10 @@
 #include "chainparams.h"
 #include "config.h"
 #include "consensus/consensus.h"
+#include "consensus/validation.h"
+#include "pow.h"
 #include "primitives/transaction.h"
+#include "script/script.h"
 #include "test/test_bitcoin.h"
 #include "util.h"
 
@@ -28,6 +31,30 @@ static CBlock makeLargeDummyBlock(const size_t num_tx) {
     return block;
 }
 
+struct RegtestingSetup : public TestingSetup {
+    RegtestingSetup() : TestingSetup(CBaseChainParams::REGTEST) {}
+};
+
+static std::vector<CBlockHeader>
+makeHeaderChain(const CBlockIndex *pindexPrev, size_t count,
+                const Consensus::Params &params) {
+    std::vector<CBlockHeader> headers(count);
+    uint256 hashPrev = pindexPrev->GetBlockHash();
+    for (size_t i = 0; i < count; i++) {
+        CBlockHeader &header = headers[i];
+        header.nVersion = 4;
+        header.hashPrevBlock = hashPrev;
+        header.hashMerkleRoot = uint256S(strprintf("%x", i + 1));
+        header.nTime = pindexPrev->GetBlockTime() + i + 1;
+        header.nBits = GetNextWorkRequired(pindexPrev, &header, params);
+        while (!CheckProofOfWork(header.GetHash(), header.nBits, params)) {
+            header.nNonce++;
+        }
+        hashPrev = header.GetHash();
+    }
+    return headers;
+}
+
 BOOST_FIXTURE_TEST_SUITE(validation_tests, TestingSetup)
 
 /** Test that LoadExternalBlockFile works with the buffer size set
@@ -76,4 +103,99 @@ BOOST_AUTO_TEST_CASE(validation_load_external_block_file) {
     BOOST_CHECK_NO_THROW({ LoadExternalBlockFile(config, fp, 0); });
 }
 
+BOOST_FIXTURE_TEST_CASE(validation_header_check, RegtestingSetup) {
+    const Consensus::Params &params =
+        GetConfig().GetChainParams().GetConsensus();
+    std::vector<CBlockHeader> headers =
+        makeHeaderChain(chainActive.Tip(), 1, params);
+
+    uint256 hash;
+    CHeaderCheck check(headers[0], params, hash);
+    BOOST_CHECK(check());
+    BOOST_CHECK(hash == headers[0].GetHash());
+
+    while (CheckProofOfWork(headers[0].GetHash(), headers[0].nBits, params)) {
+        headers[0].nNonce++;
+    }
+    CHeaderCheck badCheck(headers[0], params, hash);
+    BOOST_CHECK(!badCheck());
+    BOOST_CHECK(hash == headers[0].GetHash());
+}
+
+BOOST_FIXTURE_TEST_CASE(validation_process_headers_parallel,
+                        RegtestingSetup) {
+    const Config &config = GetConfig();
+    const Consensus::Params &params = config.GetChainParams().GetConsensus();
+
+    // Large enough to be checked on the header check queue.
+    const size_t count = 2 * MIN_PARALLEL_HEADER_CHECKS;
+    std::vector<CBlockHeader> headers =
+        makeHeaderChain(chainActive.Tip(), count, params);
+    CValidationState state;
+    const CBlockIndex *pindex = nullptr;
+    BOOST_CHECK(ProcessNewBlockHeaders(config, headers, state, &pindex));
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK(pindex != nullptr);
+    BOOST_CHECK(pindex->GetBlockHash() == headers.back().GetHash());
+    BOOST_CHECK_EQUAL(pindex->nHeight, int(count));
+
+    // A header with bad proof of work in the middle of a batch: the headers
+    // before it are accepted and the failure is reported as usual.
+    const CBlockIndex *pindexLast = pindex;
+    headers = makeHeaderChain(pindexLast, count, params);
+    const size_t nBad = count / 2;
+    while (CheckProofOfWork(headers[nBad].GetHash(), headers[nBad].nBits,
+                            params)) {
+        headers[nBad].nNonce++;
+    }
+    state = CValidationState();
+    pindex = nullptr;
+    BOOST_CHECK(!ProcessNewBlockHeaders(config, headers, state, &pindex));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "high-hash");
+    BOOST_CHECK(pindex != nullptr);
+    BOOST_CHECK(pindex->GetBlockHash() == headers[nBad - 1].GetHash());
+    LOCK(cs_main);
+    BOOST_CHECK(!mapBlockIndex.count(headers[nBad].GetHash()));
+}
+
+BOOST_FIXTURE_TEST_CASE(validation_chain_tip_snapshot, TestChain100Setup) {
+    std::shared_ptr<const ChainTipSnapshot> tip = GetChainTipSnapshot();
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(tip->pindex == chainActive.Tip());
+        BOOST_CHECK_EQUAL(tip->nHeight, chainActive.Height());
+        BOOST_CHECK(tip->hash == chainActive.Tip()->GetBlockHash());
+        BOOST_CHECK(tip->nChainWork == chainActive.Tip()->nChainWork);
+        BOOST_CHECK_EQUAL(tip->nMedianTimePast,
+                          chainActive.Tip()->GetMedianTimePast());
+        for (int nHeight = -1; nHeight <= tip->nHeight + 1; nHeight++) {
+            BOOST_CHECK((*tip)[nHeight] == chainActive[nHeight]);
+        }
+        BOOST_CHECK(tip->Contains(chainActive[50]));
+        BOOST_CHECK(tip->Next(chainActive[50]) == chainActive[51]);
+        BOOST_CHECK(tip->Next(chainActive.Tip()) == nullptr);
+    }
+
+    // A block that is not on the chain.
+    CBlockIndex fork;
+    fork.nHeight = 50;
+    {
+        LOCK(cs_main);
+        fork.pprev = chainActive[49];
+    }
+    fork.BuildSkip();
+    BOOST_CHECK(!tip->Contains(&fork));
+    BOOST_CHECK(tip->Next(&fork) == nullptr);
+
+    // Connecting a block publishes a new snapshot, old ones don't change.
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    CreateAndProcessBlock({}, scriptPubKey);
+    std::shared_ptr<const ChainTipSnapshot> newTip = GetChainTipSnapshot();
+    BOOST_CHECK_EQUAL(newTip->nHeight, tip->nHeight + 1);
+    BOOST_CHECK(newTip->pindex->pprev == tip->pindex);
+    BOOST_CHECK(newTip->Contains(tip->pindex));
+    BOOST_CHECK(newTip->Next(tip->pindex) == newTip->pindex);
+    BOOST_CHECK(tip->Next(tip->pindex) == nullptr);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
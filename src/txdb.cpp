@@ -17,7 +17,7 @@
 static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
-static const char DB_TXINDEX = 't';
+static const char DB_LEGACY_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
@@ -194,20 +194,6 @@ bool CBlockTreeDB::WriteBatchSync(
     return WriteBatch(batch, true);
 }
 
-bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
-    return Read(std::make_pair(DB_TXINDEX, txid), pos);
-}
-
-bool CBlockTreeDB::WriteTxIndex(
-    const std::vector<std::pair<uint256, CDiskTxPos>> &vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<uint256, CDiskTxPos>>::const_iterator it =
-             vect.begin();
-         it != vect.end(); it++)
-        batch.Write(std::make_pair(DB_TXINDEX, it->first), it->second);
-    return WriteBatch(batch);
-}
-
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
@@ -219,6 +205,40 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+void CBlockTreeDB::EraseLegacyTxIndex() {
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(std::make_pair(DB_LEGACY_TXINDEX, uint256()));
+
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(*this);
+    uint64_t nErased = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, uint256> key;
+        if (!pcursor->GetKey(key) || key.first != DB_LEGACY_TXINDEX) {
+            break;
+        }
+
+        batch.Erase(key);
+        nErased++;
+        if (batch.SizeEstimate() > batch_size) {
+            WriteBatch(batch);
+            batch.Clear();
+            // Entries are ordered by txid, whose leading bytes are uniformly
+            // distributed, so they tell how far along the erase is.
+            const uint8_t *pch = key.second.begin();
+            LogPrintf("Erasing the old transaction index: %u entries erased "
+                      "[%d%%]\n",
+                      nErased, ((pch[0] << 8) | pch[1]) * 100 / 65536);
+        }
+
+        pcursor->Next();
+    }
+
+    WriteBatch(batch);
+    LogPrintf("Erased %u entries of the old transaction index\n", nErased);
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(
     std::function<CBlockIndex *(const uint256 &)> insertBlockIndex) {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
@@ -10,6 +10,7 @@
 #include "config.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "hash.h"
 #include "policy/fees.h"
 #include "policy/policy.h"
 #include "streams.h"
@@ -20,6 +21,8 @@
 #include "validation.h"
 #include "version.h"
 
+#include <algorithm>
+
 #include <boost/range/adaptor/reversed.hpp>
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef &_tx,
@@ -30,9 +33,9 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef &_tx,
                                  bool _spendsCoinbase, int64_t _sigOpsCount,
                                  LockPoints lp)
     : tx(_tx), nFee(_nFee), nTime(_nTime), entryPriority(_entryPriority),
-      entryHeight(_entryHeight), inChainInputValue(_inChainInputValue),
-      spendsCoinbase(_spendsCoinbase), sigOpCount(_sigOpsCount),
-      lockPoints(lp) {
+      inChainInputValue(_inChainInputValue), lockPoints(lp),
+      entryHeight(_entryHeight), sigOpCount(_sigOpsCount),
+      spendsCoinbase(_spendsCoinbase) {
     nTxSize = GetTransactionSize(*tx);
     nModSize = tx->CalculateModifiedSize(GetTxSize());
     nUsageSize = RecursiveDynamicUsage(*tx) + memusage::DynamicUsage(tx);
@@ -132,6 +135,7 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt,
 void CTxMemPool::UpdateTransactionsFromBlock(
     const std::vector<uint256> &vHashesToUpdate) {
     LOCK(cs);
+    nScoresUpdated++;
     // For each entry in vHashesToUpdate, store the set of in-mempool, but not
     // in-vHashesToUpdate transactions, so that we don't have to recalculate
     // descendants when we come across a previously seen entry.
@@ -317,6 +321,17 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove,
         }
     }
 
+    // Ancestors that remain in the mempool may lose several descendants at
+    // once, e.g. when TrimToSize evicts a whole package. Sum up the changes
+    // first so that each of them is updated and re-sorted in mapTx only once.
+    // Ancestors that are themselves being removed need no update.
+    struct DescendantStateDelta {
+        int64_t modifySize = 0;
+        CAmount modifyFee = 0;
+        int64_t modifyCount = 0;
+    };
+    std::map<txiter, DescendantStateDelta, CompareIteratorByHash>
+        ancestorDeltas;
     for (txiter removeIt : entriesToRemove) {
         setEntries setAncestors;
         const CTxMemPoolEntry &entry = *removeIt;
@@ -340,9 +355,26 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove,
         // to update for removal.
         CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit,
                                   nNoLimit, nNoLimit, dummy, false);
-        // Note that UpdateAncestorsOf severs the child links that point to
-        // removeIt in the entries for the parents of removeIt.
-        UpdateAncestorsOf(false, removeIt, setAncestors);
+        // Sever the child links that point to removeIt in the entries for the
+        // parents of removeIt.
+        for (txiter piter : GetMemPoolParents(removeIt)) {
+            UpdateChild(piter, removeIt, false);
+        }
+        for (txiter ancestorIt : setAncestors) {
+            if (entriesToRemove.count(ancestorIt)) {
+                continue;
+            }
+            DescendantStateDelta &delta = ancestorDeltas[ancestorIt];
+            delta.modifySize -= removeIt->GetTxSize();
+            delta.modifyFee -= removeIt->GetModifiedFee();
+            delta.modifyCount--;
+        }
+    }
+    for (const auto &ancestorDelta : ancestorDeltas) {
+        const DescendantStateDelta &delta = ancestorDelta.second;
+        mapTx.modify(ancestorDelta.first,
+                     update_descendant_state(delta.modifySize, delta.modifyFee,
+                                             delta.modifyCount));
     }
     // After updating all the ancestor sizes, we can now sever the link between
     // each transaction being removed and any mempool children (ie, update
@@ -358,8 +390,9 @@ void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize,
     nSizeWithDescendants += modifySize;
     assert(int64_t(nSizeWithDescendants) > 0);
     nModFeesWithDescendants += modifyFee;
-    nCountWithDescendants += modifyCount;
-    assert(int64_t(nCountWithDescendants) > 0);
+    int64_t nNewCount = int64_t(nCountWithDescendants) + modifyCount;
+    assert(nNewCount > 0);
+    nCountWithDescendants = nNewCount;
 }
 
 void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
@@ -368,14 +401,15 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
     nSizeWithAncestors += modifySize;
     assert(int64_t(nSizeWithAncestors) > 0);
     nModFeesWithAncestors += modifyFee;
-    nCountWithAncestors += modifyCount;
-    assert(int64_t(nCountWithAncestors) > 0);
+    int64_t nNewCount = int64_t(nCountWithAncestors) + modifyCount;
+    assert(nNewCount > 0);
+    nCountWithAncestors = nNewCount;
     nSigOpCountWithAncestors += modifySigOps;
     assert(int(nSigOpCountWithAncestors) >= 0);
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate &_minReasonableRelayFee)
-    : nTransactionsUpdated(0) {
+    : nTransactionsUpdated(0), nScoresUpdated(0) {
     // lock free clear
     _clear();
 
@@ -406,6 +440,11 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n) {
     nTransactionsUpdated += n;
 }
 
+unsigned int CTxMemPool::GetScoresUpdated() const {
+    LOCK(cs);
+    return nScoresUpdated;
+}
+
 bool CTxMemPool::addUnchecked(const uint256 &hash, const CTxMemPoolEntry &entry,
                               setEntries &setAncestors, bool validFeeEstimate) {
     NotifyEntryAdded(entry.GetSharedTx());
@@ -431,6 +470,7 @@ bool CTxMemPool::addUnchecked(const uint256 &hash, const CTxMemPoolEntry &entry,
     // (When we update the entry for in-mempool parents, memory usage will be
     // further updated.)
     cachedInnerUsage += entry.DynamicMemoryUsage();
+    cachedTxUsage += entry.DynamicMemoryUsage();
 
     const CTransaction &tx = newit->GetTx();
     std::set<uint256> setParentTransactions;
@@ -478,16 +518,19 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason) {
         vTxHashes.pop_back();
         if (vTxHashes.size() * 2 < vTxHashes.capacity())
             vTxHashes.shrink_to_fit();
-    } else
+    } else {
         vTxHashes.clear();
+    }
 
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
+    cachedTxUsage -= it->DynamicMemoryUsage();
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) +
                         memusage::DynamicUsage(mapLinks[it].children);
     mapLinks.erase(it);
     mapTx.erase(it);
     nTransactionsUpdated++;
+    nScoresUpdated++;
     minerPolicyEstimator->removeTx(txid);
 }
 
@@ -656,10 +699,12 @@ void CTxMemPool::_clear() {
     vTxHashes.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
+    cachedTxUsage = 0;
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
+    ++nScoresUpdated;
 }
 
 void CTxMemPool::clear() {
@@ -678,6 +723,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const {
 
     uint64_t checkTotal = 0;
     uint64_t innerUsage = 0;
+    uint64_t txUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache *>(pcoins));
     const int64_t nSpendHeight = GetSpendHeight(mempoolDuplicate);
@@ -689,6 +735,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const {
         unsigned int i = 0;
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
+        txUsage += it->DynamicMemoryUsage();
         const CTransaction &tx = it->GetTx();
         txlinksMap::const_iterator linksiter = mapLinks.find(it);
         assert(linksiter != mapLinks.end());
@@ -806,6 +853,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const {
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+    assert(txUsage == cachedTxUsage);
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256 &hasha,
@@ -823,6 +871,21 @@ bool CTxMemPool::CompareDepthAndScore(const uint256 &hasha,
     return counta < countb;
 }
 
+void CTxMemPool::GetDepthAndScore(const std::vector<uint256> &vHashes,
+                                  std::vector<TxDepthAndScore> &vScores) const {
+    LOCK(cs);
+    vScores.reserve(vScores.size() + vHashes.size());
+    for (const uint256 &hash : vHashes) {
+        indexed_transaction_set::const_iterator it = mapTx.find(hash);
+        if (it == mapTx.end()) {
+            continue;
+        }
+        vScores.push_back(TxDepthAndScore{hash, it->GetCountWithAncestors(),
+                                          it->GetModifiedFee(),
+                                          it->GetTxSize()});
+    }
+}
+
 namespace {
 class DepthAndScoreComparator {
 public:
@@ -966,6 +1029,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash,
         deltas.second += nFeeDelta;
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
+            nScoresUpdated++;
             mapTx.modify(it, update_fee_delta(deltas.second));
             // Now update all ancestors' modified fees with descendants
             setEntries setAncestors;
@@ -1039,16 +1103,44 @@ bool CCoinsViewMemPool::HaveCoin(const COutPoint &outpoint) const {
 }
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
+    return GetMemoryUsageBreakdown().Total();
+}
+
+MemPoolUsageBreakdown CTxMemPool::GetMemoryUsageBreakdown() const {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no
-    // exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) +
-                                 15 * sizeof(void *)) *
-               mapTx.size() +
-           memusage::DynamicUsage(mapNextTx) +
-           memusage::DynamicUsage(mapDeltas) +
-           memusage::DynamicUsage(mapLinks) +
-           memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    MemPoolUsageBreakdown usage;
+    // Every entry lives in one multi_index node shared by all the indices;
+    // the hashed index additionally owns a bucket array with an end sentinel.
+    usage.entries =
+        memusage::MallocUsage(
+            sizeof(indexed_transaction_set::final_node_type)) *
+        mapTx.size();
+    usage.index =
+        memusage::MallocUsage(sizeof(void *) * (mapTx.bucket_count() + 1));
+    usage.transactions = cachedTxUsage;
+    usage.links =
+        memusage::DynamicUsage(mapLinks) + cachedInnerUsage - cachedTxUsage;
+    usage.spends = memusage::DynamicUsage(mapNextTx);
+    usage.deltas = memusage::DynamicUsage(mapDeltas);
+    usage.txhashes = memusage::DynamicUsage(vTxHashes);
+    return usage;
+}
+
+void CTxMemPool::GetTxHashSipHashes(uint64_t k0, uint64_t k1,
+                                    std::vector<uint64_t> &siphashes) const {
+    AssertLockHeld(cs);
+    // Hash the contiguous txid array in one pass rather than chasing entries,
+    // feeding the batched kernel a chunk of txids at a time.
+    static const size_t CHUNK_SIZE = 64;
+    const uint256 *chunk[CHUNK_SIZE];
+    siphashes.resize(vTxHashes.size());
+    for (size_t i = 0; i < vTxHashes.size(); i += CHUNK_SIZE) {
+        size_t n = std::min(CHUNK_SIZE, vTxHashes.size() - i);
+        for (size_t j = 0; j < n; j++) {
+            chunk[j] = &vTxHashes[i + j].first;
+        }
+        SipHashUint256Batch(k0, k1, chunk, &siphashes[i], n);
+    }
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants,
@@ -1182,18 +1274,18 @@ void CTxMemPool::TrimToSize(size_t sizelimit,
         CalculateDescendants(mapTx.project<0>(it), stage);
         nTxnRemoved += stage.size();
 
-        std::vector<CTransaction> txn;
+        std::vector<CTransactionRef> txn;
         if (pvNoSpendsRemaining) {
             txn.reserve(stage.size());
             for (txiter iter : stage) {
-                txn.push_back(iter->GetTx());
+                txn.push_back(iter->GetSharedTx());
             }
         }
         RemoveStaged(stage, false, MemPoolRemovalReason::SIZELIMIT);
         if (pvNoSpendsRemaining) {
-            for (const CTransaction &tx : txn) {
-                for (const CTxIn &txin : tx.vin) {
-                    if (exists(txin.prevout.hash)) {
+            for (const CTransactionRef &tx : txn) {
+                for (const CTxIn &txin : tx->vin) {
+                    if (mapTx.count(txin.prevout.hash)) {
                         continue;
                     }
                     if (!mapNextTx.count(txin.prevout)) {
@@ -80,27 +80,18 @@ class CTxMemPool;
 
 class CTxMemPoolEntry {
 private:
+    // Members are grouped by size to avoid padding; sizes and counts that are
+    // bounded well below 2^32 are stored in 32 bits and widened by the
+    // accessors.
     CTransactionRef tx;
     //!< Cached to avoid expensive parent-transaction lookups
     CAmount nFee;
-    //!< ... and avoid recomputing tx size
-    size_t nTxSize;
-    //!< ... and modified size for priority
-    size_t nModSize;
-    //!< ... and total memory usage
-    size_t nUsageSize;
     //!< Local time when entering the mempool
     int64_t nTime;
     //!< Priority when entering the mempool
     double entryPriority;
-    //!< Chain height when entering the mempool
-    unsigned int entryHeight;
     //!< Sum of all txin values that are already in blockchain
     CAmount inChainInputValue;
-    //!< keep track of transactions that spend a coinbase
-    bool spendsCoinbase;
-    //!< Total sigop plus P2SH sigops count
-    int64_t sigOpCount;
     //!< Used for determining the priority of the transaction for mining in a
     //! block
     int64_t feeDelta;
@@ -112,19 +103,39 @@ private:
     // descendants as well.  if nCountWithDescendants is 0, treat this entry as
     // dirty, and nSizeWithDescendants and nModFeesWithDescendants will not be
     // correct.
-    //!< number of descendant transactions
-    uint64_t nCountWithDescendants;
-    //!< ... and size
+    //!< size of descendant transactions (including us)
     uint64_t nSizeWithDescendants;
     //!< ... and total fees (all including us)
     CAmount nModFeesWithDescendants;
 
     // Analogous statistics for ancestor transactions
-    uint64_t nCountWithAncestors;
     uint64_t nSizeWithAncestors;
     CAmount nModFeesWithAncestors;
     int64_t nSigOpCountWithAncestors;
 
+    //!< Cached to avoid recomputing tx size
+    uint32_t nTxSize;
+    //!< ... and modified size for priority
+    uint32_t nModSize;
+    //!< ... and memory usage of the transaction
+    uint32_t nUsageSize;
+    //!< Chain height when entering the mempool
+    uint32_t entryHeight;
+    //!< Total sigop plus P2SH sigops count
+    uint32_t sigOpCount;
+    //!< number of descendant transactions
+    uint32_t nCountWithDescendants;
+    //!< number of ancestor transactions
+    uint32_t nCountWithAncestors;
+
+public:
+    //!< Index in mempool's vTxHashes
+    mutable uint32_t vTxHashesIdx;
+
+private:
+    //!< keep track of transactions that spend a coinbase
+    bool spendsCoinbase;
+
 public:
     CTxMemPoolEntry(const CTransactionRef &_tx, const CAmount &_nFee,
                     int64_t _nTime, double _entryPriority,
@@ -175,9 +186,6 @@ public:
     int64_t GetSigOpCountWithAncestors() const {
         return nSigOpCountWithAncestors;
     }
-
-    //!< Index in mempool's vTxHashes
-    mutable size_t vTxHashesIdx;
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -349,6 +357,63 @@ struct TxMempoolInfo {
     int64_t nFeeDelta;
 };
 
+/**
+ * Ancestor count and modified feerate of a mempool transaction, as used by
+ * CTxMemPool::CompareDepthAndScore. Lets callers order transactions without
+ * holding the mempool lock for every comparison.
+ */
+struct TxDepthAndScore {
+    uint256 txid;
+    uint64_t nCountWithAncestors;
+    int64_t nModFee;
+    size_t nTxSize;
+};
+
+/**
+ * Sort parents before their children, then by modified feerate in descending
+ * order. Matches CTxMemPool::CompareDepthAndScore.
+ */
+class CompareTxDepthAndScore {
+public:
+    bool operator()(const TxDepthAndScore &a, const TxDepthAndScore &b) const {
+        if (a.nCountWithAncestors != b.nCountWithAncestors) {
+            return a.nCountWithAncestors < b.nCountWithAncestors;
+        }
+        double f1 = (double)a.nModFee * b.nTxSize;
+        double f2 = (double)b.nModFee * a.nTxSize;
+        if (f1 == f2) {
+            return b.txid < a.txid;
+        }
+        return f1 > f2;
+    }
+};
+
+/**
+ * Memory used by the mempool, split by data structure. All values are in
+ * bytes and include malloc overhead.
+ */
+struct MemPoolUsageBreakdown {
+    /** mapTx nodes, each holding a CTxMemPoolEntry and its index links. */
+    size_t entries;
+    /** mapTx hashed index bucket array. */
+    size_t index;
+    /** Transactions referenced by the entries. */
+    size_t transactions;
+    /** In-mempool parent/child links (mapLinks). */
+    size_t links;
+    /** Spent outpoints (mapNextTx). */
+    size_t spends;
+    /** Fee and priority deltas (mapDeltas). */
+    size_t deltas;
+    /** Hashes used for compact block reconstruction (vTxHashes). */
+    size_t txhashes;
+
+    size_t Total() const {
+        return entries + index + transactions + links + spends + deltas +
+               txhashes;
+    }
+};
+
 /**
  * Reason why a transaction was removed from the mempool, this is passed to the
  * notification signal.
@@ -468,6 +533,10 @@ private:
     //!< Value n means that n times in 2^32 we check.
     uint32_t nCheckFrequency;
     unsigned int nTransactionsUpdated;
+    //! Incremented whenever the ancestor count or modified fee of transactions
+    //! already in the pool may change. Additions don't count, they only change
+    //! the descendant state of their ancestors.
+    unsigned int nScoresUpdated;
     CBlockPolicyEstimator *minerPolicyEstimator;
 
     //!< sum of all mempool tx's virtual sizes.
@@ -475,6 +544,9 @@ private:
     //!< sum of dynamic memory usage of all the map elements (NOT the maps
     //! themselves)
     uint64_t cachedInnerUsage;
+    //!< part of cachedInnerUsage used by the transactions themselves, the
+    //! rest being mapLinks' parent and child sets
+    uint64_t cachedTxUsage;
 
     mutable int64_t lastRollingFeeUpdate;
     mutable bool blockSinceLastRollingFeeBump;
@@ -521,6 +593,15 @@ public:
     //!< All tx hashes/entries in mapTx, in random order
     std::vector<std::pair<uint256, txiter>> vTxHashes;
 
+    /**
+     * Compute the SipHash of every vTxHashes entry under the given key, in
+     * the same order, as needed to match compact block short IDs. The keys
+     * differ for every compact block, so nothing is cached: the contiguous
+     * txid array is hashed in a single pass on each call. Requires cs.
+     */
+    void GetTxHashSipHashes(uint64_t k0, uint64_t k1,
+                            std::vector<uint64_t> &siphashes) const;
+
     struct CompareIteratorByHash {
         bool operator()(const txiter &a, const txiter &b) const {
             return a->GetTx().GetId() < b->GetTx().GetId();
@@ -590,10 +671,22 @@ public:
     // lock free
     void _clear();
     bool CompareDepthAndScore(const uint256 &hasha, const uint256 &hashb);
+    /**
+     * Look up the depth and score of the given transactions under a single
+     * lock. Transactions that are not in the mempool are skipped.
+     */
+    void GetDepthAndScore(const std::vector<uint256> &vHashes,
+                          std::vector<TxDepthAndScore> &vScores) const;
     void queryHashes(std::vector<uint256> &vtxid);
     bool isSpent(const COutPoint &outpoint);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    /**
+     * A sequence number that only changes when the results of
+     * GetDepthAndScore() for transactions that are still in the pool may, so
+     * that callers can cache them across additions.
+     */
+    unsigned int GetScoresUpdated() const;
     /**
      * Check that none of this transactions inputs are in the mempool, and thus
      * the tx is not dependent on other mempool transactions to be included in a
@@ -736,6 +829,7 @@ public:
     bool ReadFeeEstimates(CAutoFile &filein);
 
     size_t DynamicMemoryUsage() const;
+    MemPoolUsageBreakdown GetMemoryUsageBreakdown() const;
 
     boost::signals2::signal<void(CTransactionRef)> NotifyEntryAdded;
     boost::signals2::signal<void(CTransactionRef, MemPoolRemovalReason)>
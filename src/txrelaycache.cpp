@@ -0,0 +1,100 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txrelaycache.h"
+
+#include "core_memusage.h"
+#include "memusage.h"
+
+#include <algorithm>
+
+CTxRelayCache::CTxRelayCache(size_t nMaxUsageIn, int64_t nExpiryIn,
+                             int nBuckets)
+    : nExpiry(nExpiryIn),
+      nBucketSpan(std::max<int64_t>(1, nExpiryIn / std::max(1, nBuckets))),
+      nMaxUsage(nMaxUsageIn), nUsage(0), nHits(0), nMisses(0), nExpired(0),
+      nEvicted(0) {}
+
+void CTxRelayCache::SetMaxUsage(size_t nMaxUsageIn) {
+    nMaxUsage = nMaxUsageIn;
+    while (nUsage > nMaxUsage && !mapTx.empty()) {
+        EvictOldest();
+    }
+}
+
+void CTxRelayCache::EvictOldest() {
+    // Every bucket in the deque holds at least one live entry.
+    Bucket &bucket = buckets.front();
+    auto it = mapTx.find(bucket.vTxids[bucket.nBegin++]);
+    nUsage -= it->second.nUsage;
+    mapTx.erase(it);
+    nEvicted++;
+    if (bucket.nBegin == bucket.vTxids.size()) {
+        buckets.pop_front();
+    }
+}
+
+bool CTxRelayCache::Add(const CTransactionRef &tx, int64_t nNow) {
+    Expire(nNow);
+
+    const uint256 &txid = tx->GetId();
+    if (mapTx.count(txid)) {
+        return false;
+    }
+
+    if (buckets.empty() || nNow >= buckets.back().nStart + nBucketSpan) {
+        buckets.push_back(Bucket{nNow, 0, std::vector<uint256>()});
+    }
+    size_t nEntryUsage =
+        RecursiveDynamicUsage(*tx) + memusage::DynamicUsage(tx) +
+        memusage::MallocUsage(
+            sizeof(memusage::unordered_node<std::pair<const uint256, Entry>>)) +
+        sizeof(uint256);
+    mapTx.emplace(txid, Entry{tx, nEntryUsage});
+    buckets.back().vTxids.push_back(txid);
+    nUsage += nEntryUsage;
+
+    while (nUsage > nMaxUsage && !mapTx.empty()) {
+        EvictOldest();
+    }
+    return true;
+}
+
+CTransactionRef CTxRelayCache::Find(const uint256 &txid) {
+    auto it = mapTx.find(txid);
+    if (it == mapTx.end()) {
+        nMisses++;
+        return nullptr;
+    }
+    nHits++;
+    return it->second.tx;
+}
+
+void CTxRelayCache::Expire(int64_t nNow) {
+    // A bucket is dropped once its newest possible entry has been kept for
+    // the full expiry window.
+    while (!buckets.empty() &&
+           buckets.front().nStart + nBucketSpan + nExpiry <= nNow) {
+        const Bucket &bucket = buckets.front();
+        for (size_t i = bucket.nBegin; i < bucket.vTxids.size(); i++) {
+            auto it = mapTx.find(bucket.vTxids[i]);
+            nUsage -= it->second.nUsage;
+            mapTx.erase(it);
+            nExpired++;
+        }
+        buckets.pop_front();
+    }
+}
+
+TxRelayCacheStats CTxRelayCache::GetStats() const {
+    TxRelayCacheStats stats;
+    stats.nEntries = mapTx.size();
+    stats.nMemoryUsage = nUsage;
+    stats.nMaxMemoryUsage = nMaxUsage;
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    stats.nExpired = nExpired;
+    stats.nEvicted = nEvicted;
+    return stats;
+}
@@ -0,0 +1,104 @@
+// Copyright (c) 2017 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXRELAYCACHE_H
+#define BITCOIN_TXRELAYCACHE_H
+
+#include "primitives/transaction.h"
+#include "txmempool.h"
+#include "uint256.h"
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+/** Default for -maxrelaycache, memory budget of the relay cache in megabytes */
+static const unsigned int DEFAULT_MAX_RELAY_CACHE_SIZE = 50;
+/** How long announced transactions can be fetched with getdata, in seconds */
+static const int64_t RELAY_CACHE_EXPIRY = 15 * 60;
+/** Number of time buckets the relay cache expiry window is split into */
+static const int RELAY_CACHE_BUCKETS = 15;
+
+struct TxRelayCacheStats {
+    size_t nEntries;
+    size_t nMemoryUsage;
+    size_t nMaxMemoryUsage;
+    uint64_t nHits;
+    uint64_t nMisses;
+    //! Entries dropped because they reached the end of the expiry window
+    uint64_t nExpired;
+    //! Entries dropped early to stay within the memory budget
+    uint64_t nEvicted;
+};
+
+/**
+ * Transactions we recently announced, kept so that getdata requests for them
+ * can still be answered once they have left the mempool.
+ *
+ * Entries are grouped in time buckets that each cover a fraction of the expiry
+ * window and are dropped as a whole once the window has passed, so expiry is
+ * O(1) per entry. When the memory budget is exceeded the oldest entries are
+ * evicted first. This class is not thread safe.
+ */
+class CTxRelayCache {
+private:
+    struct Entry {
+        CTransactionRef tx;
+        size_t nUsage;
+    };
+
+    struct Bucket {
+        int64_t nStart;
+        //! Entries before this index have already been evicted
+        size_t nBegin;
+        std::vector<uint256> vTxids;
+    };
+
+    std::unordered_map<uint256, Entry, SaltedTxidHasher> mapTx;
+    std::deque<Bucket> buckets;
+    int64_t nExpiry;
+    int64_t nBucketSpan;
+    size_t nMaxUsage;
+    size_t nUsage;
+
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nExpired;
+    uint64_t nEvicted;
+
+    void EvictOldest();
+
+public:
+    /**
+     * @param[in]   nMaxUsageIn     Memory budget in bytes.
+     * @param[in]   nExpiryIn       Minimum lifetime of an entry in
+     *                              microseconds.
+     * @param[in]   nBuckets        Number of buckets in the expiry window.
+     */
+    CTxRelayCache(size_t nMaxUsageIn,
+                  int64_t nExpiryIn = RELAY_CACHE_EXPIRY * 1000000,
+                  int nBuckets = RELAY_CACHE_BUCKETS);
+
+    void SetMaxUsage(size_t nMaxUsageIn);
+
+    /**
+     * Add a transaction announced at time nNow (in microseconds). Returns
+     * false if it was already cached, in which case its lifetime is not
+     * extended.
+     */
+    bool Add(const CTransactionRef &tx, int64_t nNow);
+
+    /** Return the cached transaction, or nullptr. */
+    CTransactionRef Find(const uint256 &txid);
+
+    /** Drop the buckets whose expiry window has passed at time nNow. */
+    void Expire(int64_t nNow);
+
+    size_t Size() const { return mapTx.size(); }
+    size_t DynamicMemoryUsage() const { return nUsage; }
+    TxRelayCacheStats GetStats() const;
+};
+
+#endif // BITCOIN_TXRELAYCACHE_H
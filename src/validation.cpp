@@ -15,6 +15,7 @@
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "hash.h"
+#include "index/txindex.h"
 #include "init.h"
 #include "policy/fees.h"
 #include "policy/policy.h"
@@ -39,6 +40,7 @@
 #include "warnings.h"
 
 #include <atomic>
+#include <list>
 #include <sstream>
 
 #include <boost/algorithm/string/join.hpp>
@@ -67,7 +69,6 @@ CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 std::atomic_bool fImporting(false);
 bool fReindex = false;
-bool fTxIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
@@ -965,39 +966,21 @@ bool AcceptToMemoryPool(const Config &config, CTxMemPool &pool,
 bool GetTransaction(const Config &config, const uint256 &txid,
                     CTransactionRef &txOut, uint256 &hashBlock,
                     bool fAllowSlow) {
-    CBlockIndex *pindexSlow = nullptr;
-
-    LOCK(cs_main);
-
     CTransactionRef ptx = mempool.get(txid);
     if (ptx) {
         txOut = ptx;
         return true;
     }
 
-    if (fTxIndex) {
-        CDiskTxPos postx;
-        if (pblocktree->ReadTxIndex(txid, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK,
-                           CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
-            CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
-            } catch (const std::exception &e) {
-                return error("%s: Deserialize or I/O error - %s", __func__,
-                             e.what());
-            }
-            hashBlock = header.GetHash();
-            if (txOut->GetId() != txid)
-                return error("%s: txid mismatch", __func__);
-            return true;
-        }
+    // The transaction index is looked up without holding cs_main.
+    if (g_txindex && g_txindex->FindTx(txid, hashBlock, txOut)) {
+        return true;
     }
 
+    CBlockIndex *pindexSlow = nullptr;
+
+    LOCK(cs_main);
+
     // use coin database to locate block that contains transaction, and scan it
     if (fAllowSlow) {
         const Coin &coin = AccessByTxid(*pcoinsTip, txid);
@@ -1086,6 +1069,43 @@ bool ReadBlockFromDisk(CBlock &block, const CBlockIndex *pindex,
     return true;
 }
 
+FILE *OpenRawBlockData(const CDiskBlockPos &pos, bool fUndo, uint32_t &nSize) {
+    // Both kinds of files store the length of a record just in front of it.
+    if (pos.IsNull() || pos.nPos < sizeof(nSize)) return nullptr;
+    CDiskBlockPos sizePos(pos.nFile, pos.nPos - sizeof(nSize));
+    CAutoFile filein(fUndo ? OpenUndoFile(sizePos, true)
+                           : OpenBlockFile(sizePos, true),
+                     SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        error("%s: open failed for %s", __func__, pos.ToString());
+        return nullptr;
+    }
+
+    try {
+        filein >> nSize;
+    } catch (const std::exception &e) {
+        error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        return nullptr;
+    }
+
+    // Make sure the whole record is there, so that callers can rely on nSize.
+    if (fseek(filein.Get(), 0, SEEK_END) != 0) {
+        error("%s: fseek failed for %s", __func__, pos.ToString());
+        return nullptr;
+    }
+    long nFileSize = ftell(filein.Get());
+    if (nFileSize < 0 || uint64_t(nFileSize) < uint64_t(pos.nPos) + nSize) {
+        error("%s: truncated record at %s", __func__, pos.ToString());
+        return nullptr;
+    }
+    if (fseek(filein.Get(), pos.nPos, SEEK_SET) != 0) {
+        error("%s: fseek failed for %s", __func__, pos.ToString());
+        return nullptr;
+    }
+
+    return filein.release();
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params &consensusParams) {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
     // Force block reward to zero when right shift is undefined.
@@ -1456,6 +1476,8 @@ bool UndoWriteToDisk(const CBlockUndo &blockundo, CDiskBlockPos &pos,
     return true;
 }
 
+} // anon namespace
+
 bool UndoReadFromDisk(CBlockUndo &blockundo, const CDiskBlockPos &pos,
                       const uint256 &hashBlock) {
     // Open history file to read
@@ -1484,6 +1506,159 @@ bool UndoReadFromDisk(CBlockUndo &blockundo, const CDiskBlockPos &pos,
     return true;
 }
 
+namespace {
+
+/** Max serialized size of the undo data kept by CBlockUndoCache */
+static const size_t MAX_BLOCK_UNDO_CACHE_SIZE = 16 * 1024 * 1024;
+
+/**
+ * The undo data of the blocks whose spent outputs were looked up most
+ * recently, so that looking up the inputs of several transactions of a block
+ * reads it once. The newest entry is always kept, even if it's larger than
+ * the limit.
+ */
+class CBlockUndoCache {
+public:
+    struct Entry {
+        uint256 hashBlock;
+        std::shared_ptr<const CBlockUndo> blockundo;
+        //! The ids of the transactions of the block, once they were needed
+        std::shared_ptr<const std::vector<uint256>> txids;
+        size_t nSize;
+    };
+
+    bool Get(const uint256 &hashBlock, Entry &entry) {
+        LOCK(cs);
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->hashBlock == hashBlock) {
+                entries.splice(entries.begin(), entries, it);
+                entry = entries.front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Put(const Entry &entry) {
+        LOCK(cs);
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->hashBlock == entry.hashBlock) {
+                nTotalSize -= it->nSize;
+                entries.erase(it);
+                break;
+            }
+        }
+        entries.push_front(entry);
+        nTotalSize += entry.nSize;
+        while (entries.size() > 1 && nTotalSize > MAX_BLOCK_UNDO_CACHE_SIZE) {
+            nTotalSize -= entries.back().nSize;
+            entries.pop_back();
+        }
+    }
+
+private:
+    CCriticalSection cs;
+    //! Most recently used first
+    std::list<Entry> entries;
+    size_t nTotalSize = 0;
+};
+
+CBlockUndoCache blockUndoCache;
+
+/**
+ * Get the undo data of a block from the cache or the disk, with the ids of
+ * its transactions if fTxIds.
+ */
+bool LoadBlockUndo(const CBlockIndex *pindex, bool fTxIds,
+                   CBlockUndoCache::Entry &entry) {
+    const uint256 hashBlock = pindex->GetBlockHash();
+    const bool fCached = blockUndoCache.Get(hashBlock, entry);
+    if (fCached && (!fTxIds || entry.txids)) {
+        return true;
+    }
+
+    CDiskBlockPos posBlock, posUndo;
+    {
+        LOCK(cs_main);
+        // The genesis block spends nothing and has no undo data.
+        if (pindex->pprev != nullptr && !(pindex->nStatus & BLOCK_HAVE_UNDO)) {
+            return false;
+        }
+        if (fTxIds && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            return false;
+        }
+        posBlock = pindex->GetBlockPos();
+        posUndo = pindex->GetUndoPos();
+    }
+
+    if (!fCached) {
+        std::shared_ptr<CBlockUndo> blockundo = std::make_shared<CBlockUndo>();
+        if (pindex->pprev != nullptr &&
+            !UndoReadFromDisk(*blockundo, posUndo,
+                              pindex->pprev->GetBlockHash())) {
+            return false;
+        }
+        entry.hashBlock = hashBlock;
+        entry.blockundo = blockundo;
+        entry.nSize =
+            ::GetSerializeSize(*blockundo, SER_DISK, CLIENT_VERSION);
+    }
+
+    if (fTxIds) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, posBlock, Params().GetConsensus())) {
+            return false;
+        }
+        // There is undo data for every transaction but the coinbase.
+        if (entry.blockundo->vtxundo.size() + 1 != block.vtx.size()) {
+            return error("%s: undo data of block %s doesn't match the block",
+                         __func__, hashBlock.ToString());
+        }
+        std::shared_ptr<std::vector<uint256>> txids =
+            std::make_shared<std::vector<uint256>>();
+        txids->reserve(block.vtx.size());
+        for (const CTransactionRef &tx : block.vtx) {
+            txids->push_back(tx->GetId());
+        }
+        entry.txids = txids;
+        entry.nSize += txids->size() * sizeof(uint256);
+    }
+
+    blockUndoCache.Put(entry);
+    return true;
+}
+
+} // anon namespace
+
+bool GetBlockUndo(const CBlockIndex *pindex,
+                  std::shared_ptr<const CBlockUndo> &blockundo) {
+    CBlockUndoCache::Entry entry;
+    if (!LoadBlockUndo(pindex, false, entry)) {
+        return false;
+    }
+    blockundo = entry.blockundo;
+    return true;
+}
+
+bool GetTxUndo(const CBlockIndex *pindex, const uint256 &txid,
+               CTxUndo &txundo) {
+    CBlockUndoCache::Entry entry;
+    if (!LoadBlockUndo(pindex, true, entry)) {
+        return false;
+    }
+    const std::vector<uint256> &txids = *entry.txids;
+    for (size_t i = 0; i < txids.size(); i++) {
+        if (txids[i] == txid) {
+            // The coinbase spends nothing.
+            txundo = i == 0 ? CTxUndo() : entry.blockundo->vtxundo[i - 1];
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace {
+
 /** Abort with a message */
 bool AbortNode(const std::string &strMessage,
                const std::string &userMessage = "") {
@@ -1656,6 +1831,13 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CHeaderCheck> headercheckqueue(128);
+
+void ThreadHeaderCheck() {
+    RenameThread("bitcoin-headerch");
+    headercheckqueue.Thread();
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -1904,10 +2086,6 @@ static bool ConnectBlock(const Config &config, const CBlock &block,
         ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
     const uint64_t nMaxSigOpsCount = GetMaxBlockSigOpsCount(currentBlockSize);
 
-    CDiskTxPos pos(pindex->GetBlockPos(),
-                   GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos>> vPos;
-    vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
 
     for (size_t i = 0; i < block.vtx.size(); i++) {
@@ -1977,8 +2155,6 @@ static bool ConnectBlock(const Config &config, const CBlock &block,
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(),
                     pindex->nHeight);
 
-        vPos.push_back(std::make_pair(tx.GetId(), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
     int64_t nTime3 = GetTimeMicros();
@@ -2040,10 +2216,6 @@ static bool ConnectBlock(const Config &config, const CBlock &block,
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex && !pblocktree->WriteTxIndex(vPos)) {
-        return AbortNode(state, "Failed to write transaction index");
-    }
-
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2222,11 +2394,39 @@ void PruneAndFlush() {
     FlushStateToDisk(state, FLUSH_STATE_NONE);
 }
 
+static std::shared_ptr<const ChainTipSnapshot> chainTipSnapshot =
+    std::make_shared<const ChainTipSnapshot>();
+
+ChainTipSnapshot::ChainTipSnapshot(const CBlockIndex *pindexIn)
+    : pindex(pindexIn) {
+    if (pindex) {
+        nHeight = pindex->nHeight;
+        hash = pindex->GetBlockHash();
+        nChainWork = pindex->nChainWork;
+        nTime = pindex->GetBlockTime();
+        nMedianTimePast = pindex->GetMedianTimePast();
+    }
+}
+
+std::shared_ptr<const ChainTipSnapshot> GetChainTipSnapshot() {
+    return std::atomic_load(&chainTipSnapshot);
+}
+
+/** Publish the tip of chainActive for readers that don't hold cs_main. Must
+ * be called after every chainActive.SetTip(). */
+static void PublishChainTip() {
+    std::atomic_store(&chainTipSnapshot,
+                      std::shared_ptr<const ChainTipSnapshot>(
+                          std::make_shared<const ChainTipSnapshot>(
+                              chainActive.Tip())));
+}
+
 /** Update chainActive and related internal data structures. */
 static void UpdateTip(const Config &config, CBlockIndex *pindexNew) {
     const CChainParams &chainParams = config.GetChainParams();
 
     chainActive.SetTip(pindexNew);
+    PublishChainTip();
 
     // New best block
     mempool.AddTransactionsUpdated(1);
@@ -3087,6 +3287,11 @@ bool CheckBlockHeader(const CBlockHeader &block, CValidationState &state,
     return true;
 }
 
+bool CHeaderCheck::operator()() {
+    *phash = pheader->GetHash();
+    return CheckProofOfWork(*phash, pheader->nBits, *pparams);
+}
+
 bool CheckBlock(const Config &config, const CBlock &block,
                 CValidationState &state,
                 const Consensus::Params &consensusParams, bool fCheckPOW,
@@ -3369,13 +3574,18 @@ bool ContextualCheckBlock(const Config &config, const CBlock &block,
     return true;
 }
 
+/**
+ * Accept a header into the block index. If phashChecked is set, it is the hash
+ * of the header and its proof of work has already been checked.
+ */
 static bool AcceptBlockHeader(const Config &config, const CBlockHeader &block,
-                              CValidationState &state, CBlockIndex **ppindex) {
+                              CValidationState &state, CBlockIndex **ppindex,
+                              const uint256 *phashChecked = nullptr) {
     AssertLockHeld(cs_main);
     const CChainParams &chainparams = config.GetChainParams();
 
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = phashChecked ? *phashChecked : block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = nullptr;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -3393,7 +3603,8 @@ static bool AcceptBlockHeader(const Config &config, const CBlockHeader &block,
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus())) {
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(),
+                              !phashChecked)) {
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__,
                          hash.ToString(), FormatStateMessage(state));
         }
@@ -3440,17 +3651,50 @@ static bool AcceptBlockHeader(const Config &config, const CBlockHeader &block,
     return true;
 }
 
+/**
+ * Hash a batch of headers and check their proof of work on the header check
+ * threads, without holding cs_main. Returns false if the batch was not checked
+ * in parallel or if any header failed.
+ */
+static bool CheckBlockHeadersParallel(const std::vector<CBlockHeader> &headers,
+                                      const Consensus::Params &params,
+                                      std::vector<uint256> &vHashes) {
+    if (nScriptCheckThreads == 0 ||
+        headers.size() < MIN_PARALLEL_HEADER_CHECKS) {
+        return false;
+    }
+
+    vHashes.resize(headers.size());
+    std::vector<CHeaderCheck> vChecks;
+    vChecks.reserve(headers.size());
+    for (size_t i = 0; i < headers.size(); i++) {
+        vChecks.emplace_back(headers[i], params, vHashes[i]);
+    }
+
+    CCheckQueueControl<CHeaderCheck> control(&headercheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
 // Exposed wrapper for AcceptBlockHeader
 bool ProcessNewBlockHeaders(const Config &config,
                             const std::vector<CBlockHeader> &headers,
                             CValidationState &state,
                             const CBlockIndex **ppindex) {
+    // If any header fails the parallel checks, they are all checked again one
+    // by one below, so that the headers before it are still accepted and the
+    // failure is reported as usual.
+    std::vector<uint256> vHashes;
+    bool fChecked = CheckBlockHeadersParallel(
+        headers, config.GetChainParams().GetConsensus(), vHashes);
+
     {
         LOCK(cs_main);
-        for (const CBlockHeader &header : headers) {
+        for (size_t i = 0; i < headers.size(); i++) {
             // Use a temp pindex instead of ppindex to avoid a const_cast
             CBlockIndex *pindex = nullptr;
-            if (!AcceptBlockHeader(config, header, state, &pindex)) {
+            if (!AcceptBlockHeader(config, headers[i], state, &pindex,
+                                   fChecked ? &vHashes[i] : nullptr)) {
                 return false;
             }
             if (ppindex) {
@@ -3988,10 +4232,20 @@ static bool LoadBlockIndexDB(const CChainParams &chainparams) {
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
-    // Check whether we have a transaction index
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__,
-              fTxIndex ? "enabled" : "disabled");
+    // The transaction index used to be kept in the block index database and
+    // updated by ConnectBlock. It now has its own database, which is built in
+    // the background, so the old entries are erased. The flag is only cleared
+    // once they are all gone, so an interrupted erase resumes on next start.
+    // A failed write throws dbwrapper_error, which is fatal like any other
+    // error while loading the block index database.
+    bool fLegacyTxIndex = false;
+    if (pblocktree->ReadFlag("txindex", fLegacyTxIndex) && fLegacyTxIndex) {
+        LogPrintf("%s: erasing the old transaction index from the block index "
+                  "database\n",
+                  __func__);
+        pblocktree->EraseLegacyTxIndex();
+        pblocktree->WriteFlag("txindex", false);
+    }
 
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
@@ -3999,6 +4253,7 @@ static bool LoadBlockIndexDB(const CChainParams &chainparams) {
         return true;
     }
     chainActive.SetTip(it->second);
+    PublishChainTip();
 
     PruneBlockIndexCandidates();
 
@@ -4232,6 +4487,7 @@ void UnloadBlockIndex() {
     LOCK(cs_main);
     setBlockIndexCandidates.clear();
     chainActive.SetTip(nullptr);
+    PublishChainTip();
     pindexBestInvalid = nullptr;
     pindexBestHeader = nullptr;
     mempool.clear();
@@ -4269,9 +4525,6 @@ bool InitBlockIndex(const Config &config) {
         return true;
     }
 
-    // Use the provided setting for -txindex in the new database
-    fTxIndex = GetBoolArg("-txindex", DEFAULT_TXINDEX);
-    pblocktree->WriteFlag("txindex", fTxIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the
@@ -4796,7 +5049,63 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params &params,
                                        versionbitscache);
 }
 
-static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+static const uint64_t MEMPOOL_DUMP_VERSION_NO_TIP = 1;
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+
+/** Number of mempool.dat entries whose scripts are pre-checked per batch. */
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
+
+namespace {
+struct MempoolDumpEntry {
+    CTransactionRef tx;
+    int64_t nTime;
+    int64_t nFeeDelta;
+};
+} // namespace
+
+/**
+ * Verify the scripts of a batch of mempool.dat entries on the script check
+ * queue so that the signature cache is warm when they are later fed through
+ * AcceptToMemoryPool one at a time. Entries are stored parent first, so the
+ * outputs of earlier entries in the batch are made available to later ones.
+ * The result is deliberately ignored: AcceptToMemoryPool repeats every check
+ * and remains the sole authority on whether an entry is accepted.
+ */
+static void PreCheckMempoolEntries(
+    std::vector<MempoolDumpEntry>::const_iterator begin,
+    std::vector<MempoolDumpEntry>::const_iterator end) {
+    AssertLockHeld(cs_main);
+
+    uint32_t scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (!Params().RequireStandard()) {
+        scriptVerifyFlags =
+            GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+    }
+
+    CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+    CCoinsViewCache view(&viewMemPool);
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    std::vector<CScriptCheck> vChecks;
+    for (auto it = begin; it != end; ++it) {
+        const CTransaction &tx = *it->tx;
+        if (tx.IsCoinBase() || !view.HaveInputs(tx)) {
+            continue;
+        }
+
+        PrecomputedTransactionData txdata(tx);
+        vChecks.clear();
+        vChecks.reserve(tx.vin.size());
+        for (size_t i = 0; i < tx.vin.size(); i++) {
+            const CTxOut &prevout =
+                view.AccessCoin(tx.vin[i].prevout).GetTxOut();
+            vChecks.emplace_back(prevout.scriptPubKey, prevout.nValue, tx, i,
+                                 scriptVerifyFlags, true, txdata);
+        }
+        control.Add(vChecks);
+        AddCoins(view, tx, MEMPOOL_HEIGHT);
+    }
+    control.Wait();
+}
 
 bool LoadMempool(const Config &config) {
     int64_t nExpiryTimeout =
@@ -4814,70 +5123,123 @@ bool LoadMempool(const Config &config) {
     int64_t skipped = 0;
     int64_t failed = 0;
     int64_t nNow = GetTime();
+    int64_t nStart = GetTimeMicros();
 
+    std::vector<MempoolDumpEntry> entries;
+    std::map<uint256, CAmount> mapDeltas;
+    // Files without a tip hash are assumed to match, as they always did.
+    bool fSameTip = true;
     try {
         uint64_t version;
         file >> version;
-        if (version != MEMPOOL_DUMP_VERSION) {
+        if (version != MEMPOOL_DUMP_VERSION &&
+            version != MEMPOOL_DUMP_VERSION_NO_TIP) {
             return false;
         }
+        if (version >= MEMPOOL_DUMP_VERSION) {
+            uint256 hashDumpTip;
+            file >> hashDumpTip;
+            LOCK(cs_main);
+            fSameTip = chainActive.Tip() &&
+                       hashDumpTip == chainActive.Tip()->GetBlockHash();
+            if (!fSameTip) {
+                LogPrintf("Mempool file was written at block %s, not at the "
+                          "current tip; skipping the script pre-check\n",
+                          hashDumpTip.ToString());
+            }
+        }
         uint64_t num;
         file >> num;
-        double prioritydummy = 0;
+        entries.reserve(std::min<uint64_t>(num, 1 << 20));
         while (num--) {
-            CTransactionRef tx;
-            int64_t nTime;
-            int64_t nFeeDelta;
-            file >> tx;
-            file >> nTime;
-            file >> nFeeDelta;
-
-            CAmount amountdelta = nFeeDelta;
+            MempoolDumpEntry entry;
+            file >> entry.tx;
+            file >> entry.nTime;
+            file >> entry.nFeeDelta;
+            if (entry.nTime + nExpiryTimeout > nNow) {
+                entries.push_back(std::move(entry));
+            } else {
+                ++skipped;
+            }
+            if (ShutdownRequested()) return false;
+        }
+        file >> mapDeltas;
+    } catch (const std::exception &e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing "
+                  "anyway.\n",
+                  e.what());
+        return false;
+    }
+
+    int64_t nRead = GetTimeMicros();
+
+    double prioritydummy = 0;
+    for (size_t nBatch = 0; nBatch < entries.size();
+         nBatch += MEMPOOL_LOAD_BATCH_SIZE) {
+        auto begin = entries.cbegin() + nBatch;
+        auto end = entries.cbegin() +
+                   std::min(nBatch + MEMPOOL_LOAD_BATCH_SIZE, entries.size());
+
+        // After a dump taken on another tip most entries are confirmed or
+        // conflicted, and AcceptToMemoryPool drops those before any script
+        // is run, so warming the signature cache would be wasted work.
+        if (nScriptCheckThreads && fSameTip) {
+            LOCK(cs_main);
+            PreCheckMempoolEntries(begin, end);
+        }
+
+        for (auto it = begin; it != end; ++it) {
+            const CTransactionRef &tx = it->tx;
+            CAmount amountdelta = it->nFeeDelta;
             if (amountdelta) {
                 mempool.PrioritiseTransaction(tx->GetId(),
                                               tx->GetId().ToString(),
                                               prioritydummy, amountdelta);
             }
             CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
+            {
                 LOCK(cs_main);
                 AcceptToMemoryPoolWithTime(config, mempool, state, tx, true,
-                                           nullptr, nTime);
-                if (state.IsValid()) {
-                    ++count;
-                } else {
-                    ++failed;
-                }
+                                           nullptr, it->nTime);
+            }
+            if (state.IsValid()) {
+                ++count;
             } else {
-                ++skipped;
+                ++failed;
             }
             if (ShutdownRequested()) return false;
         }
-        std::map<uint256, CAmount> mapDeltas;
-        file >> mapDeltas;
+    }
 
-        for (const auto &i : mapDeltas) {
-            mempool.PrioritiseTransaction(i.first, i.first.ToString(),
-                                          prioritydummy, i.second);
-        }
-    } catch (const std::exception &e) {
-        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing "
-                  "anyway.\n",
-                  e.what());
-        return false;
+    for (const auto &i : mapDeltas) {
+        mempool.PrioritiseTransaction(i.first, i.first.ToString(),
+                                      prioritydummy, i.second);
     }
 
     LogPrintf("Imported mempool transactions from disk: %i successes, %i "
-              "failed, %i expired\n",
-              count, failed, skipped);
+              "failed, %i expired (%gs to read, %gs to accept)\n",
+              count, failed, skipped, (nRead - nStart) * 0.000001,
+              (GetTimeMicros() - nRead) * 0.000001);
     return true;
 }
 
 void DumpMempool(void) {
+    // Periodic dumps from the scheduler may race the one at shutdown.
+    static CCriticalSection cs_dumpmempool;
+    LOCK(cs_dumpmempool);
+
     int64_t start = GetTimeMicros();
 
     std::map<uint256, CAmount> mapDeltas;
     std::vector<TxMempoolInfo> vinfo;
+    uint256 hashTip;
+
+    {
+        LOCK(cs_main);
+        if (chainActive.Tip()) {
+            hashTip = chainActive.Tip()->GetBlockHash();
+        }
+    }
 
     {
         LOCK(mempool.cs);
@@ -4900,7 +5262,10 @@ void DumpMempool(void) {
 
         uint64_t version = MEMPOOL_DUMP_VERSION;
         file << version;
+        file << hashTip;
 
+        // infoAll() returns parents before their children, which
+        // LoadMempool relies upon.
         file << (uint64_t)vinfo.size();
         for (const auto &i : vinfo) {
             file << *(i.tx);
@@ -23,6 +23,7 @@
 #include <cstdint>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <utility>
@@ -35,6 +36,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CBloomFilter;
 class CChainParams;
 class CConnman;
@@ -79,6 +81,9 @@ static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in
  * hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
+/** Default for -mempooldumpinterval, minutes between periodic mempool.dat
+ * writes (0 = only at shutdown) */
+static const unsigned int DEFAULT_MEMPOOL_DUMP_INTERVAL = 0;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -90,9 +95,31 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Smallest batch of headers whose proof of work is checked in parallel */
+static const size_t MIN_PARALLEL_HEADER_CHECKS = 16;
+/**
+ * Threads started to check header proof of work, besides the thread that
+ * received the headers. Headers come in batches from one peer at a time and
+ * are cheap to hash, so one is enough.
+ */
+static const int HEADER_CHECK_THREADS = 1;
 /** Number of blocks that can be requested at any given time from a single peer.
  */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the number of blocks in flight from a single peer once its
+ * download speed has been measured. */
+static const int MIN_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Number of blocks a peer must deliver before its measured download speed is
+ * used to size its in-flight limit. */
+static const uint64_t BLOCK_DOWNLOAD_WARMUP_BLOCKS = 4;
+/** Keep about this much download time (in microseconds, at the peer's measured
+ * speed) in flight with each peer. */
+static const int64_t BLOCK_DOWNLOAD_QUEUE_TIME = 2 * 1000000;
+/** Minimum time in microseconds after which a block holding back the download
+ * window is requested from a peer that is at least twice as fast. It is longer
+ * for blocks that take the staller longer to send. */
+static const int64_t BLOCK_REASSIGN_TIMEOUT = 1000000;
 /** Timeout in seconds during which a peer must stall block download progress
  * before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
@@ -184,7 +211,6 @@ extern CConditionVariable cvBlockChange;
 extern std::atomic_bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
-extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
@@ -300,6 +326,8 @@ bool LoadBlockIndex(const CChainParams &chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the header checking thread */
+void ThreadHeaderCheck();
 /** Check whether we are doing an initial block download (synchronizing from
  * disk or network) */
 bool IsInitialBlockDownload();
@@ -526,6 +554,33 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the context-free checks of one block header: hashing
+ * it and checking its proof of work. The hash is written out so that it does
+ * not need to be computed again when the header is accepted.
+ */
+class CHeaderCheck {
+private:
+    const CBlockHeader *pheader;
+    const Consensus::Params *pparams;
+    uint256 *phash;
+
+public:
+    CHeaderCheck() : pheader(nullptr), pparams(nullptr), phash(nullptr) {}
+
+    CHeaderCheck(const CBlockHeader &headerIn,
+                 const Consensus::Params &paramsIn, uint256 &hashOut)
+        : pheader(&headerIn), pparams(&paramsIn), phash(&hashOut) {}
+
+    bool operator()();
+
+    void swap(CHeaderCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(pparams, check.pparams);
+        std::swap(phash, check.phash);
+    }
+};
+
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock &block, CDiskBlockPos &pos,
                       const CMessageHeader::MessageStartChars &messageStart);
@@ -533,6 +588,30 @@ bool ReadBlockFromDisk(CBlock &block, const CDiskBlockPos &pos,
                        const Consensus::Params &consensusParams);
 bool ReadBlockFromDisk(CBlock &block, const CBlockIndex *pindex,
                        const Consensus::Params &consensusParams);
+/** Read the undo data of a block, whose parent is hashBlock, and check it. */
+bool UndoReadFromDisk(CBlockUndo &blockundo, const CDiskBlockPos &pos,
+                      const uint256 &hashBlock);
+/**
+ * Open the serialized block (or, with fUndo, undo data) stored at pos without
+ * deserializing it. On success the file is positioned at the first byte and
+ * nSize is set to the length recorded in front of it, which has been checked
+ * to fit in the file. The caller owns the returned file.
+ */
+FILE *OpenRawBlockData(const CDiskBlockPos &pos, bool fUndo, uint32_t &nSize);
+/**
+ * Get the undo data of a block, i.e. the outputs spent by its transactions,
+ * which is empty for the genesis block. Fails if the undo data isn't
+ * available. Recently used undo data is cached. Does not need cs_main.
+ */
+bool GetBlockUndo(const CBlockIndex *pindex,
+                  std::shared_ptr<const CBlockUndo> &blockundo);
+/**
+ * Get the undo data of the transaction txid of a block, which is empty for
+ * the coinbase. Fails if the block doesn't contain the transaction, or its
+ * data isn't available. Does not need cs_main.
+ */
+bool GetTxUndo(const CBlockIndex *pindex, const uint256 &txid,
+               CTxUndo &txundo);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -619,6 +698,54 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex);
 /** The currently-connected chain of blocks (protected by cs_main). */
 extern CChain chainActive;
 
+/**
+ * Immutable summary of the tip of chainActive, published every time the tip
+ * changes so that it can be read without cs_main.
+ *
+ * The header fields, height, chain work and pprev/pskip links of a block index
+ * entry do not change once it is in mapBlockIndex, so the ancestors of the tip
+ * can be walked and those fields read without the lock. Everything else in an
+ * entry (nTx, nChainTx, nStatus and the file positions) is written under
+ * cs_main and must only be read with it held.
+ *
+ * Entries are deleted by UnloadBlockIndex, which publishes an empty snapshot
+ * first. It only runs while the block index is loaded at startup, before RPC
+ * and REST leave warmup, and in unit tests.
+ */
+struct ChainTipSnapshot {
+    //! The tip, or nullptr if no chain is loaded
+    const CBlockIndex *pindex = nullptr;
+    int nHeight = -1;
+    uint256 hash;
+    arith_uint256 nChainWork;
+    int64_t nTime = 0;
+    int64_t nMedianTimePast = 0;
+
+    ChainTipSnapshot() {}
+    explicit ChainTipSnapshot(const CBlockIndex *pindexIn);
+
+    /** The block at the given height of this chain, or nullptr. */
+    const CBlockIndex *operator[](int nHeightIn) const {
+        if (pindex == nullptr || nHeightIn < 0 || nHeightIn > nHeight) {
+            return nullptr;
+        }
+        return pindex->GetAncestor(nHeightIn);
+    }
+
+    /** Whether a block is part of this chain. */
+    bool Contains(const CBlockIndex *pindexIn) const {
+        return (*this)[pindexIn->nHeight] == pindexIn;
+    }
+
+    /** The successor of a block of this chain, or nullptr. */
+    const CBlockIndex *Next(const CBlockIndex *pindexIn) const {
+        return Contains(pindexIn) ? (*this)[pindexIn->nHeight + 1] : nullptr;
+    }
+};
+
+/** The latest published snapshot of the chainActive tip. Never null. */
+std::shared_ptr<const ChainTipSnapshot> GetChainTipSnapshot();
+
 /** Global variable that points to the active CCoinsView (protected by cs_main)
  */
 extern CCoinsViewCache *pcoinsTip;
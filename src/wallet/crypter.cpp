@@ -221,6 +221,7 @@ bool CCryptoKeyStore::AddCryptedKey(
 
         mapCryptedKeys[vchPubKey.GetID()] =
             make_pair(vchPubKey, vchCryptedSecret);
+        AddKeyScriptPubKeys(vchPubKey);
     }
     return true;
 }
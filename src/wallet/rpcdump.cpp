@@ -71,6 +71,33 @@ std::string DecodeDumpString(const std::string &str) {
     return ret.str();
 }
 
+UniValue abortrescan(const Config &config, const JSONRPCRequest &request) {
+    if (!EnsureWalletIsAvailable(request.fHelp)) return NullUniValue;
+
+    if (request.fHelp || request.params.size() > 0)
+        throw std::runtime_error(
+            "abortrescan\n"
+            "\nStops the wallet rescan in progress, triggered e.g. by an "
+            "importprivkey call.\n"
+            "The transactions found so far are kept.\n"
+            "\nResult:\n"
+            "true|false      (boolean) Whether a rescan was running and is "
+            "being aborted\n"
+            "\nExamples:\n"
+            "\nImport a private key\n" +
+            HelpExampleCli("importprivkey", "\"mykey\"") +
+            "\nAbort the running wallet rescan\n" +
+            HelpExampleCli("abortrescan", "") +
+            "\nAs a JSON-RPC call\n" + HelpExampleRpc("abortrescan", ""));
+
+    // Not under cs_wallet, which the rescan holds until it stops.
+    if (!pwalletMain->IsScanning() || pwalletMain->IsAbortingRescan()) {
+        return false;
+    }
+    pwalletMain->AbortRescan();
+    return true;
+}
+
 UniValue importprivkey(const Config &config, const JSONRPCRequest &request) {
     if (!EnsureWalletIsAvailable(request.fHelp)) return NullUniValue;
 
@@ -148,6 +175,9 @@ UniValue importprivkey(const Config &config, const JSONRPCRequest &request) {
 
         if (fRescan) {
             pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+            if (pwalletMain->IsAbortingRescan()) {
+                throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted by user.");
+            }
         }
     }
 
@@ -258,6 +288,9 @@ UniValue importaddress(const Config &config, const JSONRPCRequest &request) {
 
     if (fRescan) {
         pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        if (pwalletMain->IsAbortingRescan()) {
+            throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted by user.");
+        }
         pwalletMain->ReacceptWalletTransactions();
     }
 
@@ -435,6 +468,9 @@ UniValue importpubkey(const Config &config, const JSONRPCRequest &request) {
 
     if (fRescan) {
         pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        if (pwalletMain->IsAbortingRescan()) {
+            throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted by user.");
+        }
         pwalletMain->ReacceptWalletTransactions();
     }
 
@@ -539,6 +575,9 @@ UniValue importwallet(const Config &config, const JSONRPCRequest &request) {
               chainActive.Height() - pindex->nHeight + 1);
     pwalletMain->ScanForWalletTransactions(pindex);
     pwalletMain->MarkDirty();
+    if (pwalletMain->IsAbortingRescan()) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted by user.");
+    }
 
     if (!fGood)
         throw JSONRPCError(RPC_WALLET_ERROR,
@@ -1193,6 +1232,9 @@ UniValue importmulti(const Config &config, const JSONRPCRequest &mainRequest) {
         CBlockIndex *scannedRange = nullptr;
         if (pindex) {
             scannedRange = pwalletMain->ScanForWalletTransactions(pindex, true);
+            if (pwalletMain->IsAbortingRescan()) {
+                throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted by user.");
+            }
             pwalletMain->ReacceptWalletTransactions();
         }
 
@@ -1234,6 +1276,7 @@ UniValue importmulti(const Config &config, const JSONRPCRequest &mainRequest) {
 static const CRPCCommand commands[] = {
     //  category            name                        actor (function)          okSafeMode
     //  ------------------- ------------------------    ----------------------    ----------
+    { "wallet",             "abortrescan",              abortrescan,              false,  {} },
     { "wallet",             "dumpprivkey",              dumpprivkey,              true,   {"address"}  },
     { "wallet",             "dumpwallet",               dumpwallet,               true,   {"filename"} },
     { "wallet",             "importmulti",              importmulti,              true,   {"requests","options"} },
@@ -5,9 +5,12 @@
 #include "wallet/wallet.h"
 
 #include "config.h"
+#include "consensus/validation.h"
 #include "rpc/server.h"
+#include "script/interpreter.h"
 #include "test/test_bitcoin.h"
 #include "validation.h"
+#include "wallet/db.h"
 #include "wallet/rpcdump.h"
 #include "wallet/test/wallet_test_fixture.h"
 
@@ -508,4 +511,135 @@ BOOST_FIXTURE_TEST_CASE(rescan, TestChain100Setup) {
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(rescan_threads, TestChain100Setup) {
+    LOCK(cs_main);
+
+    // Whatever the number of threads reading the blocks, the scan finds every
+    // coinbase and adds them to the wallet in block order.
+    for (const std::string &nThreads : {"1", "3", "16"}) {
+        ForceSetArg("-rescanthreads", nThreads);
+        CWallet wallet;
+        LOCK(wallet.cs_wallet);
+        wallet.AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+        BOOST_CHECK_EQUAL(
+            chainActive.Genesis(),
+            wallet.ScanForWalletTransactions(chainActive.Genesis()));
+        BOOST_CHECK(!wallet.IsScanning());
+        BOOST_CHECK_EQUAL(wallet.mapWallet.size(), 100U);
+
+        int nHeight = 0;
+        for (const auto &item : wallet.wtxOrdered) {
+            const CWalletTx *wtx = item.second.first;
+            BOOST_CHECK(wtx);
+            const int nTxHeight = mapBlockIndex.at(wtx->hashBlock)->nHeight;
+            BOOST_CHECK(nTxHeight > nHeight);
+            nHeight = nTxHeight;
+        }
+    }
+    ForceSetArg("-rescanthreads", std::to_string(DEFAULT_RESCAN_THREADS));
+}
+
+/**
+ * Backs the wallets of a test with the mock database environment, so that
+ * AddToWallet gets past writing the transaction as it does in a real wallet.
+ */
+struct MockWalletDB {
+    MockWalletDB() { bitdb.MakeMock(); }
+    ~MockWalletDB() {
+        bitdb.Flush(true);
+        bitdb.Reset();
+    }
+};
+
+BOOST_FIXTURE_TEST_CASE(coin_set_balances, TestChain100Setup) {
+    CreateAndProcessBlock({}, GetScriptForRawPubKey(coinbaseKey.GetPubKey()));
+
+    MockWalletDB mockDB;
+    CWallet wallet("wallet_test.dat");
+    bool fFirstRun;
+    wallet.LoadWallet(fFirstRun);
+    {
+        LOCK2(cs_main, wallet.cs_wallet);
+        wallet.AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+        wallet.ScanForWalletTransactions(chainActive.Genesis());
+    }
+
+    // Only the coinbase of the first block is mature.
+    std::vector<COutput> vCoins;
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 50 * COIN);
+    BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), 100 * 50 * COIN);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 0);
+    wallet.AvailableCoins(vCoins);
+    BOOST_CHECK_EQUAL(vCoins.size(), 1U);
+
+    // The coin set does not freeze the state of the coins: a new block makes
+    // the next coinbase spendable, and disconnecting it undoes that.
+    CreateAndProcessBlock({}, CScript() << OP_TRUE);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 100 * COIN);
+    BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), 99 * 50 * COIN);
+    wallet.AvailableCoins(vCoins);
+    BOOST_CHECK_EQUAL(vCoins.size(), 2U);
+
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(GetConfig(), state, chainActive.Tip()));
+    }
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 50 * COIN);
+    BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), 100 * 50 * COIN);
+
+    // Wallet-wide invalidation rebuilds the same set.
+    wallet.MarkDirty();
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 50 * COIN);
+    wallet.AvailableCoins(vCoins);
+    BOOST_CHECK_EQUAL(vCoins.size(), 1U);
+
+    // A mined spend takes its coin out of the set, and the coin comes back
+    // once the block is disconnected and the spend abandoned. The spend pays
+    // to a non-standard script, so it does not return to the mempool.
+    RegisterValidationInterface(&wallet);
+    const CTransaction &coinbase = coinbaseTxns[0];
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(coinbase.GetId(), 0);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = coinbase.vout[0].nValue - CENT;
+    spend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    std::vector<uint8_t> vchSig;
+    uint256 hash =
+        SignatureHash(coinbase.vout[0].scriptPubKey, spend, 0,
+                      SIGHASH_ALL | SIGHASH_FORKID, coinbase.vout[0].nValue);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back(uint8_t(SIGHASH_ALL | SIGHASH_FORKID));
+    spend.vin[0].scriptSig << vchSig;
+    const uint256 spendId = spend.GetId();
+
+    // The block also makes the next coinbase mature.
+    CreateAndProcessBlock({spend}, CScript() << OP_TRUE);
+    BOOST_CHECK(wallet.mapWallet.count(spendId));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 50 * COIN);
+    wallet.AvailableCoins(vCoins);
+    BOOST_CHECK_EQUAL(vCoins.size(), 1U);
+    BOOST_CHECK(vCoins[0].tx->GetId() == coinbaseTxns[1].GetId());
+
+    // Unconfirmed, the spend still counts against the coin.
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(GetConfig(), state, chainActive.Tip()));
+    }
+    BOOST_CHECK(!mempool.exists(spendId));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+    wallet.AvailableCoins(vCoins);
+    BOOST_CHECK(vCoins.empty());
+
+    BOOST_CHECK(wallet.AbandonTransaction(spendId));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 50 * COIN);
+    wallet.AvailableCoins(vCoins);
+    BOOST_CHECK_EQUAL(vCoins.size(), 1U);
+    BOOST_CHECK(vCoins[0].tx->GetId() == coinbase.GetId());
+    UnregisterValidationInterface(&wallet);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -8,9 +8,11 @@
 #include "base58.h"
 #include "chain.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "config.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "init.h"
 #include "key.h"
 #include "keystore.h"
 #include "net.h"
@@ -681,6 +683,12 @@ void CWallet::AddToSpends(const uint256 &wtxid) {
     }
 }
 
+void CWallet::AddToWalletOutpoints(const CTransaction &tx) {
+    for (size_t i = 0; i < tx.vout.size(); i++) {
+        setWalletOutpoints.insert(COutPoint(tx.GetId(), i));
+    }
+}
+
 bool CWallet::EncryptWallet(const SecureString &strWalletPassphrase) {
     if (IsCrypted()) {
         return false;
@@ -967,11 +975,88 @@ bool CWallet::GetAccountPubkey(CPubKey &pubKey, std::string strAccount,
 
 void CWallet::MarkDirty() {
     LOCK(cs_wallet);
+    // Also forget the coins of transactions no longer in the wallet.
+    setWalletCoins.clear();
     for (std::pair<const uint256, CWalletTx> &item : mapWallet) {
         item.second.MarkDirty();
     }
 }
 
+void CWallet::MarkWalletCoinsDirty(const uint256 &txid) const {
+    LOCK(cs_walletCoinsDirty);
+    setWalletCoinsDirty.insert(txid);
+}
+
+void CWallet::UpdateWalletCoins() const {
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    std::set<uint256> setDirty;
+    {
+        LOCK(cs_walletCoinsDirty);
+        setDirty.swap(setWalletCoinsDirty);
+    }
+
+    for (const uint256 &txid : setDirty) {
+        std::set<COutPoint>::iterator it =
+            setWalletCoins.lower_bound(COutPoint(txid, 0));
+        while (it != setWalletCoins.end() && it->hash == txid) {
+            it = setWalletCoins.erase(it);
+        }
+
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txid);
+        if (mi == mapWallet.end()) {
+            continue;
+        }
+
+        const CTransaction &tx = *mi->second.tx;
+        for (size_t i = 0; i < tx.vout.size(); i++) {
+            if (IsMine(tx.vout[i]) == ISMINE_NO) {
+                continue;
+            }
+
+            // Only a confirmed spend is sure to stand until the next time
+            // the transaction is marked dirty: the spending transaction is
+            // synced again when its block is disconnected.
+            const COutPoint outpoint(txid, i);
+            bool fSpent = false;
+            std::pair<TxSpends::const_iterator, TxSpends::const_iterator>
+                range = mapTxSpends.equal_range(outpoint);
+            for (TxSpends::const_iterator sit = range.first;
+                 sit != range.second && !fSpent; ++sit) {
+                std::map<uint256, CWalletTx>::const_iterator spender =
+                    mapWallet.find(sit->second);
+                fSpent = spender != mapWallet.end() &&
+                         spender->second.GetDepthInMainChain() > 0;
+            }
+            if (!fSpent) {
+                it = setWalletCoins.insert(it, outpoint);
+            }
+        }
+    }
+}
+
+std::vector<const CWalletTx *> CWallet::GetWalletCoinTransactions() const {
+    UpdateWalletCoins();
+
+    std::vector<const CWalletTx *> vWalletTx;
+    const uint256 *phashLast = nullptr;
+    for (const COutPoint &outpoint : setWalletCoins) {
+        if (phashLast && *phashLast == outpoint.hash) {
+            continue;
+        }
+        phashLast = &outpoint.hash;
+
+        std::map<uint256, CWalletTx>::const_iterator mi =
+            mapWallet.find(outpoint.hash);
+        if (mi != mapWallet.end()) {
+            vWalletTx.push_back(&mi->second);
+        }
+    }
+
+    return vWalletTx;
+}
+
 bool CWallet::MarkReplaced(const uint256 &originalHash,
                            const uint256 &newHash) {
     LOCK(cs_wallet);
@@ -1020,6 +1105,7 @@ bool CWallet::AddToWallet(const CWalletTx &wtxIn, bool fFlushOnClose) {
         wtx.nTimeReceived = GetAdjustedTime();
         wtx.nOrderPos = IncOrderPosNext(&walletdb);
         wtxOrdered.insert(std::make_pair(wtx.nOrderPos, TxPair(&wtx, nullptr)));
+        AddToWalletOutpoints(*wtx.tx);
 
         wtx.nTimeSmart = wtx.nTimeReceived;
         if (!wtxIn.hashUnset()) {
@@ -1111,6 +1197,13 @@ bool CWallet::AddToWallet(const CWalletTx &wtxIn, bool fFlushOnClose) {
     // Break debit/credit balance caches:
     wtx.MarkDirty();
 
+    // The outputs it spends may have been spent or released as well.
+    if (!wtx.IsCoinBase()) {
+        for (const CTxIn &txin : wtx.tx->vin) {
+            MarkWalletCoinsDirty(txin.prevout.hash);
+        }
+    }
+
     // Notify UI of new or updated transaction.
     NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
@@ -1134,6 +1227,7 @@ bool CWallet::LoadToWallet(const CWalletTx &wtxIn) {
     CWalletTx &wtx = mapWallet[txid];
     wtx.BindWallet(this);
     wtxOrdered.insert(std::make_pair(wtx.nOrderPos, TxPair(&wtx, nullptr)));
+    AddToWalletOutpoints(*wtx.tx);
     AddToSpends(txid);
     for (const CTxIn &txin : wtx.tx->vin) {
         if (mapWallet.count(txin.prevout.hash)) {
@@ -1165,6 +1259,12 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction &tx,
                                        int posInBlock, bool fUpdate) {
     AssertLockHeld(cs_wallet);
 
+    // Most transactions have nothing to do with the wallet: rule them out
+    // with lookups in the script and outpoint sets before going any further.
+    if (!IsPossiblyInvolvingMe(tx) && !IsMine(tx)) {
+        return false;
+    }
+
     if (posInBlock != -1) {
         for (const CTxIn &txin : tx.vin) {
             std::pair<TxSpends::const_iterator, TxSpends::const_iterator>
@@ -1348,6 +1448,10 @@ void CWallet::SyncTransaction(const CTransaction &tx, const CBlockIndex *pindex,
 
 isminetype CWallet::IsMine(const CTxIn &txin) const {
     LOCK(cs_wallet);
+    if (!setWalletOutpoints.count(txin.prevout)) {
+        return ISMINE_NO;
+    }
+
     std::map<uint256, CWalletTx>::const_iterator mi =
         mapWallet.find(txin.prevout.hash);
     if (mi != mapWallet.end()) {
@@ -1364,6 +1468,10 @@ isminetype CWallet::IsMine(const CTxIn &txin) const {
 // not-"is mine" (according to the filter) input.
 CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter &filter) const {
     LOCK(cs_wallet);
+    if (!setWalletOutpoints.count(txin.prevout)) {
+        return 0;
+    }
+
     std::map<uint256, CWalletTx>::const_iterator mi =
         mapWallet.find(txin.prevout.hash);
     if (mi != mapWallet.end()) {
@@ -1379,6 +1487,10 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter &filter) const {
 }
 
 isminetype CWallet::IsMine(const CTxOut &txout) const {
+    if (!MayBeMine(txout.scriptPubKey)) {
+        return ISMINE_NO;
+    }
+
     return ::IsMine(*this, txout.scriptPubKey);
 }
 
@@ -1702,17 +1814,99 @@ void CWalletTx::GetAccountAmounts(const std::string &strAccount,
     }
 }
 
+namespace {
+
+/** A block being rescanned, and the transactions in it paying to us. */
+struct CRescanBlock {
+    CBlockIndex *pindex;
+    bool fRead;
+    CBlock block;
+    //! Whether each transaction of the block has an output that is ours
+    std::vector<bool> vIsMine;
+
+    CRescanBlock() : pindex(nullptr), fRead(false) {}
+};
+
+/**
+ * Reads a block of a rescan from disk and matches the outputs of its
+ * transactions against the keys and scripts of the wallet. Run on the rescan
+ * worker threads while the thread running the rescan holds cs_main and
+ * cs_wallet, so it only uses the key store, which has a lock of its own.
+ */
+class CRescanBlockCheck {
+private:
+    const CWallet *pwallet;
+    CRescanBlock *prescanBlock;
+
+public:
+    CRescanBlockCheck() : pwallet(nullptr), prescanBlock(nullptr) {}
+    CRescanBlockCheck(const CWallet *pwalletIn, CRescanBlock *prescanBlockIn)
+        : pwallet(pwalletIn), prescanBlock(prescanBlockIn) {}
+
+    bool operator()() {
+        CRescanBlock &rescanBlock = *prescanBlock;
+        rescanBlock.fRead =
+            ReadBlockFromDisk(rescanBlock.block, rescanBlock.pindex,
+                              Params().GetConsensus());
+        if (rescanBlock.fRead) {
+            rescanBlock.vIsMine.resize(rescanBlock.block.vtx.size());
+            for (size_t i = 0; i < rescanBlock.block.vtx.size(); i++) {
+                rescanBlock.vIsMine[i] =
+                    pwallet->IsMine(*rescanBlock.block.vtx[i]);
+            }
+        }
+        // Unreadable blocks are reported through fRead: failing the check
+        // would make the queue skip the other blocks.
+        return true;
+    }
+
+    void swap(CRescanBlockCheck &check) {
+        std::swap(pwallet, check.pwallet);
+        std::swap(prescanBlock, check.prescanBlock);
+    }
+};
+
+/** Interrupts and joins the rescan worker threads when leaving the scan. */
+class CRescanThreads {
+private:
+    boost::thread_group threadGroup;
+
+public:
+    CRescanThreads(CCheckQueue<CRescanBlockCheck> &queue, int nThreads) {
+        for (int i = 0; i < nThreads; i++) {
+            threadGroup.create_thread([&queue]() {
+                RenameThread("bitcoin-rescan");
+                queue.Thread();
+            });
+        }
+    }
+
+    ~CRescanThreads() {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+};
+
+} // namespace
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions from or to
  * us. If fUpdate is true, found transactions that already exist in the wallet
  * will be updated.
  *
+ * Blocks are read and matched against our keys by -rescanthreads threads, a
+ * window of blocks at a time; adding the transactions to the wallet is done
+ * by the calling thread, in block order. The scan stops early on
+ * AbortRescan() or on shutdown.
+ *
  * Returns pointer to the first block in the last contiguous range that was
- * successfully scanned.
+ * successfully scanned, or nullptr if the scan was aborted.
  */
 CBlockIndex *CWallet::ScanForWalletTransactions(CBlockIndex *pindexStart,
                                                 bool fUpdate) {
     LOCK2(cs_main, cs_wallet);
+    fAbortRescan = false;
+    fScanningWallet = true;
 
     CBlockIndex *ret = nullptr;
     int64_t nNow = GetTime();
@@ -1727,6 +1921,26 @@ CBlockIndex *CWallet::ScanForWalletTransactions(CBlockIndex *pindexStart,
         pindex = chainActive.Next(pindex);
     }
 
+    int nThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    if (nThreads <= 0) {
+        nThreads += GetNumCores();
+    }
+    nThreads = std::max(1, std::min(nThreads, MAX_RESCAN_THREADS));
+
+    // The calling thread reads blocks too while it waits for the window.
+    CCheckQueue<CRescanBlockCheck> queue(1);
+    CRescanThreads threads(queue, nThreads - 1);
+    // Every block of the window is held deserialized until it is matched, so
+    // keep it small: a few blocks per thread are enough to keep them busy.
+    const size_t nWindowSize =
+        std::min(RESCAN_BLOCKS_PER_THREAD * nThreads, MAX_RESCAN_WINDOW);
+    std::vector<CRescanBlock> vWindow;
+
+    if (pindex) {
+        LogPrintf("Rescanning from height %d using %d threads\n",
+                  pindex->nHeight, nThreads);
+    }
+
     // Show rescan progress in GUI as dialog or on splashscreen, if -rescan on
     // startup.
     ShowProgress(_("Rescanning..."), 0);
@@ -1734,35 +1948,63 @@ CBlockIndex *CWallet::ScanForWalletTransactions(CBlockIndex *pindexStart,
         GuessVerificationProgress(chainParams.TxData(), pindex);
     double dProgressTip =
         GuessVerificationProgress(chainParams.TxData(), chainActive.Tip());
-    while (pindex) {
-        if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0) {
-            ShowProgress(
-                _("Rescanning..."),
-                std::max(1,
-                         std::min(99, (int)((GuessVerificationProgress(
-                                                 chainParams.TxData(), pindex) -
-                                             dProgressStart) /
-                                            (dProgressTip - dProgressStart) *
-                                            100))));
-        }
-
-        CBlock block;
-        if (ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
-            for (size_t posInBlock = 0; posInBlock < block.vtx.size();
-                 ++posInBlock) {
-                AddToWalletIfInvolvingMe(*block.vtx[posInBlock], pindex,
-                                         posInBlock, fUpdate);
+    while (pindex && !fAbortRescan && !ShutdownRequested()) {
+        vWindow.clear();
+        vWindow.resize(nWindowSize);
+        size_t nBlocks = 0;
+        for (; pindex && nBlocks < nWindowSize;
+             pindex = chainActive.Next(pindex)) {
+            vWindow[nBlocks++].pindex = pindex;
+        }
+        vWindow.resize(nBlocks);
+
+        {
+            CCheckQueueControl<CRescanBlockCheck> control(&queue);
+            std::vector<CRescanBlockCheck> vChecks;
+            vChecks.reserve(vWindow.size());
+            for (CRescanBlock &rescanBlock : vWindow) {
+                vChecks.emplace_back(this, &rescanBlock);
+            }
+            control.Add(vChecks);
+            control.Wait();
+        }
+
+        for (const CRescanBlock &rescanBlock : vWindow) {
+            CBlockIndex *pindexBlock = rescanBlock.pindex;
+            if (pindexBlock->nHeight % 100 == 0 &&
+                dProgressTip - dProgressStart > 0.0) {
+                double dProgress = GuessVerificationProgress(
+                    chainParams.TxData(), pindexBlock);
+                ShowProgress(_("Rescanning..."),
+                             std::max(1, std::min(99, (int)((dProgress -
+                                                             dProgressStart) /
+                                                            (dProgressTip -
+                                                             dProgressStart) *
+                                                            100))));
             }
 
-            if (!ret) {
-                ret = pindex;
+            if (rescanBlock.fRead) {
+                const CBlock &block = rescanBlock.block;
+                for (size_t posInBlock = 0; posInBlock < block.vtx.size();
+                     ++posInBlock) {
+                    const CTransaction &tx = *block.vtx[posInBlock];
+                    if (!rescanBlock.vIsMine[posInBlock] &&
+                        !IsPossiblyInvolvingMe(tx)) {
+                        continue;
+                    }
+                    AddToWalletIfInvolvingMe(tx, pindexBlock, posInBlock,
+                                             fUpdate);
+                }
+
+                if (!ret) {
+                    ret = pindexBlock;
+                }
+            } else {
+                ret = nullptr;
             }
-        } else {
-            ret = nullptr;
         }
 
-        pindex = chainActive.Next(pindex);
-        if (GetTime() >= nNow + 60) {
+        if (pindex && GetTime() >= nNow + 60) {
             nNow = GetTime();
             LogPrintf("Still rescanning. At block %d. Progress=%f\n",
                       pindex->nHeight,
@@ -1770,12 +2012,35 @@ CBlockIndex *CWallet::ScanForWalletTransactions(CBlockIndex *pindexStart,
         }
     }
 
+    if (pindex) {
+        LogPrintf("Rescan %s at block %d. Progress=%f\n",
+                  fAbortRescan ? "aborted" : "interrupted by shutdown",
+                  pindex->nHeight,
+                  GuessVerificationProgress(chainParams.TxData(), pindex));
+        ret = nullptr;
+    }
+
     // Hide progress dialog in GUI.
     ShowProgress(_("Rescanning..."), 100);
 
+    fScanningWallet = false;
     return ret;
 }
 
+bool CWallet::IsPossiblyInvolvingMe(const CTransaction &tx) const {
+    AssertLockHeld(cs_wallet);
+    if (mapWallet.count(tx.GetId())) {
+        return true;
+    }
+    for (const CTxIn &txin : tx.vin) {
+        if (setWalletOutpoints.count(txin.prevout) ||
+            mapTxSpends.count(txin.prevout)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void CWallet::ReacceptWalletTransactions() {
     // If transactions aren't being broadcasted, don't let them into local
     // mempool either.
@@ -1842,6 +2107,22 @@ std::set<uint256> CWalletTx::GetConflicts() const {
     return result;
 }
 
+void CWalletTx::MarkDirty() {
+    fCreditCached = false;
+    fAvailableCreditCached = false;
+    fImmatureCreditCached = false;
+    fWatchDebitCached = false;
+    fWatchCreditCached = false;
+    fAvailableWatchCreditCached = false;
+    fImmatureWatchCreditCached = false;
+    fDebitCached = false;
+    fChangeCached = false;
+
+    if (pwallet) {
+        pwallet->MarkWalletCoinsDirty(GetId());
+    }
+}
+
 CAmount CWalletTx::GetDebit(const isminefilter &filter) const {
     if (tx->vin.empty()) return 0;
 
@@ -2137,9 +2418,7 @@ CAmount CWallet::GetBalance() const {
     LOCK2(cs_main, cs_wallet);
 
     CAmount nTotal = 0;
-    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin();
-         it != mapWallet.end(); ++it) {
-        const CWalletTx *pcoin = &(*it).second;
+    for (const CWalletTx *pcoin : GetWalletCoinTransactions()) {
         if (pcoin->IsTrusted()) {
             nTotal += pcoin->GetAvailableCredit();
         }
@@ -2152,9 +2431,7 @@ CAmount CWallet::GetUnconfirmedBalance() const {
     LOCK2(cs_main, cs_wallet);
 
     CAmount nTotal = 0;
-    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin();
-         it != mapWallet.end(); ++it) {
-        const CWalletTx *pcoin = &(*it).second;
+    for (const CWalletTx *pcoin : GetWalletCoinTransactions()) {
         if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 &&
             pcoin->InMempool()) {
             nTotal += pcoin->GetAvailableCredit();
@@ -2168,9 +2445,7 @@ CAmount CWallet::GetImmatureBalance() const {
     LOCK2(cs_main, cs_wallet);
 
     CAmount nTotal = 0;
-    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin();
-         it != mapWallet.end(); ++it) {
-        const CWalletTx *pcoin = &(*it).second;
+    for (const CWalletTx *pcoin : GetWalletCoinTransactions()) {
         nTotal += pcoin->GetImmatureCredit();
     }
 
@@ -2181,9 +2456,7 @@ CAmount CWallet::GetWatchOnlyBalance() const {
     LOCK2(cs_main, cs_wallet);
 
     CAmount nTotal = 0;
-    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin();
-         it != mapWallet.end(); ++it) {
-        const CWalletTx *pcoin = &(*it).second;
+    for (const CWalletTx *pcoin : GetWalletCoinTransactions()) {
         if (pcoin->IsTrusted()) {
             nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -2196,9 +2469,7 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const {
     LOCK2(cs_main, cs_wallet);
 
     CAmount nTotal = 0;
-    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin();
-         it != mapWallet.end(); ++it) {
-        const CWalletTx *pcoin = &(*it).second;
+    for (const CWalletTx *pcoin : GetWalletCoinTransactions()) {
         if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 &&
             pcoin->InMempool()) {
             nTotal += pcoin->GetAvailableWatchOnlyCredit();
@@ -2212,9 +2483,7 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const {
     LOCK2(cs_main, cs_wallet);
 
     CAmount nTotal = 0;
-    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin();
-         it != mapWallet.end(); ++it) {
-        const CWalletTx *pcoin = &(*it).second;
+    for (const CWalletTx *pcoin : GetWalletCoinTransactions()) {
         nTotal += pcoin->GetImmatureWatchOnlyCredit();
     }
 
@@ -2227,10 +2496,8 @@ void CWallet::AvailableCoins(std::vector<COutput> &vCoins, bool fOnlyConfirmed,
     vCoins.clear();
 
     LOCK2(cs_main, cs_wallet);
-    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin();
-         it != mapWallet.end(); ++it) {
-        const uint256 &wtxid = it->first;
-        const CWalletTx *pcoin = &(*it).second;
+    for (const CWalletTx *pcoin : GetWalletCoinTransactions()) {
+        const uint256 &wtxid = pcoin->GetId();
 
         if (!CheckFinalTx(*pcoin)) {
             continue;
@@ -2280,11 +2547,11 @@ void CWallet::AvailableCoins(std::vector<COutput> &vCoins, bool fOnlyConfirmed,
         for (unsigned int i = 0; i < pcoin->tx->vout.size(); i++) {
             isminetype mine = IsMine(pcoin->tx->vout[i]);
             if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                !IsLockedCoin((*it).first, i) &&
+                !IsLockedCoin(wtxid, i) &&
                 (pcoin->tx->vout[i].nValue > 0 || fIncludeZeroValue) &&
                 (!coinControl || !coinControl->HasSelected() ||
                  coinControl->fAllowOtherInputs ||
-                 coinControl->IsSelected(COutPoint((*it).first, i)))) {
+                 coinControl->IsSelected(COutPoint(wtxid, i)))) {
                 vCoins.push_back(COutput(
                     pcoin, i, nDepth,
                     ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
@@ -3938,6 +4205,14 @@ std::string CWallet::GetWalletHelpString(bool showDebug) {
     strUsage += HelpMessageOpt(
         "-rescan",
         _("Rescan the block chain for missing wallet transactions on startup"));
+    strUsage += HelpMessageOpt(
+        "-rescanthreads=<n>",
+        strprintf(_("Set the number of threads reading blocks during a "
+                    "rescan (%u to %d, 0 = auto, <0 = leave that many cores "
+                    "free, default: %d). Each thread keeps up to %d blocks in "
+                    "memory, at most %d in total"),
+                  -GetNumCores(), MAX_RESCAN_THREADS, DEFAULT_RESCAN_THREADS,
+                  RESCAN_BLOCKS_PER_THREAD, MAX_RESCAN_WINDOW));
     strUsage += HelpMessageOpt(
         "-salvagewallet",
         _("Attempt to recover private keys from a corrupt wallet on startup"));
@@ -7,6 +7,7 @@
 #define BITCOIN_WALLET_WALLET_H
 
 #include "amount.h"
+#include "coins.h"
 #include "script/ismine.h"
 #include "script/sign.h"
 #include "streams.h"
@@ -25,6 +26,7 @@
 #include <set>
 #include <stdexcept>
 #include <string>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -68,6 +70,14 @@ static const bool DEFAULT_WALLETBROADCAST = true;
 static const bool DEFAULT_DISABLE_WALLET = false;
 //! if set, all keys will be derived by using BIP32
 static const bool DEFAULT_USE_HD_WALLET = true;
+//! -rescanthreads default (0 = one per core)
+static const int DEFAULT_RESCAN_THREADS = 0;
+//! Maximum number of threads reading and matching blocks during a rescan
+static const int MAX_RESCAN_THREADS = 16;
+//! Blocks each rescan thread may have read ahead of the wallet
+static const int RESCAN_BLOCKS_PER_THREAD = 2;
+//! Maximum number of blocks held in memory at once during a rescan
+static const int MAX_RESCAN_WINDOW = 32;
 
 extern const char *DEFAULT_WALLET_DAT;
 
@@ -376,17 +386,7 @@ public:
     }
 
     //! make sure balances are recalculated
-    void MarkDirty() {
-        fCreditCached = false;
-        fAvailableCreditCached = false;
-        fImmatureCreditCached = false;
-        fWatchDebitCached = false;
-        fWatchCreditCached = false;
-        fAvailableWatchCreditCached = false;
-        fImmatureWatchCreditCached = false;
-        fDebitCached = false;
-        fChangeCached = false;
-    }
+    void MarkDirty();
 
     void BindWallet(CWallet *pwalletIn) {
         pwallet = pwalletIn;
@@ -592,12 +592,45 @@ private:
     void AddToSpends(const COutPoint &outpoint, const uint256 &wtxid);
     void AddToSpends(const uint256 &wtxid);
 
+    /**
+     * The outputs of the transactions in mapWallet, so that inputs that do
+     * not spend from the wallet are told apart with a hash lookup. Outputs
+     * are kept whether they are ours or not, since importing a key or a
+     * script can make them ours later.
+     */
+    std::unordered_set<COutPoint, SaltedOutpointHasher> setWalletOutpoints;
+    void AddToWalletOutpoints(const CTransaction &tx);
+
+    /**
+     * The outputs of wallet transactions that are ours and not spent by a
+     * confirmed wallet transaction: a superset of the unspent coins of the
+     * wallet, walked by the balances and AvailableCoins() instead of
+     * mapWallet. The transactions marked dirty are queued in
+     * setWalletCoinsDirty and their outputs sorted again on the next walk,
+     * under cs_main.
+     */
+    mutable std::set<COutPoint> setWalletCoins;
+    //! Guards setWalletCoinsDirty only and is never held while taking another
+    //! lock, so that CWalletTx::MarkDirty need not take cs_wallet.
+    mutable CCriticalSection cs_walletCoinsDirty;
+    mutable std::set<uint256> setWalletCoinsDirty;
+    void UpdateWalletCoins() const;
+    //! The transactions with outputs in setWalletCoins, in txid order
+    std::vector<const CWalletTx *> GetWalletCoinTransactions() const;
+
     /* Mark a transaction (and its in-wallet descendants) as conflicting with a
      * particular block. */
     void MarkConflicted(const uint256 &hashBlock, const uint256 &hashTx);
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Whether a transaction without outputs of ours can still concern the
+     * wallet: it is in the wallet already, spends from one of our
+     * transactions or conflicts with one.
+     */
+    bool IsPossiblyInvolvingMe(const CTransaction &tx) const;
+
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 
@@ -607,6 +640,10 @@ private:
 
     int64_t nTimeFirstKey;
 
+    //! Set to interrupt the rescan in progress, see AbortRescan()
+    std::atomic<bool> fAbortRescan;
+    std::atomic<bool> fScanningWallet;
+
     /**
      * Private version of AddWatchOnly method which does not accept a timestamp,
      * and which will reset the wallet's nTimeFirstKey value to 1 if the watch
@@ -673,6 +710,8 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        fAbortRescan = false;
+        fScanningWallet = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -802,6 +841,8 @@ public:
                           bool bForceNew = false);
 
     void MarkDirty();
+    //! Queue the outputs of a transaction to be sorted into setWalletCoins
+    void MarkWalletCoinsDirty(const uint256 &txid) const;
     bool AddToWallet(const CWalletTx &wtxIn, bool fFlushOnClose = true);
     bool LoadToWallet(const CWalletTx &wtxIn);
     void SyncTransaction(const CTransaction &tx, const CBlockIndex *pindex,
@@ -811,6 +852,10 @@ public:
                                   bool fUpdate);
     CBlockIndex *ScanForWalletTransactions(CBlockIndex *pindexStart,
                                            bool fUpdate = false);
+    //! Stop the rescan in progress once the blocks being read are processed
+    void AbortRescan() { fAbortRescan = true; }
+    bool IsAbortingRescan() const { return fAbortRescan; }
+    bool IsScanning() const { return fScanningWallet; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime,
                                   CConnman *connman) override;